@@ -342,6 +342,13 @@ Read *fread_reading(FILE *fp, char *fn, int format) {
  *  -1 for failure
  */
 int mfwrite_reading(mFILE *fp, Read *read, int format) {
+    return mfwrite_reading_mt(fp, read, format, NULL);
+}
+
+/*
+ * As mfwrite_reading, with ZTR chunks compressed on thread pool 'p'.
+ */
+int mfwrite_reading_mt(mFILE *fp, Read *read, int format, struct t_pool *p) {
     int r = -1;
     int no_compress = 0;
 
@@ -368,7 +375,7 @@ int mfwrite_reading(mFILE *fp, Read *read, int format) {
     case TT_ZTR2: {
         ztr_t *ztr;
 	ztr = read2ztr(read);
-	compress_ztr(ztr, 2);
+	compress_ztr_mt(ztr, 2, p);
 	r = mfwrite_ztr(fp, ztr); 
 	delete_ztr(ztr);
 	no_compress = 1;
@@ -377,7 +384,7 @@ int mfwrite_reading(mFILE *fp, Read *read, int format) {
     case TT_ZTR1: {
         ztr_t *ztr;
 	ztr = read2ztr(read);
-	compress_ztr(ztr, 1);
+	compress_ztr_mt(ztr, 1, p);
 	r = mfwrite_ztr(fp, ztr); 
 	delete_ztr(ztr);
 	break;
@@ -385,7 +392,7 @@ int mfwrite_reading(mFILE *fp, Read *read, int format) {
     case TT_ZTR3: {
         ztr_t *ztr;
 	ztr = read2ztr(read);
-	compress_ztr(ztr, 3);
+	compress_ztr_mt(ztr, 3, p);
 	r = mfwrite_ztr(fp, ztr); 
 	delete_ztr(ztr);
 	no_compress = 1;
@@ -241,6 +241,13 @@ int write_reading(char *fn, Read *read, int format);
 int fwrite_reading(FILE *fp, Read *read, int format);
 int mfwrite_reading(mFILE *fp, Read *read, int format);
 
+/*
+ * As mfwrite_reading, but ZTR chunks are compressed concurrently on
+ * thread pool 'p' (see compress_ztr_mt). p may be NULL.
+ */
+struct t_pool;
+int mfwrite_reading_mt(mFILE *fp, Read *read, int format, struct t_pool *p);
+
 
 /* ----- Utility routines ----- */
 
@@ -0,0 +1,235 @@
+/*
+ * Copyright (c) 2026 Genome Research Ltd.
+ * 
+ * Redistribution and use in source and binary forms, with or without 
+ * modification, are permitted provided that the following conditions are met:
+ * 
+ *    1. Redistributions of source code must retain the above copyright notice,
+ *       this list of conditions and the following disclaimer.
+ * 
+ *    2. Redistributions in binary form must reproduce the above
+ *       copyright notice, this list of conditions and the following
+ *       disclaimer in the documentation and/or other materials provided
+ *       with the distribution.
+ * 
+ *    3. Neither the names Genome Research Ltd and Wellcome Trust Sanger
+ *    Institute nor the names of its contributors may be used to endorse
+ *    or promote products derived from this software without specific
+ *    prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY GENOME RESEARCH LTD AND CONTRIBUTORS "AS
+ * IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+ * TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL GENOME RESEARCH
+ * LTD OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "io_lib_config.h"
+#endif
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <pthread.h>
+
+#include "io_lib/arena_alloc.h"
+
+/*
+ * Chunk sizes start small and double as the arena grows, up to
+ * ARENA_CHUNK_SIZE, so arenas holding only a few small arrays stay
+ * small.  Larger requests get a chunk of their own.
+ */
+#define ARENA_MIN_CHUNK  (4*1024)
+#define ARENA_CHUNK_SIZE (256*1024)
+
+/* All allocations are aligned to this */
+#define ARENA_ALIGN 16
+#define ARENA_HDR ((sizeof(arena_chunk) + ARENA_ALIGN-1) & ~(ARENA_ALIGN-1))
+
+/* Limits on how much we keep in the shared free list */
+#define ARENA_MAX_FREE       64
+#define ARENA_MAX_FREE_BYTES (256*1024*1024)
+
+static pthread_mutex_t arena_lock = PTHREAD_MUTEX_INITIALIZER;
+static arena_chunk *arena_free = NULL;
+static int arena_nfree = 0;
+static size_t arena_free_bytes = 0;
+
+/*
+ * Obtains a chunk with at least 'size' usable bytes, preferring the
+ * smallest suitable one from the shared free list.
+ */
+static arena_chunk *chunk_get(size_t size) {
+    arena_chunk *ch, **best = NULL, **pp;
+
+    pthread_mutex_lock(&arena_lock);
+    for (pp = &arena_free; *pp; pp = &(*pp)->next) {
+	if ((*pp)->size >= size && (!best || (*pp)->size < (*best)->size))
+	    best = pp;
+    }
+    if (best) {
+	ch = *best;
+	*best = ch->next;
+	arena_nfree--;
+	arena_free_bytes -= ch->size;
+	pthread_mutex_unlock(&arena_lock);
+    } else {
+	pthread_mutex_unlock(&arena_lock);
+	if (!(ch = malloc(ARENA_HDR + size)))
+	    return NULL;
+	ch->size = size;
+    }
+
+    ch->next = NULL;
+    ch->used = 0;
+    return ch;
+}
+
+/*
+ * Returns a linked list of chunks to the shared free list, freeing any
+ * that would take it over its limits.
+ */
+static void chunk_put(arena_chunk *ch) {
+    while (ch) {
+	arena_chunk *next = ch->next;
+
+	pthread_mutex_lock(&arena_lock);
+	if (arena_nfree < ARENA_MAX_FREE &&
+	    arena_free_bytes + ch->size <= ARENA_MAX_FREE_BYTES) {
+	    ch->next = arena_free;
+	    arena_free = ch;
+	    arena_nfree++;
+	    arena_free_bytes += ch->size;
+	    ch = NULL;
+	}
+	pthread_mutex_unlock(&arena_lock);
+
+	if (ch)
+	    free(ch);
+	ch = next;
+    }
+}
+
+/*
+ * Creates a new, empty, arena.  No chunks are obtained until the first
+ * allocation.
+ *
+ * Returns arena_t pointer on success
+ *         NULL on failure
+ */
+arena_t *arena_create(void) {
+    return (arena_t *)calloc(1, sizeof(arena_t));
+}
+
+/*
+ * Releases all memory allocated from this arena, while keeping the
+ * arena itself available for reuse.
+ */
+void arena_reset(arena_t *a) {
+    if (!a)
+	return;
+
+    chunk_put(a->chunks);
+    a->chunks = NULL;
+}
+
+/*
+ * Releases all memory allocated from this arena and the arena itself.
+ */
+void arena_destroy(arena_t *a) {
+    if (!a)
+	return;
+
+    arena_reset(a);
+    free(a);
+}
+
+/*
+ * Allocates 'size' bytes from the arena, aligned to ARENA_ALIGN.
+ * The memory is uninitialised.
+ *
+ * Returns pointer on success
+ *         NULL on failure
+ */
+void *arena_alloc(arena_t *a, size_t size) {
+    arena_chunk *ch = a->chunks;
+    size_t csize;
+    void *p;
+
+    size = (size + ARENA_ALIGN-1) & ~(size_t)(ARENA_ALIGN-1);
+    if (!size)
+	size = ARENA_ALIGN;
+
+    if (!ch || ch->size - ch->used < size) {
+	csize = ch ? ch->size*2 : ARENA_MIN_CHUNK;
+	if (csize > ARENA_CHUNK_SIZE)
+	    csize = ARENA_CHUNK_SIZE;
+
+	if (!(ch = chunk_get(size > csize ? size : csize)))
+	    return NULL;
+
+	if (a->chunks && size > csize/2) {
+	    /*
+	     * A large item; keep the current chunk at the head so its
+	     * remaining space can still be used by smaller requests.
+	     */
+	    ch->next = a->chunks->next;
+	    a->chunks->next = ch;
+	} else {
+	    ch->next = a->chunks;
+	    a->chunks = ch;
+	}
+    }
+
+    p = (char *)ch + ARENA_HDR + ch->used;
+    ch->used += size;
+
+    return p;
+}
+
+/*
+ * As arena_alloc, but for nmemb elements of 'size' bytes each, and
+ * zeroed.
+ *
+ * Returns pointer on success
+ *         NULL on failure
+ */
+void *arena_calloc(arena_t *a, size_t nmemb, size_t size) {
+    void *p;
+
+    if (size && nmemb > SIZE_MAX / size)
+	return NULL;
+
+    if ((p = arena_alloc(a, nmemb * size)))
+	memset(p, 0, nmemb * size);
+
+    return p;
+}
+
+/*
+ * Frees all chunks held on the shared free list. Chunks still in use by
+ * arenas are unaffected and will be recycled as normal once released.
+ */
+void arena_trim(void) {
+    arena_chunk *ch;
+
+    pthread_mutex_lock(&arena_lock);
+    ch = arena_free;
+    arena_free = NULL;
+    arena_nfree = 0;
+    arena_free_bytes = 0;
+    pthread_mutex_unlock(&arena_lock);
+
+    while (ch) {
+	arena_chunk *next = ch->next;
+	free(ch);
+	ch = next;
+    }
+}
@@ -0,0 +1,81 @@
+/*
+ * Copyright (c) 2026 Genome Research Ltd.
+ * 
+ * Redistribution and use in source and binary forms, with or without 
+ * modification, are permitted provided that the following conditions are met:
+ * 
+ *    1. Redistributions of source code must retain the above copyright notice,
+ *       this list of conditions and the following disclaimer.
+ * 
+ *    2. Redistributions in binary form must reproduce the above
+ *       copyright notice, this list of conditions and the following
+ *       disclaimer in the documentation and/or other materials provided
+ *       with the distribution.
+ * 
+ *    3. Neither the names Genome Research Ltd and Wellcome Trust Sanger
+ *    Institute nor the names of its contributors may be used to endorse
+ *    or promote products derived from this software without specific
+ *    prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY GENOME RESEARCH LTD AND CONTRIBUTORS "AS
+ * IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+ * TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL GENOME RESEARCH
+ * LTD OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _ARENA_ALLOC_H_
+#define _ARENA_ALLOC_H_
+
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * A region allocator for objects sharing a single lifetime, such as the
+ * scratch arrays belonging to a CRAM slice or container.
+ *
+ * Memory is carved sequentially out of large chunks and is never freed
+ * individually; arena_reset() or arena_destroy() release everything at
+ * once.  Released chunks go onto a process-wide free list, protected by
+ * a mutex, so worker threads recycle each other's chunks instead of
+ * repeatedly going through malloc/free (or mmap/munmap for the larger
+ * ones).
+ *
+ * An individual arena_t is not itself thread safe; it should only be
+ * used by one thread at a time.
+ *
+ * arena_trim() hands the free list back to the system. cram_close()
+ * calls it when the last cram_fd is closed.
+ */
+
+typedef struct arena_chunk {
+    struct arena_chunk *next;
+    size_t size;		/* usable bytes following this header */
+    size_t used;
+} arena_chunk;
+
+typedef struct {
+    arena_chunk *chunks;	/* current chunk is at the head */
+} arena_t;
+
+arena_t *arena_create(void);
+void arena_destroy(arena_t *a);
+void arena_reset(arena_t *a);
+void *arena_alloc(arena_t *a, size_t size);
+void *arena_calloc(arena_t *a, size_t nmemb, size_t size);
+void arena_trim(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /*_ARENA_ALLOC_H_*/
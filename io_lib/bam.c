@@ -436,6 +436,7 @@ static void bam_file_init(bam_file_t *b) {
     b->equeue   = NULL;
     b->dqueue   = NULL;
     b->job_pending = NULL;
+    b->last_job = NULL;
     b->eof      = 0;
     b->nd_jobs    = 0;
     b->ne_jobs    = 0;
@@ -583,6 +584,11 @@ bam_file_t *bam_open_block(const char *blk, size_t blk_size, SAM_hdr *sh) {
 }
 
 
+/* Method names for io_stats_dump; BGZF has just the one. */
+static char *bam_method_name(int method) {
+    return method == 0 ? "deflate" : NULL;
+}
+
 int bam_close(bam_file_t *b) {
     int r = 0;
 
@@ -612,6 +618,13 @@ int bam_close(bam_file_t *b) {
 	}
     }
 
+    if (b->stats) {
+	io_stats_dump(b->stats, b->stats->fp, (b->bam || b->binary) ? "bam" : "sam",
+		      (b->mode & O_WRONLY) ? "write" : "read",
+		      bam_method_name, b->pool);
+	io_stats_destroy(b->stats);
+    }
+
     if (b->bs)
 	free(b->bs);
 
@@ -655,6 +668,9 @@ int bam_close(bam_file_t *b) {
     if (b->dqueue)
 	t_results_queue_destroy(b->dqueue);
 
+    if (b->last_job)
+	free(b->last_job);
+
     free(b);
 
     return r;
@@ -668,6 +684,7 @@ int bam_close(bam_file_t *b) {
  */
 static int bam_more_input(bam_file_t *b) {
     size_t l;
+    io_clock t;
 
     if (!b->fp)
 	return -1;
@@ -677,9 +694,11 @@ static int bam_more_input(bam_file_t *b) {
 	b->comp_p = b->comp;
     }
 
+    io_stats_start(b->stats, &t);
     l = fread(&b->comp[b->comp_sz], 1, Z_BUFF_SIZE - b->comp_sz, b->fp);
     if (l <= 0)
 	return -1;
+    io_stats_add(b->stats, IO_STAGE_READ, &t, l, l);
     
     b->comp_sz += l;
     return 0;
@@ -690,8 +709,8 @@ typedef struct {
     unsigned char uncomp[Z_BUFF_SIZE];
     size_t comp_sz, uncomp_sz;
     int ignore_chksum;
+    io_stats *stats;
 } bgzf_decode_job;
-static bgzf_decode_job *last_job = NULL;
 
 
 /*
@@ -700,6 +719,9 @@ static bgzf_decode_job *last_job = NULL;
 #ifdef HAVE_LIBDEFLATE
 void *bgzf_decode_thread(void *arg) {
     bgzf_decode_job *j = (bgzf_decode_job *)arg;
+    io_clock t;
+
+    io_stats_start(j->stats, &t);
     struct libdeflate_decompressor *z = libdeflate_alloc_decompressor();
     if (!z) return NULL;
 
@@ -711,6 +733,7 @@ void *bgzf_decode_thread(void *arg) {
 	fprintf(stderr, "Libdeflate returned error code %d\n", err);
 	return NULL;
     }
+    io_stats_method(j->stats, 0, 0, &t, j->comp_sz, j->uncomp_sz);
 
     if (!j->ignore_chksum) {
 	uint32_t crc1=libdeflate_crc32(0L, (unsigned char *)j->uncomp, j->uncomp_sz);
@@ -731,6 +754,9 @@ void *bgzf_decode_thread(void *arg) {
     bgzf_decode_job *j = (bgzf_decode_job *)arg;
     int err;
     z_stream s;
+    io_clock t;
+
+    io_stats_start(j->stats, &t);
 
     s.avail_in  = j->comp_sz;
     s.next_in   = j->comp; 
@@ -749,6 +775,7 @@ void *bgzf_decode_thread(void *arg) {
 	fprintf(stderr, "Inflate returned error code %d\n", err);
 	return NULL;
     }
+    io_stats_method(j->stats, 0, 0, &t, j->comp_sz, s.total_out);
 
     if (!j->ignore_chksum) {
 	uint32_t crc1=iolib_crc32(0L, (unsigned char *)j->uncomp, s.total_out);
@@ -780,6 +807,7 @@ static int bam_uncompress_input(bam_file_t *b) {
     unsigned char *bgzf;
     int xlen, bsize;
     bgzf_decode_job *j;
+    io_clock t;
 
     assert(b->uncomp_sz == 0);
 
@@ -886,6 +914,7 @@ static int bam_uncompress_input(bam_file_t *b) {
 		memcpy(j->comp, b->comp_p, bsize+8);
 		j->comp_sz = bsize;
 		j->ignore_chksum = b->ignore_chksum;
+		j->stats = b->stats;
 
 		b->comp_p  += bsize + 8; // crc & isize
 		b->comp_sz -= bsize + 8; // crc & isize
@@ -894,6 +923,7 @@ static int bam_uncompress_input(bam_file_t *b) {
 	    //nonblock = b->nd_jobs ? 1 : 0;
 	    nonblock = t_pool_results_queue_len(b->dqueue) ? 1 : 0;
 
+	    io_stats_queue(b->stats, b->pool);
 	    if (-1 == t_pool_dispatch2(b->pool, b->dqueue,
 				       bgzf_decode_thread, j, nonblock)) {
 		/* Would block */
@@ -932,9 +962,9 @@ static int bam_uncompress_input(bam_file_t *b) {
 	memcpy(b->uncomp, j->uncomp, j->uncomp_sz);
 	b->uncomp_p = b->uncomp;
 #else
-	if (last_job)
-	    free(last_job);
-	last_job = j;
+	if (b->last_job)
+	    free(b->last_job);
+	b->last_job = j;
 	b->uncomp_p = j->uncomp;
 #endif
 	b->uncomp_sz = j->uncomp_sz;
@@ -1007,6 +1037,7 @@ static int bam_uncompress_input(bam_file_t *b) {
 		} while (b->comp_sz < bsize + 8);
 	    }
 
+	    io_stats_start(b->stats, &t);
 #ifdef HAVE_LIBDEFLATE
 	    struct libdeflate_decompressor *z = libdeflate_alloc_decompressor();
 	    if (!z) return -1;
@@ -1044,6 +1075,7 @@ static int bam_uncompress_input(bam_file_t *b) {
 	    b->uncomp_sz  = b->s.total_out;
 	    b->uncomp_p   = b->uncomp;
 #endif
+	    io_stats_method(b->stats, 0, 0, &t, bsize, b->uncomp_sz);
 
 	    if (b->idx){
 		if (gzi_index_add_block(b->idx, bsize + 26, b->uncomp_sz))
@@ -2981,6 +3013,140 @@ bam_seq_t *bam_dup(bam_seq_t *b) {
 }
 
 
+/* Size class whose records are all at least 'size' bytes, or -1 */
+static int bam_pool_class_min(size_t size) {
+    int c = 0;
+    size_t csize = BAM_POOL_MIN;
+
+    while (csize < size) {
+	if (++c >= BAM_POOL_NCLASS)
+	    return -1;
+	csize *= 2;
+    }
+    return c;
+}
+
+/* Largest size class whose size is no more than 'size' bytes, or -1 */
+static int bam_pool_class_max(size_t size) {
+    int c = -1;
+    size_t csize = BAM_POOL_MIN;
+
+    // Anything over twice the largest class is too wasteful to keep
+    if (size > ((size_t)BAM_POOL_MIN << BAM_POOL_NCLASS))
+	return -1;
+
+    while (csize <= size && c+1 < BAM_POOL_NCLASS) {
+	c++;
+	csize *= 2;
+    }
+    return c;
+}
+
+bam_pool_t *bam_pool_create(int max_free) {
+    bam_pool_t *p;
+    int c;
+
+    if (!(p = calloc(1, sizeof(*p))))
+	return NULL;
+
+    p->max_free = max_free;
+    for (c = 0; c < BAM_POOL_NCLASS; c++) {
+	if (!(p->free[c] = malloc(max_free * sizeof(*p->free[c])))) {
+	    while (--c >= 0)
+		free(p->free[c]);
+	    free(p);
+	    return NULL;
+	}
+    }
+    pthread_mutex_init(&p->lock, NULL);
+
+    return p;
+}
+
+void bam_pool_destroy(bam_pool_t *p) {
+    int c, i;
+
+    if (!p)
+	return;
+
+    for (c = 0; c < BAM_POOL_NCLASS; c++) {
+	for (i = 0; i < p->nfree[c]; i++)
+	    free(p->free[c][i]);
+	free(p->free[c]);
+    }
+    pthread_mutex_destroy(&p->lock);
+    free(p);
+}
+
+bam_seq_t *bam_pool_borrow(bam_pool_t *p, size_t size) {
+    bam_seq_t *b = NULL;
+    int c;
+
+    if (size < sizeof(*b))
+	size = sizeof(*b);
+
+    c = p ? bam_pool_class_min(size) : -1;
+    if (c < 0) {
+	size = ((size+15)/16)*16;
+	if (!(b = malloc(size)))
+	    return NULL;
+	b->alloc = size;
+	return b;
+    }
+
+    pthread_mutex_lock(&p->lock);
+    if (p->nfree[c])
+	b = p->free[c][--p->nfree[c]];
+    pthread_mutex_unlock(&p->lock);
+
+    if (!b) {
+	size = (size_t)BAM_POOL_MIN << c;
+	if (!(b = malloc(size)))
+	    return NULL;
+	b->alloc = size;
+    }
+
+    return b;
+}
+
+void bam_pool_return(bam_pool_t *p, bam_seq_t *b) {
+    int c;
+
+    if (!b)
+	return;
+
+    c = p ? bam_pool_class_max(b->alloc) : -1;
+    if (c >= 0) {
+	pthread_mutex_lock(&p->lock);
+	if (p->nfree[c] < p->max_free) {
+	    p->free[c][p->nfree[c]++] = b;
+	    b = NULL;
+	}
+	pthread_mutex_unlock(&p->lock);
+    }
+
+    free(b);
+}
+
+int bam_pool_copy(bam_pool_t *p, bam_seq_t **dst, bam_seq_t *src) {
+    // See bam_get_seq for explanation of the 44.
+    size_t len = MIN(src->alloc, src->blk_size+44);
+    uint32_t a;
+
+    if (!*dst || (*dst)->alloc < len) {
+	bam_pool_return(p, *dst);
+	if (!(*dst = bam_pool_borrow(p, len)))
+	    return -1;
+    }
+
+    a = (*dst)->alloc;
+    memcpy(*dst, src, len);
+    (*dst)->alloc = a;
+
+    return 0;
+}
+
+
 unsigned char *append_int(unsigned char *cp, int32_t i) {
     int32_t j;
 
@@ -3323,6 +3489,23 @@ static int bgzf_encode(int level,
 }
 #endif
 
+/*
+ * Writes an encoded BGZF block to the file.
+ *
+ * Returns 0 on success
+ *        -1 on failure
+ */
+static int bgzf_block_output(bam_file_t *bf, const void *blk, size_t len) {
+    io_clock t;
+
+    io_stats_start(bf->stats, &t);
+    if (len != fwrite(blk, 1, len, bf->fp))
+	return -1;
+    io_stats_add(bf->stats, IO_STAGE_WRITE, &t, len, len);
+
+    return 0;
+}
+
 static int bgzf_block_write(bam_file_t *bf, int level,
 			    const void *buf, size_t count) {
     if (!bf->idx)
@@ -3364,14 +3547,14 @@ static int bgzf_block_write(bam_file_t *bf, int level,
 static int bgzf_write(bam_file_t *bf, int level, const void *buf, size_t count) {
     unsigned char blk[Z_BUFF_SIZE+4];
     uint32_t len;
+    io_clock t;
 
+    io_stats_start(bf->stats, &t);
     if (0 != bgzf_encode(level, buf, count, blk, &len)) 
 	return -1;
+    io_stats_method(bf->stats, 1, 0, &t, count, len);
 
-    if (len != fwrite(blk, 1, len, bf->fp))
-	return -1;
-
-    return 0;
+    return bgzf_block_output(bf, blk, len);
 }
 
 typedef struct {
@@ -3379,15 +3562,39 @@ typedef struct {
     unsigned char in[Z_BUFF_SIZE];
     unsigned char out[Z_BUFF_SIZE];
     uint32_t in_sz, out_sz;
+    io_stats *stats;
 } bgzf_encode_job;
 
 void *bgzf_encode_thread(void *arg) {
     bgzf_encode_job *j = (bgzf_encode_job *)arg;
+    io_clock t;
 
+    io_stats_start(j->stats, &t);
     bgzf_encode(j->level, j->in, j->in_sz, j->out, &j->out_sz);
+    io_stats_method(j->stats, 1, 0, &t, j->in_sz, j->out_sz);
     return arg;
 }
 
+/*
+ * Writes a completed bgzf_encode_thread result and frees it.
+ * Returns 0 on success
+ *        -1 on failure
+ */
+static int bgzf_result_output(bam_file_t *bf, t_pool_result *r) {
+    bgzf_encode_job *j;
+    int err;
+
+    if (!r)
+	return -1;
+
+    j = (bgzf_encode_job *)r->data;
+    bf->inflight -= sizeof(*j);
+    err = bgzf_block_output(bf, j->out, j->out_sz);
+    t_pool_delete_result(r, 1);
+
+    return err ? -1 : 0;
+}
+
 static int bgzf_write_mt(bam_file_t *bf, int level, const void *buf,
 			 size_t count) {
     bgzf_encode_job *j;
@@ -3400,13 +3607,24 @@ static int bgzf_write_mt(bam_file_t *bf, int level, const void *buf,
     j->level = level;
     memcpy(j->in, buf, count);
     j->in_sz = count;
+    j->stats = bf->stats;
+    io_stats_queue(bf->stats, bf->pool);
     t_pool_dispatch(bf->pool, bf->equeue, bgzf_encode_thread, j);
+    bf->inflight += sizeof(*j);
 
     while ((r = t_pool_next_result(bf->equeue))) {
-	j = (bgzf_encode_job *)r->data;
-	if (j->out_sz != fwrite(j->out, 1, j->out_sz, bf->fp))
+	if (bgzf_result_output(bf, r))
+	    return -1;
+    }
+
+    /*
+     * Results are written in order, so one slow block lets the completed
+     * ones behind it pile up.  Wait for it when over BAM_OPT_MAX_INFLIGHT.
+     */
+    while (bf->max_inflight && bf->inflight > bf->max_inflight &&
+	   !t_pool_results_queue_empty(bf->equeue)) {
+	if (bgzf_result_output(bf, t_pool_next_result_wait(bf->equeue)))
 	    return -1;
-	t_pool_delete_result(r, 1);
     }
 
     return 0;
@@ -3415,7 +3633,6 @@ static int bgzf_write_mt(bam_file_t *bf, int level, const void *buf,
 #ifdef USE_MT
 static int bgzf_flush_mt(bam_file_t *bf) {
     t_pool_result *r;
-    bgzf_encode_job *j;
 
     if (!bf->pool)
 	return 0;
@@ -3423,10 +3640,8 @@ static int bgzf_flush_mt(bam_file_t *bf) {
     t_pool_flush(bf->pool);
 
     while ((r = t_pool_next_result(bf->equeue))) {
-	j = (bgzf_encode_job *)r->data;
-	if (j->out_sz != fwrite(j->out, 1, j->out_sz, bf->fp))
+	if (bgzf_result_output(bf, r))
 	    return -1;
-	t_pool_delete_result(r, 1);
     }
 
     return 0;
@@ -4116,6 +4331,9 @@ int bam_set_voption(bam_file_t *fd, enum bam_option opt, va_list args) {
 	fd->pool = va_arg(args, t_pool *);
 	fd->equeue = t_results_queue_init();
 	fd->dqueue = t_results_queue_init();
+	// Worker idle time is only measured for the stats report
+	if (fd->stats && fd->pool)
+	    t_pool_time_idle(fd->pool);
 	break;
 
     case BAM_OPT_BINNING:
@@ -4131,6 +4349,23 @@ int bam_set_voption(bam_file_t *fd, enum bam_option opt, va_list args) {
     case BAM_OPT_OUTPUT_BGZIP_IDX:
         fd->idx_fn =  va_arg(args, char *);
 	break;
+
+    case BAM_OPT_STATS: {
+	FILE *fp = va_arg(args, FILE *);
+	if (fd->stats) {
+	    io_stats_destroy(fd->stats);
+	    fd->stats = NULL;
+	}
+	if (fp && !(fd->stats = io_stats_create(fp)))
+	    return -1;
+	if (fd->stats && fd->pool)
+	    t_pool_time_idle(fd->pool);
+	break;
+    }
+
+    case BAM_OPT_MAX_INFLIGHT:
+	fd->max_inflight = va_arg(args, int64_t);
+	break;
     }
 
     return 0;
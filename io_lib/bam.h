@@ -55,6 +55,7 @@ extern "C" {
 #include "io_lib/hash_table.h"
 #include "io_lib/sam_header.h"
 #include "io_lib/thread_pool.h"
+#include "io_lib/io_stats.h"
 #include "io_lib/binning.h"
 #include "io_lib/bgzip.h"
 
@@ -195,6 +196,7 @@ typedef struct {
     /* Decoding queue */
     t_results_queue *dqueue;
     void *job_pending;
+    void *last_job; /* decoded block uncomp_p currently points into */
     int eof;
     int nd_jobs, ne_jobs;
 
@@ -211,6 +213,13 @@ typedef struct {
     unsigned char bgbuf[Z_BUFF_SIZE];
     unsigned char *bgbuf_p;
     size_t bgbuf_sz;
+
+    /* BAM_OPT_STATS timings, or NULL */
+    io_stats *stats;
+
+    /* Bytes held by queued BGZF encode jobs, and BAM_OPT_MAX_INFLIGHT */
+    size_t inflight;
+    size_t max_inflight;
 } bam_file_t;
 
 /* BAM flags */
@@ -741,6 +750,73 @@ int bam_construct_seq(bam_seq_t **b, size_t extra_len,
  */
 bam_seq_t *bam_dup(bam_seq_t *b);
 
+/*
+ * A thread-safe pool of bam_seq_t records, for code that holds on to
+ * many records at once (eg CRAM encoding) and wishes to avoid a malloc
+ * and free per record.
+ *
+ * Records are kept in power-of-two size classes from BAM_POOL_MIN
+ * bytes upwards.  Every record handed out by the pool is an ordinary
+ * malloced bam_seq_t, so it may still be grown by the usual bam_*
+ * functions or released with free() if it is never returned.
+ */
+#define BAM_POOL_MIN    256
+#define BAM_POOL_NCLASS 14   /* 256 bytes to 2Mb */
+
+typedef struct {
+    bam_seq_t **free[BAM_POOL_NCLASS];
+    int nfree[BAM_POOL_NCLASS];
+    int max_free;            /* maximum records held per size class */
+    pthread_mutex_t lock;
+} bam_pool_t;
+
+/*! Creates a bam_seq_t pool holding at most max_free spare records
+ * per size class.
+ *
+ * @return
+ * Returns the pool on success;
+ *         NULL on failure.
+ */
+bam_pool_t *bam_pool_create(int max_free);
+
+/*! Destroys a pool and all spare records held within it.
+ *
+ * Records currently borrowed are unaffected and become the caller's
+ * responsibility to free.
+ */
+void bam_pool_destroy(bam_pool_t *p);
+
+/*! Borrows a record with at least 'size' bytes allocated.
+ *
+ * Only the alloc field is initialised.  A NULL pool falls back to
+ * malloc.
+ *
+ * @return
+ * Returns the record on success;
+ *         NULL on failure.
+ */
+bam_seq_t *bam_pool_borrow(bam_pool_t *p, size_t size);
+
+/*! Returns a record to the pool.
+ *
+ * The record must not be used by the caller after this.  Records too
+ * small or large to pool, or arriving when their size class is full,
+ * are freed.
+ */
+void bam_pool_return(bam_pool_t *p, bam_seq_t *b);
+
+/*! Copies src into *dst, as bam_dup does.
+ *
+ * *dst may be NULL or an existing record to overwrite.  If it is too
+ * small it is returned to the pool and a larger one borrowed in its
+ * place.
+ *
+ * @return
+ * Returns 0 on success;
+ *        -1 on failure.
+ */
+int bam_pool_copy(bam_pool_t *p, bam_seq_t **dst, bam_seq_t *src);
+
 /*! Writes a SAM header block.
  *
  * @return
@@ -754,7 +830,9 @@ enum bam_option {
     BAM_OPT_BINNING,
     BAM_OPT_IGNORE_CHKSUM,
     BAM_OPT_WITH_BGZIP_IDX,
-    BAM_OPT_OUTPUT_BGZIP_IDX
+    BAM_OPT_OUTPUT_BGZIP_IDX,
+    BAM_OPT_STATS,
+    BAM_OPT_MAX_INFLIGHT
 };
 
 /*! Sets options on the bam_file_t.
@@ -56,8 +56,15 @@
 #include <assert.h>
 
 #include <zlib.h>
+#include <pthread.h>
+#ifdef HAVE_LIBDEFLATE
+#include <libdeflate.h>
+#endif
+
 #include "io_lib/bgzip.h"
 #include "io_lib/os.h"
+#include "io_lib/crc32.h"
+#include "io_lib/thread_pool.h"
 
 /* ----------------------------------------------------------------------
  * bgzip .gzi index support
@@ -253,43 +260,25 @@ static int64_t gzi_uoff_to_voff(gzi *idx, uint64_t uoff, int *sz) {
     return (idx->c_off[x]<<16) | (uoff - idx->u_off[x]);
 }
 
-uint64_t gzi_load(FILE *fp, gzi *idx, uint64_t ustart, uint64_t uend, char *out) {
-    int csz = 0, err;
-    int64_t vstart = gzi_uoff_to_voff(idx, ustart, 0);
-    int64_t vend   = gzi_uoff_to_voff(idx, uend, &csz);
-
-    off_t cstart = vstart >> 16;
-    off_t cend   = vend   >> 16;
-
+/*
+ * Inflates the concatenated gzip members in comp[0..csz-1] via a single
+ * zlib stream, discarding the first 'skip' bytes and writing at most
+ * 'len' bytes to out.  This is the fallback for data that doesn't carry
+ * BGZF block sizes.
+ *
+ * Returns the number of bytes written on success;
+ *         0 on failure.
+ */
+static uint64_t gzi_inflate_stream(char *comp, size_t csz, uint64_t skip,
+				   uint64_t len, char *out) {
     uint64_t out_sz = 0;
-
-    if (!csz) {
-	// go to EOF to find size of last blockx
-	fseeko(fp, 0, SEEK_END);
-	csz = ftello(fp) - cstart;
-    } else {
-	csz += cend - cstart;
-    }
-
-
-    // Load the compressed blocks
-    char *comp = malloc(csz);
-    if (!comp)
-	return 0;
-    
-    if (fseeko(fp, cstart, SEEK_SET) < 0)
-	return 0;
-
-    if (csz != fread(comp, 1, csz, fp))
-	return 0;
-
+    int err;
 
     z_stream z;
     z.zalloc = 0;
     z.zfree = 0;
     if (inflateInit2(&z, 31) != Z_OK) {
 	fprintf(stderr, "Zlib err: %s\n", z.msg);
-	free(comp);
 	return 0;
     }
 
@@ -299,33 +288,399 @@ uint64_t gzi_load(FILE *fp, gzi *idx, uint64_t ustart, uint64_t uend, char *out)
     // Discard initial portion
     unsigned char buf[65536];
     z.next_out = buf;
-    z.avail_out = vstart & 0xffff;
+    z.avail_out = skip;
     if (z.avail_out) {
 	int err = inflate(&z, Z_FINISH);
 	if (err != Z_OK && err != Z_BUF_ERROR) {
 	    fprintf(stderr, "Zlib err: %s\n", z.msg);
-	    free(comp);
+	    inflateEnd(&z);
 	    return 0;
 	}
     }
 
     // Decode remainder, in a loop as we have concatenated zib streams.
+    // Stop at the end of the input too, as a range may extend beyond EOF.
     z.total_out = 0;
     z.next_out = (unsigned char *)out;
-    z.avail_out = uend-ustart+1;
+    z.avail_out = len;
 
-    do {
+    for (;;) {
 	err = inflate(&z, Z_FINISH);
+	if (err != Z_STREAM_END || !z.avail_out || !z.avail_in)
+	    break;
 	out_sz += z.total_out;
-	if (err == Z_STREAM_END && z.avail_out && z.avail_in)
-	    inflateReset(&z);
-    } while ((err == Z_STREAM_END || err == Z_OK) && z.avail_out != 0);
+	inflateReset(&z);
+    }
+    out_sz += z.total_out;
 
     inflateEnd(&z);
-    free(comp);
     return (err == Z_STREAM_END || err == Z_OK || err == Z_BUF_ERROR) ? out_sz : 0;
 }
 
+/*
+ * A single BGZF block of a gzi_load range. The blocks are laid end to
+ * end from the start of the first one, with 'uoff' being the offset of
+ * this block's uncompressed data in that concatenation.
+ */
+typedef struct {
+    unsigned char *data;   // raw deflate stream
+    size_t size;
+    uint32_t crc;
+    uint32_t usize;
+    uint64_t uoff;
+} gzi_block;
+
+/*
+ * Shared state for decoding the blocks of one range. Blocks are handed
+ * out in order to the caller and any pool workers helping it; the
+ * caller always takes part so progress never depends on a free worker,
+ * which matters as references are frequently loaded from within the
+ * pool itself.
+ *
+ * The struct is reference counted as a helper may not start running
+ * until after the caller has finished.  Such late helpers find no work
+ * left and touch nothing but this struct.
+ */
+typedef struct {
+    gzi_block *b;
+    int nblocks;
+    uint64_t skip, len;    // window of the concatenation to write to out
+    char *out;
+
+    pthread_mutex_t lock;
+    pthread_cond_t done_c;
+    int next;              // next block to decode
+    int ndone;             // blocks finished (successfully or not)
+    int err;
+    int nref;
+} gzi_decoder;
+
+/*
+ * Parses the BGZF block at p.
+ *
+ * Returns the total size of the block on success, filling out b;
+ *         -1 if this is not a valid BGZF block.
+ */
+static int gzi_parse_block(unsigned char *p, size_t avail, gzi_block *b) {
+    size_t xlen, bsize = 0, x;
+
+    if (avail < 18 || p[0] != 31 || p[1] != 139 || p[2] != 8 ||
+	!(p[3] & 4))
+	return -1;
+
+    xlen = p[10] | (p[11]<<8);
+    if (12 + xlen > avail)
+	return -1;
+
+    // Find the BC subfield holding the block size
+    for (x = 12; x + 4 <= 12 + xlen; x += 4 + (p[x+2] | (p[x+3]<<8))) {
+	if (p[x] == 'B' && p[x+1] == 'C' && p[x+2] == 2 && p[x+3] == 0 &&
+	    x + 6 <= 12 + xlen) {
+	    bsize = (p[x+4] | (p[x+5]<<8)) + 1;
+	    break;
+	}
+    }
+
+    if (bsize < 12 + xlen + 8 || bsize > avail)
+	return -1;
+
+    b->data  = p + 12 + xlen;
+    b->size  = bsize - 12 - xlen - 8;
+    b->crc   = p[bsize-8] | (p[bsize-7]<<8) | (p[bsize-6]<<16) |
+	((uint32_t)p[bsize-5]<<24);
+    b->usize = p[bsize-4] | (p[bsize-3]<<8) | (p[bsize-2]<<16) |
+	((uint32_t)p[bsize-1]<<24);
+
+    return b->usize <= 65536 ? bsize : -1;
+}
+
+/*
+ * Inflates a single block into its portion of d->out. Blocks wholly
+ * inside the window are decoded in place, while the partial blocks at
+ * either end go via a bounce buffer.
+ *
+ * Returns 0 on success;
+ *        -1 on failure.
+ */
+#ifdef HAVE_LIBDEFLATE
+static int gzi_inflate_block(struct libdeflate_decompressor *z,
+			     gzi_decoder *d, gzi_block *b) {
+#else
+static int gzi_inflate_block(z_stream *z, gzi_decoder *d, gzi_block *b) {
+#endif
+    unsigned char buf[65536], *dst;
+    uint64_t from = b->uoff > d->skip ? b->uoff : d->skip;
+    uint64_t to   = b->uoff + b->usize < d->skip + d->len
+	? b->uoff + b->usize : d->skip + d->len;
+    size_t usize;
+
+    if (b->uoff >= d->skip && b->uoff + b->usize <= d->skip + d->len)
+	dst = (unsigned char *)d->out + (b->uoff - d->skip);
+    else
+	dst = buf;
+
+#ifdef HAVE_LIBDEFLATE
+    int err = libdeflate_deflate_decompress(z, b->data, b->size,
+					    dst, b->usize, &usize);
+    if (err != LIBDEFLATE_SUCCESS) {
+	fprintf(stderr, "Libdeflate returned error code %d\n", err);
+	return -1;
+    }
+
+    if (usize != b->usize ||
+	libdeflate_crc32(0L, dst, usize) != b->crc) {
+	fprintf(stderr, "Invalid CRC in bgzip block\n");
+	return -1;
+    }
+#else
+    int err;
+
+    if (inflateReset(z) != Z_OK)
+	return -1;
+
+    z->next_in   = b->data;
+    z->avail_in  = b->size;
+    z->next_out  = dst;
+    z->avail_out = b->usize;
+    z->total_out = 0;
+
+    if ((err = inflate(z, Z_FINISH)) != Z_STREAM_END) {
+	fprintf(stderr, "Inflate returned error code %d\n", err);
+	return -1;
+    }
+    usize = z->total_out;
+
+    if (usize != b->usize ||
+	iolib_crc32(0L, dst, usize) != b->crc) {
+	fprintf(stderr, "Invalid CRC in bgzip block\n");
+	return -1;
+    }
+#endif
+
+    if (dst == buf)
+	memcpy(d->out + (from - d->skip), buf + (from - b->uoff), to - from);
+
+    return 0;
+}
+
+/*
+ * Decodes blocks from d until none are left or an error occurs.
+ */
+static void gzi_decode_blocks(gzi_decoder *d) {
+    pthread_mutex_lock(&d->lock);
+    if (d->err || d->next >= d->nblocks) {
+	pthread_mutex_unlock(&d->lock);
+	return;
+    }
+    pthread_mutex_unlock(&d->lock);
+
+#ifdef HAVE_LIBDEFLATE
+    struct libdeflate_decompressor *z = libdeflate_alloc_decompressor();
+#else
+    z_stream zs, *z = &zs;
+    zs.zalloc = NULL;
+    zs.zfree  = NULL;
+    zs.opaque = NULL;
+    zs.next_in = NULL;
+    zs.avail_in = 0;
+    if (inflateInit2(&zs, -15) != Z_OK)
+	z = NULL;
+#endif
+
+    pthread_mutex_lock(&d->lock);
+    if (!z)
+	d->err = 1;
+
+    while (!d->err && d->next < d->nblocks) {
+	gzi_block *b = &d->b[d->next++];
+	int err;
+
+	pthread_mutex_unlock(&d->lock);
+	err = gzi_inflate_block(z, d, b);
+	pthread_mutex_lock(&d->lock);
+
+	if (err)
+	    d->err = 1;
+	if (++d->ndone == d->next)
+	    pthread_cond_signal(&d->done_c);
+    }
+    pthread_mutex_unlock(&d->lock);
+
+#ifdef HAVE_LIBDEFLATE
+    if (z)
+	libdeflate_free_decompressor(z);
+#else
+    if (z)
+	inflateEnd(z);
+#endif
+}
+
+static void gzi_decoder_release(gzi_decoder *d) {
+    int nref;
+
+    pthread_mutex_lock(&d->lock);
+    nref = --d->nref;
+    pthread_mutex_unlock(&d->lock);
+
+    if (nref == 0) {
+	pthread_mutex_destroy(&d->lock);
+	pthread_cond_destroy(&d->done_c);
+	free(d);
+    }
+}
+
+static void *gzi_decode_thread(void *arg) {
+    gzi_decoder *d = (gzi_decoder *)arg;
+    gzi_decode_blocks(d);
+    gzi_decoder_release(d);
+    return NULL;
+}
+
+/*
+ * Decodes the BGZF blocks in comp[0..csz-1], using any idle threads in
+ * pool p to help. Parameters are as for gzi_inflate_stream.
+ *
+ * Returns the number of bytes written on success;
+ *         0 on failure;
+ *        -1 if the data is not BGZF (use gzi_inflate_stream instead).
+ */
+static int64_t gzi_inflate_blocks(char *comp, size_t csz, uint64_t skip,
+				  uint64_t len, char *out, t_pool *p) {
+    gzi_block *b = NULL;
+    gzi_decoder *d;
+    int nblocks = 0, nalloc = 0, i, err;
+    uint64_t uoff = 0;
+    size_t pos = 0;
+
+    // Walk the block headers to find where each one decodes to
+    while (pos < csz && uoff < skip + len) {
+	gzi_block blk;
+	int bsize = gzi_parse_block((unsigned char *)comp + pos, csz - pos,
+				    &blk);
+	if (bsize < 0) {
+	    free(b);
+	    return -1;
+	}
+	pos += bsize;
+
+	blk.uoff = uoff;
+	uoff += blk.usize;
+	if (uoff <= skip)
+	    continue; // empty, or before the window
+
+	if (nblocks == nalloc) {
+	    gzi_block *b2;
+	    nalloc = nalloc ? nalloc*2 : 16;
+	    if (!(b2 = realloc(b, nalloc * sizeof(*b)))) {
+		free(b);
+		return 0;
+	    }
+	    b = b2;
+	}
+	b[nblocks++] = blk;
+    }
+
+    if (uoff <= skip) {
+	free(b);
+	return 0;
+    }
+
+    if (!(d = calloc(1, sizeof(*d)))) {
+	free(b);
+	return 0;
+    }
+    d->b = b;
+    d->nblocks = nblocks;
+    d->skip = skip;
+    d->len = len;
+    d->out = out;
+    d->nref = 1;
+    pthread_mutex_init(&d->lock, NULL);
+    pthread_cond_init(&d->done_c, NULL);
+
+    // Recruit helpers, but never block waiting for space in the pool.
+    for (i = 0; p && i < nblocks-1 && i < p->tsize; i++) {
+	pthread_mutex_lock(&d->lock);
+	d->nref++;
+	pthread_mutex_unlock(&d->lock);
+	if (t_pool_dispatch2(p, NULL, gzi_decode_thread, d, 1) < 0) {
+	    pthread_mutex_lock(&d->lock);
+	    d->nref--;
+	    pthread_mutex_unlock(&d->lock);
+	    break;
+	}
+    }
+
+    gzi_decode_blocks(d);
+
+    // Wait for any blocks still being decoded by helpers
+    pthread_mutex_lock(&d->lock);
+    while (d->ndone < d->next)
+	pthread_cond_wait(&d->done_c, &d->lock);
+    err = d->err;
+    pthread_mutex_unlock(&d->lock);
+
+    gzi_decoder_release(d);
+    free(b);
+
+    if (err)
+	return 0;
+
+    return (uoff < skip + len ? uoff : skip + len) - skip;
+}
+
+/*
+ * Decompresses uncompressed offsets ustart to uend inclusive into out,
+ * using the index to locate the compressed blocks. If p is non-NULL
+ * the BGZF blocks spanning the range are inflated in parallel.
+ *
+ * Returns the number of bytes written on success;
+ *         0 on failure.
+ */
+uint64_t gzi_load_mt(FILE *fp, gzi *idx, uint64_t ustart, uint64_t uend,
+		     char *out, t_pool *p) {
+    int csz = 0;
+    int64_t vstart = gzi_uoff_to_voff(idx, ustart, 0);
+    int64_t vend   = gzi_uoff_to_voff(idx, uend, &csz);
+    int64_t out_sz;
+
+    off_t cstart = vstart >> 16;
+    off_t cend   = vend   >> 16;
+
+    if (!csz) {
+	// go to EOF to find size of last blockx
+	fseeko(fp, 0, SEEK_END);
+	csz = ftello(fp) - cstart;
+    } else {
+	csz += cend - cstart;
+    }
+
+
+    // Load the compressed blocks
+    char *comp = malloc(csz);
+    if (!comp)
+	return 0;
+    
+    if (fseeko(fp, cstart, SEEK_SET) < 0 ||
+	csz != fread(comp, 1, csz, fp)) {
+	free(comp);
+	return 0;
+    }
+
+    out_sz = gzi_inflate_blocks(comp, csz, vstart & 0xffff,
+				uend-ustart+1, out, p);
+    if (out_sz < 0)
+	out_sz = gzi_inflate_stream(comp, csz, vstart & 0xffff,
+				    uend-ustart+1, out);
+
+    free(comp);
+    return out_sz;
+}
+
+uint64_t gzi_load(FILE *fp, gzi *idx, uint64_t ustart, uint64_t uend, char *out) {
+    return gzi_load_mt(fp, idx, ustart, uend, out, NULL);
+}
+
 
 /* ----------------------------------------------------------------------
  * A FILE* wrapper that can read and seek either into uncompressed or
@@ -339,6 +694,7 @@ struct bzi_FILE {
     FILE *fp;
     gzi  *idx;
     uint64_t pos;
+    t_pool *pool;
 };
 
 void bzi_close(bzi_FILE *zp) {
@@ -374,13 +730,23 @@ size_t bzi_read(void *ptr, size_t size, size_t nmemb, bzi_FILE *zp) {
     if (!zp->idx) {
 	return fread(ptr, size, nmemb, zp->fp);
     } else {
-	uint64_t n = gzi_load(zp->fp, zp->idx,
-			      zp->pos, zp->pos + size*nmemb -1, ptr);
+	uint64_t n = gzi_load_mt(zp->fp, zp->idx,
+				 zp->pos, zp->pos + size*nmemb -1, ptr,
+				 zp->pool);
 	zp->pos += n;
 	return n;
     }
 }
 
+/*
+ * Sets a thread pool to use for decompressing bgzipped data in
+ * subsequent bzi_read calls, or NULL to decode in the calling thread
+ * only. The pool is not owned by zp.
+ */
+void bzi_set_pool(bzi_FILE *zp, t_pool *p) {
+    zp->pool = p;
+}
+
 int bzi_seek(bzi_FILE *zp, off_t offset, int whence) {
     if (!zp->idx) {
 	return fseeko(zp->fp, offset, whence);
@@ -34,6 +34,8 @@
 #ifndef _BGZIP_H_
 #define _BGZIP_H_
 
+struct t_pool;
+
 typedef struct gzi {
     uint64_t n;
     uint64_t *c_off;
@@ -46,6 +48,8 @@ gzi *gzi_index_init();
 gzi *gzi_index_load(const char *fn);
 void gzi_index_free(gzi *idx);
 uint64_t gzi_load(FILE *fp, gzi *idx, uint64_t ustart, uint64_t uend, char *out);
+uint64_t gzi_load_mt(FILE *fp, gzi *idx, uint64_t ustart, uint64_t uend,
+		     char *out, struct t_pool *p);
 
 struct bzi_FILE;
 typedef struct bzi_FILE bzi_FILE;
@@ -54,5 +58,6 @@ bzi_FILE *bzi_open(const char *path, const char *mode);
 void bzi_close(bzi_FILE *zp);
 size_t bzi_read(void *ptr, size_t size, size_t nmemb, bzi_FILE *zp);
 int bzi_seek(bzi_FILE *zp, off_t offset, int whence);
+void bzi_set_pool(bzi_FILE *zp, struct t_pool *p);
 
 #endif /* _BGZIP_H_ */
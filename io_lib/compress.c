@@ -103,6 +103,7 @@
 #include <errno.h>
 #include <unistd.h>
 #include <string.h>
+#include <pthread.h>
 #include <sys/time.h>
 
 #include "io_lib/os.h" /* for ftruncate() under WINNT */
@@ -385,9 +386,16 @@ static char *pipe_into(const char *command, char *input, size_t insize,
 /* The main external routines for io_lib */
 
 /*
- * This contains the last used compression method.
+ * This contains the last used compression method. It is held per thread
+ * as reading a file resets it, so concurrent readers and writers (eg
+ * convert_trace -threads) must not see each other's values.
  */
-static int compression_used = 0;
+static pthread_key_t compression_key;
+static pthread_once_t compression_once = PTHREAD_ONCE_INIT;
+
+static void compression_key_init(void) {
+    pthread_key_create(&compression_key, NULL);
+}
 
 typedef struct {
     unsigned char magic[3];
@@ -418,11 +426,13 @@ static Magics magics[] = {
 };
 
 void set_compression_method(int method) {
-    compression_used = method;
+    pthread_once(&compression_once, compression_key_init);
+    pthread_setspecific(compression_key, (void *)(size_t)method);
 }
 
 int get_compression_method(void) {
-    return compression_used;
+    pthread_once(&compression_once, compression_key_init);
+    return (int)(size_t)pthread_getspecific(compression_key);
 }
 
 /*
@@ -468,6 +478,7 @@ int compress_file(char *file) {
     char fname[2048];
     mFILE *mf;
     FILE *fp;
+    int compression_used = get_compression_method();
 
     /* Do nothing unless requested */
     if (compression_used == 0)
@@ -499,6 +510,7 @@ int compress_file(char *file) {
 int fcompress_file(mFILE *fp) {
     size_t size;
     char *data;
+    int compression_used = get_compression_method();
 
     /* Do nothing unless requested */
     if (compression_used == 0)
@@ -611,7 +623,7 @@ mFILE *freopen_compressed(mFILE *fp, mFILE **ofp) {
 	    break;
     }
     if (i == num_magics) {
-	compression_used = 0;
+	set_compression_method(0);
 	return fp;
     }
 
@@ -628,7 +640,7 @@ mFILE *freopen_compressed(mFILE *fp, mFILE **ofp) {
 #endif
     }
 
-    compression_used = i+1;
+    set_compression_method(i+1);
 
     return mfcreate(udata, usize);
 }
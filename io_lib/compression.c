@@ -78,6 +78,9 @@
 #include <assert.h>
 #include <math.h>
 #include <ctype.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 #ifndef M_PI
 #  define M_PI 3.14159265358979323846
@@ -516,7 +519,7 @@ char *unxrle(char *comp, int comp_len, int *uncomp_len) {
     /* Expand */
     uncomp = out = (char *)malloc(unclen+1);
     for (in = (unsigned char *)comp, cpos = 3; cpos < comp_len;) {
-	char c;
+	unsigned char c;
 	if ((c = in[cpos++]) != guard) {
 	    *out++ = c;
 	} else {
@@ -710,6 +713,53 @@ char *unxrle2(char *comp, int comp_len, int *uncomp_len) {
  * Implementation ideas taken from Jean Thierry-Mieg's CTF code.
  */
 
+#ifdef __SSE2__
+/*
+ * Helpers for the vectorised delta and 16to8 code below. All arithmetic
+ * is modulo the lane width, which is exactly what the scalar code keeps
+ * once the result is truncated to 1 or 2 bytes, so output is bit-identical.
+ */
+
+/* Swaps the bytes within each 16-bit lane; big endian <-> native */
+static inline __m128i bswap16_sse2(__m128i x) {
+    return _mm_or_si128(_mm_slli_epi16(x, 8), _mm_srli_epi16(x, 8));
+}
+
+/* Inclusive running total over 16 byte lanes, starting from *carry */
+static inline __m128i prefix8_sse2(__m128i x, __m128i *carry) {
+    __m128i c;
+
+    x = _mm_add_epi8(x, _mm_slli_si128(x, 1));
+    x = _mm_add_epi8(x, _mm_slli_si128(x, 2));
+    x = _mm_add_epi8(x, _mm_slli_si128(x, 4));
+    x = _mm_add_epi8(x, _mm_slli_si128(x, 8));
+    x = _mm_add_epi8(x, *carry);
+
+    /* Broadcast the last lane as the next carry */
+    c = _mm_srli_si128(x, 15);
+    c = _mm_unpacklo_epi8(c, c);
+    c = _mm_shufflelo_epi16(c, 0);
+    *carry = _mm_unpacklo_epi64(c, c);
+
+    return x;
+}
+
+/* Inclusive running total over 8 16-bit lanes, starting from *carry */
+static inline __m128i prefix16_sse2(__m128i x, __m128i *carry) {
+    __m128i c;
+
+    x = _mm_add_epi16(x, _mm_slli_si128(x, 2));
+    x = _mm_add_epi16(x, _mm_slli_si128(x, 4));
+    x = _mm_add_epi16(x, _mm_slli_si128(x, 8));
+    x = _mm_add_epi16(x, *carry);
+
+    c = _mm_shufflehi_epi16(x, _MM_SHUFFLE(3,3,3,3));
+    *carry = _mm_unpackhi_epi64(c, c);
+
+    return x;
+}
+#endif
+
 /*
  * decorrelate1()
  *
@@ -729,7 +779,7 @@ char *decorrelate1(char *x_uncomp,
 		   int uncomp_len,
 		   int level,
 		   int *comp_len) {
-    int i, z;
+    int i = 0, z;
     int u1 = 0, u2 = 0, u3 = 0;
     char *comp = (char *)xmalloc(uncomp_len + 2);
     unsigned char *u_uncomp = (unsigned char *)x_uncomp;
@@ -737,10 +787,49 @@ char *decorrelate1(char *x_uncomp,
     if (!comp)
 	return NULL;
 
+    if (level < 1 || level > 3) {
+	xfree(comp);
+	return NULL;
+    }
+
     comp+=2;
+
+#ifdef __SSE2__
+    /*
+     * Each delta depends only on the input, so 16 can be computed at once
+     * from the vector of samples and copies shifted along by 1 to 3 lanes.
+     */
+    if (uncomp_len >= 16) {
+	__m128i prev = _mm_setzero_si128();
+	for (; i+16 <= uncomp_len; i+=16) {
+	    __m128i x  = _mm_loadu_si128((__m128i *)&u_uncomp[i]);
+	    __m128i p1 = _mm_or_si128(_mm_slli_si128(x, 1),
+				      _mm_srli_si128(prev, 15));
+	    __m128i d  = _mm_sub_epi8(x, p1);
+	    if (level > 1) {
+		__m128i p2 = _mm_or_si128(_mm_slli_si128(x, 2),
+					  _mm_srli_si128(prev, 14));
+		/* level 2: x - 2p1 + p2;  level 3: x - 3p1 + 3p2 - p3 */
+		d = _mm_add_epi8(_mm_sub_epi8(d, p1), p2);
+		if (level > 2) {
+		    __m128i p3 = _mm_or_si128(_mm_slli_si128(x, 3),
+					      _mm_srli_si128(prev, 13));
+		    d = _mm_sub_epi8(_mm_add_epi8(_mm_sub_epi8(d, p1),
+						  _mm_add_epi8(p2, p2)), p3);
+		}
+	    }
+	    _mm_storeu_si128((__m128i *)&comp[i], d);
+	    prev = x;
+	}
+	u1 = u_uncomp[i-1];
+	u2 = u_uncomp[i-2];
+	u3 = u_uncomp[i-3];
+    }
+#endif
+
     switch (level) {
     case 1:
-	for (i = 0; i < uncomp_len; i++) {
+	for (; i < uncomp_len; i++) {
 	    z = u1;
 	    u1 = u_uncomp[i];
 	    comp[i] = u_uncomp[i] - z;
@@ -748,7 +837,7 @@ char *decorrelate1(char *x_uncomp,
 	break;
 	
     case 2:
-	for (i = 0; i < uncomp_len; i++) {
+	for (; i < uncomp_len; i++) {
 	    z = 2*u1 - u2;
 	    u2 = u1;
 	    u1 = u_uncomp[i];
@@ -757,7 +846,7 @@ char *decorrelate1(char *x_uncomp,
 	break;
 
     case 3:
-	for (i = 0; i < uncomp_len; i++) {
+	for (; i < uncomp_len; i++) {
 	    z = 3*u1 - 3*u2 + u3;
 	    u3 = u2;
 	    u2 = u1;
@@ -838,7 +927,7 @@ char *decorrelate1dyn(char *x_uncomp,
 char *recorrelate1(char *x_comp,
 		   int comp_len,
 		   int *uncomp_len) {
-    int i, z;
+    int i = 0, z;
     int u1 = 0, u2 = 0, u3 = 0;
     int level = x_comp[1];
     char *uncomp;
@@ -851,16 +940,40 @@ char *recorrelate1(char *x_comp,
     comp_len-=2;
     *uncomp_len = comp_len;
 
+#ifdef __SSE2__
+    /*
+     * A level N delta is undone by N successive running totals, each of
+     * which vectorises with a carry between blocks.
+     */
+    if (level >= 1 && level <= 3 && comp_len >= 16) {
+	__m128i c1 = _mm_setzero_si128();
+	__m128i c2 = _mm_setzero_si128();
+	__m128i c3 = _mm_setzero_si128();
+	for (; i+16 <= comp_len; i+=16) {
+	    __m128i x = _mm_loadu_si128((__m128i *)&x_comp[i]);
+	    x = prefix8_sse2(x, &c1);
+	    if (level > 1)
+		x = prefix8_sse2(x, &c2);
+	    if (level > 2)
+		x = prefix8_sse2(x, &c3);
+	    _mm_storeu_si128((__m128i *)&uncomp[i], x);
+	}
+	u1 = uncomp[i-1];
+	u2 = uncomp[i-2];
+	u3 = uncomp[i-3];
+    }
+#endif
+
     switch (level) {
     case 1:
-	for (i = 0; i < comp_len; i++) {
+	for (; i < comp_len; i++) {
 	    z = u1;
 	    u1 = uncomp[i] = x_comp[i] + z;
 	}
 	break;
 
     case 2:
-	for (i = 0; i < comp_len; i++) {
+	for (; i < comp_len; i++) {
 	    z = 2*u1 - u2;
 	    u2 = u1;
 	    u1 = uncomp[i] = x_comp[i] + z;
@@ -868,7 +981,7 @@ char *recorrelate1(char *x_comp,
 	break;
 	
     case 3:
-	for (i = 0; i < comp_len; i++) {
+	for (; i < comp_len; i++) {
 	    z = 3*u1 - 3*u2 + u3;
 	    u3 = u2;
 	    u2 = u1;
@@ -905,7 +1018,7 @@ char *decorrelate2(char *x_uncomp,
 		   int uncomp_len,
 		   int level,
 		   int *comp_len) {
-    int i, z, delta;
+    int i = 0, z, delta;
     int u1 = 0, u2 = 0, u3 = 0;
     char *comp = (char *)xmalloc(uncomp_len + 2);
     unsigned char *u_uncomp = (unsigned char *)x_uncomp;
@@ -913,10 +1026,45 @@ char *decorrelate2(char *x_uncomp,
     if (!comp)
 	return NULL;
 
+    if (level < 1 || level > 3) {
+	xfree(comp);
+	return NULL;
+    }
+
     comp+=2;
+
+#ifdef __SSE2__
+    /* As decorrelate1, but 8 big-endian 16-bit samples at a time */
+    if (uncomp_len >= 16) {
+	__m128i prev = _mm_setzero_si128();
+	for (; i+16 <= uncomp_len; i+=16) {
+	    __m128i x  = bswap16_sse2(_mm_loadu_si128((__m128i *)&u_uncomp[i]));
+	    __m128i p1 = _mm_or_si128(_mm_slli_si128(x, 2),
+				      _mm_srli_si128(prev, 14));
+	    __m128i d  = _mm_sub_epi16(x, p1);
+	    if (level > 1) {
+		__m128i p2 = _mm_or_si128(_mm_slli_si128(x, 4),
+					  _mm_srli_si128(prev, 12));
+		d = _mm_add_epi16(_mm_sub_epi16(d, p1), p2);
+		if (level > 2) {
+		    __m128i p3 = _mm_or_si128(_mm_slli_si128(x, 6),
+					      _mm_srli_si128(prev, 10));
+		    d = _mm_sub_epi16(_mm_add_epi16(_mm_sub_epi16(d, p1),
+						    _mm_add_epi16(p2, p2)), p3);
+		}
+	    }
+	    _mm_storeu_si128((__m128i *)&comp[i], bswap16_sse2(d));
+	    prev = x;
+	}
+	u1 = (u_uncomp[i-2] << 8) + u_uncomp[i-1];
+	u2 = (u_uncomp[i-4] << 8) + u_uncomp[i-3];
+	u3 = (u_uncomp[i-6] << 8) + u_uncomp[i-5];
+    }
+#endif
+
     switch (level) {
     case 1:
-	for (i = 0; i < uncomp_len; i+=2) {
+	for (; i < uncomp_len; i+=2) {
 	    z = u1;
 	    u1 = (u_uncomp[i] << 8) + u_uncomp[i+1];
 	    delta = u1 - z;
@@ -926,7 +1074,7 @@ char *decorrelate2(char *x_uncomp,
 	break;
 	
     case 2:
-	for (i = 0; i < uncomp_len; i+=2) {
+	for (; i < uncomp_len; i+=2) {
 	    z = 2*u1 - u2;
 	    u2 = u1;
 	    u1 = (u_uncomp[i] << 8) + u_uncomp[i+1];
@@ -937,7 +1085,7 @@ char *decorrelate2(char *x_uncomp,
 	break;
 
     case 3:
-	for (i = 0; i < uncomp_len; i+=2) {
+	for (; i < uncomp_len; i+=2) {
 	    z = 3*u1 - 3*u2 + u3;
 	    u3 = u2;
 	    u2 = u1;
@@ -1019,7 +1167,7 @@ char *decorrelate2dyn(char *x_uncomp,
 char *recorrelate2(char *x_comp,
 		   int comp_len,
 		   int *uncomp_len) {
-    int i, z;
+    int i = 0, z;
     int u1 = 0, u2 = 0, u3 = 0;
     int level = x_comp[1];
     char *uncomp;
@@ -1033,9 +1181,31 @@ char *recorrelate2(char *x_comp,
     comp_len-=2;
     *uncomp_len = comp_len;
 
+#ifdef __SSE2__
+    /* As recorrelate1, but 8 big-endian 16-bit samples at a time */
+    if (level >= 1 && level <= 3 && comp_len >= 16) {
+	__m128i c1 = _mm_setzero_si128();
+	__m128i c2 = _mm_setzero_si128();
+	__m128i c3 = _mm_setzero_si128();
+	unsigned char *u_uncomp = (unsigned char *)uncomp;
+	for (; i+16 <= comp_len; i+=16) {
+	    __m128i x = bswap16_sse2(_mm_loadu_si128((__m128i *)&u_comp[i]));
+	    x = prefix16_sse2(x, &c1);
+	    if (level > 1)
+		x = prefix16_sse2(x, &c2);
+	    if (level > 2)
+		x = prefix16_sse2(x, &c3);
+	    _mm_storeu_si128((__m128i *)&uncomp[i], bswap16_sse2(x));
+	}
+	u1 = (u_uncomp[i-2] << 8) | u_uncomp[i-1];
+	u2 = (u_uncomp[i-4] << 8) | u_uncomp[i-3];
+	u3 = (u_uncomp[i-6] << 8) | u_uncomp[i-5];
+    }
+#endif
+
     switch (level) {
     case 1:
-	for (i = 0; i < comp_len; i+=2) {
+	for (; i < comp_len; i+=2) {
 	    z = u1;
 	    u1 = ((u_comp[i] << 8) | u_comp[i+1]) + z;
 	    uncomp[i  ] = (u1 >> 8) & 0xff;
@@ -1044,7 +1214,7 @@ char *recorrelate2(char *x_comp,
 	break;
 
     case 2:
-	for (i = 0; i < comp_len; i+=2) {
+	for (; i < comp_len; i+=2) {
 	    z = 2*u1 - u2;
 	    u2 = u1;
 	    u1 = ((u_comp[i] << 8) | u_comp[i+1]) + z;
@@ -1054,7 +1224,7 @@ char *recorrelate2(char *x_comp,
 	break;
 	
     case 3:
-	for (i = 0; i < comp_len; i+=2) {
+	for (; i < comp_len; i+=2) {
 	    z = 3*u1 - 3*u2 + u3;
 	    u3 = u2;
 	    u2 = u1;
@@ -1283,6 +1453,20 @@ char *shrink_16to8(char *x_uncomp, int uncomp_len, int *comp_len) {
 
     comp[0] = ZTR_FORM_16TO8;
     for (i = 0, j = 1; i < uncomp_len; i+=2) {
+#ifdef __SSE2__
+	/* Pack 8 samples at once when none of them need escaping */
+	if (i+16 <= uncomp_len) {
+	    __m128i x = bswap16_sse2(_mm_loadu_si128((__m128i *)&s_uncomp[i]));
+	    __m128i big = _mm_or_si128(_mm_cmpgt_epi16(x, _mm_set1_epi16(127)),
+				       _mm_cmplt_epi16(x, _mm_set1_epi16(-127)));
+	    if (!_mm_movemask_epi8(big)) {
+		_mm_storel_epi64((__m128i *)&comp[j], _mm_packs_epi16(x, x));
+		j += 8;
+		i += 14;
+		continue;
+	    }
+	}
+#endif
 	i16 = (s_uncomp[i] << 8) | (unsigned char)s_uncomp[i+1];
 	if (i16 >= -127 && i16 <= 127) {
 	    comp[j++] = i16;
@@ -1337,6 +1521,26 @@ char *expand_8to16(char *x_comp, int comp_len, int *uncomp_len) {
 #endif
 
     for (i = 0, j = 1; j < comp_len; i+=2) {
+#ifdef __SSE2__
+	/*
+	 * Sign extend 16 values at once when there is no -128 escape
+	 * amongst them. Otherwise fall through to one at a time.
+	 */
+	if (j+16 <= comp_len) {
+	    __m128i x = _mm_loadu_si128((__m128i *)&s_comp[j]);
+	    __m128i esc = _mm_cmpeq_epi8(x, _mm_set1_epi8(-128));
+	    if (!_mm_movemask_epi8(esc)) {
+		__m128i sign = _mm_cmplt_epi8(x, _mm_setzero_si128());
+		_mm_storeu_si128((__m128i *)&uncomp[i],
+				 _mm_unpacklo_epi8(sign, x));
+		_mm_storeu_si128((__m128i *)&uncomp[i+16],
+				 _mm_unpackhi_epi8(sign, x));
+		j += 16;
+		i += 30;
+		continue;
+	    }
+	}
+#endif
 	if (s_comp[j] >= 0) {
 	    uncomp[i  ] = 0;
 	    uncomp[i+1] = s_comp[j++];
@@ -1393,8 +1597,8 @@ char *shrink_32to8(char *x_uncomp, int uncomp_len, int *comp_len) {
     comp[0] = ZTR_FORM_32TO8;
     for (i = 0, j = 1; i < uncomp_len; i+=4) {
 	i32 = (s_uncomp[i] << 24) |
-	    (s_uncomp[i+1] << 16) |
-	    (s_uncomp[i+2] <<  8) |
+	    ((unsigned char)s_uncomp[i+1] << 16) |
+	    ((unsigned char)s_uncomp[i+2] <<  8) |
 	    (unsigned char)s_uncomp[i+3];
 	if (i32 >= -127 && i32 <= 127) {
 	    comp[j++] = i32;
@@ -1463,7 +1667,6 @@ char *expand_8to32(char *comp, int comp_len, int *uncomp_len) {
  * ZTR_FORM_FOLLOW1
  * ---------------------------------------------------------------------------
  */
-static int follow_tab[256][256];
 char *follow1(char *x_uncomp,
 	      int uncomp_len,
 	      int *comp_len) {
@@ -1473,12 +1676,21 @@ char *follow1(char *x_uncomp,
     int i, j;
     char next[256];
     int count[256];
+    int (*follow_tab)[256];
 
     if (!comp)
 	return NULL;
 
-    /* Count di-freqs */
-    memset(follow_tab, 0, 256*256*sizeof(int));
+    /*
+     * Count di-freqs.
+     * Per call rather than static so chunks may be compressed in parallel.
+     * Being large, calloc typically returns fresh zero pages so only the
+     * rows we touch are ever faulted in.
+     */
+    if (NULL == (follow_tab = xcalloc(256, sizeof(*follow_tab)))) {
+	xfree(comp);
+	return NULL;
+    }
 #if 0
     for (i = 0; i < uncomp_len-1; i++)
 	follow_tab[u_uncomp[i]][u_uncomp[i+1]]++;
@@ -1524,6 +1736,7 @@ char *follow1(char *x_uncomp,
     }
     *comp_len = j;
 
+    xfree(follow_tab);
     return comp;
 }
 
@@ -1792,7 +2005,7 @@ char *ichebcomp(char *uncomp, int uncomp_len, int *data_len)
 	case 1:
 	    data[1] = be_int2(d16[0]);
 	}
-	*data_len = nwords*2;
+	*data_len = (nwords+1)*2;
 	return (char *)data;
     }
 
@@ -1198,17 +1198,13 @@ cram_codec *cram_beta_encode_init(cram_stats *st,
 		min_val = i;
 	    max_val = i;
 	}
-	if (st->h) {
-	    HashItem *hi;
-	    HashIter *iter = HashTableIterCreate();
-	    while ((hi = HashTableIterNext(st->h, iter))) {
-		i = (int64_t)(size_t)hi->key;
-		if (min_val > i)
-		    min_val = i;
-		if (max_val < i)
-		    max_val = i;
-	    }
-	    HashTableIterDestroy(iter);
+	for (i = 0; i < st->h_size; i++) {
+	    if (!st->h[i].used || !st->h[i].count)
+		continue;
+	    if (min_val > st->h[i].val)
+		min_val = st->h[i].val;
+	    if (max_val < st->h[i].val)
+		max_val = st->h[i].val;
 	}
     }
 
@@ -3024,27 +3020,22 @@ cram_codec *cram_huffman_encode_init(cram_stats *st,
 	if (min_val > i) min_val = i;
 	nvals++;
     }
-    if (st->h) {
-	HashIter *iter=  HashTableIterCreate();
-	HashItem *hi;
-
-	while ((hi = HashTableIterNext(st->h, iter))) {
-	    if (nvals >= vals_alloc) {
-		vals_alloc = vals_alloc ? vals_alloc*2 : 1024;
-		vals  = realloc(vals,  vals_alloc * sizeof(int));
-		freqs = realloc(freqs, vals_alloc * sizeof(int));
-		if (!vals || !freqs)
-		    return NULL;
-	    }
-	    vals[nvals]=(size_t)hi->key;
-	    freqs[nvals] = hi->data.i;
-	    assert(hi->data.i > 0);
-	    ntot += freqs[nvals];
-	    if (max_val < i) max_val = i;
-	    if (min_val > i) min_val = i;
-	    nvals++;
+    for (i = 0; i < st->h_size; i++) {
+	if (!st->h[i].used || !st->h[i].count)
+	    continue;
+	if (nvals >= vals_alloc) {
+	    vals_alloc = vals_alloc ? vals_alloc*2 : 1024;
+	    vals  = realloc(vals,  vals_alloc * sizeof(int));
+	    freqs = realloc(freqs, vals_alloc * sizeof(int));
+	    if (!vals || !freqs)
+		return NULL;
 	}
-	HashTableIterDestroy(iter);
+	vals[nvals] = st->h[i].val;
+	freqs[nvals] = st->h[i].count;
+	ntot += freqs[nvals];
+	if (max_val < vals[nvals]) max_val = vals[nvals];
+	if (min_val > vals[nvals]) min_val = vals[nvals];
+	nvals++;
     }
 
     assert(nvals > 0);
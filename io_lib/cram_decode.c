@@ -132,6 +132,28 @@ int cram_decode_TD(cram_fd *fd, char *cp, const char *endp,
     return sz;
 }
 
+/*
+ * Uncompresses a block, accumulating the time taken and sizes per
+ * method when CRAM_OPT_STATS is enabled.
+ *
+ * Returns 0 on success
+ *        -1 on failure
+ */
+static int cram_uncompress_block_stats(cram_fd *fd, cram_block *b) {
+    enum cram_block_method method = b->method;
+    io_clock t;
+    int r;
+
+    if (!fd->stats || method == RAW)
+	return cram_uncompress_block(b);
+
+    io_stats_start(fd->stats, &t);
+    r = cram_uncompress_block(b);
+    io_stats_method(fd->stats, 0, method, &t, b->comp_size, b->uncomp_size);
+
+    return r;
+}
+
 /*
  * Decodes a CRAM block compression header.
  * Returns header ptr on success
@@ -148,7 +170,7 @@ cram_block_compression_hdr *cram_decode_compression_header(cram_fd *fd,
 	return NULL;
 
     if (b->method != RAW) {
-	if (cram_uncompress_block(b)) {
+	if (cram_uncompress_block_stats(fd, b)) {
 	    free(hdr);
 	    return NULL;
 	}
@@ -689,13 +711,13 @@ int cram_dependent_data_series(cram_fd *fd,
 	    s->data_series |= CRAM_RG | CRAM_BF;
 
 	// Always uncompress CORE block
-	if (cram_uncompress_block(s->block[0]))
+	if (cram_uncompress_block_stats(fd, s->block[0]))
 	    return -1;
     } else {
 	s->data_series = CRAM_ALL;
 
 	for (i = 0; i < s->hdr->num_blocks; i++) {
-	    if (cram_uncompress_block(s->block[i]))
+	    if (cram_uncompress_block_stats(fd, s->block[i]))
 		return -1;
 	}
 
@@ -772,7 +794,7 @@ int cram_dependent_data_series(cram_fd *fd,
 			if (s->block[j]->content_type == EXTERNAL &&
 			    s->block[j]->content_id == bnum1) {
 			    block_used[j] = 1;
-			    if (cram_uncompress_block(s->block[j])) {
+			    if (cram_uncompress_block_stats(fd, s->block[j])) {
 				free(block_used);
 				return -1;
 			    }
@@ -818,7 +840,7 @@ int cram_dependent_data_series(cram_fd *fd,
 				if (s->block[j]->content_type == EXTERNAL &&
 				    s->block[j]->content_id == bnum1) {
 				    block_used[j] = 1;
-				    if (cram_uncompress_block(s->block[j])) {
+				    if (cram_uncompress_block_stats(fd, s->block[j])) {
 					free(block_used);
 					return -1;
 				    }
@@ -1023,7 +1045,7 @@ cram_block_slice_hdr *cram_decode_slice_header(cram_fd *fd, cram_block *b) {
     if (b->method != RAW) {
         /* Spec. says slice header should be RAW, but we can future-proof
 	   by trying to decode it if it isn't. */
-        if (cram_uncompress_block(b) < 0)
+        if (cram_uncompress_block_stats(fd, b) < 0)
             return NULL;
     }
 
@@ -2362,7 +2384,8 @@ static int bulk_cram_to_bam(SAM_hdr *bfd, cram_fd *fd, cram_slice *s) {
 	len += round8(sz);
     }
 
-    s->bl = (bam_seq_t **)malloc(s->hdr->num_records * sizeof(*s->bl) + len + 8);
+    s->bl = (bam_seq_t **)arena_alloc(s->arena, s->hdr->num_records *
+				      sizeof(*s->bl) + len + 8);
     if (!s->bl)
 	return -1;
 
@@ -2424,6 +2447,9 @@ int cram_decode_slice(cram_fd *fd, cram_container *c, cram_slice *s,
     int embed_ref;
     char **refs = NULL;
     uint32_t ds;
+    io_clock t;
+
+    io_stats_start(fd->stats, &t);
 
     if (cram_dependent_data_series(fd, c->comp_hdr, s) != 0)
 	return -1;
@@ -2464,9 +2490,9 @@ int cram_decode_slice(cram_fd *fd, cram_container *c, cram_slice *s,
     if (blk->content_type != CORE)
 	return -1;
 
-    if (s->crecs)
-	free(s->crecs);
-    if (!(s->crecs = malloc(s->hdr->num_records * sizeof(*s->crecs))))
+    if (!s->crecs &&
+	!(s->crecs = arena_alloc(s->arena,
+				 s->hdr->num_records * sizeof(*s->crecs))))
 	return -1;
 
     ref_id = s->hdr->ref_seq_id;
@@ -2500,7 +2526,7 @@ int cram_decode_slice(cram_fd *fd, cram_container *c, cram_slice *s,
 	    b = cram_get_block_by_id(s, s->hdr->ref_base_id);
 	    if (!b)
 		return -1;
-            if (cram_uncompress_block(b) != 0)
+            if (cram_uncompress_block_stats(fd, b) != 0)
                 return -1;
 	    s->ref = (char *)BLOCK_DATA(b);
 	    s->ref_start = s->hdr->ref_seq_start;
@@ -3058,9 +3084,19 @@ int cram_decode_slice(cram_fd *fd, cram_container *c, cram_slice *s,
     //
     // Possible future optimisation - check range query and don't
     // convert all reads to BAM.
+    //
+    // A slice callback gets the cram records instead, also in the
+    // decoder thread.  Callers wanting BAM too will convert on demand.
+
+    io_stats_add(fd->stats, IO_STAGE_DECODE, &t, 0, 0);
 
-    if (fd->pool)
+    if (fd->slice_cb.func) {
+	r |= fd->slice_cb.func(fd->slice_cb.data, fd, s);
+    } else if (fd->pool) {
+	io_stats_start(fd->stats, &t);
 	r |= bulk_cram_to_bam(bfd, fd, s);
+	io_stats_add(fd->stats, IO_STAGE_CONVERT, &t, 0, 0);
+    }
 
     return r;
 }
@@ -3102,6 +3138,7 @@ int cram_decode_slice_mt(cram_fd *fd, cram_container *c, cram_slice *s,
     
     nonblock = t_pool_results_queue_sz(fd->rqueue) ? 1 : 0;
 
+    io_stats_queue(fd->stats, fd->pool);
     if (-1 == t_pool_dispatch2(fd->pool, fd->rqueue, cram_decode_slice_thread,
 			       j, nonblock)) {
 	/* Would block */
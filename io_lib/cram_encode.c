@@ -58,21 +58,6 @@
 
 #ifdef SAMTOOLS
 #    define bam_copy(dst, src) bam_copy1(*(dst), (src))
-#else
-void bam_copy(bam_seq_t **bt, bam_seq_t *bf) {
-    size_t a;
-
-    // See bam.c bam_get_seq func for explanation of the 44.
-    if (bf->blk_size+44 > (*bt)->alloc) {
-	a = ((int)((bf->blk_size+44+15)/16))*16;
-	*bt = realloc(*bt, a);
-    } else {
-	a = (*bt)->alloc;
-    }
-
-    memcpy(*bt, bf, MIN(bf->alloc, bf->blk_size+44));
-    (*bt)->alloc = a;
-}
 #endif
 
 static int process_one_read(cram_fd *fd, cram_container *c,
@@ -415,12 +400,10 @@ cram_block *cram_encode_compression_header(cram_fd *fd, cram_container *c,
     mc = 0;
     BLOCK_SIZE(map) = 0;
     if (c->tags_used) {
-        HashItem *hi;
-        HashIter *iter = HashTableIterCreate();
-	if (!iter)
-	    return NULL;
+        FHashItem *hi;
+	int iter = 0;
 
-        while ((hi = HashTableIterNext(c->tags_used, iter))) {
+        while ((hi = FHashTableIterNext(c->tags_used, &iter))) {
 	    int key = (hi->key[0]<<16)|(hi->key[1]<<8)|hi->key[2];
 	    cram_tag_map *tm = (cram_tag_map *)hi->data.p;
 	    cram_codec *c = tm->codec;
@@ -430,8 +413,6 @@ cram_block *cram_encode_compression_header(cram_fd *fd, cram_container *c,
 
 	    mc++;
 	}
-
-	HashTableIterDestroy(iter);
     }
 #endif
     fd->vv.varint_put32_blk(cb, BLOCK_SIZE(map) + fd->vv.varint_size(mc));
@@ -884,11 +865,6 @@ static int cram_compress_slice(cram_fd *fd, cram_container *c, cram_slice *s) {
 	}
     }
 
-    if (fd->metrics_lock) pthread_mutex_lock(fd->metrics_lock);
-    for (i = 0; i < DS_END; i++)
-	fd->m[i]->stats = c->stats[i];
-    if (fd->metrics_lock) pthread_mutex_unlock(fd->metrics_lock);
-
 
     /* Specific compression methods for certain block types */
     if (cram_compress_block(fd, s, s->block[DS_IN], fd->m[DS_IN], //IN (seq)
@@ -1139,7 +1115,7 @@ static int cram_encode_slice(cram_fd *fd, cram_container *c,
     c->num_records += s->hdr->num_records;
 
     int ntags = c->tags_used ? c->tags_used->nused : 0;
-    s->block = calloc(DS_END + ntags*2, sizeof(s->block[0]));
+    s->block = arena_calloc(s->arena, DS_END + ntags*2, sizeof(s->block[0]));
     s->hdr->block_content_ids = malloc(DS_END * sizeof(int32_t));
     if (!s->block || !s->hdr->block_content_ids)
 	return -1;
@@ -1379,45 +1355,142 @@ int lossy_read_names(cram_fd *fd, cram_container *c, cram_slice *s,
  * Ie ~1% smaller total, or ~10% of seq portion.
  * With embedded ref, it's about 2% larger than external ref mode.
  */
+
+/*
+ * The consensus is computed as a streaming pileup.  Base counts are held
+ * in a ring buffer covering only the positions that reads overlapping
+ * the current one can still touch, and are turned into consensus calls
+ * as soon as the next read starts beyond them.  Memory is therefore
+ * bounded by the longest alignment in the slice rather than by the span
+ * of the slice.
+ *
+ * Slices that are not position sorted fall back to a window covering
+ * the whole slice, calling consensus only once all reads are added.
+ */
+typedef struct {
+    uint32_t (*cnt)[6];   // counts for N, A, C, G, T, *
+    uint64_t sz, mask;    // ring size, a power of 2
+    uint64_t start;       // first position not yet called
+    uint64_t first_pos;   // position of cons[0]
+    char *cons;
+    uint64_t cons_sz;
+} cons_window;
+
+/* Calls consensus for positions [w->start, end) and frees their slots */
+static int cons_call(cons_window *w, uint64_t end) {
+    uint64_t p;
+
+    if (end <= w->start)
+	return 0;
+
+    if (end - w->first_pos > w->cons_sz) {
+	uint64_t sz = w->cons_sz ? w->cons_sz : 1024;
+	char *c;
+	while (sz < end - w->first_pos)
+	    sz *= 2;
+	if (!(c = realloc(w->cons, sz)))
+	    return -1;
+	w->cons = c;
+	w->cons_sz = sz;
+    }
+
+    for (p = w->start; p < end; p++) {
+	uint32_t *c;
+	int base = 'N';
+	uint32_t freq = 0;
+
+	// Beyond the ring are positions no read has touched yet
+	if (p >= w->start + w->sz) {
+	    memset(&w->cons[p - w->first_pos], 'N', end - p);
+	    break;
+	}
+
+	c = w->cnt[p & w->mask];
+	if (freq < c[1]) freq = c[1], base = 'A';
+	if (freq < c[2]) freq = c[2], base = 'C';
+	if (freq < c[3]) freq = c[3], base = 'G';
+	if (freq < c[4]) freq = c[4], base = 'T';
+	if (freq < c[5]) freq = c[5], base = '*';
+	w->cons[p - w->first_pos] = base;
+	memset(c, 0, sizeof(w->cnt[0]));
+    }
+    w->start = end;
+
+    return 0;
+}
+
+/* Ensures positions [w->start, end) are all held in the ring */
+static int cons_reserve(cons_window *w, uint64_t end) {
+    uint64_t sz, p;
+    uint32_t (*cnt)[6];
+
+    if (end <= w->start || end - w->start <= w->sz)
+	return 0;
+
+    for (sz = w->sz ? w->sz : 1024; sz < end - w->start; sz *= 2)
+	;
+    if (!(cnt = calloc(sz, sizeof(*cnt))))
+	return -1;
+    for (p = w->start; p < w->start + w->sz; p++)
+	memcpy(cnt[p & (sz-1)], w->cnt[p & w->mask], sizeof(*cnt));
+
+    free(w->cnt);
+    w->cnt = cnt;
+    w->sz = sz;
+    w->mask = sz-1;
+
+    return 0;
+}
+
 int generate_consensus(cram_container *c, cram_slice *s, int bam_start) {
     int r1, r2;
 
-    static int L[256] = { // NACGT
-	0,0,0,0, 0,0,0,0, 0,0,0,0, 0,0,0,0, // 00
-	0,0,0,0, 0,0,0,0, 0,0,0,0, 0,0,0,0, // 10
-	0,0,0,0, 0,0,0,0, 0,0,0,0, 0,0,0,0, // 20
-	0,0,0,0, 0,0,0,0, 0,0,0,0, 0,0,0,0, // 30
-
-	0,1,0,2, 0,0,0,3, 0,0,0,0, 0,0,0,0, // 40
-	0,0,0,0, 4,0,0,0, 0,0,0,0, 0,0,0,0, // 50
-	0,1,0,2, 0,0,0,3, 0,0,0,0, 0,0,0,0, // 60
-	0,0,0,0, 4,0,0,0, 0,0,0,0, 0,0,0,0, // 70
-
-	0,0,0,0, 0,0,0,0, 0,0,0,0, 0,0,0,0,
-	0,0,0,0, 0,0,0,0, 0,0,0,0, 0,0,0,0,
-	0,0,0,0, 0,0,0,0, 0,0,0,0, 0,0,0,0,
-	0,0,0,0, 0,0,0,0, 0,0,0,0, 0,0,0,0,
-
-	0,0,0,0, 0,0,0,0, 0,0,0,0, 0,0,0,0,
-	0,0,0,0, 0,0,0,0, 0,0,0,0, 0,0,0,0,
-	0,0,0,0, 0,0,0,0, 0,0,0,0, 0,0,0,0,
-	0,0,0,0, 0,0,0,0, 0,0,0,0, 0,0,0,0
-    };
-
-    uint32_t (*cnt)[6] = NULL, cnt_sz = 0;
+    // 4-bit BAM base code to count index; A=1 C=2 G=3 T=4 others 0
+    static const int L16[16] = {0,1,2,0, 3,0,0,0, 4,0,0,0, 0,0,0,0};
+
+    cons_window w;
     uint64_t first_pos = c->bams[bam_start]->pos;
     assert(first_pos + 1 == s->hdr->ref_seq_start);
 
-    // 1: Iterate through names to count frequency
+    memset(&w, 0, sizeof(w));
+    w.start = w.first_pos = first_pos;
+
+    // Unsorted slices can't be streamed, so the window then grows to
+    // cover the entire slice instead.
+    int sorted = 1;
+    int64_t last_pos = first_pos;
+    for (r1 = bam_start, r2 = 0; r2 < s->hdr->num_records; r1++, r2++) {
+	int64_t pos = c->bams[r1]->pos;
+	if (pos < 0)
+	    continue;
+	if (pos < (int64_t)first_pos) {
+	    // Encoding against cons needs it to start at the first read
+	    fprintf(stderr, "Embedded consensus requires the first read "
+		    "in each slice to be left-most\n");
+	    return -1;
+	}
+	if (pos < last_pos)
+	    sorted = 0;
+	last_pos = pos;
+    }
+
     uint64_t max_pos = 0;
     for (r1 = bam_start, r2 = 0; r2 < s->hdr->num_records; r1++, r2++) {
-	//cram_record *cr = &s->crecs[r2];
 	bam_seq_t *b = c->bams[r1];
-	char *seq = bam_seq(b);
+	unsigned char *seq = (unsigned char *)bam_seq(b);
 	uint32_t *cig = bam_cigar(b);
 	int ncig = bam_cigar_len(b);
 
-	int i, spos = 0, rpos = b->pos;
+	int i, spos = 0;
+	uint64_t rpos = b->pos;
+
+	if (b->pos < 0)
+	    continue;
+
+	// Nothing later can touch positions before this read.
+	if (sorted && rpos > w.start && cons_call(&w, rpos) < 0)
+	    goto err;
+
 	// Iterator over cigar and seq
 	for (i = 0; i < ncig; i++) {
 	    enum cigar_op cig_op = cig[i] & BAM_CIGAR_MASK;
@@ -1434,20 +1507,14 @@ int generate_consensus(cram_container *c, cram_slice *s, int bam_start) {
 	    case BAM_CMATCH:
 	    case BAM_CBASE_MATCH:
 	    case BAM_CBASE_MISMATCH: {
-		int j;
-		while (cnt_sz <= rpos+cig_len-first_pos) {
-		    int old_sz = cnt_sz;
-		    cnt_sz = cnt_sz ? cnt_sz*2 : 1024;
-		    cnt = realloc(cnt, cnt_sz * sizeof(*cnt));
-		    memset(&cnt[old_sz], 0, (cnt_sz - old_sz)*sizeof(*cnt));
-		}
-		for (j = 0; j < cig_len && spos+j < b->len; j++) {
-		    unsigned char base = bam_nt16_rev_table[bam_seqi(seq, spos+j)];
-		    //printf("%d\t%c (%d %d %d %d %d)\n", rpos+j+1, base,
-		    //	   cnt[rpos+j-first_pos][0],
-		    //	   cnt[rpos+j-first_pos][1], cnt[rpos+j-first_pos][3],
-		    //	   cnt[rpos+j-first_pos][2], cnt[rpos+j-first_pos][4]);
-		    cnt[rpos+j-first_pos][L[base]]++;
+		int j, n = cig_len;
+		if (cons_reserve(&w, rpos+cig_len+1) < 0)
+		    goto err;
+		if (n > b->len - spos)
+		    n = b->len - spos;
+		for (j = 0; j < n; j++) {
+		    if (rpos+j >= w.start)
+			w.cnt[(rpos+j) & w.mask][L16[bam_seqi(seq, spos+j)]]++;
 		}
 		spos += cig_len;
 		rpos += cig_len;
@@ -1465,22 +1532,17 @@ int generate_consensus(cram_container *c, cram_slice *s, int bam_start) {
 
 	    case BAM_CDEL: {
 		int j;
-		while (cnt_sz <= rpos+cig_len-first_pos) {
-		    int old_sz = cnt_sz;
-		    cnt_sz = cnt_sz ? cnt_sz*2 : 1024;
-		    cnt = realloc(cnt, cnt_sz * sizeof(*cnt));
-		    memset(&cnt[old_sz], 0, (cnt_sz - old_sz)*sizeof(*cnt));
-		}
+		if (cons_reserve(&w, rpos+cig_len+1) < 0)
+		    goto err;
 		for (j = 0; j < cig_len; j++) {
-		    cnt[rpos+j-first_pos][5]++;
-		    //printf("%d\t*\n", rpos+j);
+		    if (rpos+j >= w.start)
+			w.cnt[(rpos+j) & w.mask][5]++;
 		}
 		rpos += cig_len;
 		break;
 	    }
 
 	    case BAM_CINS:
-		//printf("+%d ins\n", cig_len);
 		spos += cig_len;
 		break;
 
@@ -1490,44 +1552,21 @@ int generate_consensus(cram_container *c, cram_slice *s, int bam_start) {
 	}
     }
 
-    uint64_t p;
-//    puts("=== cons ===");
-    char *cons = malloc(max_pos - first_pos);
-    if (!cons)
-	return -1;
+    // Flush the remainder of the window.
+    if (cons_call(&w, max_pos) < 0)
+	goto err;
+    if (!w.cons && !(w.cons = malloc(1)))
+	goto err;
 
-    //fprintf(stderr, "%d to %d\n", (int)first_pos, (int)max_pos);
-    for (p = first_pos; p < max_pos; p++) {
-	//fprintf(stderr, "%d: %d %d %d %d %d\n", (int)p, cnt[p][1], cnt[p][2], cnt[p][3], cnt[p][4], cnt[p][5]);
-	int base = 'N';
-	int freq = 0;
-	if (freq < cnt[p-first_pos][1])
-	    freq = cnt[p-first_pos][1], base = 'A';
-	if (freq < cnt[p-first_pos][2])
-	    freq = cnt[p-first_pos][2], base = 'C';
-	if (freq < cnt[p-first_pos][3])
-	    freq = cnt[p-first_pos][3], base = 'G';
-	if (freq < cnt[p-first_pos][4])
-	    freq = cnt[p-first_pos][4], base = 'T';
-	if (freq < cnt[p-first_pos][5])
-	    freq = cnt[p-first_pos][5], base = '*';
-	cons[p-first_pos] = base;
-//	uint64_t t =
-//	    cnt[p-first_pos][0] +
-//	    cnt[p-first_pos][1] +
-//	    cnt[p-first_pos][2] +
-//	    cnt[p-first_pos][3] +
-//	    cnt[p-first_pos][4] +
-//	    cnt[p-first_pos][5];
-//	printf("%10"PRId64" // %4d %4d %4d %4d %4d %4d // %c %5.1f%%\n", p, cnt[p-first_pos][0],
-//	       cnt[p-first_pos][1], cnt[p-first_pos][2],
-//	       cnt[p-first_pos][3], cnt[p-first_pos][4],
-//	       cnt[p-first_pos][5], base, 100.0*freq/t);
-    }
-    s->cons = cons;
-    free(cnt);
+    s->cons = w.cons;
+    free(w.cnt);
 
     return 0;
+
+ err:
+    free(w.cnt);
+    free(w.cons);
+    return -1;
 }
 
 /*
@@ -1590,7 +1629,7 @@ int add_read_names(cram_fd *fd, cram_container *c, cram_slice *s,
 	    cr->name_len    = bam_name_len(b);
 	}
 #endif
-	cram_stats_add(c->stats[DS_RN], cr->name_len);
+	cram_stats_add(s->stats[DS_RN], cr->name_len);
     }
 
     return 0;
@@ -1601,7 +1640,7 @@ int add_read_names(cram_fd *fd, cram_container *c, cram_slice *s,
  * Returns 0 on success
  *        -1 on failure
  */
-int cram_encode_container(cram_fd *fd, cram_container *c) {
+static int cram_encode_container2(cram_fd *fd, cram_container *c) {
     int i, j, slice_offset;
     cram_block_compression_hdr *h = c->comp_hdr;
     cram_block *c_hdr;
@@ -1654,6 +1693,12 @@ int cram_encode_container(cram_fd *fd, cram_container *c) {
 
 	assert(sn < c->curr_slice);
 
+	// Statistics are gathered per slice and folded into the
+	// container once the slice is complete.
+	for (i = DS_RN; i < DS_TN; i++)
+	    if (!s->stats[i] && !(s->stats[i] = cram_stats_create()))
+		return -1;
+
 	// Discover which read names *may* be safely removed.
 	// Ie which ones have all their records in this slice.
 	lossy_read_names(fd, c, s, r1_start);
@@ -1663,8 +1708,8 @@ int cram_encode_container(cram_fd *fd, cram_container *c) {
 	// to go back to the original reference again.
 	// It does however play havoc with NM/MD tags in some scenarios
 	// (see below).
-	if (fd->embed_cons)
-	    generate_consensus(c, s, r1_start);
+	if (fd->embed_cons && generate_consensus(c, s, r1_start) < 0)
+	    return -1;
 
 	// Tracking of NM / MD tags so we can spot when the auto-generated values
 	// will differ from the current stored ones.
@@ -1718,6 +1763,10 @@ int cram_encode_container(cram_fd *fd, cram_container *c) {
 	// lossily compressed, so we do these in another pass.
 	add_read_names(fd, c, s, r1_start);
 
+	for (i = DS_RN; i < DS_TN; i++)
+	    if (cram_stats_merge(c->stats[i], s->stats[i]) < 0)
+		return -1;
+
 	if (c->multi_seq) {
 	    s->hdr->ref_seq_id    = -2;
 	    s->hdr->ref_seq_start = 0;
@@ -1740,17 +1789,16 @@ int cram_encode_container(cram_fd *fd, cram_container *c) {
 	// slice can start aggregating them from the start again.
 	if (c->tags_used->nused) {
 	    int ntags = c->tags_used->nused;
-	    s->aux_block = calloc(ntags*2, sizeof(*s->aux_block));
+	    s->aux_block = arena_calloc(s->arena, ntags*2,
+					sizeof(*s->aux_block));
 	    if (!s->aux_block)
 		return -1;
 	    
-	    HashItem *hi;
-	    HashIter *iter = HashTableIterCreate();
-	    if (!iter)
-		return -1;
+	    FHashItem *hi;
+	    int iter = 0;
 
 	    s->naux_block = 0;
-	    while ((hi = HashTableIterNext(c->tags_used, iter))) {
+	    while ((hi = FHashTableIterNext(c->tags_used, &iter))) {
 		cram_tag_map *tm = (cram_tag_map *)hi->data.p;
 		if (!tm->blk) continue;
 		s->aux_block[s->naux_block++] = tm->blk;
@@ -1760,8 +1808,6 @@ int cram_encode_container(cram_fd *fd, cram_container *c) {
 		tm->blk2 = NULL;
 	    }
 	    assert(s->naux_block <= 2*c->tags_used->nused);
-
-	    HashTableIterDestroy(iter);
 	}
     }
 
@@ -2144,7 +2190,8 @@ int cram_encode_container(cram_fd *fd, cram_container *c) {
     /* Compute landmarks */
     /* Fill out slice landmarks */
     c->num_landmarks = c->curr_slice;
-    c->landmark = malloc(c->num_landmarks * sizeof(*c->landmark));
+    c->landmark = arena_alloc(c->arena,
+			      c->num_landmarks * sizeof(*c->landmark));
     if (!c->landmark)
 	return -1;
 
@@ -2216,6 +2263,35 @@ int cram_encode_container(cram_fd *fd, cram_container *c) {
     return 0;
 }
 
+/*
+ * Encodes all slices in a container into blocks, recording the time
+ * taken when CRAM_OPT_STATS is enabled.
+ *
+ * Returns 0 on success
+ *        -1 on failure
+ */
+int cram_encode_container(cram_fd *fd, cram_container *c) {
+    io_clock t;
+    int r;
+
+    io_stats_start(fd->stats, &t);
+    r = cram_encode_container2(fd, c);
+    io_stats_add(fd->stats, IO_STAGE_ENCODE, &t, 0, r == 0 ? c->length : 0);
+
+    // Feedback for cram_adapt_slice_size
+    if (r == 0 && fd->slice_target && c->c_num_bytes) {
+	double ratio = (double)c->length / c->c_num_bytes;
+
+	if (fd->metrics_lock) pthread_mutex_lock(fd->metrics_lock);
+	fd->slice_ratio = fd->slice_ratio
+	    ? 0.75 * fd->slice_ratio + 0.25 * ratio
+	    : ratio;
+	if (fd->metrics_lock) pthread_mutex_unlock(fd->metrics_lock);
+    }
+
+    return r;
+}
+
 
 /*
  * Adds a feature code to a read within a slice. For purposes of minimising
@@ -2237,12 +2313,12 @@ static int cram_add_feature(cram_container *c, cram_slice *s,
 
     if (!r->nfeature++) {
 	r->feature = s->nfeatures;
-	cram_stats_add(c->stats[DS_FP], f->X.pos);
+	cram_stats_add(s->stats[DS_FP], f->X.pos);
     } else {
-	cram_stats_add(c->stats[DS_FP],
+	cram_stats_add(s->stats[DS_FP],
 		       f->X.pos - s->features[r->feature + r->nfeature-2].X.pos);
     }
-    cram_stats_add(c->stats[DS_FC], f->X.code);
+    cram_stats_add(s->stats[DS_FC], f->X.code);
 
     s->features[s->nfeatures++] = *f;
 
@@ -2259,7 +2335,7 @@ static int cram_add_substitution(cram_fd *fd, cram_container *c,
 	f.X.pos = pos+1;
 	f.X.code = 'X';
 	f.X.base = fd->cram_sub_matrix[ref&0x1f][base&0x1f];
-	cram_stats_add(c->stats[DS_BS], f.X.base);
+	cram_stats_add(s->stats[DS_BS], f.X.base);
     } else {
 	if (fd->binning == BINNING_ILLUMINA)
 	    qual = illumina_bin[(uc)qual];
@@ -2268,8 +2344,8 @@ static int cram_add_substitution(cram_fd *fd, cram_container *c,
 	f.B.code = 'B';
 	f.B.base = base;
 	f.B.qual = qual;
-	cram_stats_add(c->stats[DS_BA], f.B.base);
-	cram_stats_add(c->stats[DS_QS], f.B.qual);
+	cram_stats_add(s->stats[DS_BA], f.B.base);
+	cram_stats_add(s->stats[DS_QS], f.B.qual);
 	BLOCK_APPEND_CHAR(s->qual_blk, qual);
     }
     return cram_add_feature(c, s, r, &f);
@@ -2299,8 +2375,8 @@ static int cram_add_base(cram_fd *fd, cram_container *c,
     f.B.code = 'B';
     f.B.base = base;
     f.B.qual = qual;
-    cram_stats_add(c->stats[DS_BA], base);
-    cram_stats_add(c->stats[DS_QS], qual);
+    cram_stats_add(s->stats[DS_BA], base);
+    cram_stats_add(s->stats[DS_QS], qual);
     BLOCK_APPEND_CHAR(s->qual_blk, qual);
     return cram_add_feature(c, s, r, &f);
 }
@@ -2315,7 +2391,7 @@ static int cram_add_quality(cram_fd *fd, cram_container *c,
     f.Q.pos = pos+1;
     f.Q.code = 'Q';
     f.Q.qual = qual;
-    cram_stats_add(c->stats[DS_QS], qual);
+    cram_stats_add(s->stats[DS_QS], qual);
     BLOCK_APPEND_CHAR(s->qual_blk, qual);
     return cram_add_feature(c, s, r, &f);
 }
@@ -2326,7 +2402,7 @@ static int cram_add_deletion(cram_container *c, cram_slice *s, cram_record *r,
     f.D.pos = pos+1;
     f.D.code = 'D';
     f.D.len = len;
-    cram_stats_add(c->stats[DS_DL], len);
+    cram_stats_add(s->stats[DS_DL], len);
     return cram_add_feature(c, s, r, &f);
 }
 
@@ -2369,7 +2445,7 @@ static int cram_add_hardclip(cram_container *c, cram_slice *s, cram_record *r,
     f.S.pos = pos+1;
     f.S.code = 'H';
     f.S.len = len;
-    cram_stats_add(c->stats[DS_HC], len);
+    cram_stats_add(s->stats[DS_HC], len);
     return cram_add_feature(c, s, r, &f);
 }
 
@@ -2379,7 +2455,7 @@ static int cram_add_skip(cram_container *c, cram_slice *s, cram_record *r,
     f.S.pos = pos+1;
     f.S.code = 'N';
     f.S.len = len;
-    cram_stats_add(c->stats[DS_RS], len);
+    cram_stats_add(s->stats[DS_RS], len);
     return cram_add_feature(c, s, r, &f);
 }
 
@@ -2389,7 +2465,7 @@ static int cram_add_pad(cram_container *c, cram_slice *s, cram_record *r,
     f.S.pos = pos+1;
     f.S.code = 'P';
     f.S.len = len;
-    cram_stats_add(c->stats[DS_PD], len);
+    cram_stats_add(s->stats[DS_PD], len);
     return cram_add_feature(c, s, r, &f);
 }
 
@@ -2401,7 +2477,7 @@ static int cram_add_insertion(cram_container *c, cram_slice *s, cram_record *r,
 	char b = base ? *base : 'N';
 	f.i.code = 'i';
 	f.i.base = b;
-	cram_stats_add(c->stats[DS_BA], b);
+	cram_stats_add(s->stats[DS_BA], b);
     } else {
 	f.I.code = 'I';
 	f.I.len = len;
@@ -2432,7 +2508,7 @@ static int cram_add_aux_MDZ(cram_fd *fd, cram_container *c, cram_slice *s,
     cram_codec *codec;
     int key;
     HashData hd;
-    HashItem *hi;
+    FHashItem *hi;
 
     aux_f[0] = 'M';
     aux_f[1] = 'D';
@@ -2441,7 +2517,7 @@ static int cram_add_aux_MDZ(cram_fd *fd, cram_container *c, cram_slice *s,
     key = (aux_f[0]<<16)|(aux_f[1]<<8)|aux_f[2];
 
     hd.p = NULL;
-    if (!(hi = HashTableAdd(c->tags_used, aux_f, 3, hd, NULL)))
+    if (!(hi = FHashTableAdd(c->tags_used, aux_f, 3, hd, NULL)))
 	return -1;
     if (!hi->data.p) {
 	HashItem *hi_global;
@@ -2496,7 +2572,7 @@ static int cram_add_aux_NMi(cram_fd *fd, cram_container *c, cram_slice *s,
     cram_tag_map *tm;
     int key;
     HashData hd;
-    HashItem *hi;
+    FHashItem *hi;
 
     int nm_len = 0;
     aux_f[0] = 'N';
@@ -2512,7 +2588,7 @@ static int cram_add_aux_NMi(cram_fd *fd, cram_container *c, cram_slice *s,
     key = (aux_f[0]<<16)|(aux_f[1]<<8)|aux_f[2];
 
     hd.p = NULL;
-    if (!(hi = HashTableAdd(c->tags_used, aux_f, 3, hd, NULL)))
+    if (!(hi = FHashTableAdd(c->tags_used, aux_f, 3, hd, NULL)))
 	return -1;
     if (!hi->data.p) {
 	HashItem *hi_global;
@@ -2609,7 +2685,7 @@ static char *cram_encode_aux(cram_fd *fd, bam_seq_t *b, cram_container *c,
     cram_block *td_b = c->comp_hdr->TD_blk;
     int TD_blk_size = BLOCK_SIZE(td_b), new;
     HashData hd;
-    HashItem *hi;
+    FHashItem *hi;
     int omit_RG = !fd->preserve_aux_order;
     int omit_MD = !fd->preserve_aux_order;
     int omit_NM = !fd->preserve_aux_order;
@@ -2736,8 +2812,7 @@ static char *cram_encode_aux(cram_fd *fd, bam_seq_t *b, cram_container *c,
 	BLOCK_APPEND(td_b, aux_f, 3);
 
 	// Container level tags_used, for TD series
-	// replace with fast hash too
-	if (!(hi = HashTableAdd(c->tags_used, aux_f, 3, hd, NULL)))
+	if (!(hi = FHashTableAdd(c->tags_used, aux_f, 3, hd, NULL)))
 	    return NULL;
 
 	int key = (aux_f[0]<<16)|(aux_f[1]<<8)|aux_f[2];
@@ -3072,9 +3147,9 @@ static char *cram_encode_aux(cram_fd *fd, bam_seq_t *b, cram_container *c,
     // And and increment TD hash entry
     BLOCK_APPEND_CHAR(td_b, 0);
     hd.i = c->comp_hdr->nTL;
-    hi = HashTableAdd(c->comp_hdr->TD,
-		      (char *)BLOCK_DATA(td_b) + TD_blk_size,
-		      BLOCK_SIZE(td_b) - TD_blk_size, hd, &new);
+    hi = FHashTableAdd(c->comp_hdr->TD,
+		       (char *)BLOCK_DATA(td_b) + TD_blk_size,
+		       BLOCK_SIZE(td_b) - TD_blk_size, hd, &new);
     if (!hi)
 	return NULL;
 
@@ -3085,7 +3160,7 @@ static char *cram_encode_aux(cram_fd *fd, bam_seq_t *b, cram_container *c,
     }
 
     cr->TL = hi->data.i;
-    cram_stats_add(c->stats[DS_TL], cr->TL);
+    cram_stats_add(s->stats[DS_TL], cr->TL);
 
     return rg;
 }
@@ -3126,6 +3201,87 @@ void cram_update_curr_slice(cram_container *c) {
     c->curr_slice++;
 }
 
+/*
+ * Adaptive slice sizing, enabled by CRAM_OPT_SLICE_TARGET_BYTES.
+ *
+ * Slices are cut once the BAM record bytes held, multiplied by the
+ * compression ratio observed on earlier containers, reach the target
+ * compressed size.  This keeps long-read slices from growing huge while
+ * still letting short-read slices fill up to seqs_per_slice.  The target
+ * is scaled up while most encoder threads are idle, where larger slices
+ * compress better at no cost in throughput, and back down again while
+ * the job queue is full and every queued container is held in memory.
+ *
+ * Independently of this, CRAM_OPT_CONTAINER_MAX_BYTES is shared out
+ * evenly between the slices of a container.
+ *
+ * Called from the main thread as each slice is started.
+ *
+ * Returns the BAM byte limit for the new slice, or 0 for no byte limit.
+ */
+static uint64_t cram_adapt_slice_size(cram_fd *fd) {
+    double ratio, bytes;
+
+    if (!fd->slice_target) {
+	if (!fd->container_max_bytes)
+	    return 0;
+	bytes = fd->container_max_bytes / fd->slices_per_container;
+	return bytes > 0 ? bytes : 1;
+    }
+
+    if (fd->pool) {
+	t_pool *p = fd->pool;
+	int idle, full;
+
+	pthread_mutex_lock(&p->pool_m);
+	idle = p->njobs == 0 && p->nwaiting*2 > p->tsize;
+	full = p->njobs >= p->qsize;
+	pthread_mutex_unlock(&p->pool_m);
+
+	if (idle)
+	    fd->slice_scale = MIN(fd->slice_scale * 1.25, ADAPT_SLICE_SCALE_MAX);
+	else if (full)
+	    fd->slice_scale = MAX(fd->slice_scale / 1.25, 1.0);
+    }
+
+    if (fd->metrics_lock) pthread_mutex_lock(fd->metrics_lock);
+    ratio = fd->slice_ratio ? fd->slice_ratio : ADAPT_SLICE_RATIO;
+    if (fd->metrics_lock) pthread_mutex_unlock(fd->metrics_lock);
+
+    bytes = fd->slice_target * fd->slice_scale / ratio;
+    bytes = MAX(bytes, ADAPT_SLICE_MIN_BYTES);
+    bytes = MIN(bytes, ADAPT_SLICE_MAX_BYTES);
+
+    // Share the container memory limit out between its slices
+    if (fd->container_max_bytes)
+	bytes = MIN(bytes, fd->container_max_bytes / fd->slices_per_container);
+
+    if (fd->verbose > 1)
+	fprintf(stderr, "Adaptive slice size %.0f bytes (ratio %.3f, "
+		"scale %.2f)\n", bytes, ratio, fd->slice_scale);
+
+    return bytes > 0 ? bytes : 1;
+}
+
+/*
+ * Returns true if the current slice has reached its size limit, or the
+ * container has reached CRAM_OPT_CONTAINER_MAX_BYTES.  Sequence counts
+ * are checked separately as they also bound the c->bams[] array.
+ */
+static int cram_slice_full(cram_fd *fd, cram_container *c) {
+    if (fd->container_max_bytes && c->c_num_bytes >= fd->container_max_bytes)
+	return 1;
+
+    if (c->s_max_bytes && c->s_num_bytes >= c->s_max_bytes)
+	return 1;
+
+    // Adaptive sizing replaces the base count limit
+    if (fd->slice_target)
+	return 0;
+
+    return c->s_num_bases >= fd->bases_per_slice;
+}
+
 /*
  * Handles creation of a new container or new slice, flushing any
  * existing containers when appropriate. 
@@ -3148,6 +3304,7 @@ static cram_container *cram_next_container(cram_fd *fd, bam_seq_t *b) {
 
     /* Flush container */
     if (c->curr_slice == c->max_slice ||
+	(fd->container_max_bytes && c->c_num_bytes >= fd->container_max_bytes) ||
 	(bam_ref(b) != c->curr_ref && !c->multi_seq)) {
 	c->ref_seq_span = fd->last_base - c->ref_seq_start + 1;
 	if (fd->verbose)
@@ -3202,6 +3359,8 @@ static cram_container *cram_next_container(cram_fd *fd, bam_seq_t *b) {
 
     c->curr_rec = 0;
     c->s_num_bases = 0;
+    c->s_num_bytes = 0;
+    c->s_max_bytes = cram_adapt_slice_size(fd);
     // QO field: 0 implies original orientation, 1 implies sequence orientation
     // 1 is often preferable for NovaSeq, but impact is slight. ~0.5% diff.
     // Conversely other data sets it's often better than 1% saving for 0.
@@ -3248,8 +3407,8 @@ static int process_one_read(cram_fd *fd, cram_container *c,
     //dstring_nappend(s->aux_ds, bam_aux(b), cr->aux_size);
 
     
-    cr->ref_id      = bam_ref(b);  cram_stats_add(c->stats[DS_RI], cr->ref_id);
-    cram_stats_add(c->stats[DS_BF], fd->cram_flag_swap[cr->flags & 0xfff]);
+    cr->ref_id      = bam_ref(b);  cram_stats_add(s->stats[DS_RI], cr->ref_id);
+    cram_stats_add(s->stats[DS_BF], fd->cram_flag_swap[cr->flags & 0xfff]);
 
     // Non reference based encoding means storing the bases verbatim as features, which in
     // turn means every base also has a quality already stored.
@@ -3258,20 +3417,20 @@ static int process_one_read(cram_fd *fd, cram_container *c,
 
     if (cr->len <= 0 && CRAM_MAJOR_VERS(fd->version) >= 3)
 	cr->cram_flags |= CRAM_FLAG_NO_SEQ;
-    //cram_stats_add(c->stats[DS_CF], cr->cram_flags);
+    //cram_stats_add(s->stats[DS_CF], cr->cram_flags);
 
     c->num_bases   += cr->len;
     cr->apos        = bam_pos(b)+1;
     if (c->pos_sorted) {
 	if (cr->apos < s->last_apos) {
 	    c->pos_sorted = 0;
-	    //cram_stats_add(c->stats[DS_AP], cr->apos);
+	    //cram_stats_add(s->stats[DS_AP], cr->apos);
 	} else {
-	    cram_stats_add(c->stats[DS_AP], cr->apos - s->last_apos);
+	    cram_stats_add(s->stats[DS_AP], cr->apos - s->last_apos);
 	    s->last_apos = cr->apos;
 	}
     } else {
-	//cram_stats_add(c->stats[DS_AP], cr->apos);
+	//cram_stats_add(s->stats[DS_AP], cr->apos);
     }
     c->max_apos += (cr->apos > c->max_apos) * (cr->apos - c->max_apos);
 
@@ -3564,7 +3723,7 @@ static int process_one_read(cram_fd *fd, cram_container *c,
 	}
 	fake_qual = spos;
 	cr->aend = fd->no_ref ? apos : MIN(apos, c->ref_end);
-	cram_stats_add(c->stats[DS_FN], cr->nfeature);
+	cram_stats_add(s->stats[DS_FN], cr->nfeature);
 
 	if (MD && ref) {
 	    dstring_append_int(MD, apos - MD_last);
@@ -3579,11 +3738,11 @@ static int process_one_read(cram_fd *fd, cram_container *c,
 	cr->nfeature = 0;
 	cr->aend = cr->apos;
 	for (i = 0; i < cr->len; i++)
-	    cram_stats_add(c->stats[DS_BA], seq[i]);
+	    cram_stats_add(s->stats[DS_BA], seq[i]);
 	fake_qual = 0;
     }
 
-    cr->ntags      = 0; //cram_stats_add(c->stats[DS_TC], cr->ntags);
+    cr->ntags      = 0; //cram_stats_add(s->stats[DS_TC], cr->ntags);
     rg = cram_encode_aux(fd, b, c, s, cr, NM, MD, need_MD_NM);
 
     /* Read group, identified earlier */
@@ -3593,7 +3752,7 @@ static int process_one_read(cram_fd *fd, cram_container *c,
     } else {
 	cr->rg = -1;
     }
-    cram_stats_add(c->stats[DS_RG], cr->rg);
+    cram_stats_add(s->stats[DS_RG], cr->rg);
 
     /*
      * Append to the qual block now. We do this here as
@@ -3645,19 +3804,19 @@ static int process_one_read(cram_fd *fd, cram_container *c,
 	    cr->len = fake_qual >= 0 ? fake_qual : cr->aend - cr->apos + 1;
     }
 
-    cram_stats_add(c->stats[DS_RL], cr->len);
+    cram_stats_add(s->stats[DS_RL], cr->len);
 
     /* Now we know apos and aend both, update mate-pair information */
     {
 	int new;
 	HashData hd;
-	HashItem *hi;
+	FHashItem *hi;
 
 	hd.i = rnum;
 	//fprintf(stderr, "Checking %"PRId64"\t%s\n", hd.i, bam_name(b));
 	if (cr->flags & BAM_FPAIRED) {
-	    hi = HashTableAdd(s->pair[(cr->flags & BAM_FSECONDARY) ? 1 : 0],
-			      bam_name(b), bam_name_len(b), hd, &new);
+	    hi = FHashTableAdd(s->pair[(cr->flags & BAM_FSECONDARY) ? 1 : 0],
+			       bam_name(b), bam_name_len(b), hd, &new);
 	    if (!hi)
 		return -1;
 	} else {
@@ -3766,20 +3925,20 @@ static int process_one_read(cram_fd *fd, cram_container *c,
 	     * not emitted.
 	     */
 	    cr->mate_pos = p->apos;
-	    cram_stats_add(c->stats[DS_NP], cr->mate_pos);
+	    cram_stats_add(s->stats[DS_NP], cr->mate_pos);
 	    cr->tlen = explicit_tlen ? bam_ins_size(b) : sign*(aright-aleft+1);
-	    cram_stats_add(c->stats[DS_TS], cr->tlen);
+	    cram_stats_add(s->stats[DS_TS], cr->tlen);
 	    cr->mate_flags =
 	    	((p->flags & BAM_FMUNMAP)   == BAM_FMUNMAP)   * CRAM_M_UNMAP +
 	    	((p->flags & BAM_FMREVERSE) == BAM_FMREVERSE) * CRAM_M_REVERSE;
 
 	    // Decrement statistics aggregated earlier
 	    if (p->cram_flags & CRAM_FLAG_STATS_ADDED) {
-		cram_stats_del(c->stats[DS_NP], p->mate_pos);
-		cram_stats_del(c->stats[DS_MF], p->mate_flags);
+		cram_stats_del(s->stats[DS_NP], p->mate_pos);
+		cram_stats_del(s->stats[DS_MF], p->mate_flags);
 		if (!(p->cram_flags & CRAM_FLAG_EXPLICIT_TLEN))
-		    cram_stats_del(c->stats[DS_TS], p->tlen);
-		cram_stats_del(c->stats[DS_NS], p->mate_ref_id);
+		    cram_stats_del(s->stats[DS_TS], p->tlen);
+		cram_stats_del(s->stats[DS_NS], p->mate_ref_id);
 	    }
 
 	    /* Similarly we could correct the p-> values too, but these will no
@@ -3795,20 +3954,20 @@ static int process_one_read(cram_fd *fd, cram_container *c,
 	    // Clear detached from cr flags
 	    cr->cram_flags &= ~CRAM_FLAG_DETACHED;
 	    cr->cram_flags |= explicit_tlen;
-	    cram_stats_add(c->stats[DS_CF], cr->cram_flags & CRAM_FLAG_MASK);
+	    cram_stats_add(s->stats[DS_CF], cr->cram_flags & CRAM_FLAG_MASK);
 
 	    // Clear detached from p flags and set downstream
 	    if (p->cram_flags & CRAM_FLAG_STATS_ADDED) {
-		cram_stats_del(c->stats[DS_CF], p->cram_flags & CRAM_FLAG_MASK);
+		cram_stats_del(s->stats[DS_CF], p->cram_flags & CRAM_FLAG_MASK);
 		p->cram_flags &= ~CRAM_FLAG_STATS_ADDED;
 	    }
 
 	    p->cram_flags  &= ~CRAM_FLAG_DETACHED;
 	    p->cram_flags  |=  CRAM_FLAG_MATE_DOWNSTREAM | explicit_tlen;
-	    cram_stats_add(c->stats[DS_CF], p->cram_flags & CRAM_FLAG_MASK);
+	    cram_stats_add(s->stats[DS_CF], p->cram_flags & CRAM_FLAG_MASK);
 
 	    p->mate_line = hd.i - (hi->data.i + 1);
-	    cram_stats_add(c->stats[DS_NF], p->mate_line);
+	    cram_stats_add(s->stats[DS_NF], p->mate_line);
 
 	    hi->data.i = rnum;
 	    //HashTableDel(s->pair, hi, 0);
@@ -3823,24 +3982,24 @@ static int process_one_read(cram_fd *fd, cram_container *c,
 	    if (bam_flag(b) & BAM_FMREVERSE)
 		cr->mate_flags |= CRAM_M_REVERSE;
 
-	    cram_stats_add(c->stats[DS_MF], cr->mate_flags);
+	    cram_stats_add(s->stats[DS_MF], cr->mate_flags);
 
 	    cr->mate_pos    = MAX(bam_mate_pos(b)+1, 0);
-	    cram_stats_add(c->stats[DS_NP], cr->mate_pos);
+	    cram_stats_add(s->stats[DS_NP], cr->mate_pos);
 
 	    cr->tlen        = bam_ins_size(b);
-	    cram_stats_add(c->stats[DS_TS], cr->tlen);
+	    cram_stats_add(s->stats[DS_TS], cr->tlen);
 
 	    cr->cram_flags |= CRAM_FLAG_DETACHED;
-	    cram_stats_add(c->stats[DS_CF], cr->cram_flags & CRAM_FLAG_MASK);
-	    cram_stats_add(c->stats[DS_NS], bam_mate_ref(b));
+	    cram_stats_add(s->stats[DS_CF], cr->cram_flags & CRAM_FLAG_MASK);
+	    cram_stats_add(s->stats[DS_NS], bam_mate_ref(b));
 
 	    cr->cram_flags |= CRAM_FLAG_STATS_ADDED;
 	}
     }
 
     cr->mqual       = bam_map_qual(b);
-    cram_stats_add(c->stats[DS_MQ], cr->mqual);
+    cram_stats_add(s->stats[DS_MQ], cr->mqual);
 
     cr->mate_ref_id = bam_mate_ref(b);
 
@@ -3876,7 +4035,7 @@ int cram_put_bam_seq(cram_fd *fd, bam_seq_t *b) {
 
     if (!c->slice || c->curr_rec == c->max_rec ||
 	(bam_ref(b) != c->curr_ref && c->curr_ref >= -1) ||
-	(c->s_num_bases >= fd->bases_per_slice)) {
+	cram_slice_full(fd, c)) {
 	int slice_rec, curr_rec, multi_seq = fd->multi_seq == 1;
 	int curr_ref = c->slice ? c->curr_ref : bam_ref(b);
 
@@ -3884,14 +4043,15 @@ int cram_put_bam_seq(cram_fd *fd, bam_seq_t *b) {
 	 * Start packing slices when we routinely have under 1/4tr full.
 	 *
 	 * This option isn't available if we choose to embed references
-	 * since we can only have one per slice.
+	 * since we can only have one per slice.  Slices cut short by
+	 * adaptive sizing are small for other reasons, so don't count.
 	 *
 	 * The multi_seq var here refers to our intention for the next slice.
 	 * This slice has already been encoded so we output as-is.
 	 */
 	if (fd->multi_seq == -1 && c->curr_rec < c->max_rec/4+10 &&
 	    fd->last_slice && fd->last_slice < c->max_rec/4+10 &&
-	    !fd->embed_ref) {
+	    !fd->embed_ref && !(c->s_max_bytes && cram_slice_full(fd, c))) {
 	    if (fd->verbose && !c->multi_seq)
 		fprintf(stderr, "Multi-ref enabled for next container\n");
 	    multi_seq = 1;
@@ -3909,7 +4069,7 @@ int cram_put_bam_seq(cram_fd *fd, bam_seq_t *b) {
 	curr_rec  = c->curr_rec;
 
 	if (c->curr_rec == c->max_rec || fd->multi_seq != 1 || !c->slice ||
-	    c->s_num_bases >= fd->bases_per_slice) {
+	    cram_slice_full(fd, c)) {
 	    if (NULL == (c = cram_next_container(fd, b))) {
 		if (fd->ctr) {
 		    // prevent cram_close attempting to flush
@@ -3993,17 +4153,32 @@ int cram_put_bam_seq(cram_fd *fd, bam_seq_t *b) {
     }
 
     /* Copy or alloc+copy the bam record, for later encoding */
+#ifdef SAMTOOLS
     if (c->bams[c->curr_c_rec])
-	// 82% of main thread for 16-thread cram write
-	// Around 18% of total CPU time. => max 500% utilisation.
-	// Add "restrict" to pointer?
 	bam_copy(&c->bams[c->curr_c_rec], b);
     else
 	c->bams[c->curr_c_rec] = bam_dup(b);
+#else
+    // 82% of main thread for 16-thread cram write
+    // Around 18% of total CPU time. => max 500% utilisation.
+    // Add "restrict" to pointer?
+    // The pool is only needed when writing, so create it on first use.
+    if (!fd->bam_pool && !(fd->bam_pool = bam_pool_create(256)))
+	return -1;
+    if (bam_pool_copy(fd->bam_pool, &c->bams[c->curr_c_rec], b) < 0)
+	return -1;
+#endif
 
     c->curr_rec++;
     c->curr_c_rec++;
     c->s_num_bases += bam_seq_len(b);
+#ifdef SAMTOOLS
+    c->s_num_bytes += b->l_data;
+    c->c_num_bytes += b->l_data;
+#else
+    c->s_num_bytes += bam_blk_size(b);
+    c->c_num_bytes += bam_blk_size(b);
+#endif
     c->n_mapped += (bam_flag(b) & BAM_FUNMAP) ? 0 : 1;
     fd->record_counter++;
 
@@ -1795,9 +1795,12 @@ cram_block *cram_read_block(cram_fd *fd) {
     cram_block *b = malloc(sizeof(*b));
     unsigned char c;
     uint32_t crc = 0;
+    io_clock t;
     if (!b)
 	return NULL;
 
+    io_stats_start(fd->stats, &t);
+
     //fprintf(stderr, "Block at %d\n", (int)ftell(fd->fp));
 
     if (-1 == (b->method       = (c=CRAM_IO_GETC(fd)))) { free(b); return NULL; }
@@ -1847,6 +1850,8 @@ cram_block *cram_read_block(cram_fd *fd) {
     b->byte = 0;
     b->bit = 7; // MSB
 
+    io_stats_add(fd->stats, IO_STAGE_READ, &t, b->alloc, b->alloc);
+
     return b;
 }
 
@@ -2222,10 +2227,17 @@ int cram_uncompress_block(cram_block *b) {
 //    return e / log(EBASE2);
 //}
 
-static char *cram_compress_by_method(cram_slice *s, char *in, size_t in_size,
-				     int content_id, size_t *out_size,
-				     enum cram_block_method method,
-				     int level, int strat) {
+/*
+ * Compresses a buffer using a single, possibly parameterised, method.
+ * The slice is only consulted by the FQZ methods.
+ *
+ * Returns malloced compressed data, with its size in *out_size, on success.
+ *         NULL on failure or if the method is not available.
+ */
+char *cram_compress_by_method(cram_slice *s, char *in, size_t in_size,
+			      int content_id, size_t *out_size,
+			      enum cram_block_method method,
+			      int level, int strat) {
     switch (method) {
     case GZIP:
     case GZIP_RLE:
@@ -2442,6 +2454,12 @@ int cram_compress_block(cram_fd *fd, cram_slice *s,
     char *comp = NULL;
     size_t comp_size = 0;
     int strat = 0;
+    io_clock t;
+
+    // Symbol statistics for this data series, gathered by the thread
+    // encoding this slice.  Aux tag blocks have no stats.
+    cram_stats *stats = s && b->content_id > 0 && b->content_id < DS_END
+	? s->stats[b->content_id] : NULL;
 
     // Internally we have parameterised methods that externally map
     // to the same CRAM method value.
@@ -2489,6 +2507,8 @@ int cram_compress_block(cram_fd *fd, cram_slice *s,
 	return 0;
     }
 
+    io_stats_start(fd->stats, &t);
+
     if (metrics) {
 	if (fd->metrics_lock) pthread_mutex_lock(fd->metrics_lock);
 	if (fd->unsorted == 2)
@@ -2513,7 +2533,7 @@ int cram_compress_block(cram_fd *fd, cram_slice *s,
 	    }
 
             // Compress this block using the best method
-	    if (metrics->stats && metrics->stats->nvals > 16) {
+	    if (stats && stats->nvals > 16) {
 		// No point trying bit-pack if 17+ symbols.
 		if (method & (1<<RANS_PR128))
 		    method = (method|(1<<RANS_PR0))&~(1<<RANS_PR128);
@@ -2767,6 +2787,8 @@ int cram_compress_block(cram_fd *fd, cram_slice *s,
 		b->content_id, b->uncomp_size, b->comp_size,
 		cram_block_method2str(b->method), strat);
 
+    // Internal method, so trial methods are distinguished
+    io_stats_method(fd->stats, 1, b->method, &t, b->uncomp_size, b->comp_size);
     b->method = methmap[b->method];
 
     return 0;
@@ -2782,7 +2804,6 @@ cram_metrics *cram_new_metrics(void) {
     m->strat = 0;
     m->revised_method = 0;
     m->consistency = 0;
-    m->stats = NULL;
 
     return m;
 }
@@ -3616,11 +3637,12 @@ char *load_ref_portion(bzi_FILE *fp, ref_entry *e, int start, int end) {
 /*
  * Load the entire reference 'id'.
  * This also increments the reference count by 1.
+ * Bgzipped references are decompressed using pool p, if non-NULL.
  *
  * Returns ref_entry on success;
  *         NULL on failure
  */
-ref_entry *cram_ref_load(refs_t *r, int id) {
+ref_entry *cram_ref_load(refs_t *r, int id, t_pool *p) {
     ref_entry *e = r->ref_id[id];
     int start = 1, end = e->length;
     char *seq;
@@ -3664,7 +3686,10 @@ ref_entry *cram_ref_load(refs_t *r, int id) {
 
     RP("%d Loading ref %d (%d..%d)\n", gettid(), id, start, end);
 
-    if (!(seq = load_ref_portion(r->fp, e, start, end))) {
+    bzi_set_pool(r->fp, p);
+    seq = load_ref_portion(r->fp, e, start, end);
+    bzi_set_pool(r->fp, NULL);
+    if (!seq) {
 	return NULL;
     }
 
@@ -3813,7 +3838,7 @@ char *cram_get_ref(cram_fd *fd, int id, int start, int end) {
 		cram_ref_incr_locked(fd->refs, id);
 	    } else {
 		ref_entry *e;
-		if (!(e = cram_ref_load(fd->refs, id))) {
+		if (!(e = cram_ref_load(fd->refs, id, fd->pool))) {
 		    pthread_mutex_unlock(&fd->refs->lock);
 		    if (fd->ref_lock) pthread_mutex_unlock(fd->ref_lock);
 		    return NULL;
@@ -3878,7 +3903,10 @@ char *cram_get_ref(cram_fd *fd, int id, int start, int end) {
 	}
     }
 
-    if (!(fd->ref = load_ref_portion(fd->refs->fp, r, start, end))) {
+    bzi_set_pool(fd->refs->fp, fd->pool);
+    fd->ref = load_ref_portion(fd->refs->fp, r, start, end);
+    bzi_set_pool(fd->refs->fp, NULL);
+    if (!fd->ref) {
 	pthread_mutex_unlock(&fd->refs->lock);
 	if (fd->ref_lock) pthread_mutex_unlock(fd->ref_lock);
 	return NULL;
@@ -3961,6 +3989,9 @@ cram_container *cram_new_container(int nrec, int nslice) {
     c->record_counter = 0;
     c->num_bases = 0;
     c->s_num_bases = 0;
+    c->s_num_bytes = 0;
+    c->c_num_bytes = 0;
+    c->s_max_bytes = 0;
 
     c->max_slice = nslice;
     c->curr_slice = 0;
@@ -3972,7 +4003,10 @@ cram_container *cram_new_container(int nrec, int nslice) {
 
     c->bams = NULL;
 
-    if (!(c->slices = (cram_slice **)calloc(nslice, sizeof(cram_slice *))))
+    if (!(c->arena = arena_create()))
+	goto err;
+    if (!(c->slices = (cram_slice **)arena_calloc(c->arena, nslice,
+						  sizeof(cram_slice *))))
 	goto err;
     c->slice = NULL;
 
@@ -3985,7 +4019,7 @@ cram_container *cram_new_container(int nrec, int nslice) {
     
     //c->aux_B_stats = cram_stats_create();
 
-    if (!(c->tags_used = HashTableCreate(16, HASH_DYNAMIC_SIZE)))
+    if (!(c->tags_used = FHashTableCreate(16, 0)))
 	goto err;
     c->refs_used = 0;
 
@@ -3997,8 +4031,7 @@ cram_container *cram_new_container(int nrec, int nslice) {
 
  err:
     if (c) {
-	if (c->slices)
-	    free(c->slices);
+	arena_destroy(c->arena);
 	free(c);
     }
     return NULL;
@@ -4014,9 +4047,6 @@ void cram_free_container(cram_container *c) {
     if (c->refs_used)
 	free(c->refs_used);
 
-    if (c->landmark)
-	free(c->landmark);
-
     if (c->comp_hdr)
 	cram_free_compression_header(c->comp_hdr);
 
@@ -4027,7 +4057,6 @@ void cram_free_container(cram_container *c) {
 	for (i = 0; i < c->max_slice; i++)
 	    if (c->slices[i])
 		cram_free_slice(c->slices[i]);
-	free(c->slices);
     }
 
     for (id = DS_RN; id < DS_TN; id++)
@@ -4036,10 +4065,10 @@ void cram_free_container(cram_container *c) {
     //if (c->aux_B_stats) cram_stats_free(c->aux_B_stats);
     
     if (c->tags_used) {
-        HashItem *hi;
-        HashIter *iter = HashTableIterCreate();
+        FHashItem *hi;
+	int iter = 0;
 
-	while (iter && (hi = HashTableIterNext(c->tags_used, iter))) {
+	while ((hi = FHashTableIterNext(c->tags_used, &iter))) {
 	    cram_tag_map *tm = (cram_tag_map *)hi->data.p;
 	    cram_codec *c = tm->codec;
 
@@ -4047,10 +4076,10 @@ void cram_free_container(cram_container *c) {
 	    free(tm);
 	}
 	
-	HashTableDestroy(c->tags_used, 0);
-	HashTableIterDestroy(iter);
+	FHashTableDestroy(c->tags_used, 0);
     }
 
+    arena_destroy(c->arena);
     free(c);
 }
 
@@ -4150,8 +4179,9 @@ cram_container *cram_read_container(cram_fd *fd) {
 
     *c = c2;
 
-    if (!(c->landmark = malloc(c->num_landmarks * sizeof(int32_t))) &&
-	c->num_landmarks) {
+    if (!(c->arena = arena_create()) ||
+	!(c->landmark = arena_alloc(c->arena,
+				    c->num_landmarks * sizeof(int32_t)))) {
 	fd->err = errno;
 	cram_free_container(c);
 	return NULL;
@@ -4269,11 +4299,14 @@ int cram_write_container(cram_fd *fd, cram_container *c) {
 
 // common component shared by cram_flush_container{,_mt}
 static int cram_flush_container2(cram_fd *fd, cram_container *c) {
-    int i, j;
+    int i, j, r;
+    io_clock t;
 
     if (c->curr_slice > 0 && !c->slices)
 	return -1;
 
+    io_stats_start(fd->stats, &t);
+
     //fprintf(stderr, "Writing container %d, sum %u\n", c->record_counter, sum);
 
     /* Write the container struct itself */
@@ -4297,7 +4330,10 @@ static int cram_flush_container2(cram_fd *fd, cram_container *c) {
 	}
     }
 
-    return CRAM_IO_FLUSH(fd) == 0 ? 0 : -1;
+    r = CRAM_IO_FLUSH(fd) == 0 ? 0 : -1;
+    io_stats_add(fd->stats, IO_STAGE_WRITE, &t, c->length, c->length);
+
+    return r;
 }
 
 /*
@@ -4333,6 +4369,15 @@ void *cram_flush_thread(void *arg) {
     return arg;
 }
 
+/*
+ * Returns true if the containers queued for encoding hold more than
+ * CRAM_OPT_MAX_INFLIGHT bytes and we should wait for one to finish.
+ */
+static int cram_inflight_full(cram_fd *fd) {
+    return fd->max_inflight && fd->inflight > fd->max_inflight &&
+	!t_pool_results_queue_empty(fd->rqueue);
+}
+
 static int cram_flush_result(cram_fd *fd) {
     int i, ret = 0;
     t_pool_result *r;
@@ -4341,7 +4386,12 @@ static int cram_flush_result(cram_fd *fd) {
     // NB: we can have one result per slice, not per container,
     // so we need to free the container only after all slices
     // within it have been freed.  (Automatic via reference counting.)
-    while ((r = t_pool_next_result(fd->rqueue))) {
+    //
+    // Results come back in order, so a slow container lets those behind
+    // it complete and accumulate.  Block on it if over the memory budget.
+    while ((r = t_pool_next_result(fd->rqueue)) ||
+	   (cram_inflight_full(fd) &&
+	    (r = t_pool_next_result_wait(fd->rqueue)))) {
 	cram_job *j = (cram_job *)r->data;
 	cram_container *c;
 
@@ -4352,6 +4402,7 @@ static int cram_flush_result(cram_fd *fd) {
 
 	fd = j->fd;
 	c = j->c;
+	fd->inflight -= c->c_num_bytes;
 
 	if (fd->mode == 'w')
 	    if (0 != cram_flush_container2(fd, c))
@@ -4464,11 +4515,64 @@ int cram_flush_container_mt(cram_fd *fd, cram_container *c) {
     j->fd = fd;
     j->c = c;
     
+    io_stats_queue(fd->stats, fd->pool);
     t_pool_dispatch(fd->pool, fd->rqueue, cram_flush_thread, j);
+    fd->inflight += c->c_num_bytes;
 
     return cram_flush_result(fd);
 }
 
+/*
+ * Copies container 'c', whose header has just been read from 'in' by
+ * cram_read_container(), to 'out' without decoding it.  Any records
+ * buffered on 'out' are encoded and written first so the output stays
+ * in order.  Only the container record_counter is rewritten; the
+ * compression header and slices are copied byte for byte, so both
+ * files must be the same CRAM version.
+ *
+ * Returns 0 on success
+ *        -1 on failure
+ */
+int cram_copy_container(cram_fd *in, cram_fd *out, cram_container *c) {
+    char buf[65536];
+    int32_t len;
+
+    if (in->version != out->version || out->mode != 'w')
+	return -1;
+
+    /* Drain the partially filled output container, if any */
+    if (out->ctr) {
+	if (out->ctr->slice)
+	    cram_update_curr_slice(out->ctr);
+
+	if (-1 == cram_flush_container_mt(out, out->ctr))
+	    return -1;
+
+	if (out->pool) {
+	    t_pool_flush(out->pool);
+	    if (0 != cram_flush_result(out))
+		return -1;
+	} else {
+	    cram_free_container(out->ctr);
+	}
+	out->ctr = NULL;
+    }
+
+    c->record_counter = out->record_counter;
+    if (0 != cram_write_container(out, c))
+	return -1;
+    out->record_counter += c->num_records;
+
+    for (len = c->length; len > 0; len -= sizeof(buf)) {
+	size_t l = MIN(len, sizeof(buf));
+	if (l != CRAM_IO_READ(buf, 1, l, in) ||
+	    l != CRAM_IO_WRITE(buf, 1, l, out))
+	    return -1;
+    }
+
+    return CRAM_IO_FLUSH(out) == 0 ? 0 : -1;
+}
+
 /* ----------------------------------------------------------------------
  * Compression headers; the first part of the container
  */
@@ -4489,7 +4593,7 @@ cram_block_compression_hdr *cram_new_compression_header(void) {
 	return NULL;
     }
 
-    if (!(hdr->TD = HashTableCreate(16, HASH_DYNAMIC_SIZE))) {
+    if (!(hdr->TD = FHashTableCreate(16, 0))) {
 	cram_free_block(hdr->TD_blk);
 	free(hdr);
 	return NULL;
@@ -4537,7 +4641,7 @@ void cram_free_compression_header(cram_block_compression_hdr *hdr) {
     if (hdr->TD_blk)
 	cram_free_block(hdr->TD_blk);
     if (hdr->TD)
-	HashTableDestroy(hdr->TD, 0);
+	FHashTableDestroy(hdr->TD, 0);
 
     free(hdr);
 }
@@ -4566,9 +4670,6 @@ void cram_free_slice(cram_slice *s) {
     if (!s)
 	return;
 
-    if (s->bl)
-	free(s->bl);
-
     if (s->hdr_block)
 	cram_free_block(s->hdr_block);
 
@@ -4580,7 +4681,6 @@ void cram_free_slice(cram_slice *s) {
 		cram_free_block(s->block[i]);
 	    }
 	}
-	free(s->block);
     }
 
     if (s->block_by_id) {
@@ -4593,8 +4693,6 @@ void cram_free_slice(cram_slice *s) {
 	}
     }
 
-    if (s->block_by_id)
-	free(s->block_by_id);
 
     if (s->hdr)
 	cram_free_slice_header(s->hdr);
@@ -4625,9 +4723,6 @@ void cram_free_slice(cram_slice *s) {
     if (s->cigar)
 	free(s->cigar);
 
-    if (s->crecs)
-	free(s->crecs);
-
     if (s->features)
 	free(s->features);
 
@@ -4637,16 +4732,21 @@ void cram_free_slice(cram_slice *s) {
 #endif
 
     if (s->pair[0])
-	HashTableDestroy(s->pair[0], 0);
+	FHashTableDestroy(s->pair[0], 0);
     if (s->pair[1])
-	HashTableDestroy(s->pair[1], 0);
-
-    if (s->aux_block)
-	free(s->aux_block);
+	FHashTableDestroy(s->pair[1], 0);
 
     if (s->cons)
 	free(s->cons);
 
+    if (s->stats[DS_RN]) {
+	int i;
+	for (i = DS_RN; i < DS_TN; i++)
+	    if (s->stats[i])
+		cram_stats_free(s->stats[i]);
+    }
+
+    arena_destroy(s->arena);
     free(s);
 }
 
@@ -4670,7 +4770,9 @@ cram_slice *cram_new_slice(enum cram_content_type type, int nrecs) {
     s->block = NULL;
     s->block_by_id = NULL;
     s->last_apos = 0;
-    if (!(s->crecs = malloc(nrecs * sizeof(cram_record))))  goto err;
+    if (!(s->arena = arena_create()))                       goto err;
+    if (!(s->crecs = arena_alloc(s->arena, nrecs * sizeof(cram_record))))
+	goto err;
     s->cigar = NULL;
     s->cigar_alloc = 0;
     s->ncigar = 0;
@@ -4691,8 +4793,8 @@ cram_slice *cram_new_slice(enum cram_content_type type, int nrecs) {
 #endif
 
     // Volatile keys as we do realloc in dstring
-    if (!(s->pair[0] = HashTableCreate(10000, HASH_DYNAMIC_SIZE)))   goto err;
-    if (!(s->pair[1] = HashTableCreate(10000, HASH_DYNAMIC_SIZE)))   goto err;
+    if (!(s->pair[0] = FHashTableCreate(16, 0)))      goto err;
+    if (!(s->pair[1] = FHashTableCreate(16, 0)))      goto err;
     
 #ifdef BA_external
     s->BA_len = 0;
@@ -4754,7 +4856,10 @@ cram_slice *cram_read_slice(cram_fd *fd) {
 	goto err;
     }
 
-    s->block = calloc(n = s->hdr->num_blocks, sizeof(*s->block));
+    if (!(s->arena = arena_create()))
+	goto err;
+    s->block = arena_calloc(s->arena, n = s->hdr->num_blocks,
+			    sizeof(*s->block));
     if (!s->block)
 	goto err;
 
@@ -4769,7 +4874,7 @@ cram_slice *cram_read_slice(cram_fd *fd) {
 		min_id = s->block[i]->content_id;
 	}
     }
-    if (!(s->block_by_id = calloc(768, sizeof(s->block[0]))))
+    if (!(s->block_by_id = arena_calloc(s->arena, 768, sizeof(s->block[0]))))
 	goto err;
 
     // 0-255 are pure content_id
@@ -5110,7 +5215,7 @@ int cram_write_SAM_hdr(cram_fd *fd, SAM_hdr *hdr) {
 
 	c->num_blocks = 2;
 	c->num_landmarks = 2;
-	if (!(c->landmark = malloc(2*sizeof(*c->landmark)))) {
+	if (!(c->landmark = arena_alloc(c->arena, 2*sizeof(*c->landmark)))) {
 	    cram_free_block(b);
 	    cram_free_container(c);
 	    return -1;
@@ -5127,7 +5232,7 @@ int cram_write_SAM_hdr(cram_fd *fd, SAM_hdr *hdr) {
 	// Pad the block instead.
 	c->num_blocks = 1;
 	c->num_landmarks = 1;
-	if (!(c->landmark = malloc(sizeof(*c->landmark))))
+	if (!(c->landmark = arena_alloc(c->arena, sizeof(*c->landmark))))
 	    return -1;
 	c->landmark[0] = 0;
 
@@ -5560,6 +5665,30 @@ cram_fd * cram_io_open(
     return fd;
 }
 
+/*
+ * Counts the open cram_fds so the last cram_close() can return the
+ * shared arena free list to the system.
+ */
+static pthread_mutex_t cram_nopen_lock = PTHREAD_MUTEX_INITIALIZER;
+static int cram_nopen = 0;
+
+static void cram_fd_opened(void) {
+    pthread_mutex_lock(&cram_nopen_lock);
+    cram_nopen++;
+    pthread_mutex_unlock(&cram_nopen_lock);
+}
+
+static void cram_fd_closed(void) {
+    int last;
+
+    pthread_mutex_lock(&cram_nopen_lock);
+    last = --cram_nopen == 0;
+    pthread_mutex_unlock(&cram_nopen_lock);
+
+    if (last)
+	arena_trim();
+}
+
 /*
  * Opens a CRAM file for read (mode "rb") or write ("wb").
  * The filename may be "-" to indicate stdin or stdout.
@@ -5652,6 +5781,10 @@ cram_fd *cram_open(const char *filename, const char *mode) {
     fd->seqs_per_slice = SEQS_PER_SLICE;
     fd->bases_per_slice = BASES_PER_SLICE;
     fd->slices_per_container = SLICE_PER_CNT;
+    fd->slice_target = 0;
+    fd->container_max_bytes = 0;
+    fd->slice_ratio = 0;
+    fd->slice_scale = 1.0;
     fd->embed_ref = 0;
     fd->embed_cons = 0;
     fd->no_ref = 0;
@@ -5694,6 +5827,7 @@ cram_fd *cram_open(const char *filename, const char *mode) {
     if (-1 == refs_from_header(fd->refs, fd, fd->header))
 	goto err;
 
+    cram_fd_opened();
     return fd;
 
  err:
@@ -5764,6 +5898,10 @@ cram_fd *cram_open_by_callbacks(
     fd->seqs_per_slice = SEQS_PER_SLICE;
     fd->bases_per_slice = BASES_PER_SLICE;
     fd->slices_per_container = SLICE_PER_CNT;
+    fd->slice_target = 0;
+    fd->container_max_bytes = 0;
+    fd->slice_ratio = 0;
+    fd->slice_scale = 1.0;
     fd->embed_ref = 0;
     fd->embed_cons = 0;
     fd->no_ref = 0;
@@ -5805,6 +5943,7 @@ cram_fd *cram_open_by_callbacks(
     if (-1 == refs_from_header(fd->refs, fd, fd->header))
 	goto err;
 
+    cram_fd_opened();
     return fd;
 
  err:
@@ -5894,6 +6033,10 @@ cram_fd *cram_openw_by_callbacks(
     fd->seqs_per_slice = SEQS_PER_SLICE;
     fd->bases_per_slice = BASES_PER_SLICE;
     fd->slices_per_container = SLICE_PER_CNT;
+    fd->slice_target = 0;
+    fd->container_max_bytes = 0;
+    fd->slice_ratio = 0;
+    fd->slice_scale = 1.0;
     fd->embed_ref = 0;
     fd->embed_cons = 0;
     fd->no_ref = 0;
@@ -5933,6 +6076,7 @@ cram_fd *cram_openw_by_callbacks(
     if (-1 == refs_from_header(fd->refs, fd, fd->header))
 	goto err;
 
+    cram_fd_opened();
     return fd;
 
  err:
@@ -6052,6 +6196,11 @@ int cram_write_eof_block(cram_fd *fd) {
 }
 
 
+/* Method names for io_stats_dump */
+static char *cram_method_name(int method) {
+    return cram_block_method2str(method);
+}
+
 /*
  * Closes a CRAM file.
  * Returns 0 on success
@@ -6073,6 +6222,7 @@ int cram_close(cram_fd *fd) {
 
 	if (-1 == cram_flush_container_mt(fd, fd->ctr)) {
 	    fd = cram_io_close(fd,0);
+	    cram_fd_closed();
 	    return -1;
 	}
     }
@@ -6082,6 +6232,7 @@ int cram_close(cram_fd *fd) {
 
 	if (0 != cram_flush_result(fd)) {
 	    fd = cram_io_close(fd,0);
+	    cram_fd_closed();
 	    return -1;
 	}
 
@@ -6106,6 +6257,13 @@ int cram_close(cram_fd *fd) {
 	    return -1;
     }
 
+    if (fd->stats) {
+	io_stats_dump(fd->stats, fd->stats->fp, "cram",
+		      fd->mode == 'w' ? "write" : "read",
+		      cram_method_name, fd->pool);
+	io_stats_destroy(fd->stats);
+    }
+
     for (bl = fd->bl; bl; bl = next) {
 	int i, max_rec = fd->seqs_per_slice * fd->slices_per_container;
 
@@ -6117,6 +6275,9 @@ int cram_close(cram_fd *fd) {
 	free(bl->bams);
 	free(bl);
     }
+#ifndef SAMTOOLS
+    bam_pool_destroy(fd->bam_pool);
+#endif
 
     if (fd->file_def)
 	cram_free_file_def(fd->file_def);
@@ -6152,6 +6313,7 @@ int cram_close(cram_fd *fd) {
 
     /* rclose == return value for flush and close in case of CRAM output */
     fd = cram_io_close(fd, &rclose);
+    cram_fd_closed();
 
     return rclose;
 }
@@ -6165,6 +6327,15 @@ int cram_eof(cram_fd *fd) {
 }
 
 
+/*
+ * Worker idle time is only measured for the stats report, so it is
+ * switched on once an fd has both stats and a thread pool.
+ */
+static void cram_time_idle(cram_fd *fd) {
+    if (fd->stats && fd->pool)
+	t_pool_time_idle(fd->pool);
+}
+
 /* 
  * Sets options on the cram_fd. See CRAM_OPT_* definitions in cram_structs.h.
  * Use this immediately after opening.
@@ -6349,6 +6520,7 @@ int cram_set_voption(cram_fd *fd, enum cram_option opt, va_list args) {
 	    pthread_mutex_init(fd->bam_list_lock, NULL);
 	    fd->shared_ref = 1;
 	    fd->own_pool = 1;
+	    cram_time_idle(fd);
         }
 	break;
     }
@@ -6363,6 +6535,7 @@ int cram_set_voption(cram_fd *fd, enum cram_option opt, va_list args) {
 	    pthread_mutex_init(fd->metrics_lock, NULL);
 	    pthread_mutex_init(fd->ref_lock, NULL);
 	    pthread_mutex_init(fd->bam_list_lock, NULL);
+	    cram_time_idle(fd);
 	}
 	fd->shared_ref = 1; // Needed to avoid clobbering ref between threads
 	fd->own_pool = 0;
@@ -6425,6 +6598,39 @@ int cram_set_voption(cram_fd *fd, enum cram_option opt, va_list args) {
 	break;
     }
 
+    case CRAM_OPT_SLICE_CALLBACK: {
+	cram_slice_callback *cb = va_arg(args, cram_slice_callback *);
+	if (cb)
+	    fd->slice_cb = *cb;
+	else
+	    fd->slice_cb.func = NULL;
+	break;
+    }
+
+    case CRAM_OPT_STATS: {
+	FILE *fp = va_arg(args, FILE *);
+	if (fd->stats) {
+	    io_stats_destroy(fd->stats);
+	    fd->stats = NULL;
+	}
+	if (fp && !(fd->stats = io_stats_create(fp)))
+	    return -1;
+	cram_time_idle(fd);
+	break;
+    }
+
+    case CRAM_OPT_SLICE_TARGET_BYTES:
+	fd->slice_target = va_arg(args, int);
+	break;
+
+    case CRAM_OPT_CONTAINER_MAX_BYTES:
+	fd->container_max_bytes = va_arg(args, int64_t);
+	break;
+
+    case CRAM_OPT_MAX_INFLIGHT:
+	fd->max_inflight = va_arg(args, int64_t);
+	break;
+
     default:
 	fprintf(stderr, "Unknown CRAM option code %d\n", opt);
 	return -1;
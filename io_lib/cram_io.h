@@ -125,6 +125,21 @@ int cram_compress_block(cram_fd *fd, cram_slice *slice,
 			cram_block *b, cram_metrics *metrics,
 			int64_t method, int level);
 
+/*! Compresses a buffer using a single compression method.
+ *
+ * Method may be one of the internal parameterised methods (eg RANS1 or
+ * GZIP_RLE); strat is the zlib strategy or codec specific variant.
+ * The slice is only required for the FQZ methods.
+ *
+ * @return
+ * Returns malloced compressed data on success, setting *out_size;
+ *         NULL on failure or if the method is unavailable
+ */
+char *cram_compress_by_method(cram_slice *s, char *in, size_t in_size,
+			      int content_id, size_t *out_size,
+			      enum cram_block_method method,
+			      int level, int strat);
+
 cram_metrics *cram_new_metrics(void);
 char *cram_block_method2str(enum cram_block_method m);
 char *cram_content_type2str(enum cram_content_type t);
@@ -366,6 +381,19 @@ int cram_write_container(cram_fd *fd, cram_container *h);
 int cram_flush_container(cram_fd *fd, cram_container *c);
 int cram_flush_container_mt(cram_fd *fd, cram_container *c);
 
+/*! Copies a container from one CRAM file to another without decoding.
+ *
+ * 'c' is a container header just read from 'in' by cram_read_container().
+ * Records buffered on 'out' are flushed first.  Only the container
+ * record_counter is rewritten; the remainder is copied verbatim, so
+ * both files must share the same CRAM version.
+ *
+ * @return
+ * Returns 0 on success;
+ *        -1 on failure
+ */
+int cram_copy_container(cram_fd *in, cram_fd *out, cram_container *c);
+
 
 /**@}*/
 /**@{ ----------------------------------------------------------------------
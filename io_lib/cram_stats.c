@@ -57,26 +57,85 @@ cram_stats *cram_stats_create(void) {
     return calloc(1, sizeof(cram_stats));
 }
 
-void cram_stats_add(cram_stats *st, int64_t val) {
-    st->nsamp++;
+/*
+ * Finds the slot for val in the spill table using linear probing.
+ * The table is kept at most 3/4 full so there is always an empty slot
+ * to terminate the search.
+ */
+static inline cram_stats_item *cram_stats_slot(cram_stats *st, int64_t val) {
+    uint64_t mask = st->h_size-1;
+    uint64_t k = (((uint64_t)val * 0x9E3779B97F4A7C15ULL) >> 32) & mask;
+
+    while (st->h[k].used && st->h[k].val != val)
+	k = (k+1) & mask;
+
+    return &st->h[k];
+}
+
+/*
+ * Doubles the size of the spill table.
+ *
+ * Returns 0 on success
+ *        -1 on failure
+ */
+static int cram_stats_grow(cram_stats *st) {
+    cram_stats_item *old = st->h;
+    int i, old_size = st->h_size;
+    int new_size = old_size ? old_size*2 : 256;
+
+    if (!(st->h = calloc(new_size, sizeof(*st->h)))) {
+	st->h = old;
+	return -1;
+    }
+    st->h_size = new_size;
+
+    for (i = 0; i < old_size; i++) {
+	if (!old[i].used)
+	    continue;
+	*cram_stats_slot(st, old[i].val) = old[i];
+    }
+    free(old);
+
+    return 0;
+}
+
+/*
+ * Adds count occurrences of val to the stats.
+ *
+ * Returns 0 on success
+ *        -1 on failure
+ */
+static int cram_stats_add_n(cram_stats *st, int64_t val, int count) {
+    st->nsamp += count;
 
     if (val < MAX_STAT_VAL && val >= 0) {
-	st->freqs[val]++;
+	if (!st->freqs[val])
+	    st->nvals++;
+	st->freqs[val] += count;
     } else {
-	HashItem *hi;
+	cram_stats_item *it;
 
-	if (!st->h) {
-	    st->h = HashTableCreate(2048, HASH_DYNAMIC_SIZE|HASH_NONVOLATILE_KEYS|HASH_INT_KEYS);
+	if ((st->h_used+1)*4 > st->h_size*3 && cram_stats_grow(st) < 0) {
+	    st->nsamp -= count;
+	    return -1;
 	}
 
-	if ((hi = HashTableSearchInt64(st->h, val))) {
-	    hi->data.i++;
-	} else {
-	    HashData hd;
-	    hd.i = 1;
-	    HashTableAddInt64(st->h, val, hd, NULL);
+	it = cram_stats_slot(st, val);
+	if (!it->used) {
+	    it->used = 1;
+	    it->val = val;
+	    st->h_used++;
 	}
+	if (!it->count)
+	    st->nvals++;
+	it->count += count;
     }
+
+    return 0;
+}
+
+int cram_stats_add(cram_stats *st, int64_t val) {
+    return cram_stats_add_n(st, val, 1);
 }
 
 void cram_stats_del(cram_stats *st, int64_t val) {
@@ -85,12 +144,15 @@ void cram_stats_del(cram_stats *st, int64_t val) {
     if (val < MAX_STAT_VAL && val >= 0) {
 	st->freqs[val]--;
 	assert(st->freqs[val] >= 0);
+	if (!st->freqs[val])
+	    st->nvals--;
     } else if (st->h) {
-	HashItem *hi;
+	cram_stats_item *it = cram_stats_slot(st, val);
 
-	if ((hi = HashTableSearchInt64(st->h, val))) {
-	    if (--hi->data.i == 0)
-		HashTableDel(st->h, hi, 0);
+	if (it->used && it->count > 0) {
+	    // Slot is kept as we have no tombstones; iterators skip count 0.
+	    if (--it->count == 0)
+		st->nvals--;
 	} else {
 	    fprintf(stderr, "Failed to remove val %"PRId64" from cram_stats\n", val);
 	    st->nsamp++;
@@ -101,6 +163,38 @@ void cram_stats_del(cram_stats *st, int64_t val) {
     }
 }
 
+/*
+ * Adds the contents of src to dst.  Used to fold the per-slice statistics
+ * into the container once each slice has been converted.
+ *
+ * Returns 0 on success
+ *        -1 on failure
+ */
+int cram_stats_merge(cram_stats *dst, cram_stats *src) {
+    int i;
+
+    if (!src->nsamp)
+	return 0;
+
+    for (i = 0; i < MAX_STAT_VAL; i++) {
+	if (!src->freqs[i])
+	    continue;
+	if (!dst->freqs[i])
+	    dst->nvals++;
+	dst->freqs[i] += src->freqs[i];
+	dst->nsamp += src->freqs[i];
+    }
+
+    for (i = 0; i < src->h_size; i++) {
+	if (!src->h[i].used || !src->h[i].count)
+	    continue;
+	if (cram_stats_add_n(dst, src->h[i].val, src->h[i].count) < 0)
+	    return -1;
+    }
+
+    return 0;
+}
+
 void cram_stats_dump(cram_stats *st) {
     int i;
     fprintf(stderr, "cram_stats:\n");
@@ -109,15 +203,10 @@ void cram_stats_dump(cram_stats *st) {
 	    continue;
 	fprintf(stderr, "\t%d\t%d\n", i, st->freqs[i]);
     }
-    if (st->h) {
-	HashIter *iter=  HashTableIterCreate();
-	HashItem *hi;
-
-	while ((hi = HashTableIterNext(st->h, iter))) {
-	    fprintf(stderr, "\t%d\t%d\n", (int)hi->key64,
-		    (int)hi->data.i);
-	}
-	HashTableIterDestroy(iter);
+    for (i = 0; i < st->h_size; i++) {
+	if (!st->h[i].used || !st->h[i].count)
+	    continue;
+	fprintf(stderr, "\t%"PRId64"\t%d\n", st->h[i].val, st->h[i].count);
     }
 }
 
@@ -133,7 +222,6 @@ void cram_stats_dump(cram_stats *st) {
 enum cram_encoding cram_stats_encoding(cram_fd *fd, cram_stats *st) {
     int nvals, i, ntot = 0;
     int64_t max_val = 0, min_val = INT64_MAX;
-    int *vals = NULL, *freqs = NULL, vals_alloc = 0;
 
     //cram_stats_dump(st);
 
@@ -141,53 +229,27 @@ enum cram_encoding cram_stats_encoding(cram_fd *fd, cram_stats *st) {
     for (nvals = i = 0; i < MAX_STAT_VAL; i++) {
 	if (!st->freqs[i])
 	    continue;
-	if (nvals >= vals_alloc) {
-	    vals_alloc = vals_alloc ? vals_alloc*2 : 1024;
-	    vals  = realloc(vals,  vals_alloc * sizeof(int));
-	    freqs = realloc(freqs, vals_alloc * sizeof(int));
-	    if (!vals || !freqs) {
-		if (vals)  free(vals);
-		if (freqs) free(freqs);
-		return E_HUFFMAN; // Cannot do much else atm
-	    }
-	}
-	vals[nvals] = i;
-	freqs[nvals] = st->freqs[i];
-	ntot += freqs[nvals];
+	ntot += st->freqs[i];
 	if (max_val < i) max_val = i;
 	if (min_val > i) min_val = i;
 	nvals++;
     }
-    if (st->h) {
-	HashIter *iter=  HashTableIterCreate();
-	HashItem *hi;
-	int64_t i;
-
-	while ((hi = HashTableIterNext(st->h, iter))) {
-	    if (nvals >= vals_alloc) {
-		vals_alloc = vals_alloc ? vals_alloc*2 : 1024;
-		vals  = realloc(vals,  vals_alloc * sizeof(int));
-		freqs = realloc(freqs, vals_alloc * sizeof(int));
-		if (!vals || !freqs)
-		    return E_HUFFMAN; // Cannot do much else atm
-	    }
-	    i = hi->key64;
-	    vals[nvals]=i;
-	    freqs[nvals] = hi->data.i;
-	    ntot += freqs[nvals];
-	    if (max_val < i) max_val = i;
-	    if (min_val > i) min_val = i;
-	    nvals++;
-	}
-	HashTableIterDestroy(iter);
+    for (i = 0; i < st->h_size; i++) {
+	int64_t v;
+
+	if (!st->h[i].used || !st->h[i].count)
+	    continue;
+	v = st->h[i].val;
+	ntot += st->h[i].count;
+	if (max_val < v) max_val = v;
+	if (min_val > v) min_val = v;
+	nvals++;
     }
 
     st->nvals = nvals;
     st->min_val = min_val;
     st->max_val = max_val;
     assert(ntot == st->nsamp);
-    free(vals);
-    free(freqs);
 
     if (fd->verbose > 1)
 	fprintf(stderr, "Range = %"PRId64"..%"PRId64", nvals=%d, ntot=%d\n",
@@ -232,8 +294,7 @@ enum cram_encoding cram_stats_encoding(cram_fd *fd, cram_stats *st) {
 }
 
 void cram_stats_free(cram_stats *st) {
-    if (st->h)
-	HashTableDestroy(st->h, 0);
+    free(st->h);
     free(st);
 }
 
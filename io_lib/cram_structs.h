@@ -57,8 +57,10 @@ extern "C" {
 
 #include "io_lib/hash_table.h"       // From io_lib aka staden-read
 #include "io_lib/thread_pool.h"
+#include "io_lib/io_stats.h"
 #include "io_lib/mFILE.h"
 #include "io_lib/bgzip.h"
+#include "io_lib/arena_alloc.h"
 
 #ifdef SAMTOOLS
 // From within samtools/HTSlib
@@ -72,6 +74,16 @@ extern "C" {
 #define BASES_PER_SLICE (SEQS_PER_SLICE*500)
 #define SLICE_PER_CNT  1
 
+/*
+ * Adaptive slice sizing (CRAM_OPT_SLICE_TARGET_BYTES) bounds, in BAM
+ * record bytes per slice, and the compression ratio assumed until the
+ * first container has been encoded.
+ */
+#define ADAPT_SLICE_MIN_BYTES  (64*1024)
+#define ADAPT_SLICE_MAX_BYTES  (256*1024*1024)
+#define ADAPT_SLICE_RATIO      0.2
+#define ADAPT_SLICE_SCALE_MAX  4.0
+
 #define CRAM_SUBST_MATRIX "CGTNAGTNACTNACGNACGT"
 
 // TN only in Cram v1
@@ -79,9 +91,23 @@ extern "C" {
 
 #define MAX_STAT_VAL 1024
 //#define MAX_STAT_VAL 16
+
+/*
+ * Values outside of 0..MAX_STAT_VAL-1 (positions, template lengths, etc)
+ * are counted in a flat linear-probing table rather than a HashTable, so
+ * adding a value never needs a per-item allocation.
+ */
+typedef struct {
+    int64_t val;
+    int     count;
+    int     used;  // slot occupied; count may still drop to zero
+} cram_stats_item;
+
 typedef struct {
     int freqs[MAX_STAT_VAL];
-    HashTable *h;
+    cram_stats_item *h; // open addressing spill of large/negative values
+    int h_size;         // allocated size of h[], always a power of 2
+    int h_used;         // number of occupied slots in h[]
     int nsamp; // total number of values added
     int nvals; // total number of unique values added
     int64_t min_val, max_val;
@@ -296,8 +322,6 @@ typedef struct {
     int64_t revised_method;
 
     double extra[CRAM_MAX_METHOD];
-
-    cram_stats *stats;
 } cram_metrics;
 
 /* Block */
@@ -350,7 +374,7 @@ typedef struct {
     cram_block *TD_blk;  // Tag Dictionary
     int nTL;		 // number of TL entries in TD
     unsigned char **TL;  // array of size nTL, pointer into TD_blk.
-    HashTable *TD;       // for encoding, keyed on TD entries
+    FHashTable *TD;      // for encoding, keyed on TD entries
     
     HashTable *preservation_map;
     struct cram_map *rec_encoding_map[CRAM_MAP_HASH];
@@ -456,7 +480,7 @@ typedef struct {
     /* Statistics for encoding */
     cram_stats *stats[DS_END];
 
-    HashTable *tags_used; // cram_tag_map[], per tag types in use.
+    FHashTable *tags_used; // cram_tag_map[], per tag types in use.
 
     int *refs_used;       // array of frequency of ref seq IDs
 
@@ -466,8 +490,13 @@ typedef struct {
     uint32_t crc32;       // Raw container bytes CRC
 
     uint64_t s_num_bases; // number of bases in this slice
+    uint64_t s_num_bytes; // BAM record bytes held for this slice
+    uint64_t c_num_bytes; // BAM record bytes held for this container
+    uint64_t s_max_bytes; // adaptive slice limit on s_num_bytes, 0 if unused
 
     uint32_t n_mapped;    // Number of mapped reads
+
+    arena_t *arena;       // Storage for slices[] and landmark[]
 } cram_container;
 
 /*
@@ -640,7 +669,7 @@ typedef struct cram_slice {
     cram_block *soft_blk;
     cram_block *aux_blk;  // BAM aux block, used when going from CRAM to BAM
 
-    HashTable *pair[2];      // for identifying read-pairs in this slice.
+    FHashTable *pair[2];     // for identifying read-pairs in this slice.
 
     char *ref;               // slice of current reference
     int ref_start;           // start position of current reference;
@@ -666,6 +695,15 @@ typedef struct cram_slice {
 
     // Cache of converted BAM structs
     bam_seq_t **bl;
+
+    // Encoding statistics gathered while converting this slice's records.
+    // These are private to the thread encoding the slice and are merged
+    // into the container stats once the slice has been converted.
+    cram_stats *stats[DS_END];
+
+    // Storage for crecs[], block[], block_by_id[] and aux_block[],
+    // all released together in cram_free_slice.
+    arena_t *arena;
 } cram_slice;
 
 /*-----------------------------------------------------------------------------
@@ -839,6 +877,15 @@ typedef struct varint_vec {
     int (*varint_size)(int64_t val);
 } varint_vec;
 
+/*
+ * A function called on each slice as soon as it has been decoded, see
+ * CRAM_OPT_SLICE_CALLBACK.  Returns 0 on success, -1 on failure.
+ */
+typedef struct {
+    int (*func)(void *data, struct cram_fd *fd, cram_slice *s);
+    void *data;
+} cram_slice_callback;
+
 typedef struct cram_fd {
     FILE                 *fp_in;
 #if defined(CRAM_IO_CUSTOM_BUFFERING)
@@ -938,6 +985,9 @@ typedef struct cram_fd {
     pthread_mutex_t *ref_lock;
     spare_bams *bl;
     pthread_mutex_t *bam_list_lock;
+#ifndef SAMTOOLS
+    bam_pool_t *bam_pool;               // records for c->bams[], shared by dups
+#endif
     void *job_pending;
 
     int ooc;                            // out of containers.
@@ -951,6 +1001,20 @@ typedef struct cram_fd {
     varint_vec vv;
 
     int level_fixed; // boolean flag to indicate if level is explicit.
+
+    cram_slice_callback slice_cb; // Per decoded slice, in decoder threads
+
+    io_stats *stats;               // CRAM_OPT_STATS timings, or NULL
+
+    // Adaptive slice sizing, see cram_adapt_slice_size()
+    int slice_target;              // target compressed bytes/slice, 0 => off
+    int64_t container_max_bytes;   // limit on c->c_num_bytes, 0 => none
+    double slice_ratio;            // observed compressed / BAM bytes
+    double slice_scale;            // growth factor from worker utilisation
+
+    // Encode backpressure, see cram_flush_result()
+    int64_t inflight;              // BAM bytes in containers being encoded
+    int64_t max_inflight;          // CRAM_OPT_MAX_INFLIGHT, 0 => unlimited
 } cram_fd;
 
 #if defined(CRAM_IO_CUSTOM_BUFFERING)
@@ -1082,7 +1146,12 @@ enum cram_option {
     CRAM_OPT_USE_FQZ,
     CRAM_OPT_EMBED_CONS,
     CRAM_OPT_USE_TOK,
-    CRAM_OPT_PROFILE
+    CRAM_OPT_PROFILE,
+    CRAM_OPT_SLICE_CALLBACK,
+    CRAM_OPT_STATS,
+    CRAM_OPT_SLICE_TARGET_BYTES,
+    CRAM_OPT_CONTAINER_MAX_BYTES,
+    CRAM_OPT_MAX_INFLIGHT
 };
 
 /* BF bitfields */
@@ -72,6 +72,7 @@
 #include <unistd.h>
 #include <assert.h>
 #include <unistd.h>
+#include <pthread.h>
 
 #include "io_lib/deflate_interlaced.h"
 
@@ -260,6 +261,9 @@ static huffman_code_t codes_english[] = {
 };
 
 static huffman_codeset_t *static_codeset[NCODES_STATIC];
+static pthread_mutex_t static_codeset_lock = PTHREAD_MUTEX_INITIALIZER;
+
+int init_decode_tables(huffman_codeset_t *cs);
 
 /*
  * ---------------------------------------------------------------------------
@@ -771,12 +775,19 @@ huffman_codeset_t *generate_code_set(int code_set, int ncodes,
 	    return NULL;
 	}
 
-	/* If our global codeset hasn't been initialised yet, do so */
+	/*
+	 * If our global codeset hasn't been initialised yet, do so.
+	 * The decode tables are built now too, as these sets are shared
+	 * between threads and must not be modified once published.
+	 */
+	pthread_mutex_lock(&static_codeset_lock);
 	if (!static_codeset[code_set]) {
 	    huffman_codes_t *c = (huffman_codes_t *)malloc(sizeof(*c));
 
-	    if (NULL == (cs = (huffman_codeset_t *)malloc(sizeof(*cs))))
+	    if (NULL == (cs = (huffman_codeset_t *)malloc(sizeof(*cs)))) {
+		pthread_mutex_unlock(&static_codeset_lock);
 		return NULL;
+	    }
 
 	    cs->codes = (huffman_codes_t **)malloc(sizeof(*cs->codes));
 	    cs->codes[0] = c;
@@ -811,15 +822,18 @@ huffman_codeset_t *generate_code_set(int code_set, int ncodes,
 
 	    default:
 		fprintf(stderr, "Unknown huffman code set '%d'\n", code_set);
+		pthread_mutex_unlock(&static_codeset_lock);
 		return NULL;
 	    }
 
 	    canonical_codes(c);
+	    init_decode_tables(cs);
 
 	    static_codeset[code_set] = cs;
 	}
 
 	cs = static_codeset[code_set];
+	pthread_mutex_unlock(&static_codeset_lock);
     }
 
     return cs;
@@ -132,6 +132,7 @@
 #include <stdio.h>
 #include <string.h> /* IMPORT: strdup (hopefully!) */
 #include <ctype.h>
+#include <pthread.h>
 
 /* 6/1/99 johnt - includes needed for Visual C++ */
 #ifdef _MSC_VER
@@ -381,6 +382,24 @@ void exp_destroy_info(Exp_info *e)
 
 
 
+/*
+ * Lookup table of the characters exp_read_sequence() keeps, set up once
+ * as experiment files may be read from several threads.
+ */
+static int valid_char[256];
+static pthread_once_t valid_char_once = PTHREAD_ONCE_INIT;
+
+static void init_valid_char(void) {
+    int i;
+
+    for (i = 0; i < 256; i++) {
+	if (i < 128 && !isspace(i) && !isdigit(i) && !iscntrl(i))
+	    valid_char[i] = 1;
+	else
+	    valid_char[i] = 0;
+    }
+}
+
 /*
  * Read from file a sequence, discarding all white space til a // is
  * encountered
@@ -391,19 +410,8 @@ static char *exp_read_sequence(FILE *fp)
     size_t seq_len = 0, seq_alloc;
     char line[EXP_FILE_LINE_LENGTH+1];
     char *l;
-    static int valid_char[256], init = 0;
 
-    /* Initialise lookup tables for efficiency later on.*/
-    if (!init) {
-	int i;
-	for (i = 0; i < 256; i++) {
-	    if (i < 128 && !isspace(i) && !isdigit(i) && !iscntrl(i))
-		valid_char[i] = 1;
-	    else
-		valid_char[i] = 0;
-	}
-	init = 1;
-    }
+    pthread_once(&valid_char_once, init_valid_char);
 
     /* Initialise memory */
     seq_alloc = EXP_FILE_LINE_LENGTH * 8;
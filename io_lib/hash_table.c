@@ -38,8 +38,19 @@
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#ifdef HAVE_MMAP
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 #include "io_lib/os.h"
 #include "io_lib/hash_table.h"
+#include "io_lib/thread_pool.h"
 #include "io_lib/jenkins_lookup3.h"
 
 /* =========================================================================
@@ -581,6 +592,259 @@ HashItem *HashTableAdd(HashTable *h, char *key, int key_len, HashData data,
     return hi;
 }
 
+/*
+ * A slice of the work for HashTableAddBatch.  Jobs first hash a range of
+ * items, then link the items hashing to a range of buckets.
+ */
+typedef struct {
+    HashTable *h;
+    HashItem **items;
+    uint32_t *bnum;		/* bucket per item, or ~0 if a duplicate */
+    char **keys;
+    int *key_lens;
+    HashData *data;
+    int start, end;		/* items to hash */
+    int *order;			/* item indices sorted by bucket range */
+    int ostart, oend;		/* our portion of order[] to link */
+    int failed;			/* out of memory copying keys */
+} hash_batch_job;
+
+static void *hash_batch_hash(void *arg) {
+    hash_batch_job *j = (hash_batch_job *)arg;
+    HashTable *h = j->h;
+    int i;
+
+    for (i = j->start; i < j->end; i++) {
+	HashItem *hi = j->items[i];
+	char *key = j->keys[i];
+	int key_len = j->key_lens && j->key_lens[i]
+	    ? j->key_lens[i] : strlen(key);
+
+	if (h->options & HASH_NONVOLATILE_KEYS) {
+	    hi->key = key;
+	} else {
+	    if (NULL == (hi->key = (char *)malloc(key_len+1))) {
+		j->failed = 1;
+		continue;
+	    }
+	    memcpy(hi->key, key, key_len);
+	    hi->key[key_len] = 0;
+	}
+	hi->key_len = key_len;
+	hi->data = j->data[i];
+	j->bnum[i] = hash64(h->options & HASH_FUNC_MASK,
+			    (uint8_t *)key, key_len) & h->mask;
+    }
+
+    return arg;
+}
+
+static void *hash_batch_link(void *arg) {
+    hash_batch_job *j = (hash_batch_job *)arg;
+    HashTable *h = j->h;
+    int k;
+
+    /* Only this job touches the buckets in its range */
+    for (k = j->ostart; k < j->oend; k++) {
+	int i = j->order[k];
+	HashItem *hi = j->items[i], *hi2;
+	uint32_t b = j->bnum[i];
+
+	if (!(h->options & HASH_ALLOW_DUP_KEYS)) {
+	    for (hi2 = h->bucket[b]; hi2; hi2 = hi2->next) {
+		if (hi->key_len == hi2->key_len &&
+		    memcmp(hi->key, hi2->key, hi->key_len) == 0)
+		    break;
+	    }
+	    if (hi2) {
+		j->bnum[i] = ~0;
+		continue;
+	    }
+	}
+
+	hi->next = h->bucket[b];
+	h->bucket[b] = hi;
+    }
+
+    return arg;
+}
+
+/*
+ * Runs func on each of the njobs jobs, on pool p if non-NULL.  Any jobs
+ * that cannot be dispatched are run on the calling thread instead.
+ */
+static void hash_batch_run(t_pool *p, void *(*func)(void *),
+			   hash_batch_job *jobs, int njobs) {
+    t_results_queue *q = NULL;
+    int i = 0, n;
+
+    if (p && njobs > 1 && (q = t_results_queue_init())) {
+	for (; i < njobs; i++)
+	    if (t_pool_dispatch(p, q, func, &jobs[i]) == -1)
+		break;
+    }
+
+    for (n = i; i < njobs; i++)
+	func(&jobs[i]);
+
+    while (n-- > 0)
+	t_pool_delete_result(t_pool_next_result_wait(q), 0);
+
+    if (q)
+	t_results_queue_destroy(q);
+}
+
+/*
+ * Adds n keys with their data to HashTable h in one go.
+ *
+ * If p is NULL this is simply HashTableAdd() on each key in turn.
+ * Otherwise the table is sized once up front and the keys are hashed and
+ * linked into their buckets in parallel on thread pool p.  Each worker
+ * owns a contiguous range of buckets, so no locking is needed.  The same
+ * items are added either way, but as the serial path reorders chains
+ * each time the table grows, the order of items within a bucket can
+ * differ; a saved HashFile is then not byte-identical to a serial build,
+ * although lookups are unaffected.
+ *
+ * key_lens may be NULL, or hold zero entries, for nul terminated keys.
+ * HASH_INT_KEYS tables are not supported.
+ *
+ * As with HashTableAdd, keys already present are not added unless the
+ * table has HASH_ALLOW_DUP_KEYS; the earliest occurrence wins.  If dup
+ * is non-NULL it is set to the index of the first key skipped this way,
+ * or -1 if there were none.
+ *
+ * Returns the number of items added on success
+ *        -1 on failure
+ */
+int HashTableAddBatch(HashTable *h, char **keys, int *key_lens,
+		      HashData *data, int n, struct t_pool *p, int *dup) {
+    hash_batch_job *jobs = NULL;
+    HashItem **items = NULL;
+    uint32_t *bnum = NULL;
+    int *order = NULL, *count = NULL;
+    int i, r, njobs, added = 0, ret = -1;
+    uint32_t nb;
+
+    if (dup)
+	*dup = -1;
+
+    if (h->options & HASH_INT_KEYS)
+	return -1;
+
+    if (n <= 0)
+	return 0;
+
+    if (!p) {
+	for (i = 0; i < n; i++) {
+	    int new;
+	    int key_len = key_lens && key_lens[i]
+		? key_lens[i] : strlen(keys[i]);
+
+	    if (!HashTableAdd(h, keys[i], key_len, data[i], &new))
+		return -1;
+	    if (new)
+		added++;
+	    else if (dup && *dup == -1)
+		*dup = i;
+	}
+	return added;
+    }
+
+    /* Grow once to the size repeated HashTableAdd calls would reach */
+    if (h->options & HASH_DYNAMIC_SIZE) {
+	nb = h->nbuckets;
+	while (h->nused + n > HASH_TABLE_RESIZE * nb)
+	    nb *= 4;
+	if (nb != h->nbuckets && HashTableResize(h, nb) != 0)
+	    return -1;
+    }
+
+    njobs = p ? p->tsize : 1;
+    if (njobs > n)
+	njobs = n;
+    if (njobs > h->nbuckets)
+	njobs = h->nbuckets;
+
+    items = malloc(n * sizeof(*items));
+    bnum  = malloc(n * sizeof(*bnum));
+    order = malloc(n * sizeof(*order));
+    count = calloc(njobs+1, sizeof(*count));
+    jobs  = calloc(njobs, sizeof(*jobs));
+    if (!items || !bnum || !order || !count || !jobs)
+	goto out;
+
+    /* Item allocation uses the (unlocked) pool, so do it here */
+    for (i = 0; i < n; i++) {
+	if (NULL == (items[i] = HashItemCreate(h))) {
+	    while (i-- > 0)
+		HashItemDestroy(h, items[i], 0);
+	    goto out;
+	}
+    }
+
+    /* Hash and copy keys */
+    for (r = 0; r < njobs; r++) {
+	jobs[r].h = h;
+	jobs[r].items = items;
+	jobs[r].bnum = bnum;
+	jobs[r].keys = keys;
+	jobs[r].key_lens = key_lens;
+	jobs[r].data = data;
+	jobs[r].order = order;
+	jobs[r].start = (int64_t)n * r / njobs;
+	jobs[r].end   = (int64_t)n * (r+1) / njobs;
+    }
+    hash_batch_run(p, hash_batch_hash, jobs, njobs);
+    for (r = 0; r < njobs; r++)
+	if (jobs[r].failed)
+	    goto err_items;
+
+    /* Stable counting sort of items by bucket range */
+#define BRANGE(b) ((int)(((uint64_t)(b) * njobs) / h->nbuckets))
+    for (i = 0; i < n; i++)
+	count[BRANGE(bnum[i])+1]++;
+    for (r = 0; r < njobs; r++) {
+	count[r+1] += count[r];
+	jobs[r].ostart = count[r];
+	jobs[r].oend   = count[r+1];
+    }
+    for (i = 0; i < n; i++)
+	order[count[BRANGE(bnum[i])]++] = i;
+#undef BRANGE
+
+    /* Link into buckets */
+    hash_batch_run(p, hash_batch_link, jobs, njobs);
+
+    /* Discard duplicates */
+    for (i = 0; i < n; i++) {
+	if (bnum[i] == (uint32_t)~0) {
+	    if (dup && *dup == -1)
+		*dup = i;
+	    HashItemDestroy(h, items[i], 0);
+	} else {
+	    added++;
+	}
+    }
+
+    ret = added;
+    goto out;
+
+ err_items:
+    /* Nothing has been linked yet if hashing failed */
+    for (i = 0; i < n; i++)
+	HashItemDestroy(h, items[i], 0);
+
+ out:
+    free(items);
+    free(bnum);
+    free(order);
+    free(count);
+    free(jobs);
+
+    return ret;
+}
+
 // Custom version of above for option HASH_INT_KEYS | HASH_NONVOLATILE_KEYS.
 // Needed on 32-bit platforms where we cannot shoehorn in a 64-bit integer
 // into a pointer.  The previous interface is still valid for 32-bit integer
@@ -939,6 +1203,309 @@ void HashTableStats(HashTable *h, FILE *fp) {
     }
 }
 
+/* =========================================================================
+ * Flat open-addressing hash tables
+ * =========================================================================
+ *
+ * FHashTable uses SwissTable style probing.  Alongside the slot array is
+ * an array of control bytes, one per slot, holding the bottom 7 bits of
+ * the hash of the key in that slot or FHASH_EMPTY.  A probe loads 16
+ * control bytes at a time and compares them all against the wanted hash
+ * tag (with SSE2 where available), so only the few slots with a matching
+ * tag need a key comparison.  The first 16 control bytes are mirrored
+ * after the end so a group never needs to wrap around.
+ *
+ * Items are never removed, so the probe for a key can stop at the first
+ * group holding an empty slot.
+ */
+
+#define FHASH_EMPTY 0x80
+#define FHASH_GROUP 16
+
+static inline int fhash_ctz(uint32_t x) {
+#ifdef __GNUC__
+    return __builtin_ctz(x);
+#else
+    int n = 0;
+    while (!(x & 1)) {
+	x >>= 1;
+	n++;
+    }
+    return n;
+#endif
+}
+
+/*
+ * Compares a group of 16 control bytes against hash tag h2.
+ * Returns a bit-mask of matching slots and sets *empty to the bit-mask
+ * of empty slots in the group.
+ */
+static inline uint32_t fhash_match(uint8_t *ctrl, uint8_t h2,
+				   uint32_t *empty) {
+#ifdef __SSE2__
+    __m128i g = _mm_loadu_si128((__m128i *)ctrl);
+    *empty = _mm_movemask_epi8(g); // only FHASH_EMPTY has the top bit set
+    return _mm_movemask_epi8(_mm_cmpeq_epi8(g, _mm_set1_epi8(h2)));
+#else
+    uint32_t m = 0, e = 0;
+    int i;
+    for (i = 0; i < FHASH_GROUP; i++) {
+	m |= (uint32_t)(ctrl[i] == h2) << i;
+	e |= (uint32_t)(ctrl[i] == FHASH_EMPTY) << i;
+    }
+    *empty = e;
+    return m;
+#endif
+}
+
+/*
+ * Looks for key in h.  Returns the matching item if found.  Otherwise
+ * returns NULL and sets *pos to the empty slot where it should be added.
+ */
+static FHashItem *fhash_find(FHashTable *h, char *key, uint32_t key_len,
+			     uint32_t hv, uint32_t *pos) {
+    uint32_t p = (hv >> 7) & h->mask;
+    uint8_t h2 = hv & 0x7f;
+
+    for (;;) {
+	uint32_t empty, m = fhash_match(&h->ctrl[p], h2, &empty);
+
+	while (m) {
+	    FHashItem *hi = &h->slot[(p + fhash_ctz(m)) & h->mask];
+	    if (hi->hv == hv && hi->key_len == key_len &&
+		memcmp(hi->key, key, key_len) == 0)
+		return hi;
+	    m &= m-1;
+	}
+
+	if (empty) {
+	    *pos = (p + fhash_ctz(empty)) & h->mask;
+	    return NULL;
+	}
+
+	p = (p + FHASH_GROUP) & h->mask;
+    }
+}
+
+static inline void fhash_set_ctrl(FHashTable *h, uint32_t pos, uint8_t c) {
+    h->ctrl[pos] = c;
+    if (pos < FHASH_GROUP)
+	h->ctrl[h->nslots + pos] = c;
+}
+
+/*
+ * Creates a new FHashTable object.  Size is the number of items expected
+ * and is rounded up to give a power of 2 number of slots.  The table grows
+ * as needed.
+ *
+ * Options are the HASH_FUNC_* hash function and HASH_NONVOLATILE_KEYS.
+ *
+ * Returns:
+ *    A pointer to a FHashTable on success
+ *    NULL on failure
+ */
+FHashTable *FHashTableCreate(int size, int options) {
+    FHashTable *h;
+    uint32_t nslots = FHASH_GROUP;
+
+    if (!(h = (FHashTable *)calloc(1, sizeof(*h))))
+	return NULL;
+
+    /* Keep the table no more than 7/8ths full */
+    while (nslots < (uint32_t)size + size/7 + 1)
+	nslots *= 2;
+
+    h->options = options;
+    h->nslots = nslots;
+    h->mask = nslots-1;
+    h->nused = 0;
+    h->key_pool = NULL;
+    h->slot = (FHashItem *)malloc(nslots * sizeof(*h->slot));
+    h->ctrl = (uint8_t *)malloc(nslots + FHASH_GROUP);
+    if (!h->slot || !h->ctrl) {
+	FHashTableDestroy(h, 0);
+	return NULL;
+    }
+    memset(h->ctrl, FHASH_EMPTY, nslots + FHASH_GROUP);
+
+    return h;
+}
+
+/*
+ * Deallocates a FHashTable object (created by FHashTableCreate).
+ *
+ * As with HashTableDestroy, deallocate_data indicates whether the data
+ * pointers attached to the items should also be free()d.
+ */
+void FHashTableDestroy(FHashTable *h, int deallocate_data) {
+    if (!h)
+	return;
+
+    if (deallocate_data && h->ctrl) {
+	uint32_t i;
+	for (i = 0; i < h->nslots; i++)
+	    if (h->ctrl[i] != FHASH_EMPTY && h->slot[i].data.p)
+		free(h->slot[i].data.p);
+    }
+
+    if (h->key_pool)
+	string_pool_destroy(h->key_pool);
+    free(h->slot);
+    free(h->ctrl);
+    free(h);
+}
+
+/*
+ * Resizes a FHashTable to have 'newsize' slots, which must be a power of
+ * 2 large enough to hold the existing items.  Items keep their cached
+ * hash values so no keys are rehashed.
+ *
+ * Returns 0 for success
+ *        -1 for failure
+ */
+int FHashTableResize(FHashTable *h, int newsize) {
+    FHashItem *old_slot = h->slot;
+    uint8_t *old_ctrl = h->ctrl;
+    uint32_t i, old_nslots = h->nslots;
+
+    if (newsize < FHASH_GROUP || (newsize & (newsize-1)) ||
+	h->nused >= newsize)
+	return -1;
+
+    h->slot = (FHashItem *)malloc(newsize * sizeof(*h->slot));
+    h->ctrl = (uint8_t *)malloc(newsize + FHASH_GROUP);
+    if (!h->slot || !h->ctrl) {
+	free(h->slot);
+	free(h->ctrl);
+	h->slot = old_slot;
+	h->ctrl = old_ctrl;
+	return -1;
+    }
+    memset(h->ctrl, FHASH_EMPTY, newsize + FHASH_GROUP);
+    h->nslots = newsize;
+    h->mask = newsize-1;
+
+    for (i = 0; i < old_nslots; i++) {
+	FHashItem *hi;
+	uint32_t p, empty;
+
+	if (old_ctrl[i] == FHASH_EMPTY)
+	    continue;
+
+	/* Keys are unique, so just find the first empty slot */
+	p = (old_slot[i].hv >> 7) & h->mask;
+	for (;;) {
+	    fhash_match(&h->ctrl[p], 0, &empty);
+	    if (empty)
+		break;
+	    p = (p + FHASH_GROUP) & h->mask;
+	}
+	p = (p + fhash_ctz(empty)) & h->mask;
+
+	hi = &h->slot[p];
+	*hi = old_slot[i];
+	if (old_slot[i].key == old_slot[i].ikey)
+	    hi->key = hi->ikey;
+	fhash_set_ctrl(h, p, old_ctrl[i]);
+    }
+
+    free(old_slot);
+    free(old_ctrl);
+
+    return 0;
+}
+
+/*
+ * Adds a HashData item to FHashTable h with a specific key.  As with
+ * HashTableAdd, a key_len of zero means use strlen(key) and *new (if
+ * non-NULL) is set to indicate whether the key was newly added.
+ * Duplicate keys are never stored.
+ *
+ * Keys are copied unless the HASH_NONVOLATILE_KEYS option was used.
+ *
+ * Returns:
+ *    The FHashItem created (or matching if a duplicate) on success
+ *    NULL on failure
+ */
+FHashItem *FHashTableAdd(FHashTable *h, char *key, int key_len,
+			 HashData data, int *new) {
+    uint32_t hv, pos;
+    FHashItem *hi;
+
+    if (!key_len)
+	key_len = strlen(key);
+
+    hv = hash(h->options & HASH_FUNC_MASK, (uint8_t *)key, key_len);
+
+    if ((hi = fhash_find(h, key, key_len, hv, &pos))) {
+	if (new) *new = 0;
+	return hi;
+    }
+
+    if ((uint64_t)(h->nused+1) * 8 > (uint64_t)h->nslots * 7) {
+	if (FHashTableResize(h, h->nslots*2) != 0)
+	    return NULL;
+	fhash_find(h, key, key_len, hv, &pos);
+    }
+
+    hi = &h->slot[pos];
+    if (h->options & HASH_NONVOLATILE_KEYS) {
+	hi->key = key;
+    } else if (key_len < FHASH_INLINE_KEY) {
+	hi->key = hi->ikey;
+	memcpy(hi->key, key, key_len);
+	hi->key[key_len] = 0;
+    } else {
+	if (!h->key_pool && !(h->key_pool = string_pool_create(65536)))
+	    return NULL;
+	if (!(hi->key = string_ndup(h->key_pool, key, key_len)))
+	    return NULL;
+    }
+    hi->key_len = key_len;
+    hi->hv = hv;
+    hi->data = data;
+    fhash_set_ctrl(h, pos, hv & 0x7f);
+    h->nused++;
+
+    if (new) *new = 1;
+
+    return hi;
+}
+
+/*
+ * Searches the FHashTable for the data registered with 'key'.
+ *
+ * Returns
+ *    FHashItem if found
+ *    NULL if not found
+ */
+FHashItem *FHashTableSearch(FHashTable *h, char *key, int key_len) {
+    uint32_t hv, pos;
+
+    if (!key_len)
+	key_len = strlen(key);
+
+    hv = hash(h->options & HASH_FUNC_MASK, (uint8_t *)key, key_len);
+    return fhash_find(h, key, key_len, hv, &pos);
+}
+
+/*
+ * Iterates through members of a FHashTable.  *iter should be set to 0
+ * before the first call.
+ *
+ * Returns the next FHashItem on success
+ *         NULL when there are no more items.
+ */
+FHashItem *FHashTableIterNext(FHashTable *h, int *iter) {
+    while ((uint32_t)*iter < h->nslots) {
+	uint32_t i = (*iter)++;
+	if (h->ctrl[i] != FHASH_EMPTY)
+	    return &h->slot[i];
+    }
+
+    return NULL;
+}
+
 /*
  * --------------------------------------------------------------------
  * Below we have a specialisation of the HashTable code where the data
@@ -1551,6 +2118,42 @@ int HashFileQuery(HashFile *hf, uint8_t *key, int key_len,
     /* Hash 'key' to compute the bucket number */
     hval = hash64(hf->hh.hfunc, key, key_len) & (hf->hh.nbuckets-1);
 
+    /* Memory mapped: walk the chain in place */
+    if (hf->map) {
+	unsigned char *cp, *base = hf->map + hf->hf_start;
+	unsigned char *end = hf->map + hf->map_len;
+
+	cp = base + hf->header_size + 4*hval;
+	if (cp + 4 > end)
+	    return -1;
+	memcpy(&pos, cp, 4);
+	pos = be_int4(pos);
+	if (0 == pos)
+	    return -1;
+
+	for (cp = base + pos; cp < end && (klen = *cp++); cp += klen + 13) {
+	    uint64_t pos64;
+	    uint32_t size;
+
+	    if (cp + klen + 13 > end)
+		return -1;
+	    if (klen != key_len || 0 != memcmp(key, cp, key_len))
+		continue;
+
+	    item->header = (cp[klen] >> 4) & 0xf;
+	    item->footer = cp[klen] & 0xf;
+	    memcpy(&pos64, cp + klen + 1, 8);
+	    item->archive = *(char *)&pos64;
+	    *(char *)&pos64 = 0;
+	    item->pos = be_int8(pos64) + hf->hh.offset;
+	    memcpy(&size, cp + klen + 9, 4);
+	    item->size = be_int4(size);
+	    return 0;
+	}
+
+	return -1;
+    }
+
     /* Read the bucket to find the first linked list item location */
     if (-1 == fseeko(hf->hfp, hf->hf_start + 4*hval + hf->header_size,SEEK_SET))
 	return -1;
@@ -1652,6 +2255,20 @@ void HashFileDestroy(HashFile *hf) {
 	    free(hf->afp);
     }
 
+#ifdef HAVE_MMAP
+    if (hf->amap) {
+	int i;
+	for (i = 0; i < hf->narchives; i++)
+	    if (hf->amap[i])
+		munmap(hf->amap[i], hf->amap_len[i]);
+	free(hf->amap);
+	free(hf->amap_len);
+    }
+
+    if (hf->map)
+	munmap(hf->map, hf->map_len);
+#endif
+
     if (hf->hfp)
 	fclose(hf->hfp);
 
@@ -1678,19 +2295,135 @@ static int HashFileOpenArchive(HashFile *hf, int archive_no) {
 }
 
 
+#ifdef HAVE_MMAP
 /*
- * Extracts the contents for a file out of the HashFile.
+ * Maps an entire open FILE read-only.
+ * Returns the mapping on success
+ *         NULL on failure
  */
-char *HashFileExtract(HashFile *hf, char *fname, size_t *len) {
-    HashFileItem hfi;
+static unsigned char *HashFileMapFile(FILE *fp, size_t *len) {
+    struct stat sb;
+    void *map;
+
+    if (fstat(fileno(fp), &sb) != 0 || sb.st_size == 0)
+	return NULL;
+
+    map = mmap(NULL, sb.st_size, PROT_READ, MAP_SHARED, fileno(fp), 0);
+    if (map == MAP_FAILED)
+	return NULL;
+
+    *len = sb.st_size;
+    return (unsigned char *)map;
+}
+#endif
+
+/*
+ * Switches an open HashFile to memory mapped mode.  Queries then walk the
+ * bucket chains directly in the mapping, and archives are mapped when
+ * first used so that extraction is a memcpy (or no copy at all via
+ * HashFileExtractView) rather than a seek and read.
+ *
+ * Returns 0 on success
+ *        -1 on failure, in which case the HashFile still works unmapped.
+ */
+int HashFileMmap(HashFile *hf) {
+#ifdef HAVE_MMAP
+    if (hf->map)
+	return 0;
+
+    if (!hf->hfp || !(hf->map = HashFileMapFile(hf->hfp, &hf->map_len)))
+	return -1;
+
+    if ((size_t)(hf->hf_start + hf->header_size + 4*(off_t)hf->hh.nbuckets)
+	> hf->map_len) {
+	munmap(hf->map, hf->map_len);
+	hf->map = NULL;
+	return -1;
+    }
+
+    if (hf->narchives) {
+	hf->amap     = calloc(hf->narchives, sizeof(*hf->amap));
+	hf->amap_len = calloc(hf->narchives, sizeof(*hf->amap_len));
+	if (!hf->amap || !hf->amap_len) {
+	    free(hf->amap);
+	    free(hf->amap_len);
+	    hf->amap = NULL;
+	    hf->amap_len = NULL;
+	}
+    }
+
+    return 0;
+#else
+    return -1;
+#endif
+}
+
+/*
+ * Returns a pointer to 'size' bytes at 'pos' in a mapped archive, or NULL
+ * if the archive is not mapped or the range is out of bounds.
+ */
+static unsigned char *HashFileMapped(HashFile *hf, int archive_no,
+				     uint64_t pos, uint32_t size) {
+    unsigned char *map = NULL;
+    size_t len = 0;
+
+    if (!hf->map)
+	return NULL;
+
+    if (!hf->narchives) {
+	map = hf->map;
+	len = hf->map_len;
+    } else if (hf->amap && archive_no < hf->narchives) {
+#ifdef HAVE_MMAP
+	if (!hf->amap[archive_no] && 0 == HashFileOpenArchive(hf, archive_no))
+	    hf->amap[archive_no] = HashFileMapFile(hf->afp[archive_no],
+						   &hf->amap_len[archive_no]);
+#endif
+	map = hf->amap[archive_no];
+	len = hf->amap_len[archive_no];
+    }
+
+    if (!map || pos + size > len)
+	return NULL;
+
+    return map + pos;
+}
+
+/*
+ * Copies 'size' bytes at 'pos' in an archive to 'data'.
+ * Returns 0 on success
+ *        -1 on failure
+ */
+static int HashFileRead(HashFile *hf, int archive_no, uint64_t pos,
+			uint32_t size, char *data) {
+    unsigned char *cp;
+
+    if ((cp = HashFileMapped(hf, archive_no, pos, size))) {
+	memcpy(data, cp, size);
+	return 0;
+    }
+
+    HashFileOpenArchive(hf, archive_no);
+    if (!hf->afp[archive_no])
+	return -1;
+
+    fseeko(hf->afp[archive_no], pos, SEEK_SET);
+    if (1 != fread(data, size, 1, hf->afp[archive_no]))
+	return -1;
+
+    return 0;
+}
+
+/*
+ * Extracts the contents of an item found by HashFileQuery.
+ */
+static char *HashFileExtractItem(HashFile *hf, HashFileItem *item,
+				 size_t *len) {
+    HashFileItem hfi = *item;
     size_t sz, pos;
     char *data;
     HashFileSection *head = NULL, *foot = NULL;
 
-    /* Find out if and where the item is in the archive */
-    if (-1 == HashFileQuery(hf, (uint8_t *)fname, strlen(fname), &hfi))
-	return NULL;
-
     /* Work out the size including header/footer and allocate */
     sz = hfi.size;
     if (hfi.header) {
@@ -1710,39 +2443,166 @@ char *HashFileExtract(HashFile *hf, char *fname, size_t *len) {
     /* Header */
     pos = 0;
     if (head) {
-	HashFileOpenArchive(hf, head->archive_no);
-	if (!hf->afp[head->archive_no])
-	    return NULL;
-
-	fseeko(hf->afp[head->archive_no], head->pos, SEEK_SET);
-	if (1 != fread(&data[pos], head->size, 1, hf->afp[head->archive_no]))
-	    return NULL;
+	if (HashFileRead(hf, head->archive_no, head->pos, head->size,
+			 &data[pos]))
+	    goto err;
 	pos += head->size;
     }
 
     /* Main file */
-    HashFileOpenArchive(hf, hfi.archive);
-    if (!hf->afp[hfi.archive])
-	return NULL;
-
-    fseeko(hf->afp[hfi.archive], hfi.pos, SEEK_SET);
-    if (1 != fread(&data[pos], hfi.size, 1, hf->afp[hfi.archive]))
-	return NULL;
+    if (HashFileRead(hf, hfi.archive, hfi.pos, hfi.size, &data[pos]))
+	goto err;
     pos += hfi.size;
 
     /* Footer */
     if (foot) {
-	HashFileOpenArchive(hf, foot->archive_no);
-	if (!hf->afp[foot->archive_no])
-	    return NULL;
-
-	fseeko(hf->afp[foot->archive_no], foot->pos, SEEK_SET);
-	if (1 != fread(&data[pos], foot->size, 1, hf->afp[foot->archive_no]))
-	    return NULL;
+	if (HashFileRead(hf, foot->archive_no, foot->pos, foot->size,
+			 &data[pos]))
+	    goto err;
 	pos += foot->size;
     }
 
     return data;
+
+ err:
+    free(data);
+    return NULL;
+}
+
+/*
+ * Extracts the contents for a file out of the HashFile.
+ */
+char *HashFileExtract(HashFile *hf, char *fname, size_t *len) {
+    HashFileItem hfi;
+
+    /* Find out if and where the item is in the archive */
+    if (-1 == HashFileQuery(hf, (uint8_t *)fname, strlen(fname), &hfi))
+	return NULL;
+
+    return HashFileExtractItem(hf, &hfi, len);
+}
+
+/*
+ * As HashFileExtract, but if the HashFile has been mapped with
+ * HashFileMmap and the item has no header or footer then this returns a
+ * pointer directly into the mapping and sets *view to 1.  This must not
+ * be freed or written to, and is valid until HashFileDestroy.
+ *
+ * Otherwise *view is set to 0 and a malloced copy is returned, as per
+ * HashFileExtract.  Note the view is not nul terminated.
+ *
+ * Returns pointer to the contents on success
+ *         NULL on failure
+ */
+char *HashFileExtractView(HashFile *hf, char *fname, size_t *len, int *view) {
+    HashFileItem hfi;
+    unsigned char *cp;
+
+    *view = 0;
+    if (!hf->map)
+	return HashFileExtract(hf, fname, len);
+
+    if (-1 == HashFileQuery(hf, (uint8_t *)fname, strlen(fname), &hfi))
+	return NULL;
+
+    if (hfi.header || hfi.footer ||
+	!(cp = HashFileMapped(hf, hfi.archive, hfi.pos, hfi.size)))
+	return HashFileExtract(hf, fname, len);
+
+    *view = 1;
+    *len = hfi.size;
+    return (char *)cp;
+}
+
+/* Number of sorted items ahead of the current one to issue readahead for */
+#define HASHFILE_READAHEAD 32
+
+typedef struct {
+    int idx;			/* position in the caller's key list */
+    HashFileItem item;
+} HashFileBatchItem;
+
+static int hfbi_sort(const void *vp1, const void *vp2) {
+    const HashFileBatchItem *i1 = (const HashFileBatchItem *)vp1;
+    const HashFileBatchItem *i2 = (const HashFileBatchItem *)vp2;
+
+    if (i1->item.archive != i2->item.archive)
+	return i1->item.archive - i2->item.archive;
+    if (i1->item.pos != i2->item.pos)
+	return i1->item.pos < i2->item.pos ? -1 : 1;
+    return i1->idx - i2->idx;
+}
+
+/*
+ * Tells the OS we will shortly want 'size' bytes at 'pos' in an archive.
+ */
+static void HashFileWillNeed(HashFile *hf, HashFileItem *item) {
+    unsigned char *cp;
+
+    if ((cp = HashFileMapped(hf, item->archive, item->pos, item->size))) {
+#if defined(HAVE_MMAP) && defined(MADV_WILLNEED)
+	size_t page = sysconf(_SC_PAGESIZE);
+	size_t off = (size_t)cp & (page-1);
+	madvise(cp - off, item->size + off, MADV_WILLNEED);
+#endif
+	return;
+    }
+
+#ifdef POSIX_FADV_WILLNEED
+    HashFileOpenArchive(hf, item->archive);
+    if (hf->afp[item->archive])
+	posix_fadvise(fileno(hf->afp[item->archive]), item->pos, item->size,
+		      POSIX_FADV_WILLNEED);
+#endif
+}
+
+/*
+ * Extracts 'n' files at once.  All keys are looked up first and the
+ * items are then read in archive and file offset order, with readahead
+ * hints for those coming next, turning random access over a large
+ * archive into a mostly sequential scan.
+ *
+ * Results are returned in the order of fnames[]: data[i] is a malloced
+ * copy of fnames[i] of length len[i], or NULL if it was not found.
+ *
+ * Returns the number of files found on success
+ *         -1 on failure
+ */
+int HashFileExtractBatch(HashFile *hf, char **fnames, int n,
+			 char **data, size_t *len) {
+    HashFileBatchItem *items;
+    int i, j, nitems = 0, found = 0;
+
+    if (NULL == (items = malloc((n ? n : 1) * sizeof(*items))))
+	return -1;
+
+    /* Resolve */
+    for (i = 0; i < n; i++) {
+	data[i] = NULL;
+	len[i] = 0;
+	if (0 == HashFileQuery(hf, (uint8_t *)fnames[i], strlen(fnames[i]),
+			       &items[nitems].item))
+	    items[nitems++].idx = i;
+    }
+
+    qsort(items, nitems, sizeof(*items), hfbi_sort);
+
+    /* Fetch in file order, hinting ahead as we go */
+    for (j = 0; j < nitems && j < HASHFILE_READAHEAD; j++)
+	HashFileWillNeed(hf, &items[j].item);
+
+    for (i = 0; i < nitems; i++, j++) {
+	int idx = items[i].idx;
+
+	if (j < nitems)
+	    HashFileWillNeed(hf, &items[j].item);
+
+	if ((data[idx] = HashFileExtractItem(hf, &items[i].item, &len[idx])))
+	    found++;
+    }
+
+    free(items);
+    return found;
 }
 
 /*
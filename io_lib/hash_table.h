@@ -40,6 +40,7 @@
 #include <stdlib.h>
 
 #include "io_lib/pooled_alloc.h"
+#include "io_lib/string_alloc.h"
 
 #ifdef __cplusplus
 extern "C" {
@@ -92,6 +93,35 @@ typedef struct {
     HashItem *hi;
 } HashIter;
 
+/*
+ * A flat open-addressing alternative to HashTable, for hot tables that are
+ * only ever added to and searched.  There is no per-item allocation: keys
+ * shorter than FHASH_INLINE_KEY bytes live in the item itself and longer
+ * ones are copied into a string pool (unless HASH_NONVOLATILE_KEYS).
+ *
+ * Items move when the table grows, so an FHashItem pointer is only valid
+ * until the next FHashTableAdd() on the same table.
+ */
+#define FHASH_INLINE_KEY 24
+
+typedef struct {
+    HashData data;        /* user defined data attached to this key */
+    char    *key;         /* key we hashed on */
+    uint32_t key_len;     /* and its length */
+    uint32_t hv;          /* full hash value of key */
+    char     ikey[FHASH_INLINE_KEY]; /* key storage for short keys */
+} FHashItem;
+
+typedef struct {
+    int       options;  /* HASH_FUNC & HASH_NONVOLATILE_KEYS */
+    uint32_t  nslots;   /* Number of item slots; power of 2, >= 16 */
+    uint32_t  mask;	/* bit-mask equiv of nslots */
+    int       nused;    /* How many items we're storing */
+    uint8_t  *ctrl;     /* Per slot hash tag or FHASH_EMPTY, nslots+16 */
+    FHashItem *slot;    /* The items themselves */
+    string_alloc_t *key_pool; /* Copies of keys too long to inline */
+} FHashTable;
+
 #define HASHFILE_MAGIC ".hsh"
 #define HASHFILE_VERSION100 "1.00"
 #define HASHFILE_VERSION "1.01"
@@ -155,6 +185,10 @@ typedef struct {
     FILE **afp;			/* archive FILE(s) */
     int header_size;		/* size of header + filename + N(head/feet) */
     off_t hf_start;		/* location of HashFile header in file */
+    unsigned char *map;		/* hash file mapping, see HashFileMmap() */
+    size_t map_len;
+    unsigned char **amap;	/* archive file mappings, opened on demand */
+    size_t *amap_len;
 } HashFile;
 
 /* Functions to to use HashTable.options */
@@ -187,6 +221,9 @@ HashItem *HashTableAdd(HashTable *h, char *key, int key_len,
 		       HashData data, int *added);
 HashItem *HashTableAddInt64(HashTable *h, int64_t key,
 			    HashData data, int *added);
+struct t_pool;
+int HashTableAddBatch(HashTable *h, char **keys, int *key_lens,
+		      HashData *data, int n, struct t_pool *p, int *dup);
 int HashTableDel(HashTable *h, HashItem *hi, int deallocate_data);
 int HashTableRemove(HashTable *h, char *key, int key_len, int deallocate_data);
 int HashTableRemoveInt64(HashTable *h, int64_t key, int deallocate_data);
@@ -205,11 +242,24 @@ void HashTableIterDestroy(HashIter *iter);
 HashItem *HashTableIterNext(HashTable *h, HashIter *iter);
 void HashTableIterReset(HashIter *iter);
 
+/* FHashTable prototypes */
+FHashTable *FHashTableCreate(int size, int options);
+void FHashTableDestroy(FHashTable *h, int deallocate_data);
+int FHashTableResize(FHashTable *h, int newsize);
+FHashItem *FHashTableAdd(FHashTable *h, char *key, int key_len,
+			 HashData data, int *added);
+FHashItem *FHashTableSearch(FHashTable *h, char *key, int key_len);
+FHashItem *FHashTableIterNext(FHashTable *h, int *iter);
+
 /* HashFile prototypes */
 uint64_t HashFileSave(HashFile *hf, FILE *fp, int64_t offset);
 HashFile *HashFileLoad(FILE *fp);
 int HashFileQuery(HashFile *hf, uint8_t *key, int key_len, HashFileItem *item);
 char *HashFileExtract(HashFile *hf, char *fname, size_t *len);
+char *HashFileExtractView(HashFile *hf, char *fname, size_t *len, int *view);
+int HashFileExtractBatch(HashFile *hf, char **fnames, int n,
+			 char **data, size_t *len);
+int HashFileMmap(HashFile *hf);
 
 
 HashFile *HashFileCreate(int size, int options);
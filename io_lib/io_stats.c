@@ -0,0 +1,248 @@
+/*
+ * Copyright (c) 2019 Genome Research Ltd.
+ * Author(s): James Bonfield
+ * 
+ * Redistribution and use in source and binary forms, with or without 
+ * modification, are permitted provided that the following conditions are met:
+ * 
+ *    1. Redistributions of source code must retain the above copyright notice,
+ *       this list of conditions and the following disclaimer.
+ * 
+ *    2. Redistributions in binary form must reproduce the above
+ *       copyright notice, this list of conditions and the following
+ *       disclaimer in the documentation and/or other materials provided
+ *       with the distribution.
+ * 
+ *    3. Neither the names Genome Research Ltd and Wellcome Trust Sanger
+ *    Institute nor the names of its contributors may be used to endorse
+ *    or promote products derived from this software without specific
+ *    prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY GENOME RESEARCH LTD AND CONTRIBUTORS "AS
+ * IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+ * TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL GENOME RESEARCH
+ * LTD OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#ifdef HAVE_CONFIG_H
+#include "io_lib_config.h"
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <time.h>
+#include <sys/time.h>
+
+#include "io_lib/io_stats.h"
+
+static char *stage_names[IO_STAGE_MAX] = {
+    "read", "uncompress", "decode", "convert", "encode", "compress", "write"
+};
+
+static double wall_time(void) {
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+/* CPU time of the calling thread, or the process if unavailable. */
+static double cpu_time(void) {
+#ifdef CLOCK_THREAD_CPUTIME_ID
+    struct timespec ts;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+#else
+    return (double)clock() / CLOCKS_PER_SEC;
+#endif
+}
+
+/* CPU time of the whole process. */
+static double process_cpu_time(void) {
+    return (double)clock() / CLOCKS_PER_SEC;
+}
+
+/*
+ * Creates a statistics block, to be written to fp when dumped.
+ *
+ * Returns io_stats pointer on success;
+ *         NULL on failure
+ */
+io_stats *io_stats_create(FILE *fp) {
+    io_stats *st = calloc(1, sizeof(*st));
+    if (!st)
+	return NULL;
+
+    st->fp = fp;
+    st->start_wall = wall_time();
+    st->start_cpu = process_cpu_time();
+    pthread_mutex_init(&st->lock, NULL);
+
+    return st;
+}
+
+void io_stats_destroy(io_stats *st) {
+    if (!st)
+	return;
+
+    pthread_mutex_destroy(&st->lock);
+    free(st);
+}
+
+void io_stats_start(io_stats *st, io_clock *c) {
+    if (!st)
+	return;
+
+    c->wall = wall_time();
+    c->cpu  = cpu_time();
+}
+
+static void stage_add(io_stage_stats *s, double wall, double cpu,
+		      int64_t bytes_in, int64_t bytes_out) {
+    s->count++;
+    s->bytes_in  += bytes_in;
+    s->bytes_out += bytes_out;
+    s->wall += wall;
+    s->cpu  += cpu;
+}
+
+void io_stats_add(io_stats *st, enum io_stage stage, io_clock *c,
+		  int64_t bytes_in, int64_t bytes_out) {
+    double wall, cpu;
+
+    if (!st)
+	return;
+
+    wall = wall_time() - c->wall;
+    cpu  = cpu_time()  - c->cpu;
+
+    pthread_mutex_lock(&st->lock);
+    stage_add(&st->stage[stage], wall, cpu, bytes_in, bytes_out);
+    pthread_mutex_unlock(&st->lock);
+}
+
+void io_stats_method(io_stats *st, int comp, int method, io_clock *c,
+		     int64_t bytes_in, int64_t bytes_out) {
+    double wall, cpu;
+
+    if (!st)
+	return;
+
+    wall = wall_time() - c->wall;
+    cpu  = cpu_time()  - c->cpu;
+
+    pthread_mutex_lock(&st->lock);
+    stage_add(&st->stage[comp ? IO_STAGE_COMPRESS : IO_STAGE_UNCOMPRESS],
+	      wall, cpu, bytes_in, bytes_out);
+    if (method >= 0 && method < IO_STATS_NMETHODS)
+	stage_add(comp ? &st->comp[method] : &st->uncomp[method],
+		  wall, cpu, bytes_in, bytes_out);
+    pthread_mutex_unlock(&st->lock);
+}
+
+void io_stats_queue(io_stats *st, t_pool *p) {
+    int n;
+
+    if (!st || !p)
+	return;
+
+    pthread_mutex_lock(&p->pool_m);
+    n = p->njobs;
+    pthread_mutex_unlock(&p->pool_m);
+
+    pthread_mutex_lock(&st->lock);
+    st->queue_n++;
+    st->queue_sum += n;
+    if (st->queue_max < n)
+	st->queue_max = n;
+    pthread_mutex_unlock(&st->lock);
+}
+
+static void dump_stage(FILE *fp, char *name, io_stage_stats *s, int last) {
+    fprintf(fp, "    \"%s\": {\"count\": %"PRId64", "
+	    "\"bytes_in\": %"PRId64", \"bytes_out\": %"PRId64", "
+	    "\"wall\": %.6f, \"cpu\": %.6f}%s\n",
+	    name, s->count, s->bytes_in, s->bytes_out, s->wall, s->cpu,
+	    last ? "" : ",");
+}
+
+static void dump_methods(FILE *fp, char *name, io_stage_stats *s,
+			 char *(*method_name)(int)) {
+    int m, last;
+
+    for (last = IO_STATS_NMETHODS-1; last >= 0; last--)
+	if (s[last].count)
+	    break;
+
+    fprintf(fp, "  \"%s\": {\n", name);
+    for (m = 0; m <= last; m++) {
+	char buf[20], *mname = method_name ? method_name(m) : NULL;
+	if (!s[m].count)
+	    continue;
+	if (!mname) {
+	    sprintf(buf, "%d", m);
+	    mname = buf;
+	}
+	dump_stage(fp, mname, &s[m], m == last);
+    }
+    fprintf(fp, "  },\n");
+}
+
+/*
+ * Writes the statistics as a JSON object.
+ *
+ * Returns 0 on success;
+ *        -1 on failure
+ */
+int io_stats_dump(io_stats *st, FILE *fp, char *format, char *mode,
+		  char *(*method_name)(int method), t_pool *p) {
+    int i;
+
+    if (!st || !fp)
+	return 0;
+
+    pthread_mutex_lock(&st->lock);
+
+    fprintf(fp, "{\n  \"format\": \"%s\",\n  \"mode\": \"%s\",\n",
+	    format, mode);
+    fprintf(fp, "  \"wall\": %.6f,\n  \"cpu\": %.6f,\n",
+	    wall_time() - st->start_wall, process_cpu_time() - st->start_cpu);
+
+    fprintf(fp, "  \"stages\": {\n");
+    for (i = 0; i < IO_STAGE_MAX; i++)
+	dump_stage(fp, stage_names[i], &st->stage[i], i == IO_STAGE_MAX-1);
+    fprintf(fp, "  },\n");
+
+    dump_methods(fp, "compress", st->comp, method_name);
+    dump_methods(fp, "uncompress", st->uncomp, method_name);
+
+    fprintf(fp, "  \"queue\": {\"samples\": %"PRId64", \"mean\": %.2f, "
+	    "\"max\": %d},\n", st->queue_n,
+	    st->queue_n ? (double)st->queue_sum / st->queue_n : 0.0,
+	    st->queue_max);
+
+    if (p) {
+	long long idle;
+	pthread_mutex_lock(&p->pool_m);
+	idle = p->idle_time;
+	pthread_mutex_unlock(&p->pool_m);
+	fprintf(fp, "  \"threads\": {\"count\": %d, \"idle\": %.6f}\n",
+		p->tsize, idle / 1e6);
+    } else {
+	fprintf(fp, "  \"threads\": {\"count\": 0, \"idle\": 0}\n");
+    }
+    fprintf(fp, "}\n");
+
+    pthread_mutex_unlock(&st->lock);
+
+    return ferror(fp) ? -1 : 0;
+}
@@ -0,0 +1,148 @@
+/*
+ * Copyright (c) 2019 Genome Research Ltd.
+ * Author(s): James Bonfield
+ * 
+ * Redistribution and use in source and binary forms, with or without 
+ * modification, are permitted provided that the following conditions are met:
+ * 
+ *    1. Redistributions of source code must retain the above copyright notice,
+ *       this list of conditions and the following disclaimer.
+ * 
+ *    2. Redistributions in binary form must reproduce the above
+ *       copyright notice, this list of conditions and the following
+ *       disclaimer in the documentation and/or other materials provided
+ *       with the distribution.
+ * 
+ *    3. Neither the names Genome Research Ltd and Wellcome Trust Sanger
+ *    Institute nor the names of its contributors may be used to endorse
+ *    or promote products derived from this software without specific
+ *    prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY GENOME RESEARCH LTD AND CONTRIBUTORS "AS
+ * IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+ * TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL GENOME RESEARCH
+ * LTD OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+/*
+ * Optional per-stage timing and byte counters for the CRAM and BAM
+ * readers and writers, enabled with CRAM_OPT_STATS / BAM_OPT_STATS.
+ *
+ * Each stage accumulates the number of calls, bytes in and out, and the
+ * elapsed and CPU time spent.  Stages may run in several threads at once
+ * so their summed elapsed time can exceed the file's total.  Compression
+ * and decompression are also broken down per method.
+ *
+ * The totals are written as a JSON object when the file is closed.
+ */
+
+#ifndef _IO_STATS_H_
+#define _IO_STATS_H_
+
+#include <stdio.h>
+#include <stdint.h>
+#include <pthread.h>
+
+#include "io_lib/thread_pool.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+enum io_stage {
+    IO_STAGE_READ = 0,   // reading from the file
+    IO_STAGE_UNCOMPRESS, // block decompression
+    IO_STAGE_DECODE,     // CRAM slice decoding, including decompression
+    IO_STAGE_CONVERT,    // CRAM to BAM record conversion
+    IO_STAGE_ENCODE,     // CRAM container encoding, including compression
+    IO_STAGE_COMPRESS,   // block compression
+    IO_STAGE_WRITE,      // writing to the file
+    IO_STAGE_MAX
+};
+
+#define IO_STATS_NMETHODS 32
+
+typedef struct {
+    int64_t count;
+    int64_t bytes_in, bytes_out;
+    double wall, cpu;
+} io_stage_stats;
+
+/* The start time of an individual measurement */
+typedef struct {
+    double wall, cpu;
+} io_clock;
+
+typedef struct io_stats {
+    io_stage_stats stage[IO_STAGE_MAX];
+    io_stage_stats comp[IO_STATS_NMETHODS];
+    io_stage_stats uncomp[IO_STATS_NMETHODS];
+
+    // Thread pool queue depth, sampled as each job is dispatched
+    int64_t queue_n, queue_sum;
+    int queue_max;
+
+    double start_wall, start_cpu;
+    FILE *fp;
+    pthread_mutex_t lock;
+} io_stats;
+
+/*! Creates a statistics block, to be written to fp when dumped.
+ *
+ * @return
+ * Returns io_stats pointer on success;
+ *         NULL on failure
+ */
+io_stats *io_stats_create(FILE *fp);
+
+/*! Deallocates an io_stats struct. */
+void io_stats_destroy(io_stats *st);
+
+/*! Starts timing a measurement.  A no-op if st is NULL. */
+void io_stats_start(io_stats *st, io_clock *c);
+
+/*! Ends a measurement started with io_stats_start, adding it to stage.
+ * A no-op if st is NULL.
+ */
+void io_stats_add(io_stats *st, enum io_stage stage, io_clock *c,
+		  int64_t bytes_in, int64_t bytes_out);
+
+/*! Ends a compression (comp=1) or decompression (comp=0) measurement,
+ * adding it to both the method and the matching stage totals.
+ * A no-op if st is NULL.
+ */
+void io_stats_method(io_stats *st, int comp, int method, io_clock *c,
+		     int64_t bytes_in, int64_t bytes_out);
+
+/*! Records the current queue depth of a thread pool.
+ * A no-op if st or p is NULL.
+ */
+void io_stats_queue(io_stats *st, t_pool *p);
+
+/*! Writes the statistics as a JSON object.
+ *
+ * Format and mode label the file (eg "cram", "write").  Method_name maps
+ * method numbers to names.  If p is non-NULL the pool's thread count and
+ * idle time are included; note this is for the whole pool, which may be
+ * shared with other files.
+ *
+ * @return
+ * Returns 0 on success;
+ *        -1 on failure
+ */
+int io_stats_dump(io_stats *st, FILE *fp, char *format, char *mode,
+		  char *(*method_name)(int method), t_pool *p);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* _IO_STATS_H_ */
@@ -83,6 +83,7 @@
 #include <unistd.h>
 #include <ctype.h>
 #include <limits.h>
+#include <pthread.h>
 #include "io_lib/os.h"
 #include "io_lib/xalloc.h"
 #ifdef TRACE_ARCHIVE
@@ -205,13 +206,271 @@ char *tokenise_search_path(char *searchpath) {
     return newsearch;
 }
 
+/*
+ * Cache of open HASH=, SRF= and TAR= archive handles, shared between
+ * threads and keyed by archive path.  This avoids reopening an archive
+ * and rereading its index for every trace looked up in it.
+ *
+ * The list is kept in most recently used order.  Each handle has its own
+ * lock held while it is in use, as the underlying FILE is seeked; the
+ * global handle_lock only protects the list itself and the refs counts.
+ * Handles in use are never evicted.
+ */
+#define HANDLE_CACHE_SIZE 16
+
+enum handle_type {
+    HANDLE_HASH,
+    HANDLE_SRF,
+    HANDLE_TAR
+};
+
+/* A tar file and the name to offset mapping from its .index, if any */
+typedef struct {
+    FILE *fp;
+    HashTable *index;
+} tar_handle;
+
+typedef struct archive_handle {
+    char *path;
+    enum handle_type type;
+    void *h;			/* HashFile, srf_t or tar_handle */
+    int refs;			/* number of users */
+    pthread_mutex_t lock;	/* held while h is in use */
+    struct archive_handle *prev, *next;
+} archive_handle;
+
+static pthread_mutex_t handle_lock = PTHREAD_MUTEX_INITIALIZER;
+static archive_handle *handle_head = NULL, *handle_tail = NULL;
+static int handle_count = 0;
+static int handle_max = HANDLE_CACHE_SIZE;
+
+static void *tar_handle_open(char *tarname) {
+    char path[PATH_MAX+101];
+    tar_handle *t;
+
+    if (NULL == (t = calloc(1, sizeof(*t))))
+	return NULL;
+
+    if (NULL == (t->fp = fopen(tarname, "rb"))) {
+	free(t);
+	return NULL;
+    }
+
+    /*
+     * Load the .index file, a list of "offset name" lines.  It is keyed on
+     * the name less any compression extension, once per extension it could
+     * have, and the first line in the file wins.
+     */
+    sprintf(path, "%.*s.index", PATH_MAX, tarname);
+    if (file_exists(path)) {
+	int num_magics = sizeof(magics) / sizeof(*magics);
+	FILE *fpind = fopen(path, "r");
+	char *cp;
+
+	if (fpind) {
+	    t->index = HashTableCreate(1024, HASH_DYNAMIC_SIZE |
+				       HASH_POOL_ITEMS);
+	    while (t->index && fgets(path, PATH_MAX+100, fpind)) {
+		HashData hd;
+		int i, len;
+
+		if ((cp = strchr(path, '\n')))
+		    *cp = 0;
+		hd.i = strtol(path, &cp, 10);
+		while (isspace(*cp))
+		    cp++;
+		len = strlen(cp);
+		for (i = 0; i < num_magics; i++) {
+		    int mlen = strlen(magics[i]);
+		    if (len > mlen && strcmp(cp + len - mlen, magics[i]) == 0)
+			HashTableAdd(t->index, cp, len - mlen, hd, NULL);
+		}
+	    }
+	    fclose(fpind);
+	}
+    }
+
+    return t;
+}
+
+static void tar_handle_close(tar_handle *t) {
+    if (t->index)
+	HashTableDestroy(t->index, 0);
+    fclose(t->fp);
+    free(t);
+}
+
+static void *hash_handle_open(char *hashfile) {
+    HashFile *hf = HashFileOpen(hashfile);
+
+    /* Query in place where possible; falls back to stdio otherwise */
+    if (hf)
+	HashFileMmap(hf);
+
+    return hf;
+}
+
+#ifndef SAMTOOLS
+static void *srf_handle_open(char *srffile) {
+    return srf_open(srffile, "r");
+}
+#endif
+
+static void handle_close(archive_handle *a) {
+    switch (a->type) {
+    case HANDLE_HASH:
+	HashFileDestroy((HashFile *)a->h);
+	break;
+    case HANDLE_SRF:
+#ifndef SAMTOOLS
+	srf_destroy((srf_t *)a->h, 1);
+#endif
+	break;
+    case HANDLE_TAR:
+	tar_handle_close((tar_handle *)a->h);
+	break;
+    }
+
+    pthread_mutex_destroy(&a->lock);
+    free(a->path);
+    free(a);
+}
+
+/* List manipulation; called with handle_lock held */
+static void handle_unlink(archive_handle *a) {
+    if (a->prev)
+	a->prev->next = a->next;
+    else
+	handle_head = a->next;
+    if (a->next)
+	a->next->prev = a->prev;
+    else
+	handle_tail = a->prev;
+    a->prev = a->next = NULL;
+}
+
+static void handle_push(archive_handle *a) {
+    a->prev = NULL;
+    a->next = handle_head;
+    if (handle_head)
+	handle_head->prev = a;
+    else
+	handle_tail = a;
+    handle_head = a;
+}
+
+/*
+ * Closes least recently used handles not in use until at most 'max'
+ * remain.  Called with handle_lock held.
+ */
+static void handle_evict(int max) {
+    archive_handle *a, *prev;
+
+    for (a = handle_tail; a && handle_count > max; a = prev) {
+	prev = a->prev;
+	if (a->refs)
+	    continue;
+	handle_unlink(a);
+	handle_count--;
+	handle_close(a);
+    }
+}
+
+/*
+ * Returns the handle for archive 'path', opening it with open_func if
+ * it is not already cached.  The handle is locked for our exclusive use
+ * and must be given back with handle_release().
+ *
+ * Returns archive_handle pointer on success
+ *         NULL on failure to open.
+ */
+static archive_handle *handle_acquire(char *path, enum handle_type type,
+				      void *(*open_func)(char *)) {
+    archive_handle *a, *b;
+
+    pthread_mutex_lock(&handle_lock);
+    for (a = handle_head; a; a = a->next)
+	if (a->type == type && strcmp(a->path, path) == 0)
+	    break;
+    if (a) {
+	handle_unlink(a);
+	handle_push(a);
+	a->refs++;
+	pthread_mutex_unlock(&handle_lock);
+	pthread_mutex_lock(&a->lock);
+	return a;
+    }
+    pthread_mutex_unlock(&handle_lock);
+
+    /* Open without holding the cache lock, as this may be slow */
+    if (NULL == (a = calloc(1, sizeof(*a))))
+	return NULL;
+    if (NULL == (a->path = strdup(path)) ||
+	NULL == (a->h = open_func(path))) {
+	free(a->path);
+	free(a);
+	return NULL;
+    }
+    a->type = type;
+    a->refs = 1;
+    pthread_mutex_init(&a->lock, NULL);
+
+    pthread_mutex_lock(&handle_lock);
+
+    /* Another thread may have opened it while we were unlocked */
+    for (b = handle_head; b; b = b->next)
+	if (b->type == type && strcmp(b->path, path) == 0)
+	    break;
+    if (b) {
+	handle_unlink(b);
+	handle_push(b);
+	b->refs++;
+	pthread_mutex_unlock(&handle_lock);
+	handle_close(a);
+	pthread_mutex_lock(&b->lock);
+	return b;
+    }
+
+    handle_push(a);
+    handle_count++;
+    handle_evict(handle_max);
+    pthread_mutex_unlock(&handle_lock);
+
+    pthread_mutex_lock(&a->lock);
+    return a;
+}
+
+static void handle_release(archive_handle *a) {
+    pthread_mutex_unlock(&a->lock);
+
+    pthread_mutex_lock(&handle_lock);
+    a->refs--;
+    if (handle_count > handle_max)
+	handle_evict(handle_max);
+    pthread_mutex_unlock(&handle_lock);
+}
+
+void iolib_set_handle_cache_size(int n) {
+    pthread_mutex_lock(&handle_lock);
+    handle_max = n > 0 ? n : 0;
+    handle_evict(handle_max);
+    pthread_mutex_unlock(&handle_lock);
+}
+
+void iolib_flush_handle_cache(void) {
+    pthread_mutex_lock(&handle_lock);
+    handle_evict(0);
+    pthread_mutex_unlock(&handle_lock);
+}
+
 /*
  * Searches for file in the tar pointed to by tarname. If it finds it, it
  * copies it out and returns a file pointer to the temporary file,
  * otherwise we return NULL.
  *
  * If 'tarname'.index exists we will use this as a fast lookup method,
- * otherwise we just do a sequential search through the tar.
+ * otherwise we just do a sequential search through the tar.  Both the
+ * open tar and its loaded index are kept in the handle cache.
  *
  * Offset specifies a starting search position. Set this to zero if you want
  * to search through the entire tar file, otherwise set it to the byte offset
@@ -223,55 +482,35 @@ char *tokenise_search_path(char *searchpath) {
  */
 static mFILE *find_file_tar(char *file, char *tarname, size_t offset) {
     int num_magics = sizeof(magics) / sizeof(*magics);
-    char path[PATH_MAX+101];
+    archive_handle *a;
+    tar_handle *t;
     FILE *fp;
     tar_block blk;
     int size;
     int name_len = strlen(file);
+    mFILE *mf = NULL;
 
     /* Maximum name length for a tar file */
     if (name_len > 100)
 	return NULL;
 
+    if (NULL == (a = handle_acquire(tarname, HANDLE_TAR, tar_handle_open)))
+	return NULL;
+    t = (tar_handle *)a->h;
+    fp = t->fp;
+
     /* Search the .index file */
-    sprintf(path, "%s.index", tarname);
-    if (file_exists(path)) {
-	FILE *fpind = fopen(path, "r");
-	char *cp;
-	int tmp_off;
-	int found = 0;
-	
-	if (fpind) {
-	    while (fgets(path, PATH_MAX+100, fpind)) {
-		if ((cp = strchr(path, '\n')))
-		    *cp = 0;
-		tmp_off = strtol(path, &cp, 10);
-		while (isspace(*cp))
-		    cp++;
-		if (strncmp(cp, file, name_len) == 0) {
-		    int i;
-		    for (i = 0; i < num_magics; i++) {
-			if (strcmp(&cp[name_len], magics[i]) == 0) {
-			    offset = tmp_off;
-			    found = 1;
-			    break;
-			}
-		    }
-		    if (found)
-			break;
-		}
-	    }
-	    fclose(fpind);
+    if (t->index) {
+	HashItem *hi = HashTableSearch(t->index, file, name_len);
 
-	    /* Not in index */
-	    if (!found)
-		return NULL;
+	/* Not in index */
+	if (!hi) {
+	    handle_release(a);
+	    return NULL;
 	}
+	offset = hi->data.i;
     }
 
-    if (NULL == (fp = fopen(tarname, "rb")))
-	return NULL;
-
     /*
      * Search through the tar file (starting from index position) looking
      * for our filename. If there was no index then we start from position 0.
@@ -300,19 +539,20 @@ static mFILE *find_file_tar(char *file, char *tarname, size_t offset) {
 
 	    /* Found it - copy out the data to an mFILE */
 	    if (NULL == (data = (char *)malloc(size)))
-		return NULL;
+		break;
 	    if (size != fread(data, 1, size, fp)) {
 		free(data);
-		return NULL;
+		break;
 	    }
-	    return mfcreate(data, size);
+	    mf = mfcreate(data, size);
+	    break;
 	}
 
 	fseek(fp, TBLOCK*((size+TBLOCK-1)/TBLOCK), SEEK_CUR);
     }
 
-    fclose(fp);
-    return NULL;
+    handle_release(a);
+    return mf;
 }
 
 /*
@@ -327,23 +567,17 @@ static mFILE *find_file_tar(char *file, char *tarname, size_t offset) {
  */
 static mFILE *find_file_hash(char *file, char *hashfile) {
     size_t size;
-    static HashFile *hf = NULL;
-    static char hf_name[1024];
+    archive_handle *a;
     char *data;
 
-    /* Cache an open HashFile for fast accesing */
-    if (strcmp(hashfile, hf_name) != 0) {
-	if (hf)
-	    HashFileDestroy(hf);
-	hf = HashFileOpen(hashfile);
-
-	if (!hf)
-	    return NULL;
-	strcpy(hf_name, hashfile);
-    }
+    if (NULL == (a = handle_acquire(hashfile, HANDLE_HASH, hash_handle_open)))
+	return NULL;
 
     /* Search */
-    if (NULL == (data = HashFileExtract(hf, file, &size)))
+    data = HashFileExtract((HashFile *)a->h, file, &size);
+    handle_release(a);
+
+    if (!data)
 	return NULL;
 
     /* Found, so copy the contents to a fake FILE pointer */
@@ -358,30 +592,30 @@ static mFILE *find_file_hash(char *file, char *hashfile) {
  *        NULL if not
  */
 static mFILE *find_file_srf(char *tname, char *srffile) {
+    archive_handle *a;
     srf_t *srf;
     uint64_t cpos, hpos, dpos;
     mFILE *mf = NULL;
     char *cp;
 
-    if (NULL == (srf = srf_open(srffile, "r")))
+    if (NULL == (a = handle_acquire(srffile, HANDLE_SRF, srf_handle_open)))
 	return NULL;
+    srf = (srf_t *)a->h;
 
     if (NULL != (cp = strrchr(tname, '/')))
     	tname = cp+1;
 
     if (0 == srf_find_trace(srf, tname, &cpos, &hpos, &dpos)) {
 	char *data = malloc(srf->th.trace_hdr_size + srf->tb.trace_size);
-	if (!data) {
-	    srf_destroy(srf, 1);
-	    return NULL;
+	if (data) {
+	    memcpy(data, srf->th.trace_hdr, srf->th.trace_hdr_size);
+	    memcpy(data + srf->th.trace_hdr_size,
+		   srf->tb.trace, srf->tb.trace_size);
+	    mf = mfcreate(data, srf->th.trace_hdr_size + srf->tb.trace_size);
 	}
-	memcpy(data, srf->th.trace_hdr, srf->th.trace_hdr_size);
-	memcpy(data + srf->th.trace_hdr_size,
-	       srf->tb.trace, srf->tb.trace_size);
-	mf = mfcreate(data, srf->th.trace_hdr_size + srf->tb.trace_size);
     }
 
-    srf_destroy(srf, 1);
+    handle_release(a);
     return mf;
 }
 #endif
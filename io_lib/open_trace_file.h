@@ -137,6 +137,18 @@ char *iolib_get_trace_path(void);
 void  iolib_set_exp_path  (char *path);
 char *iolib_get_exp_path  (void);
 
+/*
+ * Sets the maximum number of HASH=, SRF= and TAR= archives kept open
+ * between lookups (default 16).  Zero disables the cache.
+ * Handles are shared between threads and closed least recently used first.
+ */
+void  iolib_set_handle_cache_size(int n);
+
+/*
+ * Closes all cached archive handles not currently in use.
+ */
+void  iolib_flush_handle_cache(void);
+
 #ifdef __cplusplus
 }
 #endif
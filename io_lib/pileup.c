@@ -0,0 +1,1144 @@
+/*
+ * Copyright (c) 2013 Genome Research Ltd.
+ * Author(s): James Bonfield
+ * 
+ * Redistribution and use in source and binary forms, with or without 
+ * modification, are permitted provided that the following conditions are met:
+ * 
+ *    1. Redistributions of source code must retain the above copyright notice,
+ *       this list of conditions and the following disclaimer.
+ * 
+ *    2. Redistributions in binary form must reproduce the above
+ *       copyright notice, this list of conditions and the following
+ *       disclaimer in the documentation and/or other materials provided
+ *       with the distribution.
+ * 
+ *    3. Neither the names Genome Research Ltd and Wellcome Trust Sanger
+ *    Institute nor the names of its contributors may be used to endorse
+ *    or promote products derived from this software without specific
+ *    prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY GENOME RESEARCH LTD AND CONTRIBUTORS "AS
+ * IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+ * TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL GENOME RESEARCH
+ * LTD OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Author: James Bonfield, Wellcome Trust Sanger Institute. 2011-2013
+ *
+ * A pileup iterator, turning a sorted stream of alignments into columns
+ * of bases.  Originally part of the scram_pileup program.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "io_lib_config.h"
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <unistd.h>
+#include <pthread.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "io_lib/pileup.h"
+
+/*
+ * START_WITH_DEL is the mode that Gap5 uses when building this. It prepends
+ * all cigar strings with 1D and decrements the position by one. (And then
+ * has code to reverse this operation in the pileup handler.)
+ *
+ * The reason for this is that it means reads starting with an insertion work.
+ * Otherwise the inserted bases are silently lost. (Try it with "samtools
+ * mpileup" and you can see it has the same issue.)
+ *
+ * However it's probably not want most people expect.
+ */
+//#define START_WITH_DEL
+
+/* --------------------------------------------------------------------------
+ * The pileup code itself. 
+ *
+ * This consists of the external pileup_loop() function, which takes a
+ * sam/bam samfile_t pointer and a callback function. The callback function
+ * is called once per column of aligned data (so once per base in an
+ * insertion).
+ *
+ * Current known issues.
+ * 1) zero length matches, ie 2S2S cause failures.
+ * 2) Insertions at starts of sequences get included in the soft clip, so
+ *    2S2I2M is treated as if it's 4S2M
+ * 3) From 1 and 2 above, 1S1I2S becomes 2S2S which fails.
+ */
+
+/*
+ * Fast conversion from encoded SAM base nibble to a printable character
+ */
+static char tab[256][2];
+static pthread_once_t tab_once = PTHREAD_ONCE_INIT;
+
+static void init_tab_once(void) {
+    int i, j;
+    unsigned char b2;
+
+    for (i = 0; i < 16; i++) {
+	for (j = 0; j < 16; j++) {
+	    b2 = (i<<4) | j;
+	    tab[b2][0] = "NACMGRSVTWYHKDBN"[i];
+	    tab[b2][1] = "NACMGRSVTWYHKDBN"[j];
+	}
+    }
+}
+
+/* Called from the tile worker threads too, hence pthread_once */
+static void init_tab(void) {
+    pthread_once(&tab_once, init_tab_once);
+}
+
+
+/*
+ * Fetches the next base => the nth base at unpadded position pos. (Nth can
+ * be greater than 0 if we have an insertion in this column). Do not call this
+ * with pos/nth lower than the previous query, although higher is better.
+ * (This allows it to be initialised at base 0.)
+ *
+ * Stores the result in base and also updates is_insert to indicate that
+ * this sequence still has more bases in this position beyond the current
+ * nth parameter.
+ *
+ * Returns 1 if a base was fetched
+ *         0 if not (eg ran off the end of sequence)
+ */
+static int get_next_base(pileup_t *p, int pos, int nth, int *is_insert) {
+    bam_seq_t *b = p->b;
+    enum cigar_op op = p->cigar_op;
+
+    if (p->first_del && op != BAM_CPAD)
+	p->first_del = 0;
+
+    *is_insert = 0;
+
+    /* Find pos first */
+    while (p->pos < pos) {
+	p->nth = 0;
+
+	if (p->cigar_len == 0) {
+	    if (p->cigar_ind >= bam_cigar_len(b)) {
+		p->eof = 1;
+		return 0;
+	    }
+
+	    op=p->cigar_op  = p->b_cigar[p->cigar_ind] & BAM_CIGAR_MASK;
+	    p->cigar_len = p->b_cigar[p->cigar_ind] >> BAM_CIGAR_SHIFT;
+	    p->cigar_ind++;
+	}
+	
+	if ((op == BAM_CMATCH ||
+	     op == BAM_CBASE_MATCH ||
+	     op == BAM_CBASE_MISMATCH) && p->cigar_len <= pos - p->pos) {
+	    p->seq_offset += p->cigar_len;
+	    p->pos += p->cigar_len;
+	    p->cigar_len = 0;
+	} else {
+	    switch (op) {
+	    case BAM_CMATCH:
+	    case BAM_CBASE_MATCH:
+	    case BAM_CBASE_MISMATCH:
+		p->seq_offset++;
+		/* Fall through */
+	    case BAM_CDEL:
+	    case BAM_CREF_SKIP:
+		p->pos++;
+		p->cigar_len--;
+		break;
+
+	    case BAM_CINS:
+	    case BAM_CSOFT_CLIP:
+		p->seq_offset += p->cigar_len;
+		/* Fall through */
+	    case BAM_CPAD:
+	    case BAM_CHARD_CLIP:
+		p->cigar_len = 0;
+		break;
+
+	    default:
+		fprintf(stderr, "Unhandled cigar_op %d\n", op);
+		return -1;
+	    }
+	}
+    }
+
+    /* Now at pos, find nth base */
+    while (p->nth < nth) {
+	if (p->cigar_len == 0) {
+	    if (p->cigar_ind >= bam_cigar_len(b)) {
+		p->eof = 1;
+		return 0; /* off end of seq */
+	    }
+
+	    op=p->cigar_op  = p->b_cigar[p->cigar_ind] & BAM_CIGAR_MASK;
+	    p->cigar_len = p->b_cigar[p->cigar_ind] >> BAM_CIGAR_SHIFT;
+	    p->cigar_ind++;
+	}
+
+	switch (op) {
+	case BAM_CMATCH:
+	case BAM_CBASE_MATCH:
+	case BAM_CBASE_MISMATCH:
+	case BAM_CSOFT_CLIP:
+	case BAM_CDEL:
+	case BAM_CREF_SKIP:
+	    goto at_nth; /* sorry, but it's fast! */
+
+	case BAM_CINS:
+	    p->seq_offset++;
+	    /* Fall through */
+	case BAM_CPAD:
+	    p->cigar_len--;
+	    p->nth++;
+	    break;
+
+	case BAM_CHARD_CLIP:
+	    p->cigar_len = 0;
+	    break;
+
+	default:
+	    fprintf(stderr, "Unhandled cigar_op %d\n", op);
+	    return -1;
+	}
+    }
+ at_nth:
+
+    /* Fill out base & qual fields */
+    p->ref_skip = 0;
+    if (p->nth < nth && op != BAM_CINS) {
+	//p->base = '-';
+	p->base = '*';
+	p->padding = 1;
+	if (p->seq_offset < b->len)
+	    p->qual = (p->qual + p->b_qual[p->seq_offset+1])/2;
+	else
+	    p->qual = 0;
+    } else {
+	p->padding = 0;
+	switch(op) {
+	case BAM_CDEL:
+	    p->base = '*';
+	    if (p->seq_offset+1 < b->len)
+		p->qual = (p->qual + p->b_qual[p->seq_offset+1])/2;
+	    else
+		p->qual = (p->qual + p->b_qual[p->seq_offset])/2;
+	    break;
+
+	case BAM_CPAD:
+	    //p->base = '+';
+	    p->base = '*';
+	    if (p->seq_offset+1 < b->len)
+		p->qual = (p->qual + p->b_qual[p->seq_offset+1])/2;
+	    else
+		p->qual = (p->qual + p->b_qual[p->seq_offset])/2;
+	    break;
+
+	case BAM_CREF_SKIP:
+	    p->base = '.';
+	    p->qual = 0;
+	    /* end of fragment, but not sequence */
+	    p->eof = p->eof ? 2 : 3;
+	    p->ref_skip = 1;
+	    break;
+
+	default:
+	    if (p->seq_offset < b->len) {
+		p->qual = p->b_qual[p->seq_offset];
+	    /*
+	     * If you need to label inserted bases as different from
+	     * (mis)matching bases then this is where we'd make that change.
+	     * The reason could be to allow the consensus algorithm to easily
+	     * distinguish between reference bases and non-reference bases.
+	     *
+	     * Eg:
+	     * if (nth)
+	     *     p->base = tolower(tab[p->b_seq[p->seq_offset/2]][p->seq_offset&1]);
+	     * else
+	     */
+		p->base = tab[p->b_seq[p->seq_offset/2]][p->seq_offset&1];
+	    } else {
+		p->base = 'N';
+		p->qual = 0xff;
+	    }
+		
+	    break;
+	}
+    }
+
+    /* Handle moving out of N (skip) into sequence again */
+    if (p->eof && p->base != '.') {
+	p->start = 1;
+	p->ref_skip = 1;
+	p->eof = 0;
+    }
+
+    /* Starting with an indel needs a minor fudge */
+    if (p->start && p->cigar_op == BAM_CDEL) {
+	p->first_del = 1;
+    }
+
+    /* Check if next op is an insertion of some sort */
+    if (p->cigar_len == 0) {
+	if (p->cigar_ind < bam_cigar_len(b)) {
+	    op=p->cigar_op  = p->b_cigar[p->cigar_ind] & BAM_CIGAR_MASK;
+	    p->cigar_len = p->b_cigar[p->cigar_ind] >> BAM_CIGAR_SHIFT;
+	    p->cigar_ind++;
+	    if (op == BAM_CREF_SKIP) {
+		p->eof = 3;
+		p->ref_skip = 1;
+	    }
+	} else {
+	    p->eof = 1;
+	}
+    }
+
+    switch (op) {
+    case BAM_CPAD:
+    case BAM_CINS:
+	*is_insert = p->cigar_len;
+	break;
+
+    case BAM_CSOFT_CLIP:
+	/* Last op 'S' => eof */
+        p->eof = (p->cigar_ind == bam_cigar_len(b) ||
+		  (p->cigar_ind+1 == bam_cigar_len(b) &&
+		   (p->b_cigar[p->cigar_ind] & BAM_CIGAR_MASK)
+		   == BAM_CHARD_CLIP))
+	    ? 1
+	    : 0;
+	break;
+
+    case BAM_CHARD_CLIP:
+	p->eof = 1;
+	break;
+
+    default:
+	break;
+    }
+    
+    return 1;
+}
+
+/*
+ * Loops through the alignments in a region producing columns of data.
+ * When found, it calls func with clientdata as a callback. Func should
+ * return 0 for success and non-zero for failure. seq_init() is called
+ * on each new entry before we start processing it. It should return 0 or 1
+ * to indicate reject or accept status (eg to filter unmapped data).
+ * If seq_init() returns -1 we abort the pileup_loop with an error.
+ * seq_init may be NULL.
+ *
+ * The region is inclusive and 1-based.  A NULL region, or a refid < 0,
+ * consumes all data.  Columns outside of the region are not passed to
+ * seq_add(), but sequences overlapping the region start are still
+ * tracked from their own start so columns within it are complete.  If
+ * fp is CRAM with an index loaded we seek directly to the region;
+ * otherwise the file is read from the current position.
+ *
+ * Returns 0 on success
+ *        -1 on failure
+ */
+int pileup_region(scram_fd *fp, cram_range *range,
+		  int (*seq_init)(void *client_data,
+				  scram_fd *fp,
+				  pileup_t *p),
+		  int (*seq_add)(void *client_data,
+				 scram_fd *fp,
+				 pileup_t *p,
+				 int depth,
+				 int pos,
+				 int nth,
+				 int is_insert),
+		  void *client_data) {
+    int ret = -1;
+    pileup_t *phead = NULL, *p, *pfree = NULL, *last, *next, *ptail = NULL;
+    pileup_t *pnew = NULL;
+    int is_insert, nth = 0;
+    int col = 0, r;
+    int last_ref = -1;
+    int refid = -1, start = INT_MIN, end = INT_MAX;
+
+    if (range && range->refid >= 0) {
+	refid = range->refid;
+	start = range->start;
+	end   = range->end;
+
+	if (!fp->is_bam && fp->c->index &&
+	    scram_set_option(fp, CRAM_OPT_RANGE, range))
+	    return -1;
+    }
+
+    init_tab();
+    if (NULL == (pnew = calloc(1, sizeof(*p))))
+	return -1;
+    
+    do {
+	bam_seq_t *b;
+	int pos, last_in_contig;
+
+	r = scram_next_seq(fp, &pnew->b);
+	if (r == -1) {
+	    //fprintf(stderr, "bam_next_seq() failure on line %d\n", fp->line);
+	    if (!scram_eof(fp)) {
+		fprintf(stderr, "bam_next_seq() failure.\n");
+		goto error;
+	    }
+	}
+
+	b = pnew->b;
+
+	/* Force realloc */
+	//fp->bs = NULL;
+	//fp->bs_size = 0;
+
+	//r = samread(fp, pnew->b);
+	if (r >= 0) {
+	    if (bam_flag(b) & BAM_FUNMAP)
+		continue;
+	    
+	    if (b->ref == -1) {
+		/* Another indicator for unmapped */
+		continue;
+	    } else if (refid >= 0 && b->ref < refid) {
+		continue;
+	    }
+
+	    if (refid >= 0 && (b->ref > refid || b->pos+1 > end)) {
+		/* Beyond the region, so flush as if at EOF */
+		r = -1;
+		last_in_contig = 1;
+		pos = col+1;
+	    } else if (b->ref == last_ref) {
+		pos = b->pos+1;
+		//printf("New seq at pos %d @ %d %s\n", pos, b->ref,
+		//       bam_name(b));
+		last_in_contig = 0;
+	    } else {
+		//printf("New ctg at pos %d @ %d\n",b->pos+1,b->ref);
+		pos = (b->pos > col ? b->pos : col)+1;
+		last_in_contig = 1;
+	    }
+	} else {
+	    last_in_contig = 1;
+	    pos = col+1;
+	}
+
+	if (col > pos) {
+	    fprintf(stderr, "BAM/SAM file is not sorted by position. "
+		    "Aborting\n");
+	    goto error;
+	}
+
+	/* Process data between the last column and our latest addition */
+	while (col < pos && phead) {
+	    int v, ins, depth = 0, cpos;
+
+#ifdef START_WITH_DEL
+	    cpos = col-1;
+#else
+	    cpos = col;
+#endif
+	    if (cpos > end)
+		goto done;
+
+	    //printf("Col=%d pos=%d nth=%d\n", col, pos, nth);
+
+	    /* Pileup */
+	    is_insert = 0;
+	    for (p = phead; p; p = p->next) {
+		if (!get_next_base(p, col, nth, &ins))
+		    p->eof = 1;
+
+		if (is_insert < ins)
+		    is_insert = ins;
+		
+		depth++;
+	    }
+
+	    /* Call our function on phead linked list */
+	    v = cpos >= start
+		? seq_add(client_data, fp, phead, depth, cpos, nth, is_insert)
+		: 0;
+
+	    /* Remove dead seqs */
+	    for (p = phead, last = NULL; p; p = next) {
+		next = p->next;
+		
+		p->start = 0;
+		if (p->eof == 1) {
+		    if (last)
+			last->next = p->next;
+		    else
+			phead = p->next;
+
+		    p->next = pfree;
+		    pfree = p;
+		    
+		    //printf("Del seq %s at pos %d\n", bam_name(p->b), col);
+		} else {
+		    last = p;
+		}
+	    }
+	    if ((ptail = last) == NULL)
+		ptail = phead;
+
+	    if (v == 1)
+		break; /* early abort */
+	    
+	    if (v != 0)
+		goto error;
+
+	    /* Next column */
+	    if (is_insert) {
+		nth++;
+	    } else {
+		nth = 0;
+		col++;
+	    }
+
+	    /* Special case for the last sequence in a contig */
+	    if (last_in_contig && phead)
+		pos++;
+	}
+
+	/* May happen if we have a hole in the contig */
+	col = pos;
+
+	/* New contig */
+	if (b && b->ref != last_ref) {
+	    last_ref = b->ref;
+	    pos = b->pos+1;
+	    nth = 0;
+	    col = pos;
+	}
+
+	/*
+	 * Add this seq.
+	 * Note: cigars starting with I or P ops (eg 2P3I10M) mean we have
+	 * alignment instructions that take place before the designated
+	 * starting location listed in the SAM file. They won't get included
+	 * in the callback function until they officially start, which is
+	 * already too late.
+	 *
+	 * So to workaround this, we prefix all CIGAR with 1D, move the
+	 * position by 1bp, and then force the callback code to remove
+	 * leaving pads (either P or D generated).
+	 *
+	 * Ie it's a level 10 hack!
+	 */
+	if (r >= 0) {
+	    p = pnew;
+	    p->next       = NULL;
+	    p->cd         = NULL;
+	    p->start      = 1;
+	    p->eof        = 0;
+#ifdef START_WITH_DEL
+	    p->pos        = pos-1;
+	    p->cigar_ind  = 0;
+	    p->b_cigar    = bam_cigar(p->b);
+	    if ((p->b_cigar[0] & BAM_CIGAR_MASK) == BAM_CHARD_CLIP) {
+		p->cigar_len  = p->b_cigar[0] >> BAM_CIGAR_SHIFT;
+		p->cigar_op   = BAM_CHARD_CLIP;
+		if ((p->b_cigar[1] & BAM_CIGAR_MASK) == BAM_CSOFT_CLIP) {
+		    /* xHxS... => xHxS1D... */
+		    p->b_cigar[0] = p->b_cigar[1];
+		    p->b_cigar[1] = (1 << BAM_CIGAR_SHIFT) | BAM_CDEL;
+		} else {
+		    /* xH... => xH1D... */
+		    p->b_cigar[0] = (1 << BAM_CIGAR_SHIFT) | BAM_CDEL;
+		}
+	    } else {
+		if ((p->b_cigar[0] & BAM_CIGAR_MASK) == BAM_CSOFT_CLIP) {
+		    /* xS... => xS1D... */
+		    p->cigar_len  = p->b_cigar[0] >> BAM_CIGAR_SHIFT;
+		    p->cigar_op   = BAM_CSOFT_CLIP;
+		    p->b_cigar[0] = (1 << BAM_CIGAR_SHIFT) | BAM_CDEL;
+		} else {
+		    /* ... => 1D... */
+		    p->cigar_len  = 1;        /* was  0  */
+		    p->cigar_op   = BAM_CDEL; /* was 'X' */
+		}
+	    }
+	    p->seq_offset = -1;
+	    p->first_del  = 1;
+#else
+	    p->pos        = pos-1;
+	    p->cigar_ind  = 0;
+	    p->b_cigar    = bam_cigar(p->b);
+	    p->cigar_len  = 0;
+	    p->cigar_op   = -1;
+	    p->seq_offset = -1;
+	    p->first_del  = 0;
+#endif
+	    p->b_strand   = bam_strand(p->b) ? 1 : 0;
+	    p->b_qual     = (uc *)bam_qual(p->b);
+	    p->b_seq      = (uc *)bam_seq(p->b);
+
+	    if (seq_init) {
+		int v;
+		v = seq_init(client_data, fp, p);
+		if (v == -1)
+		    goto error;
+		
+		if (v == 1) {
+		    /* Keep this seq */
+		    if (phead) {
+			ptail->next = p;
+		    } else {
+			phead = p;
+		    }
+		    ptail = p;
+		} else {
+		    /* Push back on free list */
+		    p->next = pfree;
+		    pfree = p;
+		}
+	    } else {
+		if (phead)
+		    ptail->next = p;
+		else
+		    phead = p;
+		ptail = p;
+	    }
+
+	    /* Allocate the next pileup rec */
+	    if (pfree) {
+		pnew = pfree;
+		pfree = pfree->next;
+	    } else {
+		if (NULL == (pnew = calloc(1, sizeof(*pnew))))
+		    goto error;
+	    }
+	}
+    } while (r >= 0);
+
+ done:
+    ret = 0;
+ error:
+
+    if (pnew) {
+	free(pnew->b);
+	free(pnew);
+    }
+
+    /* Tidy up */
+    for (p = pfree; p; p = next) {
+	next = p->next;
+	free(p->b);
+	free(p);
+    }
+
+    /* Sequences still active when stopping at the region end */
+    for (p = phead; p; p = next) {
+	next = p->next;
+	free(p->b);
+	free(p);
+    }
+
+    return ret;
+}
+
+/*
+ * Loops through all alignments in fp producing columns of data.
+ * See pileup_region() for details.
+ *
+ * Returns 0 on success
+ *        -1 on failure
+ */
+int pileup_loop(scram_fd *fp,
+		int (*seq_init)(void *client_data,
+				scram_fd *fp,
+				pileup_t *p),
+		int (*seq_add)(void *client_data,
+			       scram_fd *fp,
+			       pileup_t *p,
+			       int depth,
+			       int pos,
+			       int nth,
+			       int is_insert),
+		void *client_data) {
+    return pileup_region(fp, NULL, seq_init, seq_add, client_data);
+}
+
+
+/* --------------------------------------------------------------------------
+ * Read depth without building pileup columns.
+ *
+ * Only the position and CIGAR of each sequence are needed, so for CRAM we
+ * avoid decoding anything else.  Each aligned block of a sequence adds +1
+ * at its start and -1 beyond its end in a difference array covering a
+ * window of the reference.  When the sequences move past the window, or
+ * past all the data in it, a prefix sum turns it into depths which are
+ * handed to the callback.
+ * Block ends beyond the window are held in a spill list until the window
+ * reaches them.
+ */
+
+#define DEPTH_WINDOW 65536
+
+typedef struct {
+    int pos;
+    int delta;
+} depth_event;
+
+typedef struct {
+    int32_t *diff;        // DEPTH_WINDOW differences from wstart onwards
+    int wstart;           // 1-based reference position of diff[0]
+    int wend;             // one beyond the last position with data
+    int32_t carry;        // depth at wstart-1
+
+    depth_event *spill;   // events at or beyond wstart+DEPTH_WINDOW
+    int nspill, aspill;
+} depth_win;
+
+/*
+ * Replaces d[0..len-1] with its running total plus carry, returning the
+ * final depth.
+ */
+static int32_t depth_prefix_sum(int32_t *d, int len, int32_t carry) {
+    int i = 0;
+
+#ifdef __SSE2__
+    __m128i c = _mm_set1_epi32(carry);
+    for (; i+4 <= len; i += 4) {
+	__m128i x = _mm_loadu_si128((__m128i *)&d[i]);
+	x = _mm_add_epi32(x, _mm_slli_si128(x, 4));
+	x = _mm_add_epi32(x, _mm_slli_si128(x, 8));
+	x = _mm_add_epi32(x, c);
+	_mm_storeu_si128((__m128i *)&d[i], x);
+	c = _mm_shuffle_epi32(x, _MM_SHUFFLE(3,3,3,3));
+    }
+    carry = _mm_cvtsi128_si32(c);
+#endif
+
+    for (; i < len; i++)
+	d[i] = carry += d[i];
+
+    return carry;
+}
+
+static int depth_event_add(depth_win *w, int pos, int delta) {
+    if (pos < w->wstart + DEPTH_WINDOW) {
+	w->diff[pos - w->wstart] += delta;
+	return 0;
+    }
+
+    if (w->nspill == w->aspill) {
+	int alloc = w->aspill ? w->aspill*2 : 256;
+	depth_event *e = realloc(w->spill, alloc * sizeof(*e));
+	if (!e)
+	    return -1;
+	w->spill = e;
+	w->aspill = alloc;
+    }
+    w->spill[w->nspill].pos = pos;
+    w->spill[w->nspill].delta = delta;
+    w->nspill++;
+
+    return 0;
+}
+
+/*
+ * Called when everything before position 'to' is final.  Emits the window
+ * once it is either full or holds all the data pending, and then moves it
+ * along.  Once there is no more data the window jumps straight to 'to'.
+ */
+static int depth_advance(depth_win *w, scram_fd *fp, int ref, int to,
+			 int (*depth_add)(void *client_data,
+					  scram_fd *fp,
+					  int ref,
+					  int pos,
+					  int32_t *depth,
+					  int len),
+			 void *client_data) {
+    while (w->wstart < to) {
+	int i, j, len;
+
+	if (w->wstart >= w->wend) {
+	    w->wstart = w->wend = to;
+	    w->carry = 0;
+	    return 0;
+	}
+
+	if (to < w->wend && to < w->wstart + DEPTH_WINDOW)
+	    return 0;
+
+	len = MIN(DEPTH_WINDOW, w->wend - w->wstart);
+	w->carry = depth_prefix_sum(w->diff, len, w->carry);
+	if (depth_add(client_data, fp, ref, w->wstart, w->diff, len))
+	    return -1;
+
+	/* Includes the final -1s at wend, if within the window */
+	memset(w->diff, 0, MIN(len+1, DEPTH_WINDOW) * sizeof(int32_t));
+	w->wstart += len;
+	if (w->wstart == w->wend)
+	    w->carry = 0;
+
+	for (i = j = 0; i < w->nspill; i++) {
+	    if (w->spill[i].pos < w->wstart + DEPTH_WINDOW)
+		w->diff[w->spill[i].pos - w->wstart] += w->spill[i].delta;
+	    else
+		w->spill[j++] = w->spill[i];
+	}
+	w->nspill = j;
+    }
+
+    return 0;
+}
+
+/*
+ * Computes the depth of aligned sequences over a region, calling
+ * depth_add() with consecutive runs of per-base depths.  Depth counts
+ * M, =, X and D cigar operations; N (reference skips) is not covered.
+ * The runs passed may include zero depth positions in gaps between
+ * sequences, but large gaps are skipped.
+ *
+ * The region is as for pileup_region().  The depth array passed to
+ * depth_add() is only valid for the duration of the call.
+ *
+ * Returns 0 on success
+ *        -1 on failure
+ */
+int pileup_depth(scram_fd *fp, cram_range *range,
+		 int (*depth_add)(void *client_data,
+				  scram_fd *fp,
+				  int ref,
+				  int pos,
+				  int32_t *depth,
+				  int len),
+		 void *client_data) {
+    int refid = -1, start = INT_MIN, end = INT_MAX;
+    int last_ref = -1, last_pos = 0, ret = -1;
+    bam_seq_t *b = NULL;
+    depth_win w;
+
+    memset(&w, 0, sizeof(w));
+    if (!(w.diff = calloc(DEPTH_WINDOW, sizeof(*w.diff))))
+	return -1;
+
+    if (!fp->is_bam &&
+	scram_set_option(fp, CRAM_OPT_REQUIRED_FIELDS,
+			 SAM_FLAG | SAM_RNAME | SAM_POS | SAM_CIGAR))
+	goto error;
+
+    if (range && range->refid >= 0) {
+	refid = range->refid;
+	start = range->start;
+	end   = range->end;
+
+	if (!fp->is_bam && fp->c->index &&
+	    scram_set_option(fp, CRAM_OPT_RANGE, range))
+	    goto error;
+    }
+
+    for (;;) {
+	uint32_t *cig;
+	int i, ncig, rpos;
+
+	if (scram_next_seq(fp, &b) < 0) {
+	    if (!scram_eof(fp)) {
+		fprintf(stderr, "bam_next_seq() failure.\n");
+		goto error;
+	    }
+	    break;
+	}
+
+	if ((bam_flag(b) & BAM_FUNMAP) || b->ref == -1)
+	    continue;
+	if (refid >= 0 && b->ref < refid)
+	    continue;
+	if (refid >= 0 && (b->ref > refid || b->pos+1 > end))
+	    break;
+
+	if (b->ref != last_ref) {
+	    if (last_ref >= 0 &&
+		depth_advance(&w, fp, last_ref, INT_MAX, depth_add,
+			      client_data))
+		goto error;
+	    if (b->ref < last_ref) {
+		fprintf(stderr, "BAM/SAM file is not sorted by position. "
+			"Aborting\n");
+		goto error;
+	    }
+	    last_ref = b->ref;
+	    last_pos = 0;
+	    w.wstart = w.wend = MAX(b->pos+1, start);
+	    w.carry = 0;
+	} else if (b->pos+1 < last_pos) {
+	    fprintf(stderr, "BAM/SAM file is not sorted by position. "
+		    "Aborting\n");
+	    goto error;
+	}
+	last_pos = b->pos+1;
+
+	/* Everything before this sequence is now final */
+	if (depth_advance(&w, fp, last_ref, MAX(last_pos, start), depth_add,
+			  client_data))
+	    goto error;
+
+	cig  = bam_cigar(b);
+	ncig = bam_cigar_len(b);
+	for (rpos = last_pos, i = 0; i < ncig; i++) {
+	    int len = cig[i] >> BAM_CIGAR_SHIFT, s, e;
+
+	    switch (cig[i] & BAM_CIGAR_MASK) {
+	    case BAM_CMATCH:
+	    case BAM_CBASE_MATCH:
+	    case BAM_CBASE_MISMATCH:
+	    case BAM_CDEL:
+		s = MAX(rpos, start);
+		e = MIN(rpos + len, end == INT_MAX ? INT_MAX : end+1);
+		if (s < e) {
+		    if (depth_event_add(&w, s, +1) ||
+			depth_event_add(&w, e, -1))
+			goto error;
+		    if (w.wend < e)
+			w.wend = e;
+		}
+		/* Fall through */
+	    case BAM_CREF_SKIP:
+		rpos += len;
+		break;
+
+	    default:
+		break;
+	    }
+	}
+    }
+
+    if (last_ref >= 0 &&
+	depth_advance(&w, fp, last_ref, INT_MAX, depth_add, client_data))
+	goto error;
+
+    ret = 0;
+ error:
+    free(b);
+    free(w.diff);
+    free(w.spill);
+
+    return ret;
+}
+
+/* --------------------------------------------------------------------------
+ * Multi-threaded pileup over tiles of the reference.
+ *
+ * Each tile is a pileup_region() (or pileup_depth()) call on its own file
+ * handle, seeked by the CRAM index.  Sequences spanning tile boundaries are seen by both
+ * tiles, but each only reports columns within its own bounds.
+ */
+
+typedef struct {
+    char *fn;
+    scram_fd *master;    // owner of the index and references we borrow
+    cram_range r;
+    pileup_funcs *f;
+    void *tile_data;
+    int ret;
+} pileup_job;
+
+/*
+ * Guards the reference count of the shared refs_t.  Tiles also use it as
+ * their fd->ref_lock, as the first cram_get_ref() may load the .fai and
+ * resize the shared ref_id[] array.
+ */
+static pthread_mutex_t pileup_ref_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static int pileup_tile_region(scram_fd *fp, cram_range *r, pileup_funcs *f,
+			      void *tile_data) {
+    return f->depth_add
+	? pileup_depth(fp, r, f->depth_add, tile_data)
+	: pileup_region(fp, r, f->seq_init, f->seq_add, tile_data);
+}
+
+static void *pileup_tile_thread(void *arg) {
+    pileup_job *j = (pileup_job *)arg;
+    refs_t *refs = scram_get_refs(j->master);
+    scram_fd *fp;
+    int err;
+
+    j->ret = -1;
+    if (!(fp = scram_open(j->fn, "r")))
+	return j;
+
+    pthread_mutex_lock(&pileup_ref_lock);
+    err = refs && scram_set_option(fp, CRAM_OPT_SHARED_REF, refs);
+    pthread_mutex_unlock(&pileup_ref_lock);
+
+    fp->c->index    = j->master->c->index;
+    fp->c->index_sz = j->master->c->index_sz;
+    fp->c->ref_lock = &pileup_ref_lock;
+
+    if (!err)
+	j->ret = pileup_tile_region(fp, &j->r, j->f, j->tile_data);
+
+    fp->c->index    = NULL;
+    fp->c->index_sz = 0;
+    fp->c->ref_lock = NULL;
+
+    pthread_mutex_lock(&pileup_ref_lock);
+    if (scram_close(fp))
+	j->ret = -1;
+    pthread_mutex_unlock(&pileup_ref_lock);
+
+    return j;
+}
+
+/*
+ * Hands a completed tile to tile_done(), or just releases it if we have
+ * already failed.
+ */
+static void pileup_tile_done(pileup_job *j, void *client_data, int *failed) {
+    if (*failed || j->ret != 0) {
+	*failed = 1;
+	j->f->tile_done(client_data, j->tile_data, NULL);
+    } else if (j->f->tile_done(client_data, j->tile_data, &j->r) != 0) {
+	*failed = 1;
+    }
+    free(j);
+}
+
+static void pileup_tile_next(t_results_queue *q, void *client_data,
+			     int *failed) {
+    t_pool_result *res = t_pool_next_result_wait(q);
+
+    if (!res || !res->data) {
+	*failed = 1;
+	if (res)
+	    t_pool_delete_result(res, 0);
+	return;
+    }
+
+    pileup_tile_done((pileup_job *)res->data, client_data, failed);
+    t_pool_delete_result(res, 0);
+}
+
+/*
+ * Runs a pileup over the region 'range' of file 'fn', or all of it if
+ * range is NULL, splitting the reference into tiles of tile_size bases.
+ *
+ * Tiles run in parallel on pool p, or one after another on the calling
+ * thread if p is NULL.  The results are passed to f->tile_done() in
+ * reference order.  This requires a CRAM file with a .crai index; other
+ * files are processed as a single tile on the calling thread, with a
+ * refid of -2 if no range was given.
+ *
+ * Returns 0 on success
+ *        -1 on failure
+ */
+int pileup_tiled(char *fn, cram_range *range, int tile_size, t_pool *p,
+		 pileup_funcs *f, void *client_data) {
+    char fn_idx[PATH_MAX];
+    t_results_queue *q = NULL;
+    scram_fd *fp;
+    SAM_hdr *h;
+    int ref, n_pending = 0, failed = 0;
+
+    if (!(fp = scram_open(fn, "r")))
+	return -1;
+
+    init_tab();
+
+    snprintf(fn_idx, PATH_MAX, "%s.crai", fn);
+    if (fp->is_bam || access(fn_idx, R_OK) != 0 ||
+	cram_index_load(fp->c, fn) != 0) {
+	cram_range all = {-2, INT_MIN, INT_MAX};
+	cram_range *r = range ? range : &all;
+	void *tile_data = f->tile_init(client_data, r);
+
+	if (pileup_tile_region(fp, range, f, tile_data)) {
+	    f->tile_done(client_data, tile_data, NULL);
+	    failed = 1;
+	} else if (f->tile_done(client_data, tile_data, r)) {
+	    failed = 1;
+	}
+
+	return scram_close(fp) || failed ? -1 : 0;
+    }
+
+    if (p && !(q = t_results_queue_init())) {
+	scram_close(fp);
+	return -1;
+    }
+
+    if (tile_size < 1)
+	tile_size = INT_MAX;
+
+    h = scram_get_header(fp);
+    for (ref = 0; ref < h->nref && !failed; ref++) {
+	int64_t start = 1, end = h->ref[ref].len ? h->ref[ref].len : INT_MAX;
+
+	if (range && range->refid >= 0) {
+	    if (ref != range->refid)
+		continue;
+	    start = MAX(start, range->start);
+	    end   = MIN(end, range->end);
+	}
+
+	// Skip references with nothing aligned against them
+	if (!cram_index_query(fp->c, ref, 1, NULL))
+	    continue;
+
+	for (; start <= end && !failed; start += tile_size) {
+	    pileup_job *j = malloc(sizeof(*j));
+	    if (!j) {
+		failed = 1;
+		break;
+	    }
+
+	    j->fn = fn;
+	    j->master = fp;
+	    j->f = f;
+	    j->r.refid = ref;
+	    j->r.start = start;
+	    j->r.end   = MIN(start + tile_size-1, end);
+	    j->tile_data = f->tile_init(client_data, &j->r);
+
+	    if (!p) {
+		pileup_tile_done(pileup_tile_thread(j), client_data, &failed);
+		continue;
+	    }
+
+	    // Bound the number of completed tiles awaiting earlier ones
+	    while (n_pending >= 2*p->qsize) {
+		pileup_tile_next(q, client_data, &failed);
+		n_pending--;
+	    }
+
+	    if (t_pool_dispatch(p, q, pileup_tile_thread, j) == -1) {
+		f->tile_done(client_data, j->tile_data, NULL);
+		free(j);
+		failed = 1;
+		break;
+	    }
+	    n_pending++;
+	}
+    }
+
+    while (n_pending-- > 0)
+	pileup_tile_next(q, client_data, &failed);
+
+    if (q)
+	t_results_queue_destroy(q);
+
+    if (scram_close(fp))
+	failed = 1;
+
+    return failed ? -1 : 0;
+}
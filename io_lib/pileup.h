@@ -35,6 +35,11 @@
 #define _PILEUP_H_
 
 #include "io_lib/scram.h"
+#include "io_lib/thread_pool.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
 
 typedef struct pileup {
     struct pileup *next;  // A link list, for active seqs
@@ -77,4 +82,97 @@ int pileup_loop(scram_fd *fp,
 			       int is_insert),
 		void *client_data);
 
+/*! Produces columns of data for a region of a sorted alignment file.
+ *
+ * As pileup_loop(), but only columns within 'range' are passed on to
+ * seq_add().  range is 1-based and inclusive; NULL means the whole file.
+ * CRAM files with a loaded index are seeked directly to the region.
+ *
+ * @return
+ * Returns 0 on success;
+ *        -1 on failure
+ */
+int pileup_region(scram_fd *fp, cram_range *range,
+		  int (*seq_init)(void *client_data,
+				  scram_fd *fp,
+				  pileup_t *p),
+		  int (*seq_add)(void *client_data,
+				 scram_fd *fp,
+				 pileup_t *p,
+				 int depth,
+				 int pos,
+				 int nth,
+				 int is_insert),
+		  void *client_data);
+
+/*! Computes read depth over a region of a sorted alignment file.
+ *
+ * A faster alternative to pileup_region() when only depth is needed.
+ * depth_add() is called with runs of per-base depths for reference ref
+ * starting at 1-based position pos; these may include zero depth
+ * positions.  Depth counts M, =, X and D cigar operations.  For CRAM
+ * only the fields needed are decoded.
+ *
+ * @return
+ * Returns 0 on success;
+ *        -1 on failure
+ */
+int pileup_depth(scram_fd *fp, cram_range *range,
+		 int (*depth_add)(void *client_data,
+				  scram_fd *fp,
+				  int ref,
+				  int pos,
+				  int32_t *depth,
+				  int len),
+		 void *client_data);
+
+/*! Callbacks for pileup_tiled().
+ *
+ * tile_init() creates the per-tile data handed to seq_init() and
+ * seq_add() in place of client_data.  These two may run on several
+ * threads at once, but each tile is only ever used by one of them.
+ * tile_done() is called on the calling thread in reference order and
+ * must free the tile data.  A NULL range to tile_done() means the tile
+ * was abandoned following an error.  If depth_add() is set, tiles are
+ * processed with pileup_depth() instead and the other two are unused.
+ */
+typedef struct {
+    void *(*tile_init)(void *client_data, cram_range *r);
+    int (*seq_init)(void *tile_data,
+		    scram_fd *fp,
+		    pileup_t *p);
+    int (*seq_add)(void *tile_data,
+		   scram_fd *fp,
+		   pileup_t *p,
+		   int depth,
+		   int pos,
+		   int nth,
+		   int is_insert);
+    int (*tile_done)(void *client_data, void *tile_data, cram_range *r);
+    int (*depth_add)(void *tile_data,
+		     scram_fd *fp,
+		     int ref,
+		     int pos,
+		     int32_t *depth,
+		     int len);
+} pileup_funcs;
+
+/*! Multi-threaded pileup of an indexed CRAM file.
+ *
+ * Splits 'range' (or every reference if NULL) into tiles of tile_size
+ * bases and runs pileup_region() on each, in parallel using pool p if
+ * non-NULL.  Files that cannot be seeked by index are processed as a
+ * single tile on the calling thread.
+ *
+ * @return
+ * Returns 0 on success;
+ *        -1 on failure
+ */
+int pileup_tiled(char *fn, cram_range *range, int tile_size, t_pool *p,
+		 pileup_funcs *f, void *client_data);
+
+#ifdef __cplusplus
+}
 #endif
+
+#endif /* _PILEUP_H_ */
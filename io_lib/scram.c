@@ -415,6 +415,18 @@ int scram_set_option(scram_fd *fd, enum cram_option opt, ...) {
 	return fd->is_bam
 	    ? bam_set_option (fd->b,  BAM_OPT_IGNORE_CHKSUM, chk)
 	    : cram_set_option(fd->c, CRAM_OPT_IGNORE_CHKSUM, chk);
+    } else if (opt == CRAM_OPT_STATS) {
+	FILE *fp = va_arg(args, FILE *);
+
+	return fd->is_bam
+	    ? bam_set_option (fd->b,  BAM_OPT_STATS, fp)
+	    : cram_set_option(fd->c, CRAM_OPT_STATS, fp);
+    } else if (opt == CRAM_OPT_MAX_INFLIGHT) {
+	int64_t max = va_arg(args, int64_t);
+
+	return fd->is_bam
+	    ? bam_set_option (fd->b,  BAM_OPT_MAX_INFLIGHT, max)
+	    : cram_set_option(fd->c, CRAM_OPT_MAX_INFLIGHT, max);
     } else if (opt == CRAM_OPT_WITH_BGZIP_INDEX) {
         gzi *idx = va_arg(args, gzi *);
         if (fd->is_bam)
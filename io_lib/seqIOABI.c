@@ -153,6 +153,7 @@
 #include <ctype.h>
 #include <string.h>
 #include <time.h>
+#include <pthread.h>
 
 #include "io_lib/stdio_hack.h"
 
@@ -170,7 +171,12 @@
 
 #define baseIndex(B) ((B)=='C'?0:(B)=='A'?1:(B)=='G'?2:3)
 
+/*
+ * Set per file by getABIIndexOffset() and used by all subsequent seeks,
+ * so fread_abi() holds abi_lock to keep concurrent reads apart.
+ */
 static int header_fudge = 0;
+static pthread_mutex_t abi_lock = PTHREAD_MUTEX_INITIALIZER;
 
 /* DATA block numbers for traces, in order of FWO_ */
 static int DataCount[4] = {9, 10, 11, 12};
@@ -486,7 +492,7 @@ void abi_reset_data_counts(void) {
  *   Read *	- Success, the Read structure read.
  *   NULLRead	- Failure.
  */
-Read *fread_abi(FILE *fp) {
+static Read *fread_abi_locked(FILE *fp) {
     Read *read = NULLRead;
     int i;
     float fspacing;		/* average base spacing */
@@ -982,6 +988,16 @@ Read *fread_abi(FILE *fp) {
     return NULLRead;
 }
 
+Read *fread_abi(FILE *fp) {
+    Read *read;
+
+    pthread_mutex_lock(&abi_lock);
+    read = fread_abi_locked(fp);
+    pthread_mutex_unlock(&abi_lock);
+
+    return read;
+}
+
 /*
  * Read the ABI format sequence from file 'fn' into a Read structure.
  * All printing characters (as defined by ANSII C `isprint')
@@ -38,6 +38,11 @@
 #include <stdio.h>
 #include <assert.h>
 #include <string.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#ifdef HAVE_MMAP
+#include <sys/mman.h>
+#endif
 #include "io_lib/Read.h"
 #include "io_lib/misc.h"
 #include "io_lib/ztr.h"
@@ -95,6 +100,8 @@ srf_t *srf_open(char *fn, char *mode) {
     return (fp = fopen(fn, mode)) ? srf_create(fp) : NULL;
 }
 
+static void srf_view_clear(srf_t *srf);
+
 /*
  * Deallocates an srf_t struct. If auto_close is true then it also closes
  * any associated FILE pointer.
@@ -114,9 +121,18 @@ void srf_destroy(srf_t *srf, int auto_close) {
     if (srf->mf)
 	mfdestroy(srf->mf);
 
+    srf_view_clear(srf);
+
     if (srf->ztr)
 	delete_ztr(srf->ztr);
 
+#ifdef HAVE_MMAP
+    if (srf->map)
+	munmap(srf->map, srf->map_len);
+#endif
+    if (srf->vbuf)
+	free(srf->vbuf);
+
     free(srf);
 }
 
@@ -583,13 +599,14 @@ int srf_write_trace_body(srf_t *srf, srf_trace_body_t *tb) {
 }
 
 /*
- * Reads a trace header + trace 'blob' and stores the result in 'th'
- * If no_trace is true then it skips loading the trace data itself.
+ * Reads the fixed portion of a trace body block (type, size, flags and
+ * read-id suffix), leaving the file positioned at the start of the trace
+ * 'blob' itself.  tb->trace_size is set to the length of that blob.
  *
  * Returns 0 for success
  *        -1 for failure
  */
-int srf_read_trace_body(srf_t *srf, srf_trace_body_t *tb, int no_trace) {
+static int srf_read_trace_body_hdr(srf_t *srf, srf_trace_body_t *tb) {
     int z;
 
     /* Check block type */
@@ -614,6 +631,20 @@ int srf_read_trace_body(srf_t *srf, srf_trace_body_t *tb, int no_trace) {
     tb->read_id_length = z;
     tb->trace_size -= z+1;
 
+    return 0;
+}
+
+/*
+ * Reads a trace header + trace 'blob' and stores the result in 'th'
+ * If no_trace is true then it skips loading the trace data itself.
+ *
+ * Returns 0 for success
+ *        -1 for failure
+ */
+int srf_read_trace_body(srf_t *srf, srf_trace_body_t *tb, int no_trace) {
+    if (0 != srf_read_trace_body_hdr(srf, tb))
+	return -1;
+
     /* The trace data itself */
     if (!no_trace) {
 	if (tb->trace_size) {
@@ -824,6 +855,10 @@ srf_index_t *srf_index_create(char *ch_file, char *th_file, int dbh_sep) {
 					    HASH_POOL_ITEMS)))
 	return NULL;
 
+    idx->pool = NULL;
+    idx->pending_names = NULL;
+    idx->pending_data = NULL;
+
     return idx;
 }
 
@@ -839,6 +874,10 @@ void srf_index_destroy(srf_index_t *idx) {
 
     if (idx->db_hash)
 	HashTableDestroy(idx->db_hash, 0);
+    if (idx->pending_names)
+	ArrayDestroy(idx->pending_names);
+    if (idx->pending_data)
+	ArrayDestroy(idx->pending_data);
     if (idx->ch_pos)
 	ArrayDestroy(idx->ch_pos);
     if (idx->th_pos)
@@ -860,6 +899,7 @@ void srf_index_destroy(srf_index_t *idx) {
  * is NULL.
  */
 void srf_index_stats(srf_index_t *idx, FILE *fp) {
+    srf_index_build(idx);
     HashTableStats(idx->db_hash, fp ? fp : stderr);
 }
 
@@ -940,6 +980,19 @@ int srf_index_add_trace_body(srf_index_t *idx, char *name, uint64_t pos) {
     blockp->used  += name_len;
     blockp->space -= name_len;
 
+    /* Defer hashing to srf_index_build */
+    if (idx->pool) {
+	char **np = ARRP(char *, idx->pending_names,
+			 ArrayMax(idx->pending_names));
+	HashData *dp = ARRP(HashData, idx->pending_data,
+			    ArrayMax(idx->pending_data));
+	if (!np || !dp)
+	    return -1;
+	*np = name_copy;
+	*dp = hd;
+	return 0;
+    }
+
     if (NULL == HashTableAdd(idx->db_hash, name_copy, name_len - 1, hd, &new)){
         return -1;
     }
@@ -952,6 +1005,52 @@ int srf_index_add_trace_body(srf_index_t *idx, char *name, uint64_t pos) {
 }
 
 
+/*
+ * Requests that trace names are hashed in parallel on thread pool p.
+ * srf_index_add_trace_body then just queues the names, and they are
+ * added to the hash table in one batch by srf_index_build.
+ */
+void srf_index_set_pool(srf_index_t *idx, struct t_pool *p) {
+    if (p && !idx->pending_names) {
+	idx->pending_names = ArrayCreate(sizeof(char *), 0);
+	idx->pending_data  = ArrayCreate(sizeof(HashData), 0);
+	if (!idx->pending_names || !idx->pending_data)
+	    return;
+    }
+    idx->pool = p;
+}
+
+/*
+ * Adds any trace names queued since srf_index_set_pool to the hash table.
+ * This is called automatically by srf_index_stats and srf_index_write.
+ *
+ * Returns 0 on success
+ *        -1 on failure (including duplicate names)
+ */
+int srf_index_build(srf_index_t *idx) {
+    int n, dup;
+
+    if (!idx->pending_names || !(n = ArrayMax(idx->pending_names)))
+	return 0;
+
+    if (HashTableAddBatch(idx->db_hash,
+			  ArrayBase(char *, idx->pending_names), NULL,
+			  ArrayBase(HashData, idx->pending_data), n,
+			  idx->pool, &dup) < 0)
+	return -1;
+
+    ArrayMax(idx->pending_names) = 0;
+    ArrayMax(idx->pending_data) = 0;
+
+    if (dup >= 0) {
+	fprintf(stderr, "duplicate read name %s\n",
+		arr(char *, idx->pending_names, dup));
+	return -1;
+    }
+
+    return 0;
+}
+
 /*
  * Writes the HashTable structures to 'fp'.
  * This is a specialisation of the HashTable where the HashData is a
@@ -1002,6 +1101,9 @@ int srf_index_write(srf_t *srf, srf_index_t *idx) {
     int item_sz;
     HashTable *h = idx->db_hash;
 
+    if (0 != srf_index_build(idx))
+	return -1;
+
     /* Option: whether to store dbh positions directly in the index */
     hdr.dbh_pos_stored_sep = idx->dbh_pos_stored_sep;
 
@@ -1707,6 +1809,47 @@ ztr_t *ztr_dup(ztr_t *src) {
     return dest;
 }
 
+/*
+ * Reads a trace header block and decodes as much of its ZTR header blob
+ * as possible into srf->ztr.  The blob is kept in srf->mf with mf_pos
+ * marking the end of the decoded portion, so any trailing partial chunk
+ * can be completed by each subsequent trace body.
+ *
+ * Returns 0 for success
+ *        -1 for failure
+ */
+static int srf_load_trace_hdr(srf_t *srf) {
+    if (0 != srf_read_trace_hdr(srf, &srf->th))
+	return -1;
+
+    /* The reused view ztr mirrors the old header chunks */
+    srf_view_clear(srf);
+
+    /* Decode ZTR chunks in the header */
+    if (srf->mf)
+	mfdestroy(srf->mf);
+
+    if (NULL == (srf->mf = mfcreate(NULL, 0)))
+	return -1;
+    if (srf->th.trace_hdr_size)
+	mfwrite(srf->th.trace_hdr, 1, srf->th.trace_hdr_size, srf->mf);
+    if (srf->ztr)
+	delete_ztr(srf->ztr);
+    mrewind(srf->mf);
+
+    if (NULL != (srf->ztr = partial_decode_ztr(srf, srf->mf, NULL))) {
+	srf->mf_pos = mftell(srf->mf);
+    } else {
+	/* Maybe not enough to decode or no headerBlob. */
+	/* So delay until decoding the body. */
+	srf->mf_pos = 0;
+    }
+    mfseek(srf->mf, 0, SEEK_END);
+    srf->mf_end = mftell(srf->mf);
+
+    return 0;
+}
+
 /*
  * Fetches the next trace from an SRF container as a ZTR object.
  * This is more efficient than srf_next_trace() if we are serially
@@ -1760,30 +1903,8 @@ ztr_t *srf_next_ztr_flags(srf_t *srf, char *name, int filter_mask,
 	    break;
 
 	case SRFB_TRACE_HEADER:
-	    if (0 != srf_read_trace_hdr(srf, &srf->th))
+	    if (0 != srf_load_trace_hdr(srf))
 		return NULL;
-
-	    /* Decode ZTR chunks in the header */
-	    if (srf->mf)
-		mfdestroy(srf->mf);
-
-	    srf->mf = mfcreate(NULL, 0);
-	    if (srf->th.trace_hdr_size)
-		mfwrite(srf->th.trace_hdr, 1, srf->th.trace_hdr_size, srf->mf);
-	    if (srf->ztr)
-		delete_ztr(srf->ztr);
-	    mrewind(srf->mf);
-
-	    if (NULL != (srf->ztr = partial_decode_ztr(srf, srf->mf, NULL))) {
-		srf->mf_pos = mftell(srf->mf);
-	    } else {
-		/* Maybe not enough to decode or no headerBlob. */
-		/* So delay until decoding the body. */
-		srf->mf_pos = 0;
-	    }
-	    mfseek(srf->mf, 0, SEEK_END);
-	    srf->mf_end = mftell(srf->mf);
-
 	    break;
 
 	case SRFB_TRACE_BODY: {
@@ -1847,6 +1968,361 @@ ztr_t *srf_next_ztr(srf_t *srf, char *name, int filter_mask) {
     return srf_next_ztr_flags(srf, name, filter_mask, NULL);
 }
 
+/*
+ * ---------------------------------------------------------------------------
+ * Zero-copy trace iteration.
+ *
+ * srf_next_ztr() assembles every read into an mFILE and then decodes a
+ * freshly allocated ztr_t from it.  The functions below instead hand the
+ * decoder pointers straight into a copy-on-write mapping of the file (or a
+ * single reused buffer when mapping is unavailable) and reuse one ztr_t
+ * for every read, so serial scans allocate almost nothing per trace.
+ */
+
+#ifdef HAVE_MMAP
+/*
+ * Maps the SRF file for srf_next_trace_view.  Failure is not an error; we
+ * simply fall back to reading each body into srf->vbuf.
+ */
+static void srf_view_map(srf_t *srf) {
+    struct stat sb;
+    void *map;
+
+    srf->map_tried = 1;
+
+    if (fstat(fileno(srf->fp), &sb) != 0 || !S_ISREG(sb.st_mode) ||
+	sb.st_size == 0 || (off_t)(size_t)sb.st_size != sb.st_size)
+	return;
+
+    /*
+     * Private and writable as callers may modify chunk data in place,
+     * eg srf2fastq -r reverse complementing a raw BASE chunk.
+     */
+    map = mmap(NULL, sb.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE,
+	       fileno(srf->fp), 0);
+    if (map == MAP_FAILED)
+	return;
+
+#ifdef MADV_SEQUENTIAL
+    madvise(map, sb.st_size, MADV_SEQUENTIAL);
+#endif
+
+    srf->map = (unsigned char *)map;
+    srf->map_len = sb.st_size;
+}
+#endif
+
+/*
+ * Undoes the per-read state of srf->vztr: body chunks are dropped, along
+ * with any data uncompress_chunk() allocated in place of the view, and
+ * any huffman codes picked up from them.
+ */
+static void srf_view_release(srf_t *srf) {
+    ztr_t *z = srf->vztr;
+    int i;
+
+    if (!z)
+	return;
+
+    if (srf->vztr_nhdr < 0) {
+	/* Decoded via srf->mf, so we own the lot */
+	delete_ztr(z);
+	srf->vztr = NULL;
+	return;
+    }
+
+    /* Body chunks become ours once uncompress_chunk() replaces their data */
+    for (i = srf->vztr_nhdr; i < z->nchunks; i++) {
+	if (!z->chunk[i].ztr_owns)
+	    continue;
+	if (z->chunk[i].data)
+	    xfree(z->chunk[i].data);
+	if (z->chunk[i].mdata)
+	    xfree(z->chunk[i].mdata);
+    }
+    z->nchunks = srf->vztr_nhdr;
+
+    for (i = srf->ztr->nhcodes; i < z->nhcodes; i++) {
+	if (z->hcodes[i].codes && z->hcodes[i].ztr_owns)
+	    huffman_codeset_destroy(z->hcodes[i].codes);
+    }
+    z->nhcodes = srf->ztr->nhcodes;
+}
+
+/*
+ * Frees srf->vztr entirely. Needed whenever srf->ztr changes as vztr
+ * shares its header chunks.
+ */
+static void srf_view_clear(srf_t *srf) {
+    srf_view_release(srf);
+
+    if (srf->vztr)
+	delete_ztr(srf->vztr); /* shared header chunks have ztr_owns == 0 */
+    srf->vztr = NULL;
+    srf->vztr_alloc = 0;
+}
+
+/*
+ * Fetches the next trace from an SRF container without assembling it into
+ * an mFILE or copying the trace body.
+ *
+ * On success v->hdr points to the ZTR header blob of the current trace
+ * header block and v->body to the trace body, either within a private
+ * mapping of the file or within a buffer reused between calls. Both are
+ * valid only until the next read from srf.
+ *
+ * Name, if defined (which should be a buffer of at least 512 bytes long)
+ * will be filled out to contain the read name.
+ *
+ * filter_mask should consist of zero or more SRF_READ_FLAG_* bits.
+ * Reads with one or more flags matching these bits will be skipped over.
+ *
+ * Returns 0 on success
+ *        -1 on failure or EOF.
+ */
+int srf_next_trace_view(srf_t *srf, char *name, int filter_mask,
+			srf_trace_view_t *v) {
+    int new_hdr = 0;
+
+    do {
+	int type;
+
+	switch(type = srf_next_block_type(srf)) {
+	case -1:
+	    /* EOF */
+	    return -1;
+
+	case SRFB_NULL_INDEX: {
+	    uint64_t ilen;
+	    if (1 != fread(&ilen, 8, 1, srf->fp))
+		return -1;
+	    if (ilen != 0)
+		return -1;
+	    break;
+	}
+
+	case SRFB_CONTAINER:
+	    if (0 != srf_read_cont_hdr(srf, &srf->ch))
+		return -1;
+	    break;
+
+	case SRFB_XML:
+	    if (0 != srf_read_xml(srf, &srf->xml))
+		return -1;
+	    break;
+
+	case SRFB_TRACE_HEADER:
+	    if (0 != srf_load_trace_hdr(srf))
+		return -1;
+	    new_hdr = 1;
+	    break;
+
+	case SRFB_TRACE_BODY: {
+	    srf_trace_body_t tb;
+	    off_t pos;
+
+	    if (!srf->mf || 0 != srf_read_trace_body_hdr(srf, &tb))
+		return -1;
+
+	    if (tb.flags & filter_mask) {
+		/* Filtered, so skip it */
+		if (0 != fseeko(srf->fp, tb.trace_size, SEEK_CUR))
+		    return -1;
+		break;
+	    }
+
+	    if (name) {
+		if (-1 == construct_trace_name(srf->th.id_prefix,
+					       (unsigned char *)tb.read_id,
+					       tb.read_id_length,
+					       name, 512)) {
+		    return -1;
+		}
+	    }
+
+#ifdef HAVE_MMAP
+	    if (!srf->map_tried)
+		srf_view_map(srf);
+#endif
+
+	    pos = ftello(srf->fp);
+	    if (srf->map && pos >= 0 &&
+		(uint64_t)pos + tb.trace_size <= srf->map_len) {
+		v->body = srf->map + pos;
+		if (0 != fseeko(srf->fp, tb.trace_size, SEEK_CUR))
+		    return -1;
+	    } else {
+		if (tb.trace_size > srf->vbuf_sz) {
+		    unsigned char *b = realloc(srf->vbuf, tb.trace_size);
+		    if (!b)
+			return -1;
+		    srf->vbuf = b;
+		    srf->vbuf_sz = tb.trace_size;
+		}
+		if (tb.trace_size != fread(srf->vbuf, 1, tb.trace_size,
+					   srf->fp))
+		    return -1;
+		v->body = srf->vbuf;
+	    }
+	    v->body_len = tb.trace_size;
+	    v->hdr      = srf->th.trace_hdr;
+	    v->hdr_len  = srf->th.trace_hdr_size;
+	    v->flags    = tb.flags;
+	    v->new_hdr  = new_hdr;
+
+	    return 0;
+	}
+
+	case SRFB_INDEX: {
+	    off_t pos = ftell(srf->fp);
+	    srf_read_index_hdr(srf, &srf->hdr, 1);
+
+	    /* Skip the index body */
+	    fseeko(srf->fp, pos + srf->hdr.size, SEEK_SET);
+	    break;
+	}
+
+	default:
+	    fprintf(stderr, "Block of unknown type '%c'. Aborting\n", type);
+	    return -1;
+	}
+    } while (1);
+
+    return -1;
+}
+
+#define SRF_BE32(p) (((uint32_t)(p)[0] << 24) | ((uint32_t)(p)[1] << 16) | \
+		     ((uint32_t)(p)[2] <<  8) | ((uint32_t)(p)[3] <<  0))
+
+/*
+ * Appends a chunk whose data and meta-data live in memory we don't own
+ * to srf->vztr.
+ *
+ * Returns 0 on success
+ *        -1 on failure
+ */
+static int srf_view_add_chunk(srf_t *srf, uint32_t type,
+			      unsigned char *mdata, uint32_t mdlength,
+			      unsigned char *data, uint32_t dlength) {
+    ztr_t *z = srf->vztr;
+    ztr_chunk_t *c;
+
+    if (z->nchunks >= srf->vztr_alloc) {
+	int alloc = srf->vztr_alloc ? srf->vztr_alloc * 2 : 16;
+	c = (ztr_chunk_t *)xrealloc(z->chunk, alloc * sizeof(*c));
+	if (!c)
+	    return -1;
+	z->chunk = c;
+	srf->vztr_alloc = alloc;
+    }
+
+    c = &z->chunk[z->nchunks++];
+    c->type     = type;
+    c->mdlength = mdlength;
+    c->mdata    = mdlength ? (char *)mdata : NULL;
+    c->dlength  = dlength;
+    c->data     = (char *)data;
+    c->ztr_owns = 0;
+
+    return 0;
+}
+
+/*
+ * Fetches the next trace from an SRF container as a ZTR object, decoding
+ * the chunks in place from the view returned by srf_next_trace_view().
+ *
+ * Unlike srf_next_ztr_flags() the returned ztr_t is owned by srf and is
+ * reused for every read. It is valid only until the next call or
+ * srf_destroy() and must not be passed to delete_ztr(). Chunks may be
+ * uncompressed with uncompress_chunk() as usual.
+ *
+ * Arguments are as for srf_next_ztr_flags().
+ *
+ * Returns ztr_t * on success
+ *         NULL on failure or EOF.
+ */
+ztr_t *srf_next_ztr_view(srf_t *srf, char *name, int filter_mask,
+			 int *flags) {
+    srf_trace_view_t v;
+    unsigned char *cp, *end, *rem_hdr = NULL;
+    long rem;
+
+    srf_view_release(srf);
+
+    if (0 != srf_next_trace_view(srf, name, filter_mask, &v))
+	return NULL;
+
+    if (flags)
+	*flags = v.flags;
+
+    /*
+     * Typically the header blob ends with the type, meta-data and length
+     * of the first body chunk, leaving only its data in the trace body.
+     * We can point at both halves directly.
+     */
+    rem = srf->mf_end - srf->mf_pos;
+    if (srf->ztr && rem) {
+	unsigned char *r = (unsigned char *)srf->mf->data + srf->mf_pos;
+	if (rem >= 12 && rem - 12 == SRF_BE32(r+4) &&
+	    SRF_BE32(r+rem-4) <= v.body_len)
+	    rem_hdr = r;
+    }
+
+    /*
+     * Otherwise if the header blob could not be decoded alone, or splits
+     * a chunk elsewhere, the body is not self contained. Join the two in
+     * srf->mf as srf_next_ztr_flags() does.
+     */
+    if (!srf->ztr || (rem && !rem_hdr)) {
+	mfseek(srf->mf, srf->mf_end, SEEK_SET);
+	if (v.body_len)
+	    mfwrite(v.body, 1, v.body_len, srf->mf);
+	mftruncate(srf->mf, mftell(srf->mf));
+	mfseek(srf->mf, srf->mf_pos, SEEK_SET);
+
+	srf->vztr_nhdr = -1;
+	return srf->vztr = partial_decode_ztr(srf, srf->mf, srf->ztr
+					      ? ztr_dup(srf->ztr) : NULL);
+    }
+
+    if (!srf->vztr) {
+	if (NULL == (srf->vztr = ztr_dup(srf->ztr)))
+	    return NULL;
+	srf->vztr_nhdr = srf->vztr_alloc = srf->ztr->nchunks;
+    }
+
+    cp  = v.body;
+    end = v.body + v.body_len;
+
+    if (rem_hdr) {
+	uint32_t dlength = SRF_BE32(rem_hdr+rem-4);
+	if (0 != srf_view_add_chunk(srf, SRF_BE32(rem_hdr),
+				    rem_hdr+8, rem-12, cp, dlength))
+	    return NULL;
+	cp += dlength;
+    }
+
+    /* Any trailing partial chunk is ignored, as in partial_decode_ztr */
+    while (end - cp >= 12) {
+	uint32_t mdlength, dlength;
+
+	mdlength = SRF_BE32(cp+4);
+	if (mdlength > end - cp - 12)
+	    break;
+	dlength = SRF_BE32(cp+8+mdlength);
+	if (dlength > end - cp - 12 - mdlength)
+	    break;
+
+	if (0 != srf_view_add_chunk(srf, SRF_BE32(cp), cp+8, mdlength,
+				    cp+12+mdlength, dlength))
+	    return NULL;
+
+	cp += 12 + mdlength + dlength;
+    }
+
+    return srf->vztr->nchunks ? srf->vztr : NULL;
+}
+
 /*
  * Returns the type of the next block.
  * -1 for none (EOF)
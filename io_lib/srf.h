@@ -122,8 +122,25 @@ typedef struct {
     Array name_blocks;
     int dbh_pos_stored_sep;
     HashTable *db_hash;
+    struct t_pool *pool; /* see srf_index_set_pool */
+    Array pending_names; /* trace names not yet added to db_hash */
+    Array pending_data;
 } srf_index_t;
 
+/*
+ * A trace returned by srf_next_trace_view. Both pointers reference memory
+ * owned by the srf_t (the mapped file or a reused buffer) and are only
+ * valid until the next read.
+ */
+typedef struct {
+    unsigned char *hdr;		/* ZTR header blob from the trace header */
+    uint32_t hdr_len;
+    unsigned char *body;	/* ZTR chunks for this read */
+    uint32_t body_len;
+    int flags;			/* SRF_READ_FLAG_* bits */
+    int new_hdr;		/* true if hdr changed since the last call */
+} srf_trace_view_t;
+
 /* Master SRF object */
 typedef struct {
     FILE *fp;
@@ -139,6 +156,16 @@ typedef struct {
     ztr_t *ztr;
     mFILE *mf;
     long mf_pos, mf_end;
+
+    /* Private: zero-copy state for srf_next_trace_view / srf_next_ztr_view */
+    unsigned char *map;		/* whole file mapped copy-on-write, or NULL */
+    size_t map_len;
+    int map_tried;
+    unsigned char *vbuf;	/* body buffer when the file isn't mapped */
+    size_t vbuf_sz;
+    ztr_t *vztr;		/* ztr returned by srf_next_ztr_view */
+    int vztr_nhdr;		/* header chunks in vztr; -1 if vztr is owned */
+    int vztr_alloc;		/* allocated size of vztr->chunk */
 } srf_t;
 
 #define SRF_INDEX_MAGIC    "Ihsh"
@@ -200,12 +227,18 @@ void srf_index_stats(srf_index_t *idx, FILE *fp);
 int srf_index_add_cont_hdr(srf_index_t *idx, uint64_t pos);
 int srf_index_add_trace_hdr(srf_index_t *idx, uint64_t pos);
 int srf_index_add_trace_body(srf_index_t *idx, char *name, uint64_t pos);
+void srf_index_set_pool(srf_index_t *idx, struct t_pool *p);
+int srf_index_build(srf_index_t *idx);
 int srf_index_write(srf_t *srf, srf_index_t *idx);
 
 /*--- Higher level I/O functions */
 mFILE *srf_next_trace(srf_t *srf, char *name);
 ztr_t *srf_next_ztr_flags(srf_t *srf, char *name, int filter_mask, int *flags);
 ztr_t *srf_next_ztr(srf_t *srf, char *name, int filter_mask);
+int srf_next_trace_view(srf_t *srf, char *name, int filter_mask,
+			srf_trace_view_t *v);
+ztr_t *srf_next_ztr_view(srf_t *srf, char *name, int filter_mask,
+			 int *flags);
 
 ztr_t *partial_decode_ztr(srf_t *srf, mFILE *mf, ztr_t *z);
 ztr_t *ztr_dup(ztr_t *src);
@@ -340,6 +340,8 @@ static void *t_pool_worker(void *arg) {
     t_pool_worker_t *w = (t_pool_worker_t *)arg;
     t_pool *p = w->p;
     t_pool_job *j;
+    struct timeval i1, i2;
+    int timed;
 #ifdef DEBUG_TIME
     struct timeval t1, t2, t3;
 #endif
@@ -374,6 +376,8 @@ static void *t_pool_worker(void *arg) {
 #ifdef DEBUG_TIME
 	    gettimeofday(&t2, NULL);
 #endif
+	    if ((timed = p->time_idle))
+		gettimeofday(&i1, NULL);
 
 #ifdef IN_ORDER
 	    // Push this thread to the top of the waiting stack
@@ -399,6 +403,11 @@ static void *t_pool_worker(void *arg) {
 	    pthread_cond_wait(&p->pending_c, &p->pool_m);
 #endif
 
+	    if (timed) {
+		gettimeofday(&i2, NULL);
+		p->idle_time += TDIFF(i2,i1);
+	    }
+
 #ifdef DEBUG_TIME
 	    gettimeofday(&t3, NULL);
 	    p->wait_time += TDIFF(t3,t2);
@@ -461,6 +470,8 @@ t_pool *t_pool_init(int qsize, int tsize) {
     p->shutdown = 0;
     p->head = p->tail = NULL;
     p->t_stack = NULL;
+    p->idle_time = 0;
+    p->time_idle = 0;
 #ifdef DEBUG_TIME
     p->total_time = p->wait_time = 0;
 #endif
@@ -772,6 +783,16 @@ void t_pool_destroy(t_pool *p, int kill) {
 #endif
 }
 
+/*
+ * Starts accumulating the time workers spend waiting for jobs in
+ * p->idle_time.
+ */
+void t_pool_time_idle(t_pool *p) {
+    pthread_mutex_lock(&p->pool_m);
+    p->time_idle = 1;
+    pthread_mutex_unlock(&p->pool_m);
+}
+
 
 /*-----------------------------------------------------------------------------
  * Test app.
@@ -108,6 +108,11 @@ typedef struct t_pool {
 
     // Debugging to check wait time
     long long total_time, wait_time;
+
+    // Microseconds workers have spent idle, waiting for new jobs.
+    // Only accumulated once t_pool_time_idle() has been called.
+    long long idle_time;
+    int time_idle;
 } t_pool;
 
 typedef struct t_results_queue {
@@ -166,6 +171,13 @@ int t_pool_flush(t_pool *p);
  */
 void t_pool_destroy(t_pool *p, int kill);
 
+/*
+ * Starts accumulating the time workers spend waiting for jobs in
+ * p->idle_time. This is off by default as it costs two gettimeofday
+ * calls per wait.
+ */
+void t_pool_time_idle(t_pool *p);
+
 /*
  * Pulls a result off the head of the result queue. Caller should
  * free it (and any internals as appropriate) after use. This doesn't
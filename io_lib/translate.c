@@ -91,6 +91,7 @@
 #endif
 
 #include <stdio.h>
+#include <pthread.h>
 #ifndef NDEBUG
 #    define NDEBUG /* disable assertions */
 #endif
@@ -304,6 +305,23 @@ do { \
 	return NULL; \
 } while (0)
 
+/*
+ * Maps IUBC codes to themselves and anything else to '-'. Filled out on
+ * first use by read2exp(), which may be called from several threads.
+ */
+static char valid_bases[256];
+static pthread_once_t valid_once = PTHREAD_ONCE_INIT;
+
+static void init_valid_bases(void) {
+    char *sq;
+    int i;
+
+    for (i = 0; i < 256; i++)
+	valid_bases[i] = '-';
+    for (sq = "acgturymkswbdhvnACGTURYMKSWBDHVN"; *sq; sq++)
+	valid_bases[(unsigned)*sq] = *sq;
+}
+
 /*
  * Translates a Read structure and an Experiment file.
  * The Read structure is left unchanged.
@@ -318,17 +336,8 @@ Exp_info *read2exp(Read *read, char *EN) {
     int l = strlen(EN)+1;
     char *sq;
     int i;
-    static char valid_bases[256];
-    static int valid_setup = 0;
-
-    if (!valid_setup) {
-	for (i = 0; i < 256; i++)
-	    valid_bases[i] = '-';
-	/* IUBC codes */
-	for (sq = "acgturymkswbdhvnACGTURYMKSWBDHVN"; *sq; sq++)
-	    valid_bases[(unsigned)*sq] = *sq;
-	valid_setup = 1;
-    }
+
+    pthread_once(&valid_once, init_valid_bases);
 
     if (NULL == (e = exp_create_info()))
 	return NULL;
@@ -76,6 +76,7 @@
 
 /* #include <fcntl.h> */
 
+#include "io_lib/thread_pool.h"
 #include "io_lib/ztr.h"
 #include "io_lib/xalloc.h"
 #include "io_lib/Read.h"
@@ -1085,8 +1086,27 @@ int uncompress_chunk(ztr_t *ztr, ztr_chunk_t *chunk) {
 		chunk->data[0], chunk->dlength, new_len);
 	*/
 
+	/*
+	 * Data we don't own (eg a view into an SRF file) is left alone, but
+	 * new_data is ours. As ztr_owns also covers mdata we take a private
+	 * copy of that before claiming ownership of the chunk.
+	 */
+	if (!chunk->ztr_owns) {
+	    if (chunk->mdata && chunk->mdlength) {
+		char *mdata = (char *)xmalloc(chunk->mdlength);
+		if (!mdata) {
+		    xfree(new_data);
+		    return -1;
+		}
+		memcpy(mdata, chunk->mdata, chunk->mdlength);
+		chunk->mdata = mdata;
+	    }
+	    chunk->ztr_owns = 1;
+	} else {
+	    xfree(chunk->data);
+	}
+
 	chunk->dlength = new_len;
-	xfree(chunk->data);
 	chunk->data = new_data;
     }
 
@@ -1094,130 +1114,189 @@ int uncompress_chunk(ztr_t *ztr, ztr_chunk_t *chunk) {
 }
 
 /*
- * Compresses a ztr (in memory).
- * Level is 0, 1, 2 or 3 (no compression, delta, delta + zlib,
- * chebyshev + zlib).
+ * Applies the standard transform chain for its type to a single chunk.
+ * Only 'chunk' is modified, so different chunks of one ztr may be
+ * compressed concurrently.
  */
-int compress_ztr(ztr_t *ztr, int level) {
-    int i;
-
-    if (0 == level)
-	return 0;
-
-    for (i = 0; i < ztr->nchunks; i++) {
-	/*
-	{
-	    char str[5];
-	    fprintf(stderr, "---- %.4s ----\n",
-		    ZTR_BE2STR(ztr->chunk[i].type,str));
-	}
-	fprintf(stderr, "Uncomp length=%d\n", ztr->chunk[i].dlength);
-	*/
-
-	switch(ztr->chunk[i].type) {
-	    char *type;
-	case ZTR_TYPE_SAMP:
-	case ZTR_TYPE_SMP4:
+static void compress_ztr_chunk(ztr_t *ztr, ztr_chunk_t *chunk, int level) {
+    switch(chunk->type) {
+	char *type;
+    case ZTR_TYPE_SAMP:
+    case ZTR_TYPE_SMP4:
 #ifdef ILLUMINA_GA
-	    compress_chunk(ztr, &ztr->chunk[i],
-			   ZTR_FORM_STHUFF, CODE_TRACES, 0);
+	compress_chunk(ztr, chunk,
+		       ZTR_FORM_STHUFF, CODE_TRACES, 0);
 #else
-	    type = ztr_lookup_mdata_value(ztr, &ztr->chunk[i], "TYPE");
-	    if (type && 0 == strcmp(type, "PYRW")) {
-		/* Raw data is not really compressable */
-	    } else if (type && 0 == strcmp(type, "PYNO")) {
-		if (level > 1) {
-		    compress_chunk(ztr, &ztr->chunk[i], ZTR_FORM_16TO8,  0, 0);
-		    compress_chunk(ztr, &ztr->chunk[i],
-				   ZTR_FORM_ZLIB, Z_HUFFMAN_ONLY, 0);
-		}
+	type = ztr_lookup_mdata_value(ztr, chunk, "TYPE");
+	if (type && 0 == strcmp(type, "PYRW")) {
+	    /* Raw data is not really compressable */
+	} else if (type && 0 == strcmp(type, "PYNO")) {
+	    if (level > 1) {
+		compress_chunk(ztr, chunk, ZTR_FORM_16TO8,  0, 0);
+		compress_chunk(ztr, chunk,
+			       ZTR_FORM_ZLIB, Z_HUFFMAN_ONLY, 0);
+	    }
+	} else {
+	    if (level <= 2) {
+		/*
+		 * Experiments show that typically a double delta does
+		 * better than a single delta for 8-bit data, and the other
+		 * way around for 16-bit data
+		 */
+		compress_chunk(ztr, chunk, ZTR_FORM_DELTA2,
+			       ztr->delta_level, 0);
 	    } else {
-		if (level <= 2) {
-		    /*
-		     * Experiments show that typically a double delta does
-		     * better than a single delta for 8-bit data, and the other
-		     * way around for 16-bit data
-		     */
-		    compress_chunk(ztr, &ztr->chunk[i], ZTR_FORM_DELTA2,
-				   ztr->delta_level, 0);
-		} else {
-		    compress_chunk(ztr, &ztr->chunk[i], ZTR_FORM_ICHEB,  0, 0);
-		}
-		
-		compress_chunk(ztr, &ztr->chunk[i], ZTR_FORM_16TO8,  0, 0);
-		if (level > 1) {
-		    compress_chunk(ztr, &ztr->chunk[i], ZTR_FORM_FOLLOW1,0, 0);
-		    /*
-		      compress_chunk(ztr, &ztr->chunk[i],
-		                     ZTR_FORM_ZLIB, Z_HUFFMAN_ONLY);
-		    */
-		    compress_chunk(ztr, &ztr->chunk[i], ZTR_FORM_RLE,  150, 0);
-		    compress_chunk(ztr, &ztr->chunk[i],
-		    		   ZTR_FORM_ZLIB, Z_HUFFMAN_ONLY, 0);
-		}
+		compress_chunk(ztr, chunk, ZTR_FORM_ICHEB,  0, 0);
 	    }
-#endif
-	    break;
 
-	case ZTR_TYPE_BASE:
-#ifdef ILLUMINA_GA
-	    compress_chunk(ztr, &ztr->chunk[i], ZTR_FORM_STHUFF, CODE_DNA, 0);
-#else
+	    compress_chunk(ztr, chunk, ZTR_FORM_16TO8,  0, 0);
 	    if (level > 1) {
-		compress_chunk(ztr, &ztr->chunk[i],
+		compress_chunk(ztr, chunk, ZTR_FORM_FOLLOW1,0, 0);
+		/*
+		  compress_chunk(ztr, chunk,
+				 ZTR_FORM_ZLIB, Z_HUFFMAN_ONLY);
+		*/
+		compress_chunk(ztr, chunk, ZTR_FORM_RLE,  150, 0);
+		compress_chunk(ztr, chunk,
 			       ZTR_FORM_ZLIB, Z_HUFFMAN_ONLY, 0);
 	    }
+	}
 #endif
-	    break;
+	break;
 
-	case ZTR_TYPE_CNF1:
-	case ZTR_TYPE_CNF4:
-	case ZTR_TYPE_CSID:
+    case ZTR_TYPE_BASE:
 #ifdef ILLUMINA_GA
-	    compress_chunk(ztr, &ztr->chunk[i], ZTR_FORM_RLE,  77, 0);
-	    compress_chunk(ztr, &ztr->chunk[i],
-			   ZTR_FORM_STHUFF, CODE_CONF_RLE, 0);
+	compress_chunk(ztr, chunk, ZTR_FORM_STHUFF, CODE_DNA, 0);
 #else
-	    compress_chunk(ztr, &ztr->chunk[i], ZTR_FORM_DELTA1, 1, 0);
-	    compress_chunk(ztr, &ztr->chunk[i], ZTR_FORM_RLE,  77, 0);
-	    if (level > 1) {
-		compress_chunk(ztr, &ztr->chunk[i],
-			       ZTR_FORM_ZLIB, Z_HUFFMAN_ONLY, 0);
-	    }
+	if (level > 1) {
+	    compress_chunk(ztr, chunk,
+			   ZTR_FORM_ZLIB, Z_HUFFMAN_ONLY, 0);
+	}
 #endif
-	    break;
+	break;
 
-	case ZTR_TYPE_BPOS:
-	    compress_chunk(ztr, &ztr->chunk[i], ZTR_FORM_DELTA4, 1, 0);
-	    compress_chunk(ztr, &ztr->chunk[i], ZTR_FORM_32TO8,  0, 0);
-	    if (level > 1) {
-		compress_chunk(ztr, &ztr->chunk[i],
-			       ZTR_FORM_ZLIB, Z_HUFFMAN_ONLY, 0);
-	    }
-	    break;
+    case ZTR_TYPE_CNF1:
+    case ZTR_TYPE_CNF4:
+    case ZTR_TYPE_CSID:
+#ifdef ILLUMINA_GA
+	compress_chunk(ztr, chunk, ZTR_FORM_RLE,  77, 0);
+	compress_chunk(ztr, chunk,
+		       ZTR_FORM_STHUFF, CODE_CONF_RLE, 0);
+#else
+	compress_chunk(ztr, chunk, ZTR_FORM_DELTA1, 1, 0);
+	compress_chunk(ztr, chunk, ZTR_FORM_RLE,  77, 0);
+	if (level > 1) {
+	    compress_chunk(ztr, chunk,
+			   ZTR_FORM_ZLIB, Z_HUFFMAN_ONLY, 0);
+	}
+#endif
+	break;
 
-	case ZTR_TYPE_TEXT:
+    case ZTR_TYPE_BPOS:
+	compress_chunk(ztr, chunk, ZTR_FORM_DELTA4, 1, 0);
+	compress_chunk(ztr, chunk, ZTR_FORM_32TO8,  0, 0);
+	if (level > 1) {
+	    compress_chunk(ztr, chunk,
+			   ZTR_FORM_ZLIB, Z_HUFFMAN_ONLY, 0);
+	}
+	break;
+
+    case ZTR_TYPE_TEXT:
 #ifdef ILLUMINA_GA
 #else
-	    if (level > 1) {
-		compress_chunk(ztr, &ztr->chunk[i],
-			       ZTR_FORM_ZLIB, Z_HUFFMAN_ONLY, 0);
-	    }
+	if (level > 1) {
+	    compress_chunk(ztr, chunk,
+			   ZTR_FORM_ZLIB, Z_HUFFMAN_ONLY, 0);
+	}
 #endif
-	    break;
+	break;
 
-	case ZTR_TYPE_FLWO:
-	    compress_chunk(ztr, &ztr->chunk[i], ZTR_FORM_XRLE, 0, 4);
-	    break;
+    case ZTR_TYPE_FLWO:
+	compress_chunk(ztr, chunk, ZTR_FORM_XRLE, 0, 4);
+	break;
+
+    }
+}
+
+typedef struct {
+    ztr_t *ztr;
+    ztr_chunk_t *chunk;
+    int level;
+} compress_ztr_job;
+
+static void *compress_ztr_thread(void *arg) {
+    compress_ztr_job *j = (compress_ztr_job *)arg;
+    compress_ztr_chunk(j->ztr, j->chunk, j->level);
+    return j;
+}
+
+/*
+ * Compresses a ztr (in memory), compressing each chunk as a separate job
+ * on thread pool 'p'. If p is NULL, or there is only one chunk, this is
+ * identical to compress_ztr.
+ *
+ * Must not be called from one of p's own worker threads.
+ *
+ * Returns 0 on success
+ *        -1 on failure
+ */
+int compress_ztr_mt(ztr_t *ztr, int level, struct t_pool *p) {
+    compress_ztr_job *jobs;
+    t_results_queue *q;
+    int i, ret = 0;
+
+    if (0 == level)
+	return 0;
+
+    if (!p || ztr->nchunks < 2) {
+	for (i = 0; i < ztr->nchunks; i++)
+	    compress_ztr_chunk(ztr, &ztr->chunk[i], level);
+	return 0;
+    }
 
+    if (NULL == (jobs = (compress_ztr_job *)xmalloc(ztr->nchunks *
+						    sizeof(*jobs))))
+	return -1;
+    if (NULL == (q = t_results_queue_init())) {
+	xfree(jobs);
+	return -1;
+    }
+
+    for (i = 0; i < ztr->nchunks; i++) {
+	jobs[i].ztr   = ztr;
+	jobs[i].chunk = &ztr->chunk[i];
+	jobs[i].level = level;
+	if (-1 == t_pool_dispatch(p, q, compress_ztr_thread, &jobs[i])) {
+	    /* Compress the remainder here instead */
+	    for (; i < ztr->nchunks; i++)
+		compress_ztr_chunk(ztr, &ztr->chunk[i], level);
+	    break;
 	}
+    }
 
-	/*
-	fprintf(stderr, "Comp length=%d\n", ztr->chunk[i].dlength);
-	*/
+    /* Wait for all dispatched jobs */
+    while (!t_pool_results_queue_empty(q)) {
+	t_pool_result *r = t_pool_next_result_wait(q);
+	if (!r) {
+	    ret = -1;
+	    break;
+	}
+	t_pool_delete_result(r, 0);
     }
 
-    return 0;
+    t_results_queue_destroy(q);
+    xfree(jobs);
+
+    return ret;
+}
+
+/*
+ * Compresses a ztr (in memory).
+ * Level is 0, 1, 2 or 3 (no compression, delta, delta + zlib,
+ * chebyshev + zlib).
+ */
+int compress_ztr(ztr_t *ztr, int level) {
+    return compress_ztr_mt(ztr, level, NULL);
 }
 
 /*
@@ -197,6 +197,8 @@ ztr_t *mfread_ztr(mFILE *fp);
 Read *ztr2read(ztr_t *ztr);
 ztr_t *read2ztr(Read *r);
 int compress_ztr(ztr_t *ztr, int level);
+struct t_pool;
+int compress_ztr_mt(ztr_t *ztr, int level, struct t_pool *p);
 int uncompress_ztr(ztr_t *ztr);
 ztr_t *new_ztr(void);
 void delete_ztr(ztr_t *ztr);
@@ -75,11 +75,17 @@
 #include <string.h>
 #include <fcntl.h>
 #include <unistd.h>
+#include <time.h>
+#include <errno.h>
 
 #include <io_lib/Read.h>
 #include <io_lib/traceType.h>
 #include <io_lib/seqIOABI.h>
 #include <io_lib/open_trace_file.h>
+#include <io_lib/ztr.h>
+#include <io_lib/thread_pool.h>
+#include <io_lib/hash_table.h>
+#include <io_lib/tar_format.h>
 #include <io_lib/misc.h> /* defines MAX and __UNUSED__ */
 
 static char const rcsid[] __UNUSED__ = "$Id: convert_trace.c,v 1.12 2008-02-20 16:07:44 jkbonfield Exp $";
@@ -87,6 +93,9 @@ static char const rcsid[] __UNUSED__ = "$Id: convert_trace.c,v 1.12 2008-02-20 1
 struct opts {
     char *name;
     char *fofn;
+    char *archive;
+    char *tar;
+    char *hash;
     char *passed;
     char *failed;
     char *error;
@@ -104,6 +113,8 @@ struct opts {
     int skipx;
     int start;
     int end;
+    int nthreads;
+    t_pool *pool;	/* For ZTR chunk compression; single traces only */
 };
 
 /*
@@ -563,7 +574,7 @@ int convert(mFILE *infp, mFILE *outfp, char *infname, char *outfname,
     if (opts->compress_mode != -1)
 	set_compression_method(opts->compress_mode);
 
-    if (0 != (mfwrite_reading(outfp, r, opts->out_format))) {
+    if (0 != (mfwrite_reading_mt(outfp, r, opts->out_format, opts->pool))) {
 	fprintf(stderr, "failed to write file %s\n", outfname);
 	read_deallocate(r);
 	return 1;
@@ -574,13 +585,499 @@ int convert(mFILE *infp, mFILE *outfp, char *infname, char *outfname,
 }
 
 
+/* ------------------------------------------------------------------------
+ * Batch conversion, for -fofn and -archive.
+ *
+ * Each input is loaded and its output built entirely in memory, so the
+ * conversions themselves can run on worker threads while the main thread
+ * does all of the file and archive I/O, in list order.
+ */
+
+typedef struct {
+    char *infname;
+    char *outfname;	/* NULL for stdout, or a tar member named infname */
+    mFILE *in;		/* NULL if the input could not be opened */
+    int in_errno;
+    mFILE *out;
+    struct opts *opts;
+    int ret;
+} conv_job;
+
+typedef struct {
+    FILE *tar;		/* -tar output archive, or NULL */
+    char *tarname;
+    uint64_t tar_pos;	/* bytes written to tar so far */
+    HashFile *hf;	/* index of tar, for -hash */
+    FILE *passed;
+    FILE *failed;
+    int ret_all;
+} batch_out;
+
+static conv_job *job_create(char *infname, char *outfname, mFILE *in,
+			    struct opts *opts) {
+    conv_job *j;
+
+    if (NULL == (j = calloc(1, sizeof(*j))))
+	return NULL;
+
+    j->infname  = strdup(infname);
+    j->outfname = outfname ? strdup(outfname) : NULL;
+    j->in       = in;
+    j->in_errno = errno;
+    j->opts     = opts;
+    if (!j->infname || (outfname && !j->outfname) ||
+	NULL == (j->out = mfcreate(NULL, 0))) {
+	free(j->infname);
+	free(j->outfname);
+	free(j);
+	return NULL;
+    }
+
+    return j;
+}
+
+static void job_destroy(conv_job *j) {
+    if (j->in)
+	mfclose(j->in);
+    if (j->out)
+	mfdestroy(j->out);
+    free(j->infname);
+    free(j->outfname);
+    free(j);
+}
+
+static void *convert_job(void *arg) {
+    conv_job *j = (conv_job *)arg;
+
+    if (!j->in) {
+	j->ret = 1;
+	return j;
+    }
+
+    j->ret = convert(j->in, j->out, j->infname,
+		     j->outfname ? j->outfname : "(stdout)", j->opts);
+    return j;
+}
+
+/*
+ * Appends a member to a tar file, adding it to the index too if we're
+ * building one.
+ *
+ * Returns 0 on success
+ *        -1 on failure
+ */
+static int tar_add(batch_out *bo, char *name, char *data, size_t size) {
+    static char zero[TBLOCK];
+    tar_block blk;
+    size_t len = strlen(name), pad;
+    unsigned int sum;
+    char *cp;
+    int i;
+
+    memset(&blk, 0, sizeof(blk));
+
+    /* Long names are split between prefix and name, ustar style */
+    if (len <= NAMSIZ) {
+	memcpy(blk.header.name, name, len);
+    } else {
+	for (cp = name + len - NAMSIZ - 1; *cp && *cp != '/'; cp++)
+	    ;
+	if (!*cp || cp - name > 155 || cp == name) {
+	    fprintf(stderr, "Name too long for tar: %s\n", name);
+	    return -1;
+	}
+	memcpy(blk.header.prefix, name, cp - name);
+	memcpy(blk.header.name, cp+1, len - (cp+1 - name));
+    }
+
+    sprintf(blk.header.mode,  "%07o", 0644);
+    sprintf(blk.header.uid,   "%07o", 0);
+    sprintf(blk.header.gid,   "%07o", 0);
+    sprintf(blk.header.size,  "%011lo", (unsigned long)size);
+    sprintf(blk.header.mtime, "%011lo", (unsigned long)time(NULL));
+    blk.header.typeflag = REGTYPE;
+    memcpy(blk.header.magic, "ustar", 6);
+    memcpy(blk.header.version, "00", 2);
+
+    /* Checksum is computed with the chksum field itself as spaces */
+    memset(blk.header.chksum, ' ', sizeof(blk.header.chksum));
+    for (sum = i = 0; i < TBLOCK; i++)
+	sum += (unsigned char)blk.data[i];
+    sprintf(blk.header.chksum, "%06o", sum);
+
+    pad = (TBLOCK - size % TBLOCK) % TBLOCK;
+    if (1 != fwrite(&blk, TBLOCK, 1, bo->tar) ||
+	size != fwrite(data, 1, size, bo->tar) ||
+	pad != fwrite(zero, 1, pad, bo->tar)) {
+	perror(bo->tarname);
+	return -1;
+    }
+
+    if (bo->hf) {
+	HashFileItem *hfi;
+	HashData hd;
+
+	if (NULL == (hfi = calloc(1, sizeof(*hfi))))
+	    return -1;
+	hfi->pos  = bo->tar_pos + TBLOCK;
+	hfi->size = size;
+	hd.p = hfi;
+	/* As with hash_tar, the first of any duplicate names wins */
+	if (!HashTableAdd(bo->hf->h, name, len, hd, NULL))
+	    return -1;
+    }
+
+    bo->tar_pos += TBLOCK + size + pad;
+
+    return 0;
+}
+
+/*
+ * Writes the output of a completed conversion and updates the progress
+ * and passed/failed lists.
+ */
+static void job_finish(conv_job *j, batch_out *bo) {
+    int ret = j->ret;
+
+    if (!j->in) {
+	char buf[8192+10];
+	sprintf(buf, "ERROR %.8192s", j->infname);
+	errno = j->in_errno;
+	perror(buf);
+	if (j->opts->dots) {
+	    fputc('!', stdout);
+	    fflush(stdout);
+	}
+	if (bo->failed)
+	    fprintf(bo->failed, "%s\n", j->infname);
+	job_destroy(j);
+	return;
+    }
+
+    if (ret == 0) {
+	if (bo->tar) {
+	    if (tar_add(bo, j->outfname ? j->outfname : j->infname,
+			j->out->data, j->out->size))
+		ret = 1;
+	} else if (j->outfname) {
+	    FILE *fp;
+	    if (NULL == (fp = fopen(j->outfname, "wb")) ||
+		j->out->size != fwrite(j->out->data, 1, j->out->size, fp) ||
+		fclose(fp)) {
+		char buf[2048];
+		sprintf(buf, "ERROR %.2000s", j->outfname);
+		perror(buf);
+		ret = 1;
+	    }
+	} else {
+	    mfwrite(j->out->data, 1, j->out->size, mstdout());
+	    mfflush(mstdout());
+	}
+	bo->ret_all |= ret;
+    } else {
+	bo->ret_all |= ret;
+    }
+
+    if (j->opts->dots) {
+	fputc(ret ? '!' : '.', stdout);
+	fflush(stdout);
+    }
+    if (ret) {
+	if (bo->failed)
+	    fprintf(bo->failed, "%s\n", j->infname);
+    } else {
+	if (bo->passed)
+	    fprintf(bo->passed, "%s\n", j->infname);
+    }
+
+    job_destroy(j);
+}
+
+/*
+ * Runs a conversion, either directly or by queueing it on the pool, and
+ * then outputs any conversions that have completed.
+ *
+ * Returns 0 on success
+ *        -1 on failure
+ */
+static int job_run(conv_job *j, t_pool *p, t_results_queue *q,
+		   batch_out *bo) {
+    t_pool_result *r;
+
+    if (!p) {
+	convert_job(j);
+	job_finish(j, bo);
+	return 0;
+    }
+
+    if (-1 == t_pool_dispatch(p, q, convert_job, j))
+	return -1;
+
+    /* Results arrive in dispatch order, so output is in list order */
+    while ((r = t_pool_next_result(q))) {
+	job_finish((conv_job *)r->data, bo);
+	t_pool_delete_result(r, 0);
+    }
+
+    return 0;
+}
+
+/*
+ * Queues a conversion for each "input [output]" line of a file of
+ * filenames. Inputs are looked up via open_trace_mfile() so may also
+ * come from archives listed in RAWDATA.
+ *
+ * Returns 0 on success
+ *        -1 on failure
+ */
+static int batch_fofn(FILE *fofn_fp, struct opts *opts, t_pool *p,
+		      t_results_queue *q, batch_out *bo) {
+    char line[8192], line2[8192];
+    char *infname, *outfname;
+    mFILE *fpin;
+    conv_job *j;
+
+    while (fgets(line, 8192, fofn_fp) != NULL) {
+	int i, k, len;
+	    
+	/* Find input and output name, escaping spaces as needed */
+	len = strlen(line);
+	outfname = NULL;
+	for (i = k = 0; i < len; i++) {
+	    if (line[i] == '\\' && i != len-1) {
+		line2[k++] = line[++i];
+	    } else if (line[i] == ' ') {
+		line2[k++] = 0;
+		outfname = &line2[k];
+	    } else if (line[i] != '\n') {
+		line2[k++] = line[i];
+	    }
+	}
+	line2[k] = 0;
+	infname = line2;
+
+	/* Don't clobber input */
+	if (!bo->tar && outfname && !strcmp(infname, outfname)) {
+	    fprintf(stderr,"* Inputfn %s == Outputfn %s ...skipping\n",
+		    infname, outfname);
+	    if (bo->failed)
+		fprintf(bo->failed, "%s\n", infname);
+	    continue;
+	}
+
+	/* Open input file */
+	if (opts->in_format == TT_EXP) {
+	    fpin = open_exp_mfile(infname, NULL);
+	} else {
+	    fpin = open_trace_mfile(infname, NULL);
+	}
+	/* A NULL fpin is reported in order, when its turn to output comes */
+	if (NULL == (j = job_create(infname, outfname, fpin, opts))) {
+	    if (fpin)
+		mfclose(fpin);
+	    return -1;
+	}
+	if (-1 == job_run(j, p, q, bo))
+	    return -1;
+    }
+
+    return 0;
+}
+
+/*
+ * Queues a conversion for every regular file in a tar archive, read
+ * sequentially so it may also be a pipe.
+ *
+ * Returns 0 on success
+ *        -1 on failure
+ */
+static int batch_tar(FILE *fp, struct opts *opts, t_pool *p,
+		     t_results_queue *q, batch_out *bo) {
+    tar_block blk;
+    char member[1024], *data;
+    int long_name = 0;
+    size_t size, extra;
+    mFILE *mf;
+    conv_job *j;
+
+    while (fread(&blk, sizeof(blk), 1, fp) == 1) {
+	if (!blk.header.name[0] && !blk.header.prefix[0])
+	    break;
+
+	size = strtoul(blk.header.size, NULL, 8);
+	extra = TBLOCK*((size+TBLOCK-1)/TBLOCK) - size;
+
+	if (NULL == (data = malloc(size+extra+1)))
+	    return -1;
+	if (size+extra != fread(data, 1, size+extra, fp)) {
+	    fprintf(stderr, "Truncated tar archive\n");
+	    free(data);
+	    return -1;
+	}
+
+	/* gtar's ././@LongLink holds the name of the next member */
+	if (blk.header.typeflag == 'L') {
+	    size = size < sizeof(member) ? size : sizeof(member)-1;
+	    memcpy(member, data, size);
+	    member[size] = 0;
+	    long_name = 1;
+	    free(data);
+	    continue;
+	}
+
+	if (blk.header.typeflag != REGTYPE &&
+	    blk.header.typeflag != AREGTYPE) {
+	    long_name = 0;
+	    free(data);
+	    continue;
+	}
+
+	if (!long_name) {
+	    member[0] = 0;
+	    if (blk.header.prefix[0])
+		sprintf(member, "%.155s/", blk.header.prefix);
+	    strncat(member, blk.header.name, NAMSIZ);
+	}
+	long_name = 0;
+
+	if (NULL == (mf = mfcreate(data, size))) {
+	    free(data);
+	    return -1;
+	}
+	if (NULL == (j = job_create(member, NULL, mf, opts))) {
+	    mfclose(mf);
+	    return -1;
+	}
+	if (-1 == job_run(j, p, q, bo))
+	    return -1;
+    }
+
+    return 0;
+}
+
+/*
+ * Converts every file listed in opts->fofn or held in opts->archive.
+ * With opts->nthreads > 1 files are converted in parallel.
+ *
+ * Returns 0 if all conversions succeeded
+ *         non-zero otherwise
+ */
+static int batch_convert(struct opts *opts) {
+    batch_out bo;
+    t_pool *p = NULL;
+    t_results_queue *q = NULL;
+    t_pool_result *r;
+    FILE *in_fp;
+    int err;
+
+    memset(&bo, 0, sizeof(bo));
+
+    if (opts->fofn) {
+	in_fp = fopen(opts->fofn, "r");
+    } else {
+	in_fp = strcmp(opts->archive, "-") ? fopen(opts->archive, "rb") : stdin;
+    }
+    if (NULL == in_fp) {
+	perror(opts->fofn ? opts->fofn : opts->archive);
+	return -1;
+    }
+
+    if (opts->passed && NULL == (bo.passed = fopen(opts->passed, "w"))) {
+	perror(opts->passed);
+	return -1;
+    }
+
+    if (opts->failed && NULL == (bo.failed = fopen(opts->failed, "w"))) {
+	perror(opts->failed);
+	return -1;
+    }
+
+    if (opts->tar) {
+	bo.tarname = opts->tar;
+	if (NULL == (bo.tar = fopen(opts->tar, "wb"))) {
+	    perror(opts->tar);
+	    return -1;
+	}
+	if (opts->hash) {
+	    if (NULL == (bo.hf = HashFileCreate(0, HASH_DYNAMIC_SIZE)))
+		return -1;
+	    bo.hf->narchives = 1;
+	    bo.hf->archives = malloc(sizeof(char *));
+	    if (!bo.hf->archives ||
+		NULL == (bo.hf->archives[0] = strdup(opts->tar)))
+		return -1;
+	}
+    }
+
+    if (opts->nthreads > 1) {
+	if (NULL == (p = t_pool_init(opts->nthreads*2, opts->nthreads)) ||
+	    NULL == (q = t_results_queue_init()))
+	    return -1;
+    }
+
+    err = opts->fofn
+	? batch_fofn(in_fp, opts, p, q, &bo)
+	: batch_tar(in_fp, opts, p, q, &bo);
+
+    /* Output the remaining conversions */
+    if (p) {
+	while (!t_pool_results_queue_empty(q)) {
+	    if (NULL == (r = t_pool_next_result_wait(q)))
+		break;
+	    job_finish((conv_job *)r->data, &bo);
+	    t_pool_delete_result(r, 0);
+	}
+	t_results_queue_destroy(q);
+	t_pool_destroy(p, 0);
+    }
+
+    if (in_fp != stdin)
+	fclose(in_fp);
+
+    if (bo.tar) {
+	/* End of archive marker is two empty blocks */
+	static char zero[2*TBLOCK];
+	if (1 != fwrite(zero, 2*TBLOCK, 1, bo.tar) || fclose(bo.tar)) {
+	    perror(opts->tar);
+	    err = -1;
+	}
+    }
+
+    if (bo.hf) {
+	FILE *fp;
+	if (NULL == (fp = fopen(opts->hash, "wb"))) {
+	    perror(opts->hash);
+	    err = -1;
+	} else {
+	    HashFileSave(bo.hf, fp, 0);
+	    if (fclose(fp)) {
+		perror(opts->hash);
+		err = -1;
+	    }
+	}
+	HashFileDestroy(bo.hf);
+    }
+
+    if (bo.passed)
+	fclose(bo.passed);
+    if (bo.failed)
+	fclose(bo.failed);
+
+    return err ? -1 : bo.ret_all;
+}
+
+
 void usage(void) {
     puts("Usage: convert_trace [options] [informat outformat] < in > out");
     puts("Or     convert_trace [options] -fofn file_of_filenames");
+    puts("Or     convert_trace [options] -archive tarfile");
     puts("\nOptions are:");
     puts("    -in_format format         Format for input (defaults to any");
     puts("    -out_format format        Format for output (default ztr)");
     puts("    -fofn file_of_filenames   Get \"Input Output\" names from a fofn");
+    puts("    -archive tarfile          Convert every file in a tar archive (- for stdin)");
+    puts("    -tar tarfile              Write -fofn/-archive output to a tar archive");
+    puts("    -hash hashfile            Also write a hash_tar style index of -tar");
     puts("    -passed fofn              Output fofn of passed names");  
     puts("    -error errs               Redirect stderr to file \"errs\"");
     puts("    -failed fofn              Output fofn of failed names");  
@@ -594,12 +1091,15 @@ void usage(void) {
     puts("    -abi_data counts          ABI DATA lanes to copy: eg 9,10,11,12");
     puts("    -signed                   Apply global shift to avoid negative values");
     puts("    -noneg                    Shift each channel independently to avoid -ve");
+    puts("    -threads N                Use N threads; per file with -fofn/-archive,");
+    puts("                              else per ZTR chunk");
     puts("    --                        Explicitly state end of options");
     exit(1);
 }
 
 int main(int argc, char **argv) {
     struct opts opts;
+    int ret;
 
     opts.in_format = TT_ANY;
     opts.out_format = TT_ZTR;
@@ -614,12 +1114,17 @@ int main(int argc, char **argv) {
     opts.noneg = 0;
     opts.signed_trace = 0;
     opts.fofn = NULL;
+    opts.archive = NULL;
+    opts.tar = NULL;
+    opts.hash = NULL;
     opts.passed = NULL;
     opts.failed = NULL;
     opts.error = NULL;
     opts.skipx = 0;
     opts.start = -1;
     opts.end = -1;
+    opts.nthreads = 1;
+    opts.pool = NULL;
     
     for (argc--, argv++; argc > 0; argc--, argv++) {
 	if (**argv != '-')
@@ -641,6 +1146,18 @@ int main(int argc, char **argv) {
 	    opts.fofn = *++argv;
 	    argc--;
 
+	} else if (strcmp(*argv, "-archive") == 0) {
+	    opts.archive = *++argv;
+	    argc--;
+
+	} else if (strcmp(*argv, "-tar") == 0) {
+	    opts.tar = *++argv;
+	    argc--;
+
+	} else if (strcmp(*argv, "-hash") == 0) {
+	    opts.hash = *++argv;
+	    argc--;
+
 	} else if (strcmp(*argv, "-passed") == 0) {
 	    opts.passed = *++argv;
 	    argc--;
@@ -679,6 +1196,10 @@ int main(int argc, char **argv) {
 	} else if (strcmp(*argv, "-skipx") == 0) {
 	    opts.skipx = 1;
 
+	} else if (strcmp(*argv, "-threads") == 0) {
+	    opts.nthreads = atoi(*++argv);
+	    argc--;
+
 	} else if (strcmp(*argv, "-in_format") == 0) {
 	    argv++;
 	    argc--;
@@ -744,123 +1265,24 @@ int main(int argc, char **argv) {
 	}
     }
 
-    if (!opts.fofn) {
-	return convert(mstdin(), mstdout(), "(stdin)", "(stdout)", &opts);
-    }
-
-    /* else */ {
-	mFILE *fpin, *fpout;
-	FILE *fppassed = NULL, *fpfailed = NULL;
-	char *infname, *outfname;
-	int ret, ret_all = 0;
-	char line[8192], line2[8192];
-
-	FILE *fofn_fp;
-
-	if (NULL == (fofn_fp = fopen(opts.fofn, "r"))) {
-	    perror(opts.fofn);
-	    return -1;
-	}
-
-	if (opts.passed && NULL == (fppassed = fopen(opts.passed, "w"))) {
-	    perror(opts.passed);
-	    return -1;
-	}
-
-	if (opts.failed && NULL == (fpfailed = fopen(opts.failed, "w"))) {
-	    perror(opts.failed);
-	    return -1;
-	}
-
-	while (fgets(line, 8192, fofn_fp) != NULL) {
-	    int i, j, len;
-	    
-	    /* Find input and output name, escaping spaces as needed */
-	    len = strlen(line);
-	    outfname = NULL;
-	    for (i = j = 0; i < len; i++) {
-		if (line[i] == '\\' && i != len-1) {
-		    line2[j++] = line[++i];
-		} else if (line[i] == ' ') {
-		    line2[j++] = 0;
-		    outfname = &line2[j];
-		} else if (line[i] != '\n') {
-		    line2[j++] = line[i];
-		}
-	    }
-	    line2[j] = 0;
-	    infname = line2;
-
-	    /* Don't clobber input */
-	    if (!strcmp(infname, outfname)) {
-		fprintf(stderr,"* Inputfn %s == Outputfn %s ...skipping\n",
-			infname, outfname);
-		if (fpfailed)
-		    fprintf(fpfailed, "%s\n", infname);
-		continue;
-	    }
-
-	    /* Open input and output files */
-	    if (opts.in_format == TT_EXP) {
-		fpin = open_exp_mfile(infname, NULL);
-	    } else {
-		fpin = open_trace_mfile(infname, NULL);
-	    }
-	    if (NULL == fpin) {
-		char buf[8192+10];
-		sprintf(buf, "ERROR %s", infname);
-		perror(buf);
-		if (opts.dots) {
-		    fputc('!', stdout);
-		    fflush(stdout);
-		}
-		if (fpfailed)
-		    fprintf(fpfailed, "%s\n", infname);
-		continue;
-	    }
+    if ((opts.fofn && opts.archive) ||
+	((opts.tar || opts.hash) && !opts.fofn && !opts.archive) ||
+	(opts.hash && !opts.tar))
+	usage();
 
-	    if (outfname) {
-		if (NULL == (fpout = mfopen(outfname, "wb+"))) {
-		    char buf[2048];
-		    sprintf(buf, "ERROR %s", outfname);
-		    perror(buf);
-		    mfclose(fpin);
-		    if (opts.dots) {
-			fputc('!', stdout);
-			fflush(stdout);
-		    }
-		    if (fpfailed)
-			fprintf(fpfailed, "%s\n", infname);
-		    continue;
-		}
-	    } else {
-		outfname = "(stdout)";
-		fpout = mstdout();
-	    }
+    if (opts.fofn || opts.archive)
+	return batch_convert(&opts);
 
-	    /* Convert */
-	    ret = convert(fpin, fpout, infname, outfname, &opts);
-	    ret_all |= ret;
-	    if (opts.dots) {
-		fputc(ret ? '!' : '.', stdout);
-		fflush(stdout);
-	    }
-	    if (ret) {
-		if (fpfailed)
-		    fprintf(fpfailed, "%s\n", infname);
-	    } else {
-		if (fppassed)
-		    fprintf(fppassed, "%s\n", infname);
-	    }
+    /* Single trace, so parallelise within it instead */
+    if (opts.nthreads > 1) {
+	if (NULL == (opts.pool = t_pool_init(opts.nthreads*2, opts.nthreads)))
+	    return 1;
+    }
 
-	    /* Tidy up */
-	    mfclose(fpin);
-	    if (fpout != mstdout())
-		mfclose(fpout);
-	}
+    ret = convert(mstdin(), mstdout(), "(stdin)", "(stdout)", &opts);
 
-	fclose(fofn_fp);
+    if (opts.pool)
+	t_pool_destroy(opts.pool, 0);
 
-	return ret_all;
-    }
+    return ret;
 }
@@ -110,7 +110,7 @@ cram_block_compression_hdr_decoder2encoder(cram_fd *fd_in, cram_fd *fd_out, cram
     }
 
     // Fix tag encoding map.
-    if (!(c->tags_used = HashTableCreate(16, HASH_DYNAMIC_SIZE)))
+    if (!(c->tags_used = FHashTableCreate(16, 0)))
 	return -1;
 
     for (i = 0; i < CRAM_MAP_HASH; i++) {
@@ -128,7 +128,8 @@ cram_block_compression_hdr_decoder2encoder(cram_fd *fd_in, cram_fd *fd_out, cram
 	    key[1] = (m->key>> 8)&0xff;
 	    key[2] = (m->key>> 0)&0xff;
 		
-	    HashTableAdd(c->tags_used, (char *)key, 3, hd, NULL);
+	    if (!FHashTableAdd(c->tags_used, (char *)key, 3, hd, NULL))
+		return -1;
 	}
     }
 
@@ -240,11 +241,9 @@ static int process_comp_hdr(cram_fd *fd_in, cram_fd *fd_out, HashTable *ds_h,
     // If we have any tags listed in keep_aux, then explicitly
     // consider all others as candidate for removal.
     if (keep_aux) {
-	HashItem *hi;
-	HashIter *iter = HashTableIterCreate();
-	if (!iter)
-	    return -1;
-	while ((hi = HashTableIterNext(c->tags_used, iter))) {
+	FHashItem *hi;
+	int iter = 0;
+	while ((hi = FHashTableIterNext(c->tags_used, &iter))) {
 	    if (!tag_to_keep[hi->key[0]&0x7f][hi->key[1]&0x7f]) {
 		uintptr_t k = (uintptr_t)((hi->key[0]<<16)|
 					  (hi->key[1]<<8));
@@ -253,7 +252,6 @@ static int process_comp_hdr(cram_fd *fd_in, cram_fd *fd_out, HashTable *ds_h,
 		HashTableAdd(ds_h, (char *)k, sizeof(k), hd, NULL);
 	    }
 	}
-	HashTableIterDestroy(iter);
     }
     
     return 0;
@@ -273,8 +271,8 @@ static int find_tags_to_del(cram_fd *fd_in,
 			    cram_container *c,
 			    char (*tag_to_keep)[128],
 			    char (*tag_to_del)[128]) {
-    HashItem *hi;
-    HashIter *iter;
+    FHashItem *hi;
+    int iter = 0;
 
     if (ds_to_id(c->comp_hdr, c->comp_hdr->rec_encoding_map,
 		 (char *)c->comp_hdr_block->data, ds_h, ci_h))
@@ -286,10 +284,7 @@ static int find_tags_to_del(cram_fd *fd_in,
     // Work out which tags we will be removing.
     // This is based on the ones we requested in ds_h and the
     // ones we can according to ci_h.
-    if (!(iter = HashTableIterCreate()))
-	return -1;
-
-    while ((hi = HashTableIterNext(c->tags_used, iter))) {
+    while ((hi = FHashTableIterNext(c->tags_used, &iter))) {
 	uintptr_t k = (uintptr_t)((hi->key[0]<<16)|
 				  (hi->key[1]<<8));
 
@@ -323,7 +318,6 @@ static int find_tags_to_del(cram_fd *fd_in,
 	//printf("tag_to_del[%c][%c]=%d(*)\n", hi->key[0], hi->key[1], 1-keep);
 	tag_to_del[hi->key[0]&0x7f][hi->key[1]&0x7f] = 1-keep;
     }
-    HashTableIterDestroy(iter);
 
     return 0;
 }
@@ -367,7 +361,7 @@ static int filter_container(cram_fd *fd_in, cram_fd *fd_out,
     int j;
 
     c->curr_slice = 0;
-    c->slices = calloc(c->num_landmarks, sizeof(*c->slices));
+    c->slices = arena_calloc(c->arena, c->num_landmarks, sizeof(*c->slices));
     if (!c->slices)
 	return -1;
     // assume slices in container have same no. blocks
@@ -664,7 +658,7 @@ int filter_blocks(cram_fd *fd_in, cram_fd *fd_out, HashTable *ds_h,
 	if (cram_flush_container2(fd_out, c) != 0)
 	    return -1;
 	    
-	HashTableDestroy(c->tags_used, 1);
+	FHashTableDestroy(c->tags_used, 1);
 	c->tags_used = NULL; // Avoids freeing codecs twice.
 	cram_free_container(c);
 
@@ -677,7 +671,7 @@ int filter_blocks(cram_fd *fd_in, cram_fd *fd_out, HashTable *ds_h,
     return 0;
 
  tidy:
-    HashTableDestroy(c->tags_used, 1);
+    FHashTableDestroy(c->tags_used, 1);
     c->tags_used = NULL; // Avoids freeing codecs twice.
     cram_free_container(c);
     if (ci_h)
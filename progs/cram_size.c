@@ -35,6 +35,10 @@
  * A cut down version of cram_dump.c to accumulate only size
  * information per data series.  This is much faster than cram_dump as
  * it does not require uncompression of data blocks.
+ *
+ * Optionally it can also uncompress the blocks to report the ratio and
+ * CPU cost per content_id and per compression method, and/or only look
+ * at a sample of containers.  Containers may be scanned in parallel.
  */
 
 #ifdef HAVE_CONFIG_H
@@ -42,16 +46,56 @@
 #endif
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <assert.h>
 #include <ctype.h>
 #include <string.h>
 #include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#if defined(__MINGW32__) || defined(__FreeBSD__) || defined(__APPLE__)
+#   include <getopt.h>
+#endif
 
 #include <io_lib/cram.h>
+#include <io_lib/thread_pool.h>
 
 // Variable sized integer function pointers.
 varint_vec vv;
 
+#define NMETHODS (ARITH_PR8+1)
+
+// Decompression cost, accumulated with -d
+typedef struct {
+    int64_t nblocks;
+    int64_t comp, uncomp;
+    double cpu;
+} block_cost;
+
+// All the tallies, shared between threads
+typedef struct {
+    HashTable *bsize_h;
+    HashTable *ds_h; // content_id to data-series lookup.
+    HashTable *dc_h; // content_id to data-compression lookup
+    HashTable *cost_h; // content_id to block_cost
+    block_cost method_cost[NMETHODS];
+    int bmax;
+    int decompress;
+    pthread_mutex_t lock;
+} size_stats;
+
+static double cpu_time(void) {
+#ifdef CLOCK_THREAD_CPUTIME_ID
+    struct timespec ts;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+#else
+    return (double)clock() / CLOCKS_PER_SEC;
+#endif
+}
+
 // Accumulate per {data_series, content_id} combination.
 void ParseMap(cram_block_compression_hdr *hdr,
 	      cram_map **ma, char *data, HashTable *ds_h) {
@@ -176,194 +220,597 @@ void print_sizes(HashTable *bsize_h, HashTable *ds_h, HashTable *dc_h, int bmax)
     }
 }
 
-int process_sizes(cram_fd *fd,
-		  HashTable *bsize_h, HashTable *ds_h, HashTable *dc_h,
-		  int *bmax) {
-    cram_container *c;
-    off_t pos, pos2, hpos;
+/*
+ * Uncompresses all blocks in a slice, timing each.  Called without the
+ * lock held; the costs are added to a slice-local array.
+ */
+static int time_slice(cram_slice *s, block_cost *cost, double *cpu) {
+    int id;
+
+    for (id = 0; id < s->hdr->num_blocks; id++) {
+	cram_block *b = s->block[id];
+	double t = cpu_time();
+
+	cost[id].comp = b->comp_size;
+	if (cram_uncompress_block(b))
+	    return -1;
+	cost[id].uncomp = b->uncomp_size;
+	cpu[id] = cpu_time() - t;
+    }
 
-    pos = CRAM_IO_TELLO(fd);
-    while ((c = cram_read_container(fd))) {
-	int j;
+    return 0;
+}
 
-	if (fd->err) {
-	    perror("Cram container read");
-	    return 1;
-	}
+static void add_cost(block_cost *to, block_cost *c, double cpu) {
+    to->nblocks++;
+    to->comp   += c->comp;
+    to->uncomp += c->uncomp;
+    to->cpu    += cpu;
+}
+
+/*
+ * Accumulates the sizes of a single container, whose header has already
+ * been read.  pos is the file offset of the start of the container.
+ */
+int process_container(cram_fd *fd, cram_container *c, off_t pos,
+		      size_stats *st) {
+    off_t pos2, hpos;
+    int j;
 
-	hpos = CRAM_IO_TELLO(fd);
+    hpos = CRAM_IO_TELLO(fd);
 
-	if (!c->length) {
-	    pos = CRAM_IO_TELLO(fd);
-	    continue;
-	}
-	if (!(c->comp_hdr_block = cram_read_block(fd)))
-	    return 1;
-	assert(c->comp_hdr_block->content_type == COMPRESSION_HEADER);
+    if (!c->length)
+	return 0;
 
-	c->comp_hdr = cram_decode_compression_header(fd, c->comp_hdr_block);
-	if (!c->comp_hdr)
-	    return 1;
+    if (!(c->comp_hdr_block = cram_read_block(fd)))
+	return 1;
+    assert(c->comp_hdr_block->content_type == COMPRESSION_HEADER);
 
-	ParseMap(c->comp_hdr, c->comp_hdr->rec_encoding_map,
-		 (char *)c->comp_hdr_block->data, ds_h);
-	ParseMap(c->comp_hdr, c->comp_hdr->tag_encoding_map,
-		 (char *)c->comp_hdr_block->data, ds_h);
+    c->comp_hdr = cram_decode_compression_header(fd, c->comp_hdr_block);
+    if (!c->comp_hdr)
+	return 1;
 
-	for (j = 0; j < c->num_landmarks; j++) {
-	    cram_slice *s;
-	    int id;
-	    
-	    pos2 = CRAM_IO_TELLO(fd);
-	    assert(pos2 - pos - c->offset == c->landmark[j]);
-
-	    s = cram_read_slice(fd);
-	    
-	    // Accumulate per block content_id
-	    for (id = 0; id < s->hdr->num_blocks; id++) {
-		HashItem *hi;
-		intptr_t k = s->block[id]->content_type == CORE
-		    ? -1 : s->block[id]->content_id;
-		hi = HashTableSearch(bsize_h, (char *)k, sizeof(k));
-		if (hi) {
-		    hi->data.i += s->block[id]->comp_size;
-		} else {
-		    HashData hd;
-		    hd.i = s->block[id]->comp_size;
-		    HashTableAdd(bsize_h, (char *)k, sizeof(k), hd, NULL);
-		}
+    pthread_mutex_lock(&st->lock);
+    ParseMap(c->comp_hdr, c->comp_hdr->rec_encoding_map,
+	     (char *)c->comp_hdr_block->data, st->ds_h);
+    ParseMap(c->comp_hdr, c->comp_hdr->tag_encoding_map,
+	     (char *)c->comp_hdr_block->data, st->ds_h);
+    pthread_mutex_unlock(&st->lock);
 
-		// WARNING: scuppered by having high content_id values.
-		if (*bmax < s->block[id]->content_id)
-		    *bmax = s->block[id]->content_id;
-	    }
+    for (j = 0; j < c->num_landmarks; j++) {
+	cram_slice *s;
+	int id;
+	block_cost *cost = NULL;
+	double *cpu = NULL;
 
-	    // Hack for rans1
-	    for (id = 0; id < s->hdr->num_blocks; id++) {
-		if (s->block[id]->comp_size >= 2 &&
-		    s->block[id]->orig_method == RANS0 &&
-		    s->block[id]->data[0] != 0)
-		    s->block[id]->orig_method = RANS1;
-	    }
+	pos2 = CRAM_IO_TELLO(fd);
+	assert(pos2 - pos - c->offset == c->landmark[j]);
+
+	if (!(s = cram_read_slice(fd)))
+	    return 1;
 
-	    // Hack for ransPR*
-	    for (id = 0; id < s->hdr->num_blocks; id++) {
-		if (s->block[id]->comp_size >= 2 &&
-		    s->block[id]->orig_method == RANS_PR0 &&
-		    s->block[id]->data[0] != 0) {
-		    // Assumption: PR1 to PR193 are consecutive
-		    s->block[id]->orig_method = RANS_PR1-1;
-		    s->block[id]->orig_method +=    s->block[id]->data[0]&0x01;
-		    s->block[id]->orig_method += 2*((s->block[id]->data[0]&0x40)>0);
-		    s->block[id]->orig_method += 4*((s->block[id]->data[0]&0x80)>0);
+	// Hack for rans1
+	for (id = 0; id < s->hdr->num_blocks; id++) {
+	    if (s->block[id]->comp_size >= 2 &&
+		s->block[id]->orig_method == RANS0 &&
+		s->block[id]->data[0] != 0)
+		s->block[id]->orig_method = RANS1;
+	}
+
+	// Hack for ransPR*
+	for (id = 0; id < s->hdr->num_blocks; id++) {
+	    if (s->block[id]->comp_size >= 2 &&
+		s->block[id]->orig_method == RANS_PR0 &&
+		s->block[id]->data[0] != 0) {
+		// Assumption: PR1 to PR193 are consecutive
+		s->block[id]->orig_method = RANS_PR1-1;
+		s->block[id]->orig_method +=    s->block[id]->data[0]&0x01;
+		s->block[id]->orig_method += 2*((s->block[id]->data[0]&0x40)>0);
+		s->block[id]->orig_method += 4*((s->block[id]->data[0]&0x80)>0);
 
-		}
 	    }
+	}
 
-	    // Hack for arithPR*
-	    for (id = 0; id < s->hdr->num_blocks; id++) {
-		if (s->block[id]->comp_size >= 2 &&
-		    s->block[id]->orig_method == ARITH_PR0 &&
-		    s->block[id]->data[0] != 0) {
-		    // Assumption: PR1 to PR193 are consecutive
-		    s->block[id]->orig_method = ARITH_PR1-1;
-		    s->block[id]->orig_method +=    s->block[id]->data[0]&0x01;
-		    s->block[id]->orig_method += 2*((s->block[id]->data[0]&0x40)>0);
-		    s->block[id]->orig_method += 4*((s->block[id]->data[0]&0x80)>0);
-		}
+	// Hack for arithPR*
+	for (id = 0; id < s->hdr->num_blocks; id++) {
+	    if (s->block[id]->comp_size >= 2 &&
+		s->block[id]->orig_method == ARITH_PR0 &&
+		s->block[id]->data[0] != 0) {
+		// Assumption: PR1 to PR193 are consecutive
+		s->block[id]->orig_method = ARITH_PR1-1;
+		s->block[id]->orig_method +=    s->block[id]->data[0]&0x01;
+		s->block[id]->orig_method += 2*((s->block[id]->data[0]&0x40)>0);
+		s->block[id]->orig_method += 4*((s->block[id]->data[0]&0x80)>0);
 	    }
+	}
 
-	    // Accumulate per {id, compression_method} combo
-	    for (id = 0; id < s->hdr->num_blocks; id++) {
+	pthread_mutex_lock(&st->lock);
+	// Accumulate per block content_id
+	for (id = 0; id < s->hdr->num_blocks; id++) {
+	    HashItem *hi;
+	    intptr_t k = s->block[id]->content_type == CORE
+		? -1 : s->block[id]->content_id;
+	    hi = HashTableSearch(st->bsize_h, (char *)k, sizeof(k));
+	    if (hi) {
+		hi->data.i += s->block[id]->comp_size;
+	    } else {
 		HashData hd;
-		HashItem *hi;
-		cram_block *b = s->block[id];
-		struct {
-		    int id;
-		    enum cram_block_method method;
-		} id_type = {b->content_id, b->orig_method};
-		hd.i = 0;
-		hi = HashTableAdd(dc_h, (char *)&id_type, sizeof(id_type), hd, NULL);
-		hi->data.i++;
-
-		int t, m;
-		char fields[1024], *fp = fields;
-		for (m = 0; m < 2; m++) {
-		    cram_map **ma = m
-			? c->comp_hdr->tag_encoding_map
-			: c->comp_hdr->rec_encoding_map;
+		hd.i = s->block[id]->comp_size;
+		HashTableAdd(st->bsize_h, (char *)k, sizeof(k), hd, NULL);
+	    }
+
+	    // WARNING: scuppered by having high content_id values.
+	    if (st->bmax < s->block[id]->content_id)
+		st->bmax = s->block[id]->content_id;
+	}
+
+	// Accumulate per {id, compression_method} combo
+	for (id = 0; id < s->hdr->num_blocks; id++) {
+	    HashData hd;
+	    HashItem *hi;
+	    cram_block *b = s->block[id];
+	    struct {
+		int id;
+		enum cram_block_method method;
+	    } id_type = {b->content_id, b->orig_method};
+	    hd.i = 0;
+	    hi = HashTableAdd(st->dc_h, (char *)&id_type, sizeof(id_type), hd, NULL);
+	    hi->data.i++;
+
+	    int t, m;
+	    char fields[1024], *fp = fields;
+	    for (m = 0; m < 2; m++) {
+		cram_map **ma = m
+		    ? c->comp_hdr->tag_encoding_map
+		    : c->comp_hdr->rec_encoding_map;
 			
-		    for (t = 0; t < CRAM_MAP_HASH; t++) {
-			cram_map *m;
-			unsigned char *data = c->comp_hdr_block->data;
-			for (m = ma[t]; m; m = m->next) {
-			    if (m->encoding != E_EXTERNAL &&
-				m->encoding != E_VARINT_UNSIGNED &&
-				m->encoding != E_VARINT_SIGNED &&
-				m->encoding != E_BYTE_ARRAY_STOP &&
-				m->encoding != E_BYTE_ARRAY_LEN)
-				continue;
-			    if (data[m->offset + m->size-1] != b->content_id)
-				continue;
-			    if ((m->key>>16)&0xff)
-				*fp++ = (m->key>>16)&0xff;
-			    *fp++ = (m->key>> 8)&0xff;
-			    *fp++ = (m->key>> 0)&0xff;
-			    *fp++ = ' ';
-			}
+		for (t = 0; t < CRAM_MAP_HASH; t++) {
+		    cram_map *m;
+		    unsigned char *data = c->comp_hdr_block->data;
+		    for (m = ma[t]; m; m = m->next) {
+			if (m->encoding != E_EXTERNAL &&
+			    m->encoding != E_VARINT_UNSIGNED &&
+			    m->encoding != E_VARINT_SIGNED &&
+			    m->encoding != E_BYTE_ARRAY_STOP &&
+			    m->encoding != E_BYTE_ARRAY_LEN)
+			    continue;
+			if (data[m->offset + m->size-1] != b->content_id)
+			    continue;
+			if ((m->key>>16)&0xff)
+			    *fp++ = (m->key>>16)&0xff;
+			*fp++ = (m->key>> 8)&0xff;
+			*fp++ = (m->key>> 0)&0xff;
+			*fp++ = ' ';
 		    }
 		}
-		*fp++ = 0;
 	    }
+	    *fp++ = 0;
+	}
 
-	    cram_free_slice(s);
+	pthread_mutex_unlock(&st->lock);
+
+	if (st->decompress) {
+	    cost = calloc(s->hdr->num_blocks, sizeof(*cost));
+	    cpu  = calloc(s->hdr->num_blocks, sizeof(*cpu));
+	    if (!cost || !cpu || time_slice(s, cost, cpu)) {
+		fprintf(stderr, "Failed to uncompress slice\n");
+		free(cost);
+		free(cpu);
+		cram_free_slice(s);
+		return 1;
+	    }
 	}
 
-	pos = CRAM_IO_TELLO(fd);
-	assert(pos == hpos + c->length);
+	// Decompression costs
+	if (cost)
+	    pthread_mutex_lock(&st->lock);
+	for (id = 0; cost && id < s->hdr->num_blocks; id++) {
+	    cram_block *b = s->block[id];
+	    intptr_t k = b->content_type == CORE ? -1 : b->content_id;
+	    HashItem *hi;
+	    HashData hd;
+
+	    hd.p = NULL;
+	    hi = HashTableAdd(st->cost_h, (char *)k, sizeof(k), hd, NULL);
+	    if (!hi->data.p && !(hi->data.p = calloc(1, sizeof(block_cost))))
+		break;
+	    add_cost((block_cost *)hi->data.p, &cost[id], cpu[id]);
+
+	    if (b->orig_method >= 0 && b->orig_method < NMETHODS)
+		add_cost(&st->method_cost[b->orig_method], &cost[id], cpu[id]);
+	}
+	if (cost)
+	    pthread_mutex_unlock(&st->lock);
+
+	free(cost);
+	free(cpu);
+	cram_free_slice(s);
+    }
+
+    pos = CRAM_IO_TELLO(fd);
+    assert(pos == hpos + c->length);
+
+    return 0;
+}
+
+/*
+ * Reads all containers sequentially.
+ */
+int process_sizes(cram_fd *fd, size_stats *st) {
+    cram_container *c;
+    off_t pos;
+
+    pos = CRAM_IO_TELLO(fd);
+    while ((c = cram_read_container(fd))) {
+	if (fd->err) {
+	    perror("Cram container read");
+	    return 1;
+	}
 
+	if (process_container(fd, c, pos, st))
+	    return 1;
 	cram_free_container(c);
+
+	pos = CRAM_IO_TELLO(fd);
     }
 
     return 0;
 }
 
+/*
+ * Obtains the file offsets of containers, either from the index or by
+ * skipping through the container headers.  The index lists containers
+ * once per slice, so duplicates are removed.
+ *
+ * Returns the number of containers on success, storing the offsets in
+ * *offsets;
+ *        -1 on failure
+ */
+static int off_cmp(const void *a, const void *b) {
+    off_t x = *(const off_t *)a, y = *(const off_t *)b;
+    return (x > y) - (x < y);
+}
+
+static int add_offset(off_t **offsets, int *n, int *alloc, off_t off) {
+    if (*n == *alloc) {
+	off_t *o;
+	*alloc = *alloc ? *alloc*2 : 1024;
+	if (!(o = realloc(*offsets, *alloc * sizeof(*o))))
+	    return -1;
+	*offsets = o;
+    }
+    (*offsets)[(*n)++] = off;
+    return 0;
+}
+
+static int index_offsets(cram_index *e, off_t **offsets, int *n,
+			 int *alloc) {
+    int i;
+
+    for (i = 0; i < e->nslice; i++) {
+	if (add_offset(offsets, n, alloc, e->e[i].offset) ||
+	    index_offsets(&e->e[i], offsets, n, alloc))
+	    return -1;
+    }
+
+    return 0;
+}
+
+int container_offsets(cram_fd *fd, char *fn, int use_index,
+		      off_t **offsets) {
+    int n = 0, alloc = 0, i, j;
+    char fn_idx[PATH_MAX];
+
+    *offsets = NULL;
+    snprintf(fn_idx, PATH_MAX, "%s.crai", fn);
+
+    if (use_index && access(fn_idx, R_OK) == 0 &&
+	cram_index_load(fd, fn) == 0) {
+	for (i = 0; i < fd->index_sz; i++)
+	    if (index_offsets(&fd->index[i], offsets, &n, &alloc))
+		return -1;
+    } else {
+	cram_container *c;
+	off_t pos = CRAM_IO_TELLO(fd);
+
+	while ((c = cram_read_container(fd))) {
+	    int len = c->length;
+	    cram_free_container(c);
+
+	    if (add_offset(offsets, &n, &alloc, pos))
+		return -1;
+	    if (cram_seek(fd, len, SEEK_CUR))
+		return -1;
+	    pos = CRAM_IO_TELLO(fd);
+	}
+	if (fd->err)
+	    return -1;
+    }
+
+    if (n == 0)
+	return 0;
+
+    qsort(*offsets, n, sizeof(**offsets), off_cmp);
+    for (i = j = 1; i < n; i++)
+	if ((*offsets)[i] != (*offsets)[j-1])
+	    (*offsets)[j++] = (*offsets)[i];
+
+    return j;
+}
+
+/*
+ * A batch of containers to be processed on its own file handle.
+ */
+typedef struct {
+    char *fn;
+    off_t *offsets;
+    int n;
+    size_stats *st;
+    int ret;
+} size_job;
+
+static void *size_thread(void *arg) {
+    size_job *j = (size_job *)arg;
+    cram_fd *fd;
+    int i;
+
+    j->ret = 1;
+    if (!(fd = cram_open(j->fn, "rb")))
+	return j;
+
+    for (i = 0; i < j->n; i++) {
+	cram_container *c;
+
+	if (cram_seek(fd, j->offsets[i], SEEK_SET) ||
+	    !(c = cram_read_container(fd)) || fd->err)
+	    goto err;
+
+	if (process_container(fd, c, j->offsets[i], j->st)) {
+	    cram_free_container(c);
+	    goto err;
+	}
+	cram_free_container(c);
+    }
+    j->ret = 0;
+
+ err:
+    cram_close(fd);
+    return j;
+}
+
+/*
+ * Processes the containers at the listed offsets, in batches spread over
+ * the thread pool (or serially if p is NULL).
+ *
+ * Returns 0 on success
+ *         1 on failure
+ */
+int process_offsets(char *fn, off_t *offsets, int n, t_pool *p,
+		    size_stats *st) {
+    t_results_queue *q = NULL;
+    t_pool_result *r;
+    int i, batch, ret = 0, pending = 0;
+
+    batch = p ? (n + p->tsize*4 - 1) / (p->tsize*4) : n;
+    if (batch < 1)
+	batch = 1;
+
+    if (p && !(q = t_results_queue_init()))
+	return 1;
+
+    for (i = 0; i < n; i += batch) {
+	size_job *j = malloc(sizeof(*j));
+	if (!j) {
+	    ret = 1;
+	    break;
+	}
+	j->fn = fn;
+	j->offsets = offsets + i;
+	j->n = MIN(batch, n - i);
+	j->st = st;
+
+	if (!p) {
+	    ret |= ((size_job *)size_thread(j))->ret;
+	    free(j);
+	    continue;
+	}
+
+	if (t_pool_dispatch(p, q, size_thread, j) == -1) {
+	    free(j);
+	    ret = 1;
+	    break;
+	}
+	pending++;
+    }
+
+    while (pending-- > 0) {
+	if (!(r = t_pool_next_result_wait(q))) {
+	    ret = 1;
+	    break;
+	}
+	ret |= ((size_job *)r->data)->ret;
+	t_pool_delete_result(r, 1);
+    }
+
+    if (q)
+	t_results_queue_destroy(q);
+
+    return ret;
+}
+
+static void print_cost(char *name, block_cost *c) {
+    printf("%-24s %8"PRId64" blocks, comp %11"PRId64", uncomp %11"PRId64
+	   ", ratio %7.2f, cpu %9.3f ms, %8.1f MB/s\n",
+	   name, c->nblocks, c->comp, c->uncomp,
+	   c->comp ? (double)c->uncomp / c->comp : 0.0,
+	   c->cpu * 1000,
+	   c->cpu > 0 ? c->uncomp / c->cpu / 1e6 : 0.0);
+}
+
+/*
+ * Reports the decompression costs per content_id, listing the data
+ * series and tags held in each, followed by per compression method.
+ */
+void print_costs(size_stats *st) {
+    intptr_t id;
+    int m;
+
+    printf("\nDecompression cost per block:\n");
+    for (id = -1; id <= st->bmax; id++) {
+	HashItem *hi;
+	HashIter *iter;
+	char name[100];
+
+	if (!(hi = HashTableSearch(st->cost_h, (char *)id, sizeof(id))))
+	    continue;
+
+	if (id == -1)
+	    sprintf(name, "Block CORE");
+	else
+	    sprintf(name, "Block content_id %7d", (int)id);
+	print_cost(name, (block_cost *)hi->data.p);
+
+	iter = HashTableIterCreate();
+	printf("%24s", "");
+	while ((hi = HashTableIterNext(st->ds_h, iter))) {
+	    int c;
+	    char buf[5];
+	    int x = 4;
+
+	    if (hi->data.i != id)
+		continue;
+
+	    c = ((uintptr_t) hi->key)>>8;
+
+	    buf[x--] = 0;
+	    while(c & 0xff) {
+		buf[x--] = c;
+		c >>= 8;
+	    }
+	    printf(" %s", &buf[x+1]);
+	}
+	putchar('\n');
+	HashTableIterDestroy(iter);
+    }
+
+    printf("\nDecompression cost per method:\n");
+    for (m = 0; m < NMETHODS; m++) {
+	if (st->method_cost[m].nblocks)
+	    print_cost(cram_block_method2str(m), &st->method_cost[m]);
+    }
+}
+
+static void usage(FILE *fp) {
+    fprintf(fp, "Usage: cram_size [options] filename.cram\n\n");
+    fprintf(fp, "Options:\n");
+    fprintf(fp, "    -d             Also uncompress blocks, reporting the ratio and CPU\n");
+    fprintf(fp, "                   time per content_id and compression method.\n");
+    fprintf(fp, "    -s N           Only examine N containers, evenly spaced through\n");
+    fprintf(fp, "                   the file.  Chosen using the .crai index if present.\n");
+    fprintf(fp, "    -t N           Use N threads.\n");
+}
+
 int main(int argc, char **argv) {
     cram_fd *fd;
-    HashTable *bsize_h;
-    HashTable *ds_h; // content_id to data-series lookup.
-    HashTable *dc_h; // content_id to data-compression lookup
-    int bmax = 0;
-
-    bsize_h = HashTableCreate(128, HASH_DYNAMIC_SIZE|
-			    HASH_NONVOLATILE_KEYS |
-			    HASH_INT_KEYS);
-    ds_h = HashTableCreate(128, HASH_DYNAMIC_SIZE|
-			   HASH_NONVOLATILE_KEYS |
-			   HASH_INT_KEYS);
-    dc_h = HashTableCreate(128, HASH_DYNAMIC_SIZE);
-
-    if (argc < 2) {
-	fprintf(stderr, "Usage: cram_size filename.cram\n");
+    size_stats st;
+    int c, nthreads = 1, nsample = 0, ret = 0;
+    char *fn;
+
+    memset(&st, 0, sizeof(st));
+    st.bsize_h = HashTableCreate(128, HASH_DYNAMIC_SIZE|
+				 HASH_NONVOLATILE_KEYS |
+				 HASH_INT_KEYS);
+    st.ds_h = HashTableCreate(128, HASH_DYNAMIC_SIZE|
+			      HASH_NONVOLATILE_KEYS |
+			      HASH_INT_KEYS);
+    st.dc_h = HashTableCreate(128, HASH_DYNAMIC_SIZE);
+    st.cost_h = HashTableCreate(128, HASH_DYNAMIC_SIZE|
+				HASH_NONVOLATILE_KEYS |
+				HASH_INT_KEYS);
+    pthread_mutex_init(&st.lock, NULL);
+
+    while ((c = getopt(argc, argv, "ds:t:h")) != -1) {
+	switch (c) {
+	case 'd':
+	    st.decompress = 1;
+	    break;
+
+	case 's':
+	    nsample = atoi(optarg);
+	    break;
+
+	case 't':
+	    nthreads = atoi(optarg);
+	    if (nthreads < 1) {
+		fprintf(stderr, "Number of threads needs to be >= 1\n");
+		return 1;
+	    }
+	    break;
+
+	case 'h':
+	    usage(stdout);
+	    return 0;
+
+	default:
+	    usage(stderr);
+	    return 1;
+	}
+    }
+
+    if (argc - optind != 1) {
+	usage(stderr);
 	return 1;
     }
+    fn = argv[optind];
 
-    if (NULL == (fd = cram_open(argv[1], "rb"))) {
-	fprintf(stderr, "Error opening CRAM file '%s'.\n", argv[1]);
+    if (NULL == (fd = cram_open(fn, "rb"))) {
+	fprintf(stderr, "Error opening CRAM file '%s'.\n", fn);
 	return 1;
     }
     
     cram_init_varint(&vv, fd->file_def->major_version);
     
-    if (0 != process_sizes(fd, bsize_h, ds_h, dc_h, &bmax))
-	return 1;
+    if (nthreads == 1 && nsample <= 0) {
+	ret = process_sizes(fd, &st);
+    } else {
+	t_pool *p = NULL;
+	off_t *offsets;
+	int n = container_offsets(fd, fn, nsample > 0, &offsets);
+
+	if (n < 0) {
+	    fprintf(stderr, "Failed to find container offsets\n");
+	    return 1;
+	}
+
+	if (nsample > 0 && nsample < n) {
+	    int i;
+	    for (i = 0; i < nsample; i++)
+		offsets[i] = offsets[(int64_t)i * n / nsample];
+	    fprintf(stderr, "Sampling %d of %d containers\n", nsample, n);
+	    n = nsample;
+	}
+
+	if (nthreads > 1 && !(p = t_pool_init(nthreads*2, nthreads)))
+	    return 1;
+	ret = process_offsets(fn, offsets, n, p, &st);
+	if (p)
+	    t_pool_destroy(p, 0);
+	free(offsets);
+    }
     cram_close(fd);
 
-    print_sizes(bsize_h, ds_h, dc_h, bmax);
+    if (ret)
+	return 1;
+
+    print_sizes(st.bsize_h, st.ds_h, st.dc_h, st.bmax);
+    if (st.decompress)
+	print_costs(&st);
 
-    HashTableDestroy(bsize_h, 0);
-    HashTableDestroy(ds_h, 0);
-    HashTableDestroy(dc_h, 0);
+    HashTableDestroy(st.bsize_h, 0);
+    HashTableDestroy(st.ds_h, 0);
+    HashTableDestroy(st.dc_h, 0);
+    HashTableDestroy(st.cost_h, 1);
+    pthread_mutex_destroy(&st.lock);
 
     return 0;
 }
@@ -49,17 +49,53 @@
 int extract(HashFile *hf, char *file) {
     size_t len;
     char *data;
+    int view;
 
-    if ((data = HashFileExtract(hf, file, &len))) {
+    if ((data = HashFileExtractView(hf, file, &len, &view))) {
 	fwrite(data, len, 1, stdout);
-	free(data);
+	if (!view)
+	    free(data);
 	return 0;
     }
     return 1;
 }
 
+/*
+ * Copies a list of named files to stdout, in order.  These are fetched
+ * from the archive together in file offset order.
+ * Returns 0 on success
+ *         1 on failure
+ */
+int extract_batch(HashFile *hf, char **files, int nfiles) {
+    char **data;
+    size_t *len;
+    int i, ret = 0;
+
+    data = malloc(nfiles * sizeof(*data));
+    len  = malloc(nfiles * sizeof(*len));
+    if (!data || !len || HashFileExtractBatch(hf, files, nfiles, data, len)<0){
+	free(data);
+	free(len);
+	return 1;
+    }
+
+    for (i = 0; i < nfiles; i++) {
+	if (data[i]) {
+	    fwrite(data[i], len[i], 1, stdout);
+	    free(data[i]);
+	} else {
+	    ret = 1;
+	}
+    }
+
+    free(data);
+    free(len);
+    return ret;
+}
+
 int main(int argc, char **argv) {
     char *fofn = NULL;
+    int batch = 10000;
     char *hash;
     HashFile *hf;
     int ret = 0;
@@ -69,15 +105,20 @@ int main(int argc, char **argv) {
 	if (**argv != '-' || strcmp(*argv, "--") == 0)
 	    break;
 
-	if (strcmp(*argv, "-I") == 0) {
+	if (strcmp(*argv, "-I") == 0 && argc > 1) {
 	    argv++;
 	    fofn = *argv;
 	    argc--;
+	} else if (strcmp(*argv, "-b") == 0 && argc > 1) {
+	    argv++;
+	    batch = atoi(*argv);
+	    argc--;
 	}
     }
 
-    if (argc < 2 && !fofn) {
-	fprintf(stderr, "Usage: hash_extract [-I fofn] hashfile [name ...]\n");
+    if ((argc < 2 && !fofn) || batch < 1) {
+	fprintf(stderr, "Usage: hash_extract [-I fofn] [-b batch_size] "
+		"hashfile [name ...]\n");
 	return 1;
     }
     hash = argv[0];
@@ -88,10 +129,18 @@ int main(int argc, char **argv) {
 	perror(hash);
 	return 1;
     }
+    HashFileMmap(hf);
+
+#ifdef _WIN32
+    _setmode(_fileno(stdout), _O_BINARY);
+#endif
 
+    /* Fetch names from fofn 'batch' at a time, in file offset order */
     if (fofn) {
 	FILE *fofnfp;
 	char file[256];
+	char **files;
+	int i, nfiles = 0;
 
 	if (strcmp(fofn, "-") == 0) {
 	    fofnfp = stdin;
@@ -102,20 +151,33 @@ int main(int argc, char **argv) {
 	    }
 	}
 
+	if (NULL == (files = malloc(batch * sizeof(*files))))
+	    return 1;
+
 	while (fgets(file, 255, fofnfp)) {
 	    char *c;
 	    if ((c = strchr(file, '\n')))
 		*c = 0;
 
-	    ret |= extract(hf, file);
+	    if (NULL == (files[nfiles++] = strdup(file)))
+		return 1;
+
+	    if (nfiles == batch) {
+		ret |= extract_batch(hf, files, nfiles);
+		for (i = 0; i < nfiles; i++)
+		    free(files[i]);
+		nfiles = 0;
+	    }
 	}
 
+	if (nfiles)
+	    ret |= extract_batch(hf, files, nfiles);
+	for (i = 0; i < nfiles; i++)
+	    free(files[i]);
+	free(files);
+
 	fclose(fofnfp);
     }
-
-#ifdef _WIN32
-    _setmode(_fileno(stdout), _O_BINARY);
-#endif
     for (; argc; argc--, argv++) {
 	ret |= extract(hf, *argv);
     }
@@ -56,6 +56,7 @@
 #include <io_lib/sff.h>
 #include <io_lib/os.h>
 #include <io_lib/mFILE.h>
+#include <io_lib/thread_pool.h>
 
 /*
  * Override the sff.c functions to use FILE pointers instead. This means
@@ -100,7 +101,7 @@ static sff_common_header *fread_sff_common_header(FILE *fp) {
 }
 
 void usage(void) {
-    fprintf(stderr, "Usage: hash_sff [-o outfile] [-t] sff_file ...\n");
+    fprintf(stderr, "Usage: hash_sff [-o outfile] [-t] [-T nthreads] sff_file ...\n");
     exit(1);
 }
 
@@ -115,6 +116,12 @@ int main(int argc, char **argv) {
     uint32_t index_size, index_skipped;
     FILE *fp, *fpout = NULL;
     int copy_archive = 1;
+    t_pool *pool = NULL;
+    char **keys = NULL;
+    int *key_lens = NULL;
+    HashData *hds = NULL;
+    sff_read_header **rhs = NULL;
+    int nkeys;
     
 
     /* process command line arguments of the form -arg */
@@ -133,6 +140,14 @@ int main(int argc, char **argv) {
 	} else if (strcmp(*argv, "-t") == 0) {
 	    copy_archive = 0;
 
+	} else if (strcmp(*argv, "-T") == 0 && argc > 1) {
+	    int nthreads = atoi(argv[1]);
+	    if (nthreads > 1 &&
+		NULL == (pool = t_pool_init(nthreads*2, nthreads)))
+		return 1;
+	    argv++;
+	    argc--;
+
 	} else if (**argv == '-') {
 	    usage();
 	}
@@ -186,7 +201,15 @@ int main(int argc, char **argv) {
 	hf->headers[hf->nheaders-1].size = ch->header_len;
 	hf->headers[hf->nheaders-1].cached_data = NULL;
 
-	/* Read the index items, adding to the hash */
+	/* Read the index items, adding to the hash in one batch at the end */
+	keys     = realloc(keys,     (ch->nreads+1) * sizeof(*keys));
+	key_lens = realloc(key_lens, (ch->nreads+1) * sizeof(*key_lens));
+	hds      = realloc(hds,      (ch->nreads+1) * sizeof(*hds));
+	rhs      = realloc(rhs,      (ch->nreads+1) * sizeof(*rhs));
+	if (!keys || !key_lens || !hds || !rhs)
+	    return 1;
+	nkeys = 0;
+
 	index_skipped = 0;
 	dot = 0;
 	printf("                                                                       |\r|");
@@ -221,9 +244,21 @@ int main(int argc, char **argv) {
 	    hfi->size = (ftell(fp) - index_skipped) - hfi->pos;
 	    hd.p = hfi;
 
-	    HashTableAdd(hf->h, rh->name, rh->name_len, hd, NULL);
+	    keys[nkeys]     = rh->name;
+	    key_lens[nkeys] = rh->name_len;
+	    hds[nkeys]      = hd;
+	    rhs[nkeys++]    = rh;
 	}
 	printf("\n");
+
+	if (HashTableAddBatch(hf->h, keys, key_lens, hds, nkeys, pool,
+			      NULL) < 0) {
+	    fprintf(stderr, "Failed to add to hash table\n");
+	    return 1;
+	}
+	for (i = 0; i < nkeys; i++)
+	    free_sff_read_header(rhs[i]);
+
 	HashTableStats(hf->h, stdout);
 
 	index_offset = ftell(fp) - index_skipped;
@@ -298,6 +333,13 @@ int main(int argc, char **argv) {
 	}
 	fclose(fpout);
     }
+
+    if (pool)
+	t_pool_destroy(pool, 0);
+    free(keys);
+    free(key_lens);
+    free(hds);
+    free(rhs);
     
     return 0;
 }
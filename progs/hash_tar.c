@@ -44,6 +44,7 @@
 #include <unistd.h>
 #include <io_lib/tar_format.h>
 #include <io_lib/hash_table.h>
+#include <io_lib/thread_pool.h>
 
 typedef struct {
     int   directories;
@@ -55,6 +56,7 @@ typedef struct {
     char *footer;
     char *archive; /* when reading from stdin */
     HashTable *map;
+    int   nthreads;
 } options_t;
 
 typedef struct {
@@ -275,12 +277,25 @@ void link_footers(HashFile *hf, options_t *opt) {
     }
 }
 
-void construct_hash(HashFile *hf) {
-    int i;
+/*
+ * Adds all files[] to the hash in one batch, hashing the names on
+ * opt->nthreads threads.  As before, the first of any duplicate names wins.
+ */
+int construct_hash(HashFile *hf, options_t *opt) {
+    t_pool *p = NULL;
+    char **keys;
+    HashData *hd;
+    int i, ret;
+
+    keys = malloc(nfiles * sizeof(*keys) + 1);
+    hd   = malloc(nfiles * sizeof(*hd) + 1);
+    if (!keys || !hd)
+	return -1;
 
     for (i = 0; i < nfiles; i++) {
-	HashData hd;
 	HashFileItem *hfi = (HashFileItem *)calloc(1, sizeof(*hfi));
+	if (!hfi)
+	    return -1;
 
 	/* Just use the last head/foot defined as we only allow 1 at the mo. */
 	hfi->header  = hf->nheaders;
@@ -288,10 +303,22 @@ void construct_hash(HashFile *hf) {
 	hfi->pos     = files[i].pos;
 	hfi->size    = files[i].size;
 	hfi->archive = files[i].archive;
-	hd.p = hfi;
-	HashTableAdd(hf->h, files[i].member, strlen(files[i].member),
-		     hd, NULL);
+	hd[i].p = hfi;
+	keys[i] = files[i].member;
     }
+
+    if (opt->nthreads > 1 &&
+	NULL == (p = t_pool_init(opt->nthreads*2, opt->nthreads)))
+	return -1;
+
+    ret = HashTableAddBatch(hf->h, keys, NULL, hd, nfiles, p, NULL);
+
+    if (p)
+	t_pool_destroy(p, 0);
+    free(keys);
+    free(hd);
+
+    return ret < 0 ? -1 : 0;
 }
 
 
@@ -320,6 +347,7 @@ int main(int argc, char **argv) {
     opt.footer       = NULL;
     opt.archive      = NULL;
     opt.map          = NULL;
+    opt.nthreads     = 1;
 
     hf = HashFileCreate(0, HASH_DYNAMIC_SIZE);
 
@@ -348,6 +376,12 @@ int main(int argc, char **argv) {
 	if (strcmp(*argv, "-b") == 0)
 	    opt.basename = 1;
 
+	if (strcmp(*argv, "-t") == 0 && argc > 1) {
+	    opt.nthreads = atoi(argv[1]);
+	    argv++;
+	    argc--;
+	}
+
 	if (strcmp(*argv, "-m") == 0 && argc > 1) {
 	    /* Name mapping */
 	    opt.map = load_map(argv[1]);
@@ -393,6 +427,7 @@ int main(int argc, char **argv) {
 	fprintf(stderr, "    -h name   Set tar entry 'name' to be a file header\n");
 	fprintf(stderr, "    -f name   Set tar entry 'name' to be a file footer\n");
 	fprintf(stderr, "    -b        Use only the filename portion of a pathname\n");
+	fprintf(stderr, "    -t N      Hash the member names using N threads\n");
 	fprintf(stderr, "    -m fname  Reads lines of 'old new' and renames entries before indexing.");
 	return 1;
     }
@@ -442,7 +477,10 @@ int main(int argc, char **argv) {
 
 
     /* Construct the hash */
-    construct_hash(hf);
+    if (construct_hash(hf, &opt)) {
+	fprintf(stderr, "Failed to construct hash\n");
+	return 1;
+    }
 
 
     /* Save hash */
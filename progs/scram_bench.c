@@ -0,0 +1,765 @@
+/*
+ * Copyright (c) 2019 Genome Research Ltd.
+ * Author(s): James Bonfield
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *    1. Redistributions of source code must retain the above copyright notice,
+ *       this list of conditions and the following disclaimer.
+ *
+ *    2. Redistributions in binary form must reproduce the above
+ *       copyright notice, this list of conditions and the following
+ *       disclaimer in the documentation and/or other materials provided
+ *       with the distribution.
+ *
+ *    3. Neither the names Genome Research Ltd and Wellcome Trust Sanger
+ *    Institute nor the names of its contributors may be used to endorse
+ *    or promote products derived from this software without specific
+ *    prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY GENOME RESEARCH LTD AND CONTRIBUTORS "AS
+ * IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+ * TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL GENOME RESEARCH
+ * LTD OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Runs a standard set of benchmarks over a corpus of SAM/BAM/CRAM files.
+ *
+ * Suites:
+ *   decode  - CRAM block decompression speed per data series
+ *   codec   - compression and decompression speed of each CRAM codec,
+ *             using the uncompressed CRAM blocks as sample data
+ *   bam     - BAM (BGZF) read and write speed
+ *   threads - full record decoding speed for 1 to N threads
+ *
+ * Output is one tab separated line per measurement:
+ *   suite file name count comp_bytes raw_bytes seconds MB/s
+ *
+ * "raw_bytes" is the uncompressed size and MB/s is always relative to
+ * this.  Single threaded suites report CPU time and the thread scaling
+ * suite reports elapsed time.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "io_lib_config.h"
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <time.h>
+#include <unistd.h>
+#include <zlib.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+
+#if defined(__MINGW32__) || defined(__FreeBSD__) || defined(__APPLE__)
+#   include <getopt.h>
+#endif
+
+#include <io_lib/scram.h>
+#include <io_lib/os.h>
+
+#define SUITE_DECODE  1
+#define SUITE_CODEC   2
+#define SUITE_BAM     4
+#define SUITE_THREADS 8
+#define SUITE_ALL     15
+
+// Accumulated timings for one named measurement
+typedef struct {
+    char name[32];
+    int64_t count;
+    int64_t comp, raw;
+    double secs;
+} bench_stat;
+
+typedef struct {
+    bench_stat *s;
+    int n, alloc;
+} bench_stats;
+
+// An uncompressed CRAM block kept as sample data for the codec suite
+typedef struct {
+    char name[32];
+    int content_id;
+    char *data;
+    size_t size;
+} bench_sample;
+
+typedef struct {
+    bench_sample *s;
+    int n, alloc;
+    size_t size, max_size;
+} bench_samples;
+
+// The codecs tested.  Ext is the method recorded in the CRAM block and
+// hence the one used for decompression.
+static struct {
+    char *name;
+    enum cram_block_method method, ext;
+    int strat;
+    int level; // 0 => use the -l level
+} codecs[] = {
+    {"gzip",     GZIP,        GZIP,   Z_FILTERED,         0},
+    {"gzip-rle", GZIP_RLE,    GZIP,   Z_RLE,              0},
+    {"gzip-1",   GZIP_1,      GZIP,   Z_DEFAULT_STRATEGY, 1},
+    {"bzip2",    BZIP2,       BZIP2,  0,                  0},
+    {"lzma",     LZMA,        LZMA,   0,                  0},
+    {"bsc",      BSC,         BSC,    0,                  0},
+    {"zstd",     ZSTD,        ZSTD,   0,                  0},
+    {"zstd-1",   ZSTD_1,      ZSTD,   0,                  1},
+    {"rans0",    RANS0,       RANS,   0,                  0},
+    {"rans1",    RANS1,       RANS,   0,                  0},
+    {"ranspr0",  RANS_PR0,    RANSPR, 0,                  0},
+    {"ranspr1",  RANS_PR1,    RANSPR, 0,                  0},
+    {"ranspr64", RANS_PR64,   RANSPR, 0,                  0},
+    {"ranspr9",  RANS_PR9,    RANSPR, 0,                  0},
+    {"ranspr128",RANS_PR128,  RANSPR, 0,                  0},
+    {"ranspr129",RANS_PR129,  RANSPR, 0,                  0},
+    {"ranspr192",RANS_PR192,  RANSPR, 0,                  0},
+    {"ranspr193",RANS_PR193,  RANSPR, 0,                  0},
+    {"arith0",   ARITH_PR0,   ARITH,  0,                  0},
+    {"arith1",   ARITH_PR1,   ARITH,  0,                  0},
+    {"arith64",  ARITH_PR64,  ARITH,  0,                  0},
+    {"arith9",   ARITH_PR9,   ARITH,  0,                  0},
+    {"arith128", ARITH_PR128, ARITH,  0,                  0},
+    {"arith129", ARITH_PR129, ARITH,  0,                  0},
+    {"arith192", ARITH_PR192, ARITH,  0,                  0},
+    {"arith193", ARITH_PR193, ARITH,  0,                  0},
+    {"tok3",     NAME_TOK3,   TOK3,   0,                  0},
+    {"tok3-a",   NAME_TOKA,   TOK3,   1,                  0},
+};
+
+// Data series names, for labelling CRAM blocks by content_id
+static struct {
+    int ds;
+    char *name;
+} ds_names[] = {
+    {DS_RN, "RN"}, {DS_QS, "QS"}, {DS_IN, "IN"}, {DS_SC, "SC"},
+    {DS_BF, "BF"}, {DS_CF, "CF"}, {DS_AP, "AP"}, {DS_RG, "RG"},
+    {DS_MQ, "MQ"}, {DS_NS, "NS"}, {DS_MF, "MF"}, {DS_TS, "TS"},
+    {DS_NP, "NP"}, {DS_NF, "NF"}, {DS_RL, "RL"}, {DS_FN, "FN"},
+    {DS_FC, "FC"}, {DS_FP, "FP"}, {DS_DL, "DL"}, {DS_BA, "BA"},
+    {DS_BS, "BS"}, {DS_TL, "TL"}, {DS_RI, "RI"}, {DS_RS, "RS"},
+    {DS_PD, "PD"}, {DS_HC, "HC"}, {DS_BB, "BB"}, {DS_QQ, "QQ"},
+    {DS_TN, "TN"},
+};
+
+static double cpu_time(void) {
+#ifdef CLOCK_THREAD_CPUTIME_ID
+    struct timespec ts;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+#else
+    return (double)clock() / CLOCKS_PER_SEC;
+#endif
+}
+
+static double wall_time(void) {
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+/*
+ * Returns the accumulator for name, creating it if needed.
+ */
+static bench_stat *stat_get(bench_stats *bs, char *name) {
+    int i;
+
+    for (i = 0; i < bs->n; i++)
+	if (strcmp(bs->s[i].name, name) == 0)
+	    return &bs->s[i];
+
+    if (bs->n == bs->alloc) {
+	int alloc = bs->alloc ? bs->alloc*2 : 64;
+	bench_stat *s = realloc(bs->s, alloc * sizeof(*s));
+	if (!s)
+	    return NULL;
+	bs->s = s;
+	bs->alloc = alloc;
+    }
+
+    memset(&bs->s[bs->n], 0, sizeof(*bs->s));
+    snprintf(bs->s[bs->n].name, sizeof(bs->s->name), "%s", name);
+    return &bs->s[bs->n++];
+}
+
+static void print_line(char *suite, char *fn, char *name, int64_t count,
+		       int64_t comp, int64_t raw, double secs) {
+    printf("%s\t%s\t%s\t%"PRId64"\t%"PRId64"\t%"PRId64"\t%.6f\t%.2f\n",
+	   suite, fn, name, count, comp, raw, secs,
+	   secs > 0 ? raw / secs / 1e6 : 0.0);
+}
+
+static void print_stats(char *suite, char *fn, bench_stats *bs) {
+    int i;
+
+    for (i = 0; i < bs->n; i++)
+	print_line(suite, fn, bs->s[i].name, bs->s[i].count,
+		   bs->s[i].comp, bs->s[i].raw, bs->s[i].secs);
+}
+
+/*
+ * Names a block by the data series and tags that use its content_id.
+ */
+static void block_name(cram_block_compression_hdr *hdr, cram_block *b,
+		       char *name, size_t len) {
+    char *cp = name, *end = name + len - 5;
+    int i, id1, id2;
+
+    if (b->content_type == CORE) {
+	strcpy(name, "CORE");
+	return;
+    }
+
+    *cp = 0;
+    for (i = 0; i < sizeof(ds_names)/sizeof(*ds_names); i++) {
+	cram_codec *c = hdr->codecs[ds_names[i].ds];
+	if (!c)
+	    continue;
+
+	id1 = cram_codec_to_id(c, &id2);
+	if ((id1 == b->content_id || id2 == b->content_id) && cp < end)
+	    cp += sprintf(cp, "%s%s", cp == name ? "" : "+", ds_names[i].name);
+    }
+
+    for (i = 0; i < CRAM_MAP_HASH; i++) {
+	cram_map *m;
+	for (m = hdr->tag_encoding_map[i]; m; m = m->next) {
+	    if (!m->codec)
+		continue;
+
+	    id1 = cram_codec_to_id(m->codec, &id2);
+	    if ((id1 == b->content_id || id2 == b->content_id) && cp < end)
+		cp += sprintf(cp, "%s%c%c:%c", cp == name ? "" : "+",
+			      (m->key>>16)&0xff, (m->key>>8)&0xff, m->key&0xff);
+	}
+    }
+
+    if (cp == name)
+	snprintf(name, len, "id:%d", b->content_id);
+}
+
+/*
+ * Keeps a copy of an uncompressed block for the codec suite, until
+ * the sample limit is reached.
+ */
+static int sample_add(bench_samples *bs, cram_block *b, char *name) {
+    bench_sample *s;
+
+    if (b->uncomp_size == 0 || bs->size + b->uncomp_size > bs->max_size)
+	return 0;
+
+    if (bs->n == bs->alloc) {
+	int alloc = bs->alloc ? bs->alloc*2 : 256;
+	if (!(s = realloc(bs->s, alloc * sizeof(*s))))
+	    return -1;
+	bs->s = s;
+	bs->alloc = alloc;
+    }
+
+    s = &bs->s[bs->n];
+    if (!(s->data = malloc(b->uncomp_size)))
+	return -1;
+    memcpy(s->data, b->data, b->uncomp_size);
+    s->size = b->uncomp_size;
+    s->content_id = b->content_id;
+    strcpy(s->name, name);
+    bs->size += s->size;
+    bs->n++;
+
+    return 0;
+}
+
+static void samples_free(bench_samples *bs) {
+    int i;
+
+    for (i = 0; i < bs->n; i++)
+	free(bs->s[i].data);
+    free(bs->s);
+}
+
+/*
+ * Decode suite: times the decompression of every block in a CRAM file,
+ * accumulated per data series.  Uncompressed blocks are also gathered
+ * as sample data for the codec suite.
+ */
+static int bench_decode(char *fn, int suites, bench_samples *samples) {
+    cram_fd *fd;
+    cram_container *c;
+    bench_stats bs = {NULL, 0, 0};
+    int i, j, ret = -1;
+
+    if (!(fd = cram_open(fn, "rb"))) {
+	fprintf(stderr, "Failed to open file %s\n", fn);
+	return -1;
+    }
+
+    while ((c = cram_read_container(fd))) {
+	if (fd->err)
+	    goto err;
+
+	if (!c->length) {
+	    cram_free_container(c);
+	    continue;
+	}
+
+	if (!(c->comp_hdr_block = cram_read_block(fd)) ||
+	    !(c->comp_hdr = cram_decode_compression_header(fd,
+							   c->comp_hdr_block)))
+	    goto err;
+
+	for (i = 0; i < c->num_landmarks; i++) {
+	    cram_slice *s;
+
+	    if (!(s = cram_read_slice(fd)))
+		goto err;
+
+	    for (j = 0; j < s->hdr->num_blocks; j++) {
+		cram_block *b = s->block[j];
+		char name[32];
+		bench_stat *st;
+		int32_t comp_size = b->comp_size;
+		double t;
+
+		block_name(c->comp_hdr, b, name, sizeof(name));
+		if (!(st = stat_get(&bs, name)))
+		    goto err;
+
+		t = cpu_time();
+		if (cram_uncompress_block(b)) {
+		    fprintf(stderr, "Failed to uncompress block %s\n", name);
+		    cram_free_slice(s);
+		    goto err;
+		}
+		st->secs += cpu_time() - t;
+		st->count++;
+		st->comp += comp_size;
+		st->raw  += b->uncomp_size;
+
+		if ((suites & SUITE_CODEC) && b->content_type == EXTERNAL &&
+		    sample_add(samples, b, name) < 0) {
+		    cram_free_slice(s);
+		    goto err;
+		}
+	    }
+
+	    cram_free_slice(s);
+	}
+
+	cram_free_container(c);
+	c = NULL;
+    }
+
+    if (suites & SUITE_DECODE)
+	print_stats("decode", fn, &bs);
+    ret = 0;
+
+ err:
+    if (c)
+	cram_free_container(c);
+    if (ret)
+	fprintf(stderr, "Failed to decode %s\n", fn);
+    free(bs.s);
+    cram_close(fd);
+    return ret;
+}
+
+/*
+ * Returns 1 if the "+" separated block name includes data series ds,
+ *         0 otherwise.
+ */
+static int name_has_series(char *name, char *ds) {
+    size_t len = strlen(ds);
+    char *cp = name;
+
+    while (cp) {
+	if (strncmp(cp, ds, len) == 0 && (cp[len] == 0 || cp[len] == '+'))
+	    return 1;
+	if ((cp = strchr(cp, '+')))
+	    cp++;
+    }
+
+    return 0;
+}
+
+/*
+ * Codec suite: compresses and uncompresses the sample blocks with each
+ * method, validating the round trip.  Methods that are not built in are
+ * skipped.  The name tokenisers are only tried on read names.
+ */
+static int bench_codec(char *fn, bench_samples *samples, int level) {
+    int i, j;
+
+    for (i = 0; i < sizeof(codecs)/sizeof(*codecs); i++) {
+	int lvl = codecs[i].level ? codecs[i].level : level;
+	int tok = codecs[i].ext == TOK3;
+	int nfail = 0;
+	bench_stat comp = {"", 0, 0, 0, 0}, uncomp = {"", 0, 0, 0, 0};
+	char name[64];
+
+	for (j = 0; j < samples->n; j++) {
+	    bench_sample *s = &samples->s[j];
+	    cram_block *b;
+	    size_t out_size = 0;
+	    char *out;
+	    double t;
+
+	    if (tok && !name_has_series(s->name, "RN"))
+		continue;
+
+	    t = cpu_time();
+	    out = cram_compress_by_method(NULL, s->data, s->size,
+					  s->content_id, &out_size,
+					  codecs[i].method, lvl,
+					  codecs[i].strat);
+	    comp.secs += cpu_time() - t;
+	    if (!out) {
+		nfail++;
+		continue;
+	    }
+
+	    comp.count++;
+	    comp.comp += out_size;
+	    comp.raw  += s->size;
+
+	    if (!(b = cram_new_block(EXTERNAL, s->content_id))) {
+		free(out);
+		return -1;
+	    }
+	    b->method = codecs[i].ext;
+	    b->orig_method = codecs[i].method;
+	    b->data = (unsigned char *)out;
+	    b->alloc = b->comp_size = out_size;
+	    b->uncomp_size = s->size;
+	    b->crc32_checked = 1;
+
+	    t = cpu_time();
+	    if (cram_uncompress_block(b) ||
+		b->uncomp_size != s->size ||
+		memcmp(b->data, s->data, s->size) != 0) {
+		fprintf(stderr, "Round trip failure for %s on block %s\n",
+			codecs[i].name, s->name);
+		cram_free_block(b);
+		return -1;
+	    }
+	    uncomp.secs += cpu_time() - t;
+	    uncomp.count++;
+	    uncomp.comp += out_size;
+	    uncomp.raw  += s->size;
+
+	    cram_free_block(b);
+	}
+
+	// Unavailable in this build, or nothing suitable to compress
+	if (comp.count == 0)
+	    continue;
+
+	if (nfail)
+	    fprintf(stderr, "%s failed to compress %d of %d samples\n",
+		    codecs[i].name, nfail, nfail + (int)comp.count);
+
+	sprintf(name, "%s/%d", codecs[i].name, lvl);
+	print_line("codec-comp", fn, name, comp.count, comp.comp, comp.raw,
+		   comp.secs);
+	print_line("codec-uncomp", fn, name, uncomp.count, uncomp.comp,
+		   uncomp.raw, uncomp.secs);
+    }
+
+    return 0;
+}
+
+/*
+ * BAM suite: times reading the whole file, and writing up to max_size
+ * bytes of its records back out as BAM to /dev/null.
+ */
+static int bench_bam(char *fn, int level, size_t max_size) {
+    scram_fd *in, *out;
+    bam_seq_t *s = NULL, **recs = NULL;
+    int64_t n = 0, raw = 0, nrecs = 0, arecs = 0;
+    size_t size = 0;
+    struct stat sb;
+    char mode[10];
+    double t;
+    int i, ret = -1;
+
+    if (stat(fn, &sb) != 0 || !(in = scram_open(fn, "rb"))) {
+	fprintf(stderr, "Failed to open file %s\n", fn);
+	return -1;
+    }
+
+    t = cpu_time();
+    while (scram_get_seq(in, &s) >= 0) {
+	n++;
+	raw += bam_blk_size(s) + 4;
+    }
+    t = cpu_time() - t;
+    if (!scram_eof(in)) {
+	fprintf(stderr, "Failed to read %s\n", fn);
+	goto err;
+    }
+    print_line("bam-read", fn, "read", n, sb.st_size, raw, t);
+    scram_close(in);
+
+    // Reopen and hold a sample of records in memory, so that writing
+    // is timed on its own.
+    if (!(in = scram_open(fn, "rb")))
+	return -1;
+    while (size < max_size && scram_get_seq(in, &s) >= 0) {
+	if (nrecs == arecs) {
+	    bam_seq_t **r;
+	    arecs = arecs ? arecs*2 : 1024;
+	    if (!(r = realloc(recs, arecs * sizeof(*r))))
+		goto err;
+	    recs = r;
+	}
+	if (!(recs[nrecs] = malloc(s->alloc)))
+	    goto err;
+	memcpy(recs[nrecs++], s, s->alloc);
+	size += bam_blk_size(s) + 4;
+    }
+
+    sprintf(mode, "wb%d", level);
+    if (!(out = scram_open("/dev/null", mode)))
+	goto err;
+    scram_set_header(out, scram_get_header(in));
+
+    raw = 0;
+    t = cpu_time();
+    if (scram_write_header(out))
+	goto err_out;
+    for (i = 0; i < nrecs; i++) {
+	if (scram_put_seq(out, recs[i]))
+	    goto err_out;
+	raw += bam_blk_size(recs[i]) + 4;
+    }
+    if (scram_close(out)) {
+	out = NULL;
+	goto err_out;
+    }
+    t = cpu_time() - t;
+    out = NULL;
+
+    // The compressed size isn't visible when writing to /dev/null
+    sprintf(mode, "write/%d", level);
+    print_line("bam-write", fn, mode, nrecs, 0, raw, t);
+    ret = 0;
+
+ err_out:
+    if (out)
+	scram_close(out);
+    if (ret)
+	fprintf(stderr, "Failed to write BAM\n");
+ err:
+    for (i = 0; i < nrecs; i++)
+	free(recs[i]);
+    free(recs);
+    if (s)
+	free(s);
+    scram_close(in);
+    return ret;
+}
+
+/*
+ * Thread scaling suite: decodes all records using 1 to max_threads
+ * threads, reporting elapsed time.
+ */
+static int bench_threads(char *fn, char *ref_fn, int max_threads) {
+    int nthreads;
+    struct stat sb;
+
+    if (stat(fn, &sb) != 0) {
+	fprintf(stderr, "Failed to open file %s\n", fn);
+	return -1;
+    }
+
+    for (nthreads = 1; nthreads <= max_threads; nthreads++) {
+	scram_fd *in;
+	bam_seq_t *s = NULL;
+	int64_t n = 0, raw = 0;
+	char name[20];
+	double t;
+	int err;
+
+	t = wall_time();
+	if (!(in = scram_open(fn, "r"))) {
+	    fprintf(stderr, "Failed to open file %s\n", fn);
+	    return -1;
+	}
+	if (!in->is_bam && ref_fn && cram_load_reference(in->c, ref_fn)) {
+	    fprintf(stderr, "Failed to load reference %s\n", ref_fn);
+	    scram_close(in);
+	    return -1;
+	}
+	if (nthreads > 1 && scram_set_option(in, CRAM_OPT_NTHREADS, nthreads)) {
+	    scram_close(in);
+	    return -1;
+	}
+
+	while (scram_get_seq(in, &s) >= 0) {
+	    n++;
+	    raw += bam_blk_size(s) + 4;
+	}
+	err = !scram_eof(in);
+	if (s)
+	    free(s);
+	scram_close(in);
+	t = wall_time() - t;
+
+	if (err) {
+	    fprintf(stderr, "Failed to decode %s\n", fn);
+	    return -1;
+	}
+
+	sprintf(name, "%d", nthreads);
+	print_line("threads", fn, name, n, sb.st_size, raw, t);
+	fflush(stdout);
+    }
+
+    return 0;
+}
+
+static int parse_suites(char *str) {
+    int suites = 0;
+    char *cp;
+
+    for (cp = strtok(str, ","); cp; cp = strtok(NULL, ",")) {
+	if (strcmp(cp, "decode") == 0)
+	    suites |= SUITE_DECODE;
+	else if (strcmp(cp, "codec") == 0)
+	    suites |= SUITE_CODEC;
+	else if (strcmp(cp, "bam") == 0)
+	    suites |= SUITE_BAM;
+	else if (strcmp(cp, "threads") == 0)
+	    suites |= SUITE_THREADS;
+	else if (strcmp(cp, "all") == 0)
+	    suites |= SUITE_ALL;
+	else {
+	    fprintf(stderr, "Unknown suite '%s'\n", cp);
+	    return -1;
+	}
+    }
+
+    return suites;
+}
+
+static void usage(FILE *fp) {
+    fprintf(fp, "Usage: scram_bench [options] file ...\n\n");
+    fprintf(fp, "Runs a standard set of benchmarks over SAM, BAM and CRAM files.\n\n");
+    fprintf(fp, "Options:\n");
+    fprintf(fp, "    -s suites      Comma separated list from decode, codec, bam,\n");
+    fprintf(fp, "                   threads or all (default)\n");
+    fprintf(fp, "    -t N           Maximum number of threads for the thread suite [4]\n");
+    fprintf(fp, "    -l level       Compression level for codec and bam suites [5]\n");
+    fprintf(fp, "    -m MB          Sample size limit for codec and bam suites [64]\n");
+    fprintf(fp, "    -r ref.fa      Reference for decoding CRAM\n");
+    fprintf(fp, "    -h             This help\n\n");
+    fprintf(fp, "The decode and codec suites use CRAM inputs and the bam suite\n");
+    fprintf(fp, "uses BAM inputs.  Output is tab separated with columns:\n");
+    fprintf(fp, "    suite file name count comp_bytes raw_bytes seconds MB/s\n");
+}
+
+int main(int argc, char **argv) {
+    int c, suites = SUITE_ALL, max_threads = 4, level = 5;
+    size_t max_size = 64*1024*1024;
+    char *ref_fn = NULL;
+    int ret = 0;
+
+    while ((c = getopt(argc, argv, "hs:t:l:m:r:")) != -1) {
+	switch (c) {
+	case 'h':
+	    usage(stdout);
+	    return 0;
+
+	case 's':
+	    if ((suites = parse_suites(optarg)) <= 0)
+		return 1;
+	    break;
+
+	case 't':
+	    max_threads = atoi(optarg);
+	    if (max_threads < 1) {
+		fprintf(stderr, "Number of threads needs to be >= 1\n");
+		return 1;
+	    }
+	    break;
+
+	case 'l':
+	    level = atoi(optarg);
+	    if (level < 1 || level > 9) {
+		fprintf(stderr, "Compression level needs to be 1 to 9\n");
+		return 1;
+	    }
+	    break;
+
+	case 'm':
+	    max_size = (size_t)atoi(optarg) * 1024*1024;
+	    break;
+
+	case 'r':
+	    ref_fn = optarg;
+	    break;
+
+	default:
+	    usage(stderr);
+	    return 1;
+	}
+    }
+
+    if (optind == argc) {
+	usage(stderr);
+	return 1;
+    }
+
+    printf("#suite\tfile\tname\tcount\tcomp_bytes\traw_bytes\tseconds\tMB/s\n");
+
+    for (; optind < argc; optind++) {
+	char *fn = argv[optind];
+	scram_fd *fd;
+	int is_cram, is_bam;
+
+	if (!(fd = scram_open(fn, "r"))) {
+	    fprintf(stderr, "Failed to open file %s\n", fn);
+	    ret = 1;
+	    continue;
+	}
+	is_bam = fd->is_bam && fd->b->bgzf;
+	is_cram = !fd->is_bam;
+	scram_close(fd);
+
+	if (is_cram && (suites & (SUITE_DECODE | SUITE_CODEC))) {
+	    bench_samples samples = {NULL, 0, 0, 0, max_size};
+
+	    if (bench_decode(fn, suites, &samples) ||
+		((suites & SUITE_CODEC) && bench_codec(fn, &samples, level)))
+		ret = 1;
+	    samples_free(&samples);
+	}
+
+	if (is_bam && (suites & SUITE_BAM))
+	    if (bench_bam(fn, level, max_size))
+		ret = 1;
+
+	if (suites & SUITE_THREADS)
+	    if (bench_threads(fn, ref_fn, max_threads))
+		ret = 1;
+
+	fflush(stdout);
+    }
+
+    return ret;
+}
@@ -44,6 +44,7 @@
 #include <assert.h>
 #include <ctype.h>
 #include <errno.h>
+#include <pthread.h>
 
 #if defined(__MINGW32__) || defined(__FreeBSD__) || defined(__APPLE__)
 #   include <getopt.h>
@@ -103,6 +104,79 @@ typedef struct {
     int64_t n_diffchr[2], n_diffhigh[2];
 } bam_flagstat_t;
 
+static inline void flagstat_add(bam_flagstat_t *st, int flag, int ref,
+				int mate_ref, int map_qual) {
+    int w = flag & BAM_FQCFAIL ? 1 : 0;
+    ++st->n_reads[w];
+
+    if (flag & BAM_FPAIRED) {
+	++st->n_pair_all[w];
+	if (flag & BAM_FPROPER_PAIR)
+	    ++st->n_pair_good[w];
+
+	if (flag & BAM_FREAD1)
+	    ++st->n_read1[w];
+
+	if (flag & BAM_FREAD2)
+	    ++st->n_read2[w];
+
+	if ((flag & BAM_FMUNMAP) && !(flag & BAM_FUNMAP))
+	    ++st->n_sgltn[w]; 
+
+	if (!(flag & BAM_FUNMAP) && !(flag & BAM_FMUNMAP)) {
+	    ++st->n_pair_map[w];
+
+	    if (mate_ref != ref) {
+		++st->n_diffchr[w];
+		if (map_qual >= 5)
+		    ++st->n_diffhigh[w];
+	    }
+	}
+    }
+
+    if (!(flag & BAM_FUNMAP))
+	++st->n_mapped[w];
+
+    if (flag & BAM_FDUP)
+	++st->n_dup[w];
+}
+
+static void flagstat_merge(bam_flagstat_t *to, bam_flagstat_t *from) {
+    int64_t *t = (int64_t *)to, *f = (int64_t *)from;
+    int i;
+
+    for (i = 0; i < sizeof(*to)/sizeof(int64_t); i++)
+	t[i] += f[i];
+}
+
+/*
+ * CRAM slices are counted as they're decoded, in the decoder threads
+ * when multi-threaded, so records never need converting to BAM.
+ * Each slice is counted locally and then merged into the total.
+ */
+typedef struct {
+    pthread_mutex_t lock;
+    bam_flagstat_t st;
+} flagstat_slices;
+
+static int flagstat_slice(void *data, cram_fd *fd, cram_slice *s) {
+    flagstat_slices *fs = (flagstat_slices *)data;
+    bam_flagstat_t st;
+    int i;
+
+    memset(&st, 0, sizeof(st));
+    for (i = 0; i < s->hdr->num_records; i++) {
+	cram_record *cr = &s->crecs[i];
+	flagstat_add(&st, cr->flags, cr->ref_id, cr->mate_ref_id, cr->mqual);
+    }
+
+    pthread_mutex_lock(&fs->lock);
+    flagstat_merge(&fs->st, &st);
+    pthread_mutex_unlock(&fs->lock);
+
+    return 0;
+}
+
 int main(int argc, char **argv) {
     scram_fd *in;
     bam_seq_t *s;
@@ -115,6 +189,8 @@ int main(int argc, char **argv) {
     bam_flagstat_t st;
     int nthreads = 1;
     int benchmark = 0;
+    flagstat_slices fs;
+    cram_slice_callback cb = {flagstat_slice, &fs};
 
     scram_init();
 
@@ -219,7 +295,7 @@ int main(int argc, char **argv) {
 
     if (!benchmark)
 	scram_set_option(in, CRAM_OPT_REQUIRED_FIELDS,
-			 SAM_FLAG | SAM_MAPQ | SAM_RNEXT);
+			 SAM_FLAG | SAM_RNAME | SAM_MAPQ | SAM_RNEXT);
 
     /* Support for sub-range queries, currently implemented for CRAM only */
     if (*ref_name != 0) {
@@ -255,42 +331,33 @@ int main(int argc, char **argv) {
 	return ret;
     }
 
-    s = NULL;
-    while (scram_get_seq(in, &s) >= 0) {
-	int w = s->flag & BAM_FQCFAIL ? 1 : 0;
-	++st.n_reads[w];
-
-	if (s->flag & BAM_FPAIRED) {
-	    ++st.n_pair_all[w];
-	    if (s->flag & BAM_FPROPER_PAIR)
-		++st.n_pair_good[w];
-
-	    if (s->flag & BAM_FREAD1)
-		++st.n_read1[w];
+    if (!in->is_bam && *ref_name == 0) {
+	/* Whole slices are counted by flagstat_slice */
+	cram_record *cr;
 
-	    if (s->flag & BAM_FREAD2)
-		++st.n_read2[w];
-
-	    if ((s->flag & BAM_FMUNMAP) && !(s->flag & BAM_FUNMAP))
-		++st.n_sgltn[w]; 
-
-	    if (!(s->flag & BAM_FUNMAP) && !(s->flag & BAM_FMUNMAP)) {
-		++st.n_pair_map[w];
-
-		if (s->mate_ref != s->ref) {
-		    ++st.n_diffchr[w];
-		    if (s->map_qual >= 5)
-			++st.n_diffhigh[w];
-		}
-	    }
-	}
-
-	if (!(s->flag & BAM_FUNMAP))
-	    ++st.n_mapped[w];
+	memset(&fs, 0, sizeof(fs));
+	pthread_mutex_init(&fs.lock, NULL);
+	if (scram_set_option(in, CRAM_OPT_SLICE_CALLBACK, &cb))
+	    return 1;
 
-	if (s->flag & BAM_FDUP)
-	    ++st.n_dup[w];
+	while ((cr = cram_get_seq(in->c)))
+	    ;
+	st = fs.st;
+	pthread_mutex_destroy(&fs.lock);
+    } else if (!in->is_bam) {
+	/* Ranges may start and end mid-slice */
+	cram_record *cr;
+
+	while ((cr = cram_get_seq(in->c)))
+	    flagstat_add(&st, cr->flags, cr->ref_id, cr->mate_ref_id,
+			 cr->mqual);
     }
+    if (!in->is_bam)
+	in->eof = cram_eof(in->c);
+
+    s = NULL;
+    while (in->is_bam && scram_get_seq(in, &s) >= 0)
+	flagstat_add(&st, s->flag, s->ref, s->mate_ref, s->map_qual);
 
     if (s)
 	free(s);
@@ -48,6 +48,7 @@
 #include <assert.h>
 #include <ctype.h>
 #include <errno.h>
+#include <sys/stat.h>
 
 #if defined(__MINGW32__) || defined(__FreeBSD__) || defined(__APPLE__)
 #   include <getopt.h>
@@ -76,6 +77,24 @@ static int hdr_compare(SAM_hdr *h1, SAM_hdr *h2) {
     return 1;
 }
 
+/*
+ * Return 1 if both headers list the same read groups in the same
+ * order, as CRAM records refer to read groups by index.
+ *        0 if not
+ */
+static int rg_compare(SAM_hdr *h1, SAM_hdr *h2) {
+    int i;
+    if (h1->nrg != h2->nrg)
+	return 0;
+
+    for (i = 0; i < h1->nrg; i++) {
+	if (strcmp(h1->rg[i].name, h2->rg[i].name) != 0)
+	    return 0;
+    }
+
+    return 1;
+}
+
 static char *parse_format(char *str) {
     if (strcmp(str, "sam") == 0 || strcmp(str, "SAM") == 0)
 	return "";
@@ -106,6 +125,361 @@ static char *detect_format(char *fn) {
     return "";
 }
 
+/*
+ * The merge order: by reference, position, strand and then with READ1
+ * before READ2.  Unmapped reads with no reference sort last.
+ */
+static uint64_t merge_key(bam_seq_t *b) {
+    return (((uint64_t)bam_ref(b))<<33)
+	| (bam_pos(b)<<2)
+	| (bam_strand(b)<<1)
+	| !(bam_flag(b) & BAM_FREAD1);
+}
+
+/*
+ * A binary min-heap of input file numbers, ordered on the key of the
+ * current record of each input and then on the input number itself so
+ * that ties resolve in command line order.
+ */
+typedef struct {
+    int *h;        // heap of input numbers
+    uint64_t *key; // key per input number
+    int n;
+} merge_heap;
+
+static inline int heap_less(merge_heap *hp, int a, int b) {
+    return hp->key[a] < hp->key[b] || (hp->key[a] == hp->key[b] && a < b);
+}
+
+static void heap_sift_down(merge_heap *hp, int i) {
+    int x = hp->h[i];
+
+    for (;;) {
+	int c = 2*i+1;
+	if (c >= hp->n)
+	    break;
+	if (c+1 < hp->n && heap_less(hp, hp->h[c+1], hp->h[c]))
+	    c++;
+	if (!heap_less(hp, hp->h[c], x))
+	    break;
+	hp->h[i] = hp->h[c];
+	i = c;
+    }
+    hp->h[i] = x;
+}
+
+/*
+ * Merges records from the inputs into out in merge_key() order.
+ *
+ * If nrec is non-NULL then at most nrec[i] records are read from in[i]
+ * and the inputs are left open.  Otherwise inputs are read to EOF,
+ * being closed and set to NULL as they finish.  NULL inputs are
+ * skipped.
+ *
+ * Returns 0 on success
+ *        -1 on failure
+ */
+static int merge_records(scram_fd **in, int64_t *nrec, int n_input,
+			 scram_fd *out, int max_reads) {
+    bam_seq_t **s;
+    merge_heap heap;
+    int i, ret = -1;
+
+    s = calloc(n_input, sizeof(*s));
+    heap.h = malloc(n_input * sizeof(*heap.h));
+    heap.key = malloc(n_input * sizeof(*heap.key));
+    heap.n = 0;
+    if (!s || !heap.h || !heap.key)
+	goto err;
+
+    for (i = 0; i < n_input; i++) {
+	if (!in[i] || (nrec && nrec[i] <= 0))
+	    continue;
+
+	if (scram_get_seq(in[i], &s[i]) < 0) {
+	    if (!nrec) {
+		if (scram_close(in[i]))
+		    goto err;
+		in[i] = NULL;
+	    }
+	    continue;
+	}
+	heap.key[i] = merge_key(s[i]);
+	heap.h[heap.n++] = i;
+    }
+    for (i = heap.n/2-1; i >= 0; i--)
+	heap_sift_down(&heap, i);
+
+    while (heap.n) {
+	int best_j = heap.h[0];
+
+	if (-1 == scram_put_seq(out, s[best_j]))
+	    goto err;
+
+	if ((nrec && --nrec[best_j] == 0) ||
+	    scram_get_seq(in[best_j], &s[best_j]) < 0) {
+	    if (!nrec) {
+		if (scram_close(in[best_j]))
+		    goto err;
+		in[best_j] = NULL;
+	    }
+	    heap.h[0] = heap.h[--heap.n];
+	} else {
+	    heap.key[best_j] = merge_key(s[best_j]);
+	}
+	heap_sift_down(&heap, 0);
+
+	if (max_reads >= 0)
+	    if (--max_reads == 0)
+		break;
+    }
+    ret = 0;
+
+ err:
+    if (s) {
+	for (i = 0; i < n_input; i++)
+	    free(s[i]);
+    }
+    free(s);
+    free(heap.h);
+    free(heap.key);
+
+    return ret;
+}
+
+/*
+ * The location and reference extent of a CRAM container.  Start and end
+ * are (ref,pos) keys, with unmapped data sorting last.  End is an upper
+ * bound on the start of any record within the container: the start of
+ * the next container in a sorted file, or failing that its own span.
+ */
+typedef struct {
+    off_t offset;    // file offset of the container header
+    uint64_t start;
+    uint64_t end;
+    int64_t nrec;
+} ctr_extent;
+
+static uint64_t ctr_key(int32_t ref, int64_t pos) {
+    return (((uint64_t)(uint32_t)ref)<<32) | (uint32_t)pos;
+}
+
+/*
+ * Reads all container headers from a CRAM input, recording their file
+ * offsets and extents, and then rewinds to the first container.
+ * Multi-reference containers have no single extent, so fail the scan.
+ *
+ * Returns an array of *n_ext extents on success
+ *         NULL on failure
+ */
+static ctr_extent *scan_containers(cram_fd *fd, int *n_ext) {
+    off_t first = CRAM_IO_TELLO(fd), off = first;
+    ctr_extent *ext, *e;
+    cram_container *c;
+    int n = 0, alloc = 1024;
+
+    if (!(ext = malloc(alloc * sizeof(*ext))))
+	return NULL;
+
+    while ((c = cram_read_container(fd))) {
+	if (c->ref_seq_id == -2 || cram_seek(fd, c->length, SEEK_CUR)) {
+	    cram_free_container(c);
+	    goto err;
+	}
+
+	if (c->num_records) {
+	    if (n == alloc) {
+		alloc *= 2;
+		if (!(e = realloc(ext, alloc * sizeof(*ext)))) {
+		    cram_free_container(c);
+		    goto err;
+		}
+		ext = e;
+	    }
+	    e = &ext[n++];
+	    e->offset = off;
+	    e->start = ctr_key(c->ref_seq_id, c->ref_seq_start);
+	    e->end = ctr_key(c->ref_seq_id, c->ref_seq_span > 0
+			     ? c->ref_seq_start + c->ref_seq_span-1
+			     : c->ref_seq_start);
+	    e->nrec = c->num_records;
+
+	    // A sorted file cannot have records beyond the next container start
+	    if (n > 1 && e[-1].end > e->start)
+		e[-1].end = e->start;
+	}
+
+	cram_free_container(c);
+	off = CRAM_IO_TELLO(fd);
+    }
+
+    if (!fd->eof || cram_seek(fd, first, SEEK_SET))
+	goto err;
+    fd->eof = 0;
+
+    *n_ext = n;
+    return ext;
+
+ err:
+    cram_seek(fd, first, SEEK_SET);
+    fd->eof = 0;
+    free(ext);
+    return NULL;
+}
+
+/*
+ * Returns 1 if container start 'start' from input i may need merging
+ * with records of input j, which are bounded by key 'end'.  Ties go to
+ * the earlier input, as in merge_records().
+ */
+static inline int ctr_overlap(uint64_t start, int i, uint64_t end, int j) {
+    return start < end || (start == end && i < j);
+}
+
+/*
+ * Merges sorted CRAM inputs a container at a time.  A container that
+ * does not overlap the next pending container of any other input is
+ * copied verbatim.  Otherwise the run of containers that interleave
+ * across inputs is decoded and merged by record, using freshly opened
+ * decoders positioned at the start of the run.
+ *
+ * Returns 0 on success
+ *        -1 on failure
+ */
+static int merge_containers(scram_fd **in, char **fn, int n_input,
+			    ctr_extent **ext, int *n_ext, scram_fd *out,
+			    t_pool *pool, refs_t *refs, int verbose) {
+    int *idx = calloc(n_input, sizeof(*idx));
+    int *lim = calloc(n_input, sizeof(*lim));
+    int64_t *nrec = calloc(n_input, sizeof(*nrec));
+    uint64_t *end = calloc(n_input, sizeof(*end));
+    scram_fd **dec = calloc(n_input, sizeof(*dec));
+    int i, j, ret = -1, n_copied = 0, n_decoded = 0;
+
+    if (!idx || !lim || !nrec || !end || !dec)
+	goto err;
+
+    for (;;) {
+	ctr_extent *e;
+	int a = -1, more;
+
+	// Input with the left-most pending container
+	for (i = 0; i < n_input; i++) {
+	    if (idx[i] < n_ext[i] &&
+		(a < 0 || ext[i][idx[i]].start < ext[a][idx[a]].start))
+		a = i;
+	}
+	if (a < 0)
+	    break;
+
+	e = &ext[a][idx[a]];
+	for (i = 0; i < n_input; i++) {
+	    if (i != a && idx[i] < n_ext[i] &&
+		ctr_overlap(ext[i][idx[i]].start, i, e->end, a))
+		break;
+	}
+
+	if (i == n_input) {
+	    // No overlap, so copy it as-is
+	    cram_container *c;
+
+	    if (cram_seek(in[a]->c, e->offset, SEEK_SET) ||
+		!(c = cram_read_container(in[a]->c)))
+		goto err;
+	    j = cram_copy_container(in[a]->c, out->c, c);
+	    cram_free_container(c);
+	    if (j)
+		goto err;
+
+	    idx[a]++;
+	    n_copied++;
+	    continue;
+	}
+
+	/*
+	 * Gather the interleaving run.  An input's next container joins
+	 * when it overlaps the containers already taken from any other
+	 * input; consecutive containers from one input never need merging
+	 * with each other.
+	 */
+	memcpy(lim, idx, n_input * sizeof(*lim));
+	lim[a]++;
+	end[a] = e->end;
+	do {
+	    more = 0;
+	    for (i = 0; i < n_input; i++) {
+		while (lim[i] < n_ext[i]) {
+		    for (j = 0; j < n_input; j++) {
+			if (j != i && lim[j] > idx[j] &&
+			    ctr_overlap(ext[i][lim[i]].start, i, end[j], j))
+			    break;
+		    }
+		    if (j == n_input)
+			break;
+
+		    if (lim[i] == idx[i] || end[i] < ext[i][lim[i]].end)
+			end[i] = ext[i][lim[i]].end;
+		    lim[i]++;
+		    more = 1;
+		}
+	    }
+	} while (more);
+
+	for (i = 0; i < n_input; i++) {
+	    nrec[i] = 0;
+	    if (lim[i] == idx[i])
+		continue;
+
+	    for (j = idx[i]; j < lim[i]; j++)
+		nrec[i] += ext[i][j].nrec;
+	    n_decoded += lim[i] - idx[i];
+
+	    if (!(dec[i] = scram_open(fn[i], "rc"))) {
+		fprintf(stderr, "Failed to open bam file %s\n", fn[i]);
+		goto err;
+	    }
+	    if (pool && scram_set_option(dec[i], CRAM_OPT_THREAD_POOL, pool))
+		goto err;
+	    if (refs && scram_set_option(dec[i], CRAM_OPT_SHARED_REF, refs))
+		goto err;
+	    if (cram_seek(dec[i]->c, ext[i][idx[i]].offset, SEEK_SET))
+		goto err;
+	}
+
+	if (merge_records(dec, nrec, n_input, out, -1))
+	    goto err;
+
+	for (i = 0; i < n_input; i++) {
+	    idx[i] = lim[i];
+	    if (dec[i]) {
+		j = scram_close(dec[i]);
+		dec[i] = NULL;
+		if (j)
+		    goto err;
+	    }
+	}
+    }
+
+    if (verbose)
+	fprintf(stderr, "Copied %d containers, decoded %d\n",
+		n_copied, n_decoded);
+    ret = 0;
+
+ err:
+    if (dec) {
+	for (i = 0; i < n_input; i++)
+	    if (dec[i])
+		scram_close(dec[i]);
+    }
+    free(idx);
+    free(lim);
+    free(nrec);
+    free(end);
+    free(dec);
+
+    return ret;
+}
+
 static void usage(FILE *fp) {
     fprintf(fp, "  -=- scram_merge -=-     version %s\n", IOLIB_VERSION);
     fprintf(fp, "Author: James Bonfield, Wellcome Trust Sanger Institute. 2013\n\n");
@@ -126,12 +500,13 @@ static void usage(FILE *fp) {
 	    SLICE_PER_CNT);
     fprintf(fp, "    -V version     [Cram] Specify the file format version to write (eg 1.1, 2.0)\n");
     fprintf(fp, "    -X             [Cram] Embed reference sequence.\n");
+    fprintf(fp, "    -t N           Use N threads for decoding the inputs, plus N\n"
+	        "                   for encoding the output.\n");
 }
 
 int main(int argc, char **argv) {
     scram_fd **in, *out;
     int n_input, i;
-    bam_seq_t **s;
     char imode[10], *in_f = "", omode[10], *out_f = "";
     int level = '\0'; // nul terminate string => auto level
     int c, verbose = 0;
@@ -141,9 +516,15 @@ int main(int argc, char **argv) {
     char ref_name[1024] = {0};
     refs_t *refs = NULL;
     int max_reads = -1;
+    int nthreads = 1;
+    t_pool *in_pool = NULL, *out_pool = NULL;
+    int pass_through;
+    ctr_extent **ext = NULL;
+    int *n_ext = NULL;
+    char **fn;
 
     /* Parse command line arguments */
-    while ((c = getopt(argc, argv, "u0123456789hvs:S:V:r:XI:O:R:N:")) != -1) {
+    while ((c = getopt(argc, argv, "u0123456789hvs:S:V:r:XI:O:R:N:t:")) != -1) {
 	switch (c) {
 	case '0': case '1': case '2': case '3': case '4':
 	case '5': case '6': case '7': case '8': case '9':
@@ -216,6 +597,14 @@ int main(int argc, char **argv) {
 	    max_reads = atoi(optarg);
 	    break;
 
+	case 't':
+	    nthreads = atoi(optarg);
+	    if (nthreads < 1) {
+		fprintf(stderr, "Number of threads needs to be >= 1\n");
+		return 1;
+	    }
+	    break;
+
 	case '?':
 	    fprintf(stderr, "Unrecognised option: -%c\n", optopt);
 	    usage(stderr);
@@ -239,16 +628,32 @@ int main(int argc, char **argv) {
     }
     if (!(in = malloc(n_input * sizeof(*in))))
 	return 1;
-    if (!(s = malloc(n_input * sizeof(*s))))
-	return 1;
+    fn = &argv[optind];
+
+    /*
+     * All inputs share one decoding pool.  Each input reads ahead by no
+     * more than the pool queue size, bounding memory regardless of the
+     * number of inputs.  The output has a pool of its own so encoding
+     * never waits behind queued decode jobs.
+     */
+    if (nthreads > 1) {
+	if (!(in_pool = t_pool_init(nthreads*2, nthreads)))
+	    return 1;
+	if (!(out_pool = t_pool_init(nthreads*2, nthreads)))
+	    return 1;
+	if (scram_set_option(out, CRAM_OPT_THREAD_POOL, out_pool))
+	    return 1;
+    }
+
     for (i = 0; i < n_input; i++, optind++) {
-	s[i] = NULL;
 	if (*in_f == 0)
 	    sprintf(imode, "r%s%c", detect_format(argv[optind]), level);
 	if (!(in[i] = scram_open(argv[optind], imode))) {
 	    fprintf(stderr, "Failed to open bam file %s\n", argv[optind]);
 	    return 1;
 	}
+	if (in_pool && scram_set_option(in[i], CRAM_OPT_THREAD_POOL, in_pool))
+	    return 1;
 	if (i && !hdr_compare(scram_get_header(in[0]),
 			      scram_get_header(in[i]))) {
 	    fprintf(stderr, "Incompatible reference sequence list.\n");
@@ -325,71 +730,66 @@ int main(int argc, char **argv) {
     }
 
 
-    /* Do the actual file format conversion */
-    fprintf(stderr, "Opening and loading initial seqs\n");
-    for (i = 0; i < n_input; i++) {
-	if (scram_get_seq(in[i], &s[i]) < 0) {
-	    if (scram_close(in[i]))
-		return 1;
-	    in[i] = NULL;
-	    free(s[i]);
-	    continue;
-	}
+    /*
+     * Sorted CRAM inputs that do not interleave, such as per-region
+     * shards, can be merged by copying whole containers.  This needs
+     * seekable inputs in the output CRAM version with no request to
+     * re-encode the data.
+     */
+    pass_through = !out->is_bam && level == '\0' && !embed_ref &&
+	!s_opt && !S_opt && !*ref_name && max_reads < 0 &&
+	CRAM_MAJOR_VERS(out->c->version) >= 2;
+    for (i = 0; pass_through && i < n_input; i++) {
+	struct stat st;
+
+	if (in[i]->is_bam || in[i]->c->version != out->c->version ||
+	    !rg_compare(scram_get_header(in[0]), scram_get_header(in[i])) ||
+	    strcmp(fn[i], "-") == 0 || stat(fn[i], &st) != 0 ||
+	    !S_ISREG(st.st_mode))
+	    pass_through = 0;
     }
 
-    fprintf(stderr, "Merging...\n");
-    for (;;) {
-	int64_t best_val = INT64_MAX;
-	int best_j = 0, j;
-
-	for (j = 0; j < n_input; j++) {
-	    bam_seq_t *b = s[j];
-	    uint64_t x;
-	    if (!in[j])
-		continue;
+    if (pass_through) {
+	if (!(ext = calloc(n_input, sizeof(*ext))) ||
+	    !(n_ext = calloc(n_input, sizeof(*n_ext))))
+	    return 1;
 
-	    x = (((uint64_t)bam_ref(b))<<33)
-		| (bam_pos(b)<<2)
-		| (bam_strand(b)<<1)
-		| !(bam_flag(b) & BAM_FREAD1);
-	    if (best_val > x) {
-		best_val = x;
-		best_j = j;
-	    }
-	}
-	
-	if (best_val == INT64_MAX) { // all closed
-	    break;
-	}
+	for (i = 0; pass_through && i < n_input; i++)
+	    if (!(ext[i] = scan_containers(in[i]->c, &n_ext[i])))
+		pass_through = 0;
+    }
 
-	if (-1 == scram_put_seq(out, s[best_j]))
+    /* Do the actual file format conversion */
+    fprintf(stderr, "Merging...\n");
+    if (pass_through) {
+	if (merge_containers(in, fn, n_input, ext, n_ext, out,
+			     in_pool, refs, verbose))
+	    return 1;
+    } else {
+	if (merge_records(in, NULL, n_input, out, max_reads))
 	    return 1;
-	
-	if (scram_get_seq(in[best_j], &s[best_j]) < 0) {
-	    if (scram_close(in[best_j]))
-		return 1;
-	    in[best_j] = NULL;
-	    free(s[best_j]);
-	}
-
-	if (max_reads >= 0)
-	    if (--max_reads == 0)
-		break;
     }
 
     for (i = 0; i < n_input; i++) {
 	if (!in[i])
 	    continue;
 	scram_close(in[i]);
-	if (s[i])
-	    free(s[i]);
     }
 
     /* Finally tidy up and close files */
     if (scram_close(out))
 	return 1;
+    if (in_pool)
+	t_pool_destroy(in_pool, 0);
+    if (out_pool)
+	t_pool_destroy(out_pool, 0);
+    if (ext) {
+	for (i = 0; i < n_input; i++)
+	    free(ext[i]);
+	free(ext);
+    }
+    free(n_ext);
     free(in);
-    free(s);
 
     return 0;
 }
@@ -34,9 +34,7 @@
 /*
  * Author: James Bonfield, Wellcome Trust Sanger Institute. 2011-2013
  *
- * A basic pileup command.
- * This needs a lot of work still and to be split into library + program.
- * For now we have all in one place.
+ * A basic pileup command, using the pileup code in io_lib/pileup.c.
  *
  * Compatibility wise it is not meant to be a full blown replacement for
  * samtools mpileup or even the old samtools pileup. Primarily it is a test
@@ -56,572 +54,16 @@
 #include <stdlib.h>
 #include <string.h>
 #include <stddef.h>
-#include "scram_pileup.h"
+#include <limits.h>
+#include <unistd.h>
 
-/*
- * START_WITH_DEL is the mode that Gap5 uses when building this. It prepends
- * all cigar strings with 1D and decrements the position by one. (And then
- * has code to reverse this operation in the pileup handler.)
- *
- * The reason for this is that it means reads starting with an insertion work.
- * Otherwise the inserted bases are silently lost. (Try it with "samtools
- * mpileup" and you can see it has the same issue.)
- *
- * However it's probably not want most people expect.
- */
-//#define START_WITH_DEL
-
-/* --------------------------------------------------------------------------
- * The pileup code itself. 
- *
- * This consists of the external pileup_loop() function, which takes a
- * sam/bam samfile_t pointer and a callback function. The callback function
- * is called once per column of aligned data (so once per base in an
- * insertion).
- *
- * Current known issues.
- * 1) zero length matches, ie 2S2S cause failures.
- * 2) Insertions at starts of sequences get included in the soft clip, so
- *    2S2I2M is treated as if it's 4S2M
- * 3) From 1 and 2 above, 1S1I2S becomes 2S2S which fails.
- */
-
-/*
- * Fast conversion from encoded SAM base nibble to a printable character
- */
-static char tab[256][2];
-static void init_tab(void) {
-    int i, j;
-    unsigned char b2;
-    static int done = 0;
-
-    if (done)
-	return;
-
-    for (i = 0; i < 16; i++) {
-	for (j = 0; j < 16; j++) {
-	    b2 = (i<<4) | j;
-	    tab[b2][0] = "NACMGRSVTWYHKDBN"[i];
-	    tab[b2][1] = "NACMGRSVTWYHKDBN"[j];
-	}
-    }
-
-    done = 1;
-}
-
-
-/*
- * Fetches the next base => the nth base at unpadded position pos. (Nth can
- * be greater than 0 if we have an insertion in this column). Do not call this
- * with pos/nth lower than the previous query, although higher is better.
- * (This allows it to be initialised at base 0.)
- *
- * Stores the result in base and also updates is_insert to indicate that
- * this sequence still has more bases in this position beyond the current
- * nth parameter.
- *
- * Returns 1 if a base was fetched
- *         0 if not (eg ran off the end of sequence)
- */
-static int get_next_base(pileup_t *p, int pos, int nth, int *is_insert) {
-    bam_seq_t *b = p->b;
-    enum cigar_op op = p->cigar_op;
-
-    if (p->first_del && op != BAM_CPAD)
-	p->first_del = 0;
-
-    *is_insert = 0;
-
-    /* Find pos first */
-    while (p->pos < pos) {
-	p->nth = 0;
-
-	if (p->cigar_len == 0) {
-	    if (p->cigar_ind >= bam_cigar_len(b)) {
-		p->eof = 1;
-		return 0;
-	    }
-
-	    op=p->cigar_op  = p->b_cigar[p->cigar_ind] & BAM_CIGAR_MASK;
-	    p->cigar_len = p->b_cigar[p->cigar_ind] >> BAM_CIGAR_SHIFT;
-	    p->cigar_ind++;
-	}
-	
-	if ((op == BAM_CMATCH ||
-	     op == BAM_CBASE_MATCH ||
-	     op == BAM_CBASE_MISMATCH) && p->cigar_len <= pos - p->pos) {
-	    p->seq_offset += p->cigar_len;
-	    p->pos += p->cigar_len;
-	    p->cigar_len = 0;
-	} else {
-	    switch (op) {
-	    case BAM_CMATCH:
-	    case BAM_CBASE_MATCH:
-	    case BAM_CBASE_MISMATCH:
-		p->seq_offset++;
-		/* Fall through */
-	    case BAM_CDEL:
-	    case BAM_CREF_SKIP:
-		p->pos++;
-		p->cigar_len--;
-		break;
-
-	    case BAM_CINS:
-	    case BAM_CSOFT_CLIP:
-		p->seq_offset += p->cigar_len;
-		/* Fall through */
-	    case BAM_CPAD:
-	    case BAM_CHARD_CLIP:
-		p->cigar_len = 0;
-		break;
-
-	    default:
-		fprintf(stderr, "Unhandled cigar_op %d\n", op);
-		return -1;
-	    }
-	}
-    }
-
-    /* Now at pos, find nth base */
-    while (p->nth < nth) {
-	if (p->cigar_len == 0) {
-	    if (p->cigar_ind >= bam_cigar_len(b)) {
-		p->eof = 1;
-		return 0; /* off end of seq */
-	    }
-
-	    op=p->cigar_op  = p->b_cigar[p->cigar_ind] & BAM_CIGAR_MASK;
-	    p->cigar_len = p->b_cigar[p->cigar_ind] >> BAM_CIGAR_SHIFT;
-	    p->cigar_ind++;
-	}
-
-	switch (op) {
-	case BAM_CMATCH:
-	case BAM_CBASE_MATCH:
-	case BAM_CBASE_MISMATCH:
-	case BAM_CSOFT_CLIP:
-	case BAM_CDEL:
-	case BAM_CREF_SKIP:
-	    goto at_nth; /* sorry, but it's fast! */
-
-	case BAM_CINS:
-	    p->seq_offset++;
-	    /* Fall through */
-	case BAM_CPAD:
-	    p->cigar_len--;
-	    p->nth++;
-	    break;
-
-	case BAM_CHARD_CLIP:
-	    p->cigar_len = 0;
-	    break;
-
-	default:
-	    fprintf(stderr, "Unhandled cigar_op %d\n", op);
-	    return -1;
-	}
-    }
- at_nth:
-
-    /* Fill out base & qual fields */
-    p->ref_skip = 0;
-    if (p->nth < nth && op != BAM_CINS) {
-	//p->base = '-';
-	p->base = '*';
-	p->padding = 1;
-	if (p->seq_offset < b->len)
-	    p->qual = (p->qual + p->b_qual[p->seq_offset+1])/2;
-	else
-	    p->qual = 0;
-    } else {
-	p->padding = 0;
-	switch(op) {
-	case BAM_CDEL:
-	    p->base = '*';
-	    if (p->seq_offset+1 < b->len)
-		p->qual = (p->qual + p->b_qual[p->seq_offset+1])/2;
-	    else
-		p->qual = (p->qual + p->b_qual[p->seq_offset])/2;
-	    break;
-
-	case BAM_CPAD:
-	    //p->base = '+';
-	    p->base = '*';
-	    if (p->seq_offset+1 < b->len)
-		p->qual = (p->qual + p->b_qual[p->seq_offset+1])/2;
-	    else
-		p->qual = (p->qual + p->b_qual[p->seq_offset])/2;
-	    break;
-
-	case BAM_CREF_SKIP:
-	    p->base = '.';
-	    p->qual = 0;
-	    /* end of fragment, but not sequence */
-	    p->eof = p->eof ? 2 : 3;
-	    p->ref_skip = 1;
-	    break;
-
-	default:
-	    if (p->seq_offset < b->len) {
-		p->qual = p->b_qual[p->seq_offset];
-	    /*
-	     * If you need to label inserted bases as different from
-	     * (mis)matching bases then this is where we'd make that change.
-	     * The reason could be to allow the consensus algorithm to easily
-	     * distinguish between reference bases and non-reference bases.
-	     *
-	     * Eg:
-	     * if (nth)
-	     *     p->base = tolower(tab[p->b_seq[p->seq_offset/2]][p->seq_offset&1]);
-	     * else
-	     */
-		p->base = tab[p->b_seq[p->seq_offset/2]][p->seq_offset&1];
-	    } else {
-		p->base = 'N';
-		p->qual = 0xff;
-	    }
-		
-	    break;
-	}
-    }
-
-    /* Handle moving out of N (skip) into sequence again */
-    if (p->eof && p->base != '.') {
-	p->start = 1;
-	p->ref_skip = 1;
-	p->eof = 0;
-    }
-
-    /* Starting with an indel needs a minor fudge */
-    if (p->start && p->cigar_op == BAM_CDEL) {
-	p->first_del = 1;
-    }
-
-    /* Check if next op is an insertion of some sort */
-    if (p->cigar_len == 0) {
-	if (p->cigar_ind < bam_cigar_len(b)) {
-	    op=p->cigar_op  = p->b_cigar[p->cigar_ind] & BAM_CIGAR_MASK;
-	    p->cigar_len = p->b_cigar[p->cigar_ind] >> BAM_CIGAR_SHIFT;
-	    p->cigar_ind++;
-	    if (op == BAM_CREF_SKIP) {
-		p->eof = 3;
-		p->ref_skip = 1;
-	    }
-	} else {
-	    p->eof = 1;
-	}
-    }
-
-    switch (op) {
-    case BAM_CPAD:
-    case BAM_CINS:
-	*is_insert = p->cigar_len;
-	break;
-
-    case BAM_CSOFT_CLIP:
-	/* Last op 'S' => eof */
-        p->eof = (p->cigar_ind == bam_cigar_len(b) ||
-		  (p->cigar_ind+1 == bam_cigar_len(b) &&
-		   (p->b_cigar[p->cigar_ind] & BAM_CIGAR_MASK)
-		   == BAM_CHARD_CLIP))
-	    ? 1
-	    : 0;
-	break;
-
-    case BAM_CHARD_CLIP:
-	p->eof = 1;
-	break;
-
-    default:
-	break;
-    }
-    
-    return 1;
-}
-
-/*
- * Loops through a set of supplied ranges producing columns of data.
- * When found, it calls func with clientdata as a callback. Func should
- * return 0 for success and non-zero for failure. seq_init() is called
- * on each new entry before we start processing it. It should return 0 or 1
- * to indicate reject or accept status (eg to filter unmapped data).
- * If seq_init() returns -1 we abort the pileup_loop with an error.
- * seq_init may be NULL.
- *
- * Returns 0 on success
- *        -1 on failure
- */
-int pileup_loop(scram_fd *fp,
-		int (*seq_init)(void *client_data,
-				scram_fd *fp,
-				pileup_t *p),
-		int (*seq_add)(void *client_data,
-			       scram_fd *fp,
-			       pileup_t *p,
-			       int depth,
-			       int pos,
-			       int nth,
-			       int is_insert),
-		void *client_data) {
-    int ret = -1;
-    pileup_t *phead = NULL, *p, *pfree = NULL, *last, *next, *ptail = NULL;
-    pileup_t *pnew = NULL;
-    int is_insert, nth = 0;
-    int col = 0, r;
-    int last_ref = -1;
-
-    /* FIXME: allow for start/stop boundaries rather than consuming all data */
-
-    init_tab();
-    if (NULL == (pnew = calloc(1, sizeof(*p))))
-	return -1;
-    
-    do {
-	bam_seq_t *b;
-	int pos, last_in_contig;
-
-	r = scram_next_seq(fp, &pnew->b);
-	if (r == -1) {
-	    //fprintf(stderr, "bam_next_seq() failure on line %d\n", fp->line);
-	    if (!scram_eof(fp)) {
-		fprintf(stderr, "bam_next_seq() failure.\n");
-		return -1;
-	    }
-	}
-
-	b = pnew->b;
-
-	/* Force realloc */
-	//fp->bs = NULL;
-	//fp->bs_size = 0;
-
-	//r = samread(fp, pnew->b);
-	if (r >= 0) {
-	    if (bam_flag(b) & BAM_FUNMAP)
-		continue;
-	    
-	    if (b->ref == -1) {
-		/* Another indicator for unmapped */
-		continue;
-	    } else if (b->ref == last_ref) {
-		pos = b->pos+1;
-		//printf("New seq at pos %d @ %d %s\n", pos, b->ref,
-		//       bam_name(b));
-		last_in_contig = 0;
-	    } else {
-		//printf("New ctg at pos %d @ %d\n",b->pos+1,b->ref);
-		pos = (b->pos > col ? b->pos : col)+1;
-		last_in_contig = 1;
-	    }
-	} else {
-	    last_in_contig = 1;
-	    pos = col+1;
-	}
-
-	if (col > pos) {
-	    fprintf(stderr, "BAM/SAM file is not sorted by position. "
-		    "Aborting\n");
-	    return -1;
-	}
-
-	/* Process data between the last column and our latest addition */
-	while (col < pos && phead) {
-	    int v, ins, depth = 0;
-
-	    //printf("Col=%d pos=%d nth=%d\n", col, pos, nth);
-
-	    /* Pileup */
-	    is_insert = 0;
-	    for (p = phead; p; p = p->next) {
-		if (!get_next_base(p, col, nth, &ins))
-		    p->eof = 1;
-
-		if (is_insert < ins)
-		    is_insert = ins;
-		
-		depth++;
-	    }
-
-	    /* Call our function on phead linked list */
-#ifdef START_WITH_DEL
-	    v = seq_add(client_data, fp, phead, depth, col-1, nth, is_insert);
-#else
-	    v = seq_add(client_data, fp, phead, depth, col, nth, is_insert);
-#endif
-
-	    /* Remove dead seqs */
-	    for (p = phead, last = NULL; p; p = next) {
-		next = p->next;
-		
-		p->start = 0;
-		if (p->eof == 1) {
-		    if (last)
-			last->next = p->next;
-		    else
-			phead = p->next;
-
-		    p->next = pfree;
-		    pfree = p;
-		    
-		    //printf("Del seq %s at pos %d\n", bam_name(p->b), col);
-		} else {
-		    last = p;
-		}
-	    }
-	    if ((ptail = last) == NULL)
-		ptail = phead;
-
-	    if (v == 1)
-		break; /* early abort */
-	    
-	    if (v != 0)
-		goto error;
-
-	    /* Next column */
-	    if (is_insert) {
-		nth++;
-	    } else {
-		nth = 0;
-		col++;
-	    }
-
-	    /* Special case for the last sequence in a contig */
-	    if (last_in_contig && phead)
-		pos++;
-	}
-
-	/* May happen if we have a hole in the contig */
-	col = pos;
-
-	/* New contig */
-	if (b && b->ref != last_ref) {
-	    last_ref = b->ref;
-	    pos = b->pos+1;
-	    nth = 0;
-	    col = pos;
-	}
-
-	/*
-	 * Add this seq.
-	 * Note: cigars starting with I or P ops (eg 2P3I10M) mean we have
-	 * alignment instructions that take place before the designated
-	 * starting location listed in the SAM file. They won't get included
-	 * in the callback function until they officially start, which is
-	 * already too late.
-	 *
-	 * So to workaround this, we prefix all CIGAR with 1D, move the
-	 * position by 1bp, and then force the callback code to remove
-	 * leaving pads (either P or D generated).
-	 *
-	 * Ie it's a level 10 hack!
-	 */
-	if (r >= 0) {
-	    p = pnew;
-	    p->next       = NULL;
-	    p->cd         = NULL;
-	    p->start      = 1;
-	    p->eof        = 0;
-#ifdef START_WITH_DEL
-	    p->pos        = pos-1;
-	    p->cigar_ind  = 0;
-	    p->b_cigar    = bam_cigar(p->b);
-	    if ((p->b_cigar[0] & BAM_CIGAR_MASK) == BAM_CHARD_CLIP) {
-		p->cigar_len  = p->b_cigar[0] >> BAM_CIGAR_SHIFT;
-		p->cigar_op   = BAM_CHARD_CLIP;
-		if ((p->b_cigar[1] & BAM_CIGAR_MASK) == BAM_CSOFT_CLIP) {
-		    /* xHxS... => xHxS1D... */
-		    p->b_cigar[0] = p->b_cigar[1];
-		    p->b_cigar[1] = (1 << BAM_CIGAR_SHIFT) | BAM_CDEL;
-		} else {
-		    /* xH... => xH1D... */
-		    p->b_cigar[0] = (1 << BAM_CIGAR_SHIFT) | BAM_CDEL;
-		}
-	    } else {
-		if ((p->b_cigar[0] & BAM_CIGAR_MASK) == BAM_CSOFT_CLIP) {
-		    /* xS... => xS1D... */
-		    p->cigar_len  = p->b_cigar[0] >> BAM_CIGAR_SHIFT;
-		    p->cigar_op   = BAM_CSOFT_CLIP;
-		    p->b_cigar[0] = (1 << BAM_CIGAR_SHIFT) | BAM_CDEL;
-		} else {
-		    /* ... => 1D... */
-		    p->cigar_len  = 1;        /* was  0  */
-		    p->cigar_op   = BAM_CDEL; /* was 'X' */
-		}
-	    }
-	    p->seq_offset = -1;
-	    p->first_del  = 1;
-#else
-	    p->pos        = pos-1;
-	    p->cigar_ind  = 0;
-	    p->b_cigar    = bam_cigar(p->b);
-	    p->cigar_len  = 0;
-	    p->cigar_op   = -1;
-	    p->seq_offset = -1;
-	    p->first_del  = 0;
+#if defined(__MINGW32__) || defined(__FreeBSD__) || defined(__APPLE__)
+#   include <getopt.h>
 #endif
-	    p->b_strand   = bam_strand(p->b) ? 1 : 0;
-	    p->b_qual     = (uc *)bam_qual(p->b);
-	    p->b_seq      = (uc *)bam_seq(p->b);
-
-	    if (seq_init) {
-		int v;
-		v = seq_init(client_data, fp, p);
-		if (v == -1)
-		    return -1;
-		
-		if (v == 1) {
-		    /* Keep this seq */
-		    if (phead) {
-			ptail->next = p;
-		    } else {
-			phead = p;
-		    }
-		    ptail = p;
-		} else {
-		    /* Push back on free list */
-		    p->next = pfree;
-		    pfree = p;
-		}
-	    } else {
-		if (phead)
-		    ptail->next = p;
-		else
-		    phead = p;
-		ptail = p;
-	    }
-
-	    /* Allocate the next pileup rec */
-	    if (pfree) {
-		pnew = pfree;
-		pfree = pfree->next;
-	    } else {
-		if (NULL == (pnew = calloc(1, sizeof(*pnew))))
-		    goto error;
-	    }
-	}
-    } while (r >= 0);
-
-    ret = 0;
- error:
-
-    if (pnew) {
-	free(pnew->b);
-	free(pnew);
-    }
 
-    /* Tidy up */
-    for (p = pfree; p; p = next) {
-	next = p->next;
-	free(p->b);
-	free(p);
-    }
-
-    return ret;
-}
+#include <io_lib/pileup.h>
 
-/* --------------------------------------------------------------------------
- * Example usage of the above pileup code
- */
+#define PILEUP_TILE_SZ 100000
 
 #include <ctype.h>
 #include <io_lib/bam.h>
@@ -646,27 +88,93 @@ typedef struct {
     int  *seq_len;    // length of insertion
 } sam_pileup_t;
 
+/* A run of equal depth; end is exclusive and depth 0 means none */
+typedef struct {
+    int ref, start, end;
+    int32_t depth;
+} bg_run;
+
+/*
+ * The state for one stream of pileup output.  With multiple threads there
+ * is one per tile, and output is held in buf until the tile is complete.
+ * Otherwise fp is set and we write out whenever buf fills up.
+ */
+typedef struct {
+    FILE *fp;
+    char *buf;
+    size_t len, alloc;
+
+    /* Per-column working space */
+    unsigned char *seq, *qual, *line;
+    size_t seq_alloc, line_alloc;
+    int max_depth;
+
+    sam_pileup_t ins;
+
+    /* Bedgraph: the current run and, when tiled, the tile's first run */
+    bg_run run, first;
+    int hold_first;
+} pileup_out;
+
+#define OUT_FLUSH_SZ 65536
+
+static int out_flush(pileup_out *o) {
+    if (o->len && o->fp && o->len != fwrite(o->buf, 1, o->len, o->fp))
+	return -1;
+    o->len = 0;
+    return 0;
+}
+
+/* Appends a line of output, adding the newline */
+static int out_line(pileup_out *o, unsigned char *line, size_t len) {
+    if (o->len + len + 1 > o->alloc) {
+	size_t alloc = o->alloc ? o->alloc : OUT_FLUSH_SZ;
+	char *buf;
+
+	while (o->len + len + 1 > alloc)
+	    alloc *= 2;
+	if (!(buf = realloc(o->buf, alloc)))
+	    return -1;
+	o->buf = buf;
+	o->alloc = alloc;
+    }
+
+    memcpy(o->buf + o->len, line, len);
+    o->len += len;
+    o->buf[o->len++] = '\n';
+
+    return o->fp && o->len >= OUT_FLUSH_SZ ? out_flush(o) : 0;
+}
+
+static void out_free(pileup_out *o) {
+    free(o->buf);
+    free(o->seq);
+    free(o->qual);
+    free(o->line);
+    free(o->ins.base);
+    free(o->ins.seq_offset);
+    free(o->ins.seq_len);
+    free(o);
+}
+
 static int sam_pileup(void *cd_v, scram_fd *fp, pileup_t *p,
 		      int depth, int pos, int nth, int is_insert) {
-    static unsigned char *seq = NULL, *qual = NULL, *buf = NULL;
-    static size_t seq_alloc = 0, buf_alloc = 0;
-    static int max_depth = 0;
+    pileup_out *o = (pileup_out *)cd_v;
     unsigned char *sp, *qp, *cp;
     int ref;
-    sam_pileup_t *cd = (sam_pileup_t *)cd_v;
+    sam_pileup_t *cd = &o->ins;
     size_t buf_len;
 
-    if (max_depth < depth) {
-	max_depth = depth;
-	seq  = realloc(seq,  seq_alloc = max_depth*2);
-	qual = realloc(qual, max_depth);
-	//buf  = realloc(buf,  max_depth*2+1000);
+    if (o->max_depth < depth) {
+	o->max_depth = depth;
+	o->seq  = realloc(o->seq,  o->seq_alloc = o->max_depth*2);
+	o->qual = realloc(o->qual, o->max_depth);
 
-	if (!seq || !qual)
+	if (!o->seq || !o->qual)
 	    return -1;
     }
 
-    sp = seq; qp = qual; cp = buf;
+    sp = o->seq; qp = o->qual;
 
     if (!p)
 	return 0;
@@ -719,10 +227,10 @@ static int sam_pileup(void *cd_v, scram_fd *fp, pileup_t *p,
 	    int i, j;
 	    uint8_t *b_seq = (uint8_t *)bam_seq(p->b);
 
-	    while ((sp - seq + 5 + cd->seq_len[n]) > seq_alloc) {
-		ptrdiff_t d = sp - seq;
-		seq = realloc(seq, seq_alloc*=2);
-		sp = seq + d;
+	    while ((sp - o->seq + 5 + cd->seq_len[n]) > o->seq_alloc) {
+		ptrdiff_t d = sp - o->seq;
+		o->seq = realloc(o->seq, o->seq_alloc*=2);
+		sp = o->seq + d;
 	    }
 
 	    if(p->base != '*')
@@ -748,10 +256,10 @@ static int sam_pileup(void *cd_v, scram_fd *fp, pileup_t *p,
 	}
     } else {
 	for (; p; p = p->next) {
-	    while ((sp - seq + 4) > seq_alloc) {
-		ptrdiff_t d = sp - seq;
-		seq = realloc(seq, seq_alloc*=2);
-		sp = seq + d;
+	    while ((sp - o->seq + 4) > o->seq_alloc) {
+		ptrdiff_t d = sp - o->seq;
+		o->seq = realloc(o->seq, o->seq_alloc*=2);
+		sp = o->seq + d;
 	    }
 	    if (p->start) {
 		*sp++ = '^';
@@ -765,17 +273,17 @@ static int sam_pileup(void *cd_v, scram_fd *fp, pileup_t *p,
 	}
     }
 
-    /* Equivalent to the printf below, but faster */
+    /* Equivalent to a printf, but faster */
     buf_len = strlen(scram_get_header(fp)->ref[ref].name) + 1 // name
 	+ 10 + 1                                              // pos
 	+ 1  + 1                                              // base
 	+ 10 + 1                                              // depth
-	+ sp - seq + 1                                        // seq
-	+ qp - qual + 1;                                      // qual
-    if (buf_len > buf_alloc)
-	buf = realloc(buf, buf_alloc = buf_len);
+	+ sp - o->seq + 1                                     // seq
+	+ qp - o->qual + 1;                                   // qual
+    if (buf_len > o->line_alloc)
+	o->line = realloc(o->line, o->line_alloc = buf_len);
 
-    cp = buf;
+    cp = o->line;
     strcpy((char *) cp, scram_get_header(fp)->ref[ref].name);
     cp += strlen((char *) cp);
     *cp++ = '\t';
@@ -783,35 +291,27 @@ static int sam_pileup(void *cd_v, scram_fd *fp, pileup_t *p,
     *cp++ = 'N';
     *cp++ = '\t';
     cp = append_int(cp, depth); *cp++ = '\t';
-    memcpy(cp, seq,  sp-seq);  cp += sp-seq;  *cp++ = '\t';
-    memcpy(cp, qual, qp-qual); cp += qp-qual; *cp++ = '\0';
-    puts((char *) buf);
-
-    //*sp++ = 0;
-    //*qp++ = 0;
-    //printf("ref\t%d+%d\tN\t%d\t%s\t%s\n", pos, nth, depth, seq, qual);
+    memcpy(cp, o->seq,  sp-o->seq);  cp += sp-o->seq;  *cp++ = '\t';
+    memcpy(cp, o->qual, qp-o->qual); cp += qp-o->qual;
 
-    return 0;
+    return out_line(o, o->line, cp - o->line);
 }
 
 static int basic_pileup(void *cd, scram_fd *fp, pileup_t *p,
 			int depth, int pos, int nth, int is_insert) {
-    static unsigned char *seq = NULL, *qual = NULL, *buf = NULL;
-    static int max_depth = 0;
+    pileup_out *o = (pileup_out *)cd;
     unsigned char *qp, *cp, *rp;
     int ref;
 
-    if (max_depth < depth) {
-	max_depth = depth;
-	seq  = realloc(seq,  max_depth*3);
-	qual = realloc(qual, max_depth);
-	buf  = realloc(buf,  max_depth*2+1000);
+    if (o->max_depth < depth) {
+	o->max_depth = depth;
+	o->line = realloc(o->line, o->line_alloc = o->max_depth*2+1000);
 
-	if (!seq || !qual || !buf)
+	if (!o->line)
 	    return -1;
     }
 
-    qp = qual; cp = buf;
+    cp = o->line;
 
     if (!p)
 	return 0;
@@ -836,10 +336,8 @@ static int basic_pileup(void *cd, scram_fd *fp, pileup_t *p,
 	*qp++ = MIN(p->qual,93) + '!';
     }
     *cp++ = '\t';
-    *qp++ = '\0';
-    puts((char *) buf);
 
-    return 0;
+    return out_line(o, o->line, qp - o->line);
 }
 
 static int depth_pileup(void *cd, scram_fd *fp, pileup_t *p,
@@ -856,76 +354,337 @@ static int depth_pileup(void *cd, scram_fd *fp, pileup_t *p,
     cp = append_int(cp, pos);
     *cp++=  '\t';
     cp = append_int(cp, depth);
-    *cp++ = '\0';
-    puts((char *) buf);
-    
+
+    return out_line((pileup_out *)cd, buf, cp - buf);
+}
+
+/*
+ * Coverage from pileup_depth(), as per base depth in the same format as
+ * depth_pileup() or as bedgraph.
+ */
+static int depth_coverage(void *cd, scram_fd *fp, int ref, int pos,
+			  int32_t *depth, int len) {
+    pileup_out *o = (pileup_out *)cd;
+    char *name = scram_get_header(fp)->ref[ref].name;
+    size_t name_len = strlen(name);
+    unsigned char buf[1024], *cp;
+    int i;
+
+    if (name_len > sizeof(buf) - 24)
+	return -1;
+    memcpy(buf, name, name_len);
+    buf[name_len] = '\t';
+
+    for (i = 0; i < len; i++) {
+	if (!depth[i])
+	    continue;
+	cp = buf + name_len + 1;
+	cp = append_int(cp, pos + i);
+	*cp++=  '\t';
+	cp = append_int(cp, depth[i]);
+	if (out_line(o, buf, cp - buf))
+	    return -1;
+    }
+
     return 0;
 }
 
-int main(int argc, char **argv) {
-    scram_fd *fp;
-    sam_pileup_t *p;
-    int mode = 0;
-
-    if (argc < 2) {
-	fprintf(stderr, "Usage: scram_pileup [options] filename.{sam,bam,cram}\n");
-	fprintf(stderr, "Options:\n");
-	fprintf(stderr, " -5          Gap5 pileup format.\n");
-	fprintf(stderr, " -d          Depth format.\n");
-	fprintf(stderr, " (otherwise) Samtools pileup format.\n");
-	fprintf(stderr, "\n\nNOTE: This program is still under development "
-		"and should be considered a proof\nof concept only.\n");
-	return 1;
+static int bg_line(pileup_out *o, SAM_hdr *h, bg_run *r) {
+    unsigned char buf[1024], *cp = buf;
+    char *name = h->ref[r->ref].name;
+    size_t name_len = strlen(name);
+
+    if (name_len > sizeof(buf) - 36)
+	return -1;
+    memcpy(cp, name, name_len);
+    cp += name_len;
+    *cp++ = '\t';
+    cp = append_int(cp, r->start-1);
+    *cp++ = '\t';
+    cp = append_int(cp, r->end-1);
+    *cp++ = '\t';
+    cp = append_int(cp, r->depth);
+
+    return out_line(o, buf, cp - buf);
+}
+
+/* Finishes the current run, holding it back if it's the first in a tile */
+static int bg_end_run(pileup_out *o, SAM_hdr *h) {
+    int ret = 0;
+
+    if (!o->run.depth)
+	return 0;
+
+    if (o->hold_first && !o->first.depth)
+	o->first = o->run;
+    else
+	ret = bg_line(o, h, &o->run);
+    o->run.depth = 0;
+
+    return ret;
+}
+
+static int bedgraph_coverage(void *cd, scram_fd *fp, int ref, int pos,
+			     int32_t *depth, int len) {
+    pileup_out *o = (pileup_out *)cd;
+    SAM_hdr *h = scram_get_header(fp);
+    int i = 0;
+
+    while (i < len) {
+	int32_t d = depth[i];
+	int j = i+1;
+
+	while (j < len && depth[j] == d)
+	    j++;
+
+	if (d && d == o->run.depth && ref == o->run.ref &&
+	    pos+i == o->run.end) {
+	    o->run.end = pos+j;
+	} else {
+	    if (bg_end_run(o, h))
+		return -1;
+	    if (d) {
+		o->run.ref   = ref;
+		o->run.start = pos+i;
+		o->run.end   = pos+j;
+		o->run.depth = d;
+	    }
+	}
+	i = j;
     }
 
-    if (argc >= 2 && strcmp(argv[1], "-5") == 0) {
-	mode = '5';
-	argc--;
-	argv++;
+    return 0;
+}
+
+/*
+ * Tiled output.  Tiles are written to stdout in order via pending, which
+ * also holds the last bedgraph run so it can be joined to the first run
+ * of the next tile.
+ */
+typedef struct {
+    SAM_hdr *h;
+    pileup_out *out;
+    bg_run pending;
+} pileup_tiles;
+
+static int bg_push(pileup_tiles *t, bg_run *r) {
+    if (!r->depth)
+	return 0;
+
+    if (t->pending.depth == r->depth && t->pending.ref == r->ref &&
+	t->pending.end == r->start) {
+	t->pending.end = r->end;
+	return 0;
+    }
+
+    if (t->pending.depth && bg_line(t->out, t->h, &t->pending))
+	return -1;
+    t->pending = *r;
+
+    return 0;
+}
+
+/*
+ * Tile callbacks for pileup_tiled().  The whole-file fallback tile runs on
+ * our own thread, so it can stream output rather than holding it.
+ */
+static void *tile_init(void *cd, cram_range *r) {
+    pileup_out *o = calloc(1, sizeof(*o));
+    if (o && r->refid == -2)
+	o->fp = stdout;
+    else if (o)
+	o->hold_first = 1;
+    return o;
+}
+
+static int tile_done(void *cd, void *tile_data, cram_range *r) {
+    pileup_tiles *t = (pileup_tiles *)cd;
+    pileup_out *o = (pileup_out *)tile_data;
+    int ret = 0;
+
+    if (!o)
+	return -1;
+
+    if (r && !o->hold_first) {
+	ret |= bg_end_run(o, t->h);
+	ret |= out_flush(o);
+    } else if (r) {
+	ret |= bg_push(t, &o->first);
+	if (o->len && t->pending.depth) {
+	    ret |= bg_line(t->out, t->h, &t->pending);
+	    t->pending.depth = 0;
+	}
+	ret |= out_flush(t->out);
+
+	o->fp = stdout;
+	ret |= out_flush(o);
+	ret |= bg_push(t, &o->run);
     }
+    out_free(o);
+
+    return ret ? -1 : 0;
+}
+
+static void usage(FILE *fp) {
+    fprintf(fp, "Usage: scram_pileup [options] filename.{sam,bam,cram}\n");
+    fprintf(fp, "Options:\n");
+    fprintf(fp, " -5          Gap5 pileup format.\n");
+    fprintf(fp, " -d          Depth format.\n");
+    fprintf(fp, " -c          Depth format, computed from alignment "
+	    "positions only.\n");
+    fprintf(fp, " -b          Depth as bedgraph, as -c.\n");
+    fprintf(fp, " (otherwise) Samtools pileup format.\n");
+    fprintf(fp, " -r range    Only report ref[:start[-end]].\n");
+    fprintf(fp, " -t N        Use N threads (indexed CRAM only).\n");
+    fprintf(fp, " -T size     Bases per thread work unit [%d].\n",
+	    PILEUP_TILE_SZ);
+    fprintf(fp, "\n\nNOTE: This program is still under development "
+	    "and should be considered a proof\nof concept only.\n");
+}
+
+int main(int argc, char **argv) {
+    scram_fd *fp;
+    pileup_out *o;
+    int mode = 0, c, nthreads = 1, tile_size = PILEUP_TILE_SZ;
+    char *region = NULL;
+    cram_range r, *rp = NULL;
+    int (*seq_add)(void *, scram_fd *, pileup_t *, int, int, int, int);
+    int (*depth_add)(void *, scram_fd *, int, int, int32_t *, int) = NULL;
+    int ret;
+
+    while ((c = getopt(argc, argv, "5bcdhr:t:T:")) != -1) {
+	switch (c) {
+	case '5':
+	case 'b':
+	case 'c':
+	case 'd':
+	    mode = c;
+	    break;
+
+	case 'r':
+	    region = optarg;
+	    break;
+
+	case 't':
+	    nthreads = atoi(optarg);
+	    if (nthreads < 1) {
+		fprintf(stderr, "Number of threads needs to be >= 1\n");
+		return 1;
+	    }
+	    break;
+
+	case 'T':
+	    tile_size = atoi(optarg);
+	    break;
+
+	case 'h':
+	    usage(stdout);
+	    return 0;
 
-    if (argc >= 2 && strcmp(argv[1], "-d") == 0) {
-	mode = 'd';
-	argc--;
-	argv++;
+	default:
+	    usage(stderr);
+	    return 1;
+	}
     }
 
-    if (argc != 2) {
-	fprintf(stderr, "sam_pileup filename\n");
+    if (argc - optind != 1) {
+	usage(stderr);
 	return 1;
     }
 
     strand_init();
 
-    fp = scram_open(argv[1], "r");
+    switch(mode) {
+    case '5': seq_add = basic_pileup; break;
+    case 'd': seq_add = depth_pileup; break;
+    default:  seq_add = sam_pileup;   break;
+    }
+    if (mode == 'c')
+	depth_add = depth_coverage;
+    else if (mode == 'b')
+	depth_add = bedgraph_coverage;
+
+    fp = scram_open(argv[optind], "r");
     if (!fp) {
-	perror(argv[1]);
+	perror(argv[optind]);
 	return 1;
     }
-    
-    if (!(p = calloc(1, sizeof(*p))))
-	return 1;
 
-    switch(mode) {
-    case '5':
-	pileup_loop(fp, NULL, basic_pileup, NULL);
-	break;
+    if (region) {
+	char *cp = strchr(region, ':');
+	int start = INT_MIN, end = INT_MAX;
+
+	if (cp) {
+	    *cp = 0;
+	    switch (sscanf(cp+1, "%d-%d", &start, &end)) {
+	    case 1:
+		end = start;
+		break;
+	    case 2:
+		break;
+	    default:
+		fprintf(stderr, "Malformed range format\n");
+		return 1;
+	    }
+	}
+
+	if ((r.refid = sam_hdr_name2ref(scram_get_header(fp), region)) < 0) {
+	    fprintf(stderr, "Unknown reference name '%s'\n", region);
+	    return 1;
+	}
+	r.start = start;
+	r.end   = end;
+	rp = &r;
+    }
+
+    if (nthreads > 1) {
+	pileup_funcs f = {tile_init, NULL, seq_add, tile_done, depth_add};
+	pileup_tiles t;
+	t_pool *p;
+
+	memset(&t, 0, sizeof(t));
+	t.h = scram_get_header(fp);
+	if (!(t.out = calloc(1, sizeof(*t.out))))
+	    return 1;
+	t.out->fp = stdout;
+
+	if (!(p = t_pool_init(nthreads*2, nthreads)))
+	    return 1;
+	ret = pileup_tiled(argv[optind], rp, tile_size, p, &f, &t);
+	t_pool_destroy(p, 0);
+
+	if (t.pending.depth && bg_line(t.out, t.h, &t.pending))
+	    ret = -1;
+	if (out_flush(t.out))
+	    ret = -1;
+	out_free(t.out);
 
-    case 'd':
-	pileup_loop(fp, NULL, depth_pileup, NULL);
-	break;
+	if (scram_close(fp))
+	    return 1;
 
-    default:
-	pileup_loop(fp, NULL, sam_pileup, p);
-	break;
+	return ret == 0 && fflush(stdout) == 0 ? 0 : 1;
     }
 
-    if (p)
-	free(p);
+    if (rp && !fp->is_bam && cram_index_load(fp->c, argv[optind]) != 0)
+	return 1;
+
+    if (!(o = calloc(1, sizeof(*o))))
+	return 1;
+    o->fp = stdout;
+
+    if (depth_add) {
+	ret = pileup_depth(fp, rp, depth_add, o);
+	if (bg_end_run(o, scram_get_header(fp)))
+	    ret = -1;
+    } else {
+	ret = pileup_region(fp, rp, NULL, seq_add, o);
+    }
+    if (out_flush(o) != 0)
+	ret = -1;
+    out_free(o);
 
     if (0 != scram_close(fp))
 	return 1;
 
-    return 0;
+    return ret == 0 ? 0 : 1;
 }
-
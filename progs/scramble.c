@@ -182,6 +182,41 @@ static int filter_tags(bam_seq_t *s, char *aux_filter, int keep) {
 }
 
 
+/*
+ * Writes the statistics objects gathered in the temporary files part[]
+ * to fp as a single JSON array, and closes the temporary files.
+ *
+ * Returns 0 on success
+ *        -1 on failure
+ */
+static int write_stats(FILE *fp, FILE **part, int npart) {
+    char buf[8192];
+    size_t n;
+    int i, first = 1, err = 0;
+
+    fputs("[\n", fp);
+    for (i = 0; i < npart; i++) {
+	if (!part[i])
+	    continue;
+
+	fflush(part[i]);
+	if (ftell(part[i]) > 0) {
+	    if (!first)
+		fputs(",\n", fp);
+	    first = 0;
+	    rewind(part[i]);
+	    while ((n = fread(buf, 1, sizeof(buf), part[i])) > 0)
+		if (fwrite(buf, 1, n, fp) != n)
+		    err = -1;
+	}
+	fclose(part[i]);
+	part[i] = NULL;
+    }
+    fputs("]\n", fp);
+
+    return fflush(fp) ? -1 : err;
+}
+
 static void usage(FILE *fp) {
     fprintf(fp, "  -=- sCRAMble -=-     version %s\n", IOLIB_VERSION);
     fprintf(fp, "Author: James Bonfield, Wellcome Trust Sanger Institute. 2013-2021\n\n");
@@ -203,6 +238,8 @@ static void usage(FILE *fp) {
 	    SEQS_PER_SLICE);
     fprintf(fp, "    -S integer     [Cram] Slices per container, default %d.\n",
 	    SLICE_PER_CNT);
+    fprintf(fp, "    -A bytes       [Cram] Adaptive slices of ~'bytes' compressed size.\n");
+    fprintf(fp, "    -L MB          [Cram] Max. MB of records buffered per container.\n");
     fprintf(fp, "    -V version     [Cram] Specify the file format version to write (eg 1.1, 2.0)\n");
     fprintf(fp, "    -e             [Cram] Embed reference sequence.\n");
     fprintf(fp, "    -x             [Cram] Non-reference based encoding.\n");
@@ -229,6 +266,7 @@ static void usage(FILE *fp) {
     fprintf(fp, "    -q             Don't add scramble @PG header line\n");
     fprintf(fp, "    -N integer     Stop decoding after 'integer' sequences\n");
     fprintf(fp, "    -t N           Use N threads (availability varies by format)\n");
+    fprintf(fp, "    -W MB          Max. MB of output queued for threaded compression\n");
     fprintf(fp, "    -B             Enable Illumina 8 quality-binning system (lossy)\n");
     fprintf(fp, "    -!             Disable all checking of checksums\n");
     fprintf(fp, "    -g FILE        Convert to Bam using index (file.gzi)\n");
@@ -236,6 +274,8 @@ static void usage(FILE *fp) {
     fprintf(fp, "    -X mode        [Cram] Mode is fast, normal, small or archive.\n");
     fprintf(fp, "    -d tag-list    Keep only specified aux tags (discard the others)\n");
     fprintf(fp, "    -D tag-list    Discard specified aux tags (keep the others)\n");
+    fprintf(fp, "    -k FILE        Write per-stage timing statistics to FILE, as a JSON\n");
+    fprintf(fp, "                   array of the input and output objects\n");
 }
 
 int main(int argc, char **argv) {
@@ -258,6 +298,9 @@ int main(int argc, char **argv) {
     int sam_fields = 0; // all
     int header = 1;
     int bases_per_slice = 0;
+    int slice_target = 0;
+    int64_t container_max = 0;
+    int64_t inflight_max = 0;
     int lossy_read_names = 0;
     int preserve_aux_order = 0;
     int preserve_aux_size = 0;
@@ -266,11 +309,12 @@ int main(int argc, char **argv) {
     char *profile = "normal";
     int aux_keep = -1;
     char aux_filter[65536] = {0};
+    FILE *stats_fp = NULL, *stats_part[2] = {NULL, NULL};
 
     scram_init();
 
     /* Parse command line arguments */
-    while ((c = getopt(argc, argv, "u0123456789hvs:S:V:r:xeEI:O:R:!MmajJzZt:BN:F:Hb:nPpqg:G:fTX:d:D:")) != -1) {
+    while ((c = getopt(argc, argv, "u0123456789hvs:S:V:r:xeEI:O:R:!MmajJzZt:BN:F:Hb:nPpqg:G:fTX:d:D:k:A:L:W:")) != -1) {
 	switch (c) {
 	case 'X':
 	    profile = optarg;
@@ -316,6 +360,18 @@ int main(int argc, char **argv) {
 	    S_opt = atoi(optarg);
 	    break;
 
+	case 'A':
+	    slice_target = atoi(optarg);
+	    break;
+
+	case 'L':
+	    container_max = atoi(optarg) * (int64_t)1024*1024;
+	    break;
+
+	case 'W':
+	    inflight_max = atoi(optarg) * (int64_t)1024*1024;
+	    break;
+
 	case 'm':
 	    decode_md = 1;
 	    break;
@@ -486,6 +542,15 @@ int main(int argc, char **argv) {
 		return 1;
 	    break;
 
+	case 'k':
+	    if (strcmp(optarg, "-") == 0) {
+		stats_fp = stderr;
+	    } else if (!(stats_fp = fopen(optarg, "w"))) {
+		perror(optarg);
+		return 1;
+	    }
+	    break;
+
 	case '?':
 	    fprintf(stderr, "Unrecognised option: -%c\n", optopt);
 	    usage(stderr);
@@ -578,6 +643,14 @@ int main(int argc, char **argv) {
 	if (scram_set_option(out, CRAM_OPT_BASES_PER_SLICE, bases_per_slice))
 	    return 1;
 
+    if (slice_target)
+	if (scram_set_option(out, CRAM_OPT_SLICE_TARGET_BYTES, slice_target))
+	    return 1;
+
+    if (container_max)
+	if (scram_set_option(out, CRAM_OPT_CONTAINER_MAX_BYTES, container_max))
+	    return 1;
+
     if (embed_ref) {
 	if (scram_get_header(in)->sort_order == ORDER_NAME ||
 	    scram_get_header(in)->sort_order == ORDER_UNSORTED) {
@@ -673,6 +746,10 @@ int main(int argc, char **argv) {
 	    return 1;
 	if (scram_set_option(out, CRAM_OPT_THREAD_POOL, p))
 	    return 1;
+
+	if (inflight_max)
+	    if (scram_set_option(out, CRAM_OPT_MAX_INFLIGHT, inflight_max))
+		return 1;
     }
 
     if (ignore_md5) {
@@ -683,6 +760,19 @@ int main(int argc, char **argv) {
 	if (scram_set_option(out, CRAM_OPT_IGNORE_CHKSUM, ignore_md5))
 	    return 1;
     }
+
+    if (stats_fp) {
+	// Input and output each write an object on closing. These are
+	// collected separately and only written out once both are closed.
+	if (!(stats_part[0] = tmpfile()) || !(stats_part[1] = tmpfile())) {
+	    perror("tmpfile");
+	    return 1;
+	}
+	if (scram_set_option(in, CRAM_OPT_STATS, stats_part[0]))
+	    return 1;
+	if (scram_set_option(out, CRAM_OPT_STATS, stats_part[1]))
+	    return 1;
+    }
     
     if (lossy_read_names) {
 	if (scram_set_option(out, CRAM_OPT_LOSSY_READ_NAMES, lossy_read_names))
@@ -796,16 +886,26 @@ int main(int argc, char **argv) {
     /* Finally tidy up and close files */
     if (scram_close(in)) {
 	fprintf(stderr, "Failed in scram_close(in)\n");
+	if (stats_fp)
+	    write_stats(stats_fp, stats_part, 2);
 	return 1;
     }
     if (scram_close(out)) {
 	fprintf(stderr, "Failed in scram_close(out)\n");
+	if (stats_fp)
+	    write_stats(stats_fp, stats_part, 2);
 	return 1;
     }
 
     if (p)
 	t_pool_destroy(p, 0);
 
+    if (stats_fp && (write_stats(stats_fp, stats_part, 2) != 0 ||
+		     (stats_fp != stderr && fclose(stats_fp) != 0))) {
+	perror("Failed to write statistics");
+	return 1;
+    }
+
     if (s)
 	free(s);
 
@@ -133,10 +133,8 @@ int main(int argc, char **argv) {
     _setmode(_fileno(stdout), _O_BINARY);
 #endif
 
-    while (NULL != (ztr = srf_next_ztr(srf, name, mask))) {
+    while (NULL != (ztr = srf_next_ztr_view(srf, name, mask, NULL)))
 	ztr2fasta(ztr, name);
-	delete_ztr(ztr);
-    }
 
     srf_destroy(srf, 1);
 
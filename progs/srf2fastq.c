@@ -52,6 +52,7 @@
 #include <io_lib/ztr.h>
 #include <io_lib/srf.h>
 #include <io_lib/hash_table.h>
+#include <io_lib/thread_pool.h>
 
 #define MAX_REGIONS   40
 
@@ -550,9 +551,229 @@ void ztr2fastq(ztr_t *z, char *name, int calibrated, int sequential,
     free(chunks);
 }
 
+/* ------------------------------------------------------------------------ */
+/*
+ * Threaded decoding.
+ *
+ * The main thread reads batches of trace bodies sharing the same trace
+ * header and worker threads decode them into ztr_t structs, uncompressing
+ * the chunks ztr2fastq needs.  The main thread then formats each batch in
+ * turn with ztr2fastq, so output order and the region / file handling are
+ * unchanged.
+ */
+#define BATCH_SIZE 1024
+
+typedef struct {
+    unsigned char *hdr;		/* ZTR header blob from the trace header */
+    uint32_t hdr_len;
+    unsigned char *data;	/* read names and trace bodies */
+    size_t data_len, data_alloc;
+    size_t name_off[BATCH_SIZE];
+    size_t body_off[BATCH_SIZE];
+    uint32_t body_len[BATCH_SIZE];
+    int nreads;
+
+    /* Filled out by decode_batch */
+    ztr_t *hz;			/* decoded header, shared by ztr[] */
+    ztr_t *ztr[BATCH_SIZE];	/* NULL where a read failed to decode */
+} fq_batch;
+
+static fq_batch *batch_create(unsigned char *hdr, uint32_t hdr_len) {
+    fq_batch *b = (fq_batch *)calloc(1, sizeof(*b));
+
+    if (!b)
+	return NULL;
+
+    if (hdr_len) {
+	if (NULL == (b->hdr = malloc(hdr_len))) {
+	    free(b);
+	    return NULL;
+	}
+	memcpy(b->hdr, hdr, hdr_len);
+    }
+    b->hdr_len = hdr_len;
+
+    return b;
+}
+
+static void batch_destroy(fq_batch *b) {
+    int i;
+
+    for (i = 0; i < b->nreads; i++)
+	if (b->ztr[i])
+	    delete_ztr(b->ztr[i]);
+    if (b->hz)
+	delete_ztr(b->hz);
+    free(b->hdr);
+    free(b->data);
+    free(b);
+}
+
+/*
+ * Appends a read to a batch.
+ * Returns 0 on success
+ *        -1 on failure
+ */
+static int batch_add(fq_batch *b, char *name,
+		     unsigned char *body, uint32_t body_len) {
+    size_t name_len = strlen(name)+1;
+
+    if (b->data_len + name_len + body_len > b->data_alloc) {
+	size_t alloc = (b->data_len + name_len + body_len) * 2;
+	unsigned char *d = realloc(b->data, alloc);
+	if (!d)
+	    return -1;
+	b->data = d;
+	b->data_alloc = alloc;
+    }
+
+    b->name_off[b->nreads] = b->data_len;
+    memcpy(b->data + b->data_len, name, name_len);
+    b->data_len += name_len;
+
+    b->body_off[b->nreads] = b->data_len;
+    b->body_len[b->nreads] = body_len;
+    memcpy(b->data + b->data_len, body, body_len);
+    b->data_len += body_len;
+
+    b->nreads++;
+    return 0;
+}
+
+/*
+ * The worker thread. Decodes the trace header once and then each read
+ * against it, as srf_next_ztr does.
+ */
+static void *decode_batch(void *arg) {
+    fq_batch *b = (fq_batch *)arg;
+    long pos = 0, end;
+    mFILE *mf;
+    int i, j;
+
+    if (NULL == (mf = mfcreate(NULL, 0)))
+	return b;
+
+    if (b->hdr_len)
+	mfwrite(b->hdr, 1, b->hdr_len, mf);
+    mrewind(mf);
+    if ((b->hz = partial_decode_ztr(NULL, mf, NULL)))
+	pos = mftell(mf);
+    mfseek(mf, 0, SEEK_END);
+    end = mftell(mf);
+
+    for (i = 0; i < b->nreads; i++) {
+	ztr_t *z, *dup = b->hz ? ztr_dup(b->hz) : NULL;
+
+	mfseek(mf, end, SEEK_SET);
+	if (b->body_len[i])
+	    mfwrite(b->data + b->body_off[i], 1, b->body_len[i], mf);
+	mftruncate(mf, mftell(mf));
+	mfseek(mf, pos, SEEK_SET);
+
+	if (NULL == (z = partial_decode_ztr(NULL, mf, dup))) {
+	    if (dup)
+		delete_ztr(dup);
+	    continue;
+	}
+
+	for (j = 0; j < z->nchunks; j++) {
+	    switch (z->chunk[j].type) {
+	    case ZTR_TYPE_BASE:
+	    case ZTR_TYPE_CNF1:
+	    case ZTR_TYPE_CNF4:
+	    case ZTR_TYPE_REGN:
+		uncompress_chunk(z, &z->chunk[j]);
+		break;
+	    }
+	}
+	b->ztr[i] = z;
+    }
+
+    mfdestroy(mf);
+    return b;
+}
+
+/*
+ * Converts an entire SRF file using a pool of decoding threads.
+ * Returns 0 on success
+ *        -1 on failure
+ */
+static int srf2fastq_threaded(srf_t *srf, int mask, t_pool *p,
+			      int calibrated, int sequential, int split,
+			      char *root, int numeric, int append,
+			      int explicit, HashTable *regn_hash,
+			      int *nfiles_open, char **filenames,
+			      FILE **files, int *reverse) {
+    t_results_queue *q;
+    t_pool_result *r;
+    fq_batch *b = NULL, *ob;
+    srf_trace_view_t v;
+    char name[512];
+    int eof = 0, i;
+
+    if (NULL == (q = t_results_queue_init()))
+	return -1;
+
+    while (!eof || !t_pool_results_queue_empty(q)) {
+	if (!eof) {
+	    /* Gather reads sharing a trace header into a batch */
+	    if (0 == srf_next_trace_view(srf, name, mask, &v)) {
+		if (b && (v.new_hdr || b->nreads == BATCH_SIZE)) {
+		    if (-1 == t_pool_dispatch(p, q, decode_batch, b))
+			goto error;
+		    b = NULL;
+		}
+		if (!b && NULL == (b = batch_create(v.hdr, v.hdr_len)))
+		    goto error;
+		if (-1 == batch_add(b, name, v.body, v.body_len))
+		    goto error;
+	    } else {
+		eof = 1;
+		if (b && -1 == t_pool_dispatch(p, q, decode_batch, b))
+		    goto error;
+		b = NULL;
+	    }
+
+	    if (NULL == (r = t_pool_next_result(q)))
+		continue;
+	} else {
+	    if (NULL == (r = t_pool_next_result_wait(q)))
+		goto error;
+	}
+
+	/* Output a decoded batch; results arrive in dispatch order */
+	ob = (fq_batch *)r->data;
+	for (i = 0; i < ob->nreads; i++) {
+	    if (ob->ztr[i])
+		ztr2fastq(ob->ztr[i], (char *)ob->data + ob->name_off[i],
+			  calibrated, sequential, split, root, numeric,
+			  append, explicit, regn_hash, nfiles_open,
+			  filenames, files, reverse);
+	}
+	batch_destroy(ob);
+	t_pool_delete_result(r, 0);
+    }
+
+    t_results_queue_destroy(q);
+    return 0;
+
+ error:
+    /* Wait for the batches already dispatched so none still use q */
+    if (b)
+	batch_destroy(b);
+    while (!t_pool_results_queue_empty(q)) {
+	if (NULL == (r = t_pool_next_result_wait(q)))
+	    break;
+	batch_destroy((fq_batch *)r->data);
+	t_pool_delete_result(r, 0);
+    }
+    t_results_queue_destroy(q);
+    return -1;
+}
+
 /* ------------------------------------------------------------------------ */
 void usage(void) {
-    fprintf(stderr, "Usage: srf2fastq [-c] [-C] [-s root] [-n] [-p] archive_name ...\n");
+    fprintf(stderr, "Usage: srf2fastq [-c] [-C] [-s root] [-n] [-p] [-t nthreads] archive_name ...\n");
     fprintf(stderr, "\n");
     fprintf(stderr, "       -c       Use calibrated quality values (CNF1)\n");
     fprintf(stderr, "       -C       Ignore bad reads\n");
@@ -571,6 +792,8 @@ void usage(void) {
     fprintf(stderr, "       -r 1,2.. In a comma separated list, specify which regions to reverse,\n");
     fprintf(stderr, "                counting from 1. This will reverse complement the read and\n");
     fprintf(stderr, "                reverse the quality scores. (requires -s or -S)\n");
+    fprintf(stderr, "\n");
+    fprintf(stderr, "       -t N     Decode reads using N threads.\n");
     exit(1);
 }
 
@@ -587,6 +810,8 @@ int main(int argc, char **argv) {
     char *filenames[MAX_REGIONS];
     FILE *files[MAX_REGIONS];
     int reverse[MAX_REGIONS], reverse_set = 0;
+    int nthreads = 1;
+    t_pool *pool = NULL;
 
     memset(reverse, 0, MAX_REGIONS * sizeof(int));
 
@@ -609,6 +834,10 @@ int main(int argc, char **argv) {
             append = 1;
 	} else if (!strcmp(argv[i], "-e")) {
             explicit = 1;
+	} else if (!strcmp(argv[i], "-t")) {
+	    if (++i == argc)
+		usage();
+	    nthreads = atoi(argv[i]);
         } else if (!strcmp(argv[i], "-r")) {
 	    char *cp, *cpend;
 
@@ -648,6 +877,9 @@ int main(int argc, char **argv) {
     read_sections(READ_BASES);
     init_qlookup();
 
+    if (nthreads > 1 && NULL == (pool = t_pool_init(nthreads*2, nthreads)))
+	return 1;
+
 #ifdef _WIN32
     _setmode(_fileno(stdout), _O_BINARY);
 #endif
@@ -670,15 +902,29 @@ int main(int argc, char **argv) {
 	    return 1;
         }
     
-	while (NULL != (ztr = srf_next_ztr(srf, name, mask))) {
-            ztr2fastq(ztr, name, calibrated, sequential, split, root, numeric,
-		      append, explicit, regn_hash, &nfiles_open, filenames,
-		      files, reverse);
-	    delete_ztr(ztr);
+	if (pool) {
+	    if (-1 == srf2fastq_threaded(srf, mask, pool, calibrated,
+					 sequential, split, root, numeric,
+					 append, explicit, regn_hash,
+					 &nfiles_open, filenames, files,
+					 reverse)) {
+		fprintf(stderr, "Failed to decode %s\n", ar_name);
+		return 1;
+	    }
+	} else {
+	    /* ztr is owned by srf and reused for each read */
+	    while (NULL != (ztr = srf_next_ztr_view(srf, name, mask, NULL))) {
+		ztr2fastq(ztr, name, calibrated, sequential, split, root,
+			  numeric, append, explicit, regn_hash, &nfiles_open,
+			  filenames, files, reverse);
+	    }
 	}
 
 	srf_destroy(srf, 1);
     }
 
+    if (pool)
+	t_pool_destroy(pool, 0);
+
     return 0;
 }
@@ -53,12 +53,14 @@
 #include <io_lib/os.h>
 #include <io_lib/array.h>
 #include <io_lib/srf.h>
+#include <io_lib/thread_pool.h>
 
 /* ------------------------------------------------------------------------ */
 void usage(int code) {
-    printf("Usage: srf_index_hash [-c] srf_file\n");
+    printf("Usage: srf_index_hash [-c] [-t nthreads] srf_file\n");
     printf(" Options:\n");
     printf("    -c       check an existing index, don't re-index\n");
+    printf("    -t N     hash trace names using N threads\n");
     exit(code);
 }
 
@@ -72,6 +74,8 @@ int main(int argc, char **argv) {
     int check = 0;
     off_t old_index = 0;
     srf_index_t *idx;
+    t_pool *pool = NULL;
+    int nthreads = 1;
     
     /* Parse args */
     for (i = 1; i < argc && argv[i][0] == '-'; i++) {
@@ -79,6 +83,8 @@ int main(int argc, char **argv) {
 	    break;
 	} else if (!strcmp(argv[i], "-c")) {
 	    check = 1;
+	} else if (!strcmp(argv[i], "-t") && i+1 < argc) {
+	    nthreads = atoi(argv[++i]);
 	} else if (!strcmp(argv[i], "-h")) {
 	    usage(0);
 	} else {
@@ -107,6 +113,16 @@ int main(int argc, char **argv) {
     if (NULL == idx)
 	return 1;
 
+    /*
+     * The scan itself has to be sequential as block sizes are only known
+     * once read, but hashing the names can be deferred and done in bulk.
+     */
+    if (nthreads > 1) {
+	if (NULL == (pool = t_pool_init(nthreads*2, nthreads)))
+	    return 1;
+	srf_index_set_pool(idx, pool);
+    }
+
     /* Scan through file gathering the details to index in memory */
     while ((type = srf_next_block_details(srf, &pos, name)) >= 0) {
 	/* Only want this set if the last block in the file is an index */
@@ -154,6 +170,14 @@ int main(int argc, char **argv) {
 	return 1;
     }
     
+    if (srf_index_build(idx))
+	return 1;
+
+    if (pool) {
+	srf_index_set_pool(idx, NULL);
+	t_pool_destroy(pool, 0);
+    }
+
     if (check) {
 	srf_index_destroy(idx);
 	srf_destroy(srf, 1);
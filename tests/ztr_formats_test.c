@@ -0,0 +1,378 @@
+/*
+ * Round trips synthetic data through each of the lossless ZTR chunk
+ * formats, and through the multi-stage chains used by compress_ztr(),
+ * checking that uncompress_chunk() restores the original bytes.
+ *
+ * Lengths are chosen to straddle the 16 byte blocks used by the
+ * vectorised transforms so that both the block and tail code are run.
+ *
+ * A round trip cannot spot a transform whose encoder and decoder are
+ * wrong in the same way, so the delta and 16to8 formats are also checked
+ * against known answers produced by the scalar (non-SSE2) code.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <zlib.h>
+#include <io_lib/ztr.h>
+#include <io_lib/deflate_interlaced.h>
+
+/* Data shapes */
+#define D_BYTE   0 /* sequence-like bytes */
+#define D_16BIT  1 /* big endian trace samples */
+#define D_32BIT  2 /* big endian 32-bit values */
+#define D_QUAL4  3 /* 4 quality values per base */
+#define D_TRACE4 4 /* 4 trace channels, one sample per base */
+
+typedef struct {
+    char *name;
+    int dtype;
+    int nstages;
+    struct { int format, option, option2; } stage[3];
+} fmt_test;
+
+static fmt_test tests[] = {
+    {"rle",           D_BYTE,   1, {{ZTR_FORM_RLE,     150, 0}}},
+    {"xrle/1",        D_BYTE,   1, {{ZTR_FORM_XRLE,    150, 1}}},
+    {"xrle/4",        D_32BIT,  1, {{ZTR_FORM_XRLE,    0,   4}}},
+    /* xrle2 needs a length that is a multiple of the record size */
+    {"xrle2",         D_32BIT,  1, {{ZTR_FORM_XRLE2,   4,   0}}},
+    {"zlib",          D_BYTE,   1, {{ZTR_FORM_ZLIB,    Z_HUFFMAN_ONLY, 0}}},
+    {"delta1/1",      D_BYTE,   1, {{ZTR_FORM_DELTA1,  1,   0}}},
+    {"delta1/2",      D_BYTE,   1, {{ZTR_FORM_DELTA1,  2,   0}}},
+    {"delta1/3",      D_BYTE,   1, {{ZTR_FORM_DELTA1,  3,   0}}},
+    {"delta2/1",      D_16BIT,  1, {{ZTR_FORM_DELTA2,  1,   0}}},
+    {"delta2/2",      D_16BIT,  1, {{ZTR_FORM_DELTA2,  2,   0}}},
+    {"delta2/3",      D_16BIT,  1, {{ZTR_FORM_DELTA2,  3,   0}}},
+    {"delta4/1",      D_32BIT,  1, {{ZTR_FORM_DELTA4,  1,   0}}},
+    {"delta4/2",      D_32BIT,  1, {{ZTR_FORM_DELTA4,  2,   0}}},
+    {"delta4/3",      D_32BIT,  1, {{ZTR_FORM_DELTA4,  3,   0}}},
+    {"16to8",         D_16BIT,  1, {{ZTR_FORM_16TO8,   0,   0}}},
+    {"32to8",         D_32BIT,  1, {{ZTR_FORM_32TO8,   0,   0}}},
+    {"follow1",       D_BYTE,   1, {{ZTR_FORM_FOLLOW1, 0,   0}}},
+    {"icheb",         D_16BIT,  1, {{ZTR_FORM_ICHEB,   0,   0}}},
+    {"sthuff",        D_BYTE,   1, {{ZTR_FORM_STHUFF,  CODE_INLINE, 1}}},
+    {"qshift",        D_QUAL4,  1, {{ZTR_FORM_QSHIFT,  0,   0}}},
+    {"tshift",        D_TRACE4, 1, {{ZTR_FORM_TSHIFT,  0,   0}}},
+    {"delta2+16to8+zlib", D_16BIT, 3,
+     {{ZTR_FORM_DELTA2, 3, 0},
+      {ZTR_FORM_16TO8,  0, 0},
+      {ZTR_FORM_ZLIB,   Z_HUFFMAN_ONLY, 0}}},
+    {"icheb+16to8+follow1", D_16BIT, 3,
+     {{ZTR_FORM_ICHEB,   0, 0},
+      {ZTR_FORM_16TO8,   0, 0},
+      {ZTR_FORM_FOLLOW1, 0, 0}}},
+    {"tshift+delta2+16to8", D_TRACE4, 3,
+     {{ZTR_FORM_TSHIFT, 0, 0},
+      {ZTR_FORM_DELTA2, 3, 0},
+      {ZTR_FORM_16TO8,  0, 0}}},
+};
+
+/*
+ * Known answers. The inputs are 37 bytes and 37 big endian samples, with
+ * the leading format byte / padding of a RAW chunk. The samples include
+ * negative values and values too large for 16to8 to store in a byte.
+ */
+static unsigned char kat_bytes[38] = {
+    0x00, 0x63, 0x7a, 0xa0, 0x7e, 0xe1, 0xea, 0xf2, 0x3d, 0xc7, 0x39, 0x6d,
+    0x0d, 0xa6, 0x78, 0x16, 0x80, 0x05, 0x12, 0x3a, 0xa7, 0x4e, 0xde, 0x9f,
+    0x78, 0x9c, 0x70, 0x63, 0x00, 0x0b, 0xe6, 0xc8, 0x25, 0x21, 0x3d, 0xad,
+    0x22, 0xbc,
+};
+
+static unsigned char kat_samples[76] = {
+    0x00, 0x00, 0x00, 0x3a, 0x00, 0x39, 0x05, 0x57, 0x00, 0x34, 0xff, 0xcb,
+    0x00, 0x42, 0x00, 0x3b, 0x00, 0x39, 0x00, 0x2a, 0x04, 0x70, 0x00, 0x2b,
+    0x00, 0x33, 0x00, 0x42, 0x00, 0x41, 0x00, 0x4d, 0xff, 0xad, 0x08, 0x29,
+    0x00, 0x4c, 0x00, 0x44, 0x00, 0x49, 0x00, 0x4a, 0x00, 0x4a, 0x00, 0x59,
+    0x07, 0x07, 0x00, 0x6d, 0x00, 0x78, 0xff, 0x82, 0x00, 0x85, 0x00, 0x82,
+    0x00, 0x7c, 0x0a, 0xca, 0x00, 0x82, 0x00, 0x80, 0x00, 0x8c, 0x00, 0x99,
+    0x00, 0x98, 0x00, 0xa5,
+};
+
+static unsigned char kat_delta1_1[40] = {
+    0x40, 0x01, 0x00, 0x63, 0x17, 0x26, 0xde, 0x63, 0x09, 0x08, 0x4b, 0x8a,
+    0x72, 0x34, 0xa0, 0x99, 0xd2, 0x9e, 0x6a, 0x85, 0x0d, 0x28, 0x6d, 0xa7,
+    0x90, 0xc1, 0xd9, 0x24, 0xd4, 0xf3, 0x9d, 0x0b, 0xdb, 0xe2, 0x5d, 0xfc,
+    0x1c, 0x70, 0x75, 0x9a,
+};
+
+static unsigned char kat_delta1_2[40] = {
+    0x40, 0x02, 0x00, 0x63, 0xb4, 0x0f, 0xb8, 0x85, 0xa6, 0xff, 0x43, 0x3f,
+    0xe8, 0xc2, 0x6c, 0xf9, 0x39, 0xcc, 0xcc, 0x1b, 0x88, 0x1b, 0x45, 0x3a,
+    0xe9, 0x31, 0x18, 0x4b, 0xb0, 0x1f, 0xaa, 0x6e, 0xd0, 0x07, 0x7b, 0x9f,
+    0x20, 0x54, 0x05, 0x25,
+};
+
+static unsigned char kat_delta1_3[40] = {
+    0x40, 0x03, 0x00, 0x63, 0x51, 0x5b, 0xa9, 0xcd, 0x21, 0x59, 0x44, 0xfc,
+    0xa9, 0xda, 0xaa, 0x8d, 0x40, 0x93, 0x00, 0x4f, 0x6d, 0x93, 0x2a, 0xf5,
+    0xaf, 0x48, 0xe7, 0x33, 0x65, 0x6f, 0x8b, 0xc4, 0x62, 0x37, 0x74, 0x24,
+    0x81, 0x34, 0xb1, 0x20,
+};
+
+static unsigned char kat_delta2_1[78] = {
+    0x41, 0x01, 0x00, 0x00, 0x00, 0x3a, 0xff, 0xff, 0x05, 0x1e, 0xfa, 0xdd,
+    0xff, 0x97, 0x00, 0x77, 0xff, 0xf9, 0xff, 0xfe, 0xff, 0xf1, 0x04, 0x46,
+    0xfb, 0xbb, 0x00, 0x08, 0x00, 0x0f, 0xff, 0xff, 0x00, 0x0c, 0xff, 0x60,
+    0x08, 0x7c, 0xf8, 0x23, 0xff, 0xf8, 0x00, 0x05, 0x00, 0x01, 0x00, 0x00,
+    0x00, 0x0f, 0x06, 0xae, 0xf9, 0x66, 0x00, 0x0b, 0xff, 0x0a, 0x01, 0x03,
+    0xff, 0xfd, 0xff, 0xfa, 0x0a, 0x4e, 0xf5, 0xb8, 0xff, 0xfe, 0x00, 0x0c,
+    0x00, 0x0d, 0xff, 0xff, 0x00, 0x0d,
+};
+
+static unsigned char kat_delta2_2[78] = {
+    0x41, 0x02, 0x00, 0x00, 0x00, 0x3a, 0xff, 0xc5, 0x05, 0x1f, 0xf5, 0xbf,
+    0x04, 0xba, 0x00, 0xe0, 0xff, 0x82, 0x00, 0x05, 0xff, 0xf3, 0x04, 0x55,
+    0xf7, 0x75, 0x04, 0x4d, 0x00, 0x07, 0xff, 0xf0, 0x00, 0x0d, 0xff, 0x54,
+    0x09, 0x1c, 0xef, 0xa7, 0x07, 0xd5, 0x00, 0x0d, 0xff, 0xfc, 0xff, 0xff,
+    0x00, 0x0f, 0x06, 0x9f, 0xf2, 0xb8, 0x06, 0xa5, 0xfe, 0xff, 0x01, 0xf9,
+    0xfe, 0xfa, 0xff, 0xfd, 0x0a, 0x54, 0xeb, 0x6a, 0x0a, 0x46, 0x00, 0x0e,
+    0x00, 0x01, 0xff, 0xf2, 0x00, 0x0e,
+};
+
+static unsigned char kat_delta2_3[78] = {
+    0x41, 0x03, 0x00, 0x00, 0x00, 0x3a, 0xff, 0x8b, 0x05, 0x5a, 0xf0, 0xa0,
+    0x0e, 0xfb, 0xfc, 0x26, 0xfe, 0xa2, 0x00, 0x83, 0xff, 0xee, 0x04, 0x62,
+    0xf3, 0x20, 0x0c, 0xd8, 0xfb, 0xba, 0xff, 0xe9, 0x00, 0x1d, 0xff, 0x47,
+    0x09, 0xc8, 0xe6, 0x8b, 0x18, 0x2e, 0xf8, 0x38, 0xff, 0xef, 0x00, 0x03,
+    0x00, 0x10, 0x06, 0x90, 0xec, 0x19, 0x13, 0xed, 0xf8, 0x5a, 0x02, 0xfa,
+    0xfd, 0x01, 0x01, 0x03, 0x0a, 0x57, 0xe1, 0x16, 0x1e, 0xdc, 0xf5, 0xc8,
+    0xff, 0xf3, 0xff, 0xf1, 0x00, 0x1c,
+};
+
+static unsigned char kat_16to8[65] = {
+    0x46, 0x00, 0x3a, 0x39, 0x80, 0x05, 0x57, 0x34, 0xcb, 0x42, 0x3b, 0x39,
+    0x2a, 0x80, 0x04, 0x70, 0x2b, 0x33, 0x42, 0x41, 0x4d, 0xad, 0x80, 0x08,
+    0x29, 0x4c, 0x44, 0x49, 0x4a, 0x4a, 0x59, 0x80, 0x07, 0x07, 0x6d, 0x78,
+    0x82, 0x80, 0x00, 0x85, 0x80, 0x00, 0x82, 0x7c, 0x80, 0x0a, 0xca, 0x80,
+    0x00, 0x82, 0x80, 0x00, 0x80, 0x80, 0x00, 0x8c, 0x80, 0x00, 0x99, 0x80,
+    0x00, 0x98, 0x80, 0x00, 0xa5,
+};
+typedef struct {
+    char *name;
+    unsigned char *in;
+    int in_len;
+    int format, option;
+    unsigned char *out;
+    int out_len;
+} kat_test;
+
+#define KAT(n,i,f,o,e) {n, i, sizeof(i), f, o, e, sizeof(e)}
+static kat_test kats[] = {
+    KAT("delta1/1", kat_bytes,   ZTR_FORM_DELTA1, 1, kat_delta1_1),
+    KAT("delta1/2", kat_bytes,   ZTR_FORM_DELTA1, 2, kat_delta1_2),
+    KAT("delta1/3", kat_bytes,   ZTR_FORM_DELTA1, 3, kat_delta1_3),
+    KAT("delta2/1", kat_samples, ZTR_FORM_DELTA2, 1, kat_delta2_1),
+    KAT("delta2/2", kat_samples, ZTR_FORM_DELTA2, 2, kat_delta2_2),
+    KAT("delta2/3", kat_samples, ZTR_FORM_DELTA2, 3, kat_delta2_3),
+    KAT("16to8",    kat_samples, ZTR_FORM_16TO8,  0, kat_16to8),
+};
+
+/*
+ * Returns a trace-like value: a smooth walk with occasional spikes large
+ * enough to need escaping by 16to8.
+ */
+static int next_sample(int *v) {
+    *v += rand() % 41 - 20;
+    if (*v < 0)
+	*v = -*v;
+    if (rand() % 13 == 0)
+	return *v + rand() % 3000;
+    return *v;
+}
+
+/*
+ * Creates a ztr holding a single RAW chunk of the given shape, with n
+ * elements (bytes, samples or bases). A BASE chunk is added first for
+ * D_TRACE4 as tshift needs the calls.
+ *
+ * Returns the chunk on success
+ *         NULL on failure
+ */
+static ztr_chunk_t *make_chunk(ztr_t *z, int dtype, int n) {
+    char *data, *bases;
+    int len, i, v = 200;
+
+    switch (dtype) {
+    case D_BYTE:
+	len = n+1;
+	break;
+    case D_16BIT:
+	len = 2*n+2;
+	break;
+    case D_32BIT:
+	len = 4*n+4;
+	break;
+    case D_QUAL4:
+	len = 4*n+1;
+	break;
+    case D_TRACE4:
+	len = 8*n+2;
+	break;
+    default:
+	return NULL;
+    }
+
+    if (NULL == (data = calloc(len, 1)))
+	return NULL;
+
+    switch (dtype) {
+    case D_BYTE:
+	for (i = 1; i < len; i++)
+	    data[i] = rand() % 3 ? "ACGT"[rand()%4] : rand() % 256;
+	break;
+
+    case D_16BIT:
+    case D_TRACE4:
+	for (i = 2; i < len; i+=2) {
+	    int s = next_sample(&v) & 0xffff;
+	    data[i  ] = s >> 8;
+	    data[i+1] = s;
+	}
+	break;
+
+    case D_32BIT:
+	for (i = 4; i < len; i+=4) {
+	    int s = next_sample(&v) * (rand() % 7 ? 1 : 100000);
+	    data[i  ] = s >> 24;
+	    data[i+1] = s >> 16;
+	    data[i+2] = s >>  8;
+	    data[i+3] = s;
+	}
+	break;
+
+    case D_QUAL4:
+	for (i = 1; i < len; i++)
+	    data[i] = rand() % 50 - 10;
+	break;
+    }
+
+    if (dtype == D_TRACE4) {
+	if (NULL == (bases = malloc(n+1))) {
+	    free(data);
+	    return NULL;
+	}
+	bases[0] = ZTR_FORM_RAW;
+	for (i = 1; i <= n; i++)
+	    bases[i] = "ACGTN"[rand()%5];
+	if (!ztr_new_chunk(z, ZTR_TYPE_BASE, bases, n+1, NULL, 0)) {
+	    free(bases);
+	    free(data);
+	    return NULL;
+	}
+    }
+
+    return ztr_new_chunk(z, dtype == D_TRACE4 ? ZTR_TYPE_SMP4 : ZTR_TYPE_SAMP,
+			 data, len, NULL, 0);
+}
+
+/*
+ * Returns 0 if the round trip restored the input
+ *        -1 otherwise
+ */
+static int test_one(fmt_test *t, int n) {
+    ztr_t *z = new_ztr();
+    ztr_chunk_t *c;
+    char *orig = NULL;
+    int orig_len, i, ret = -1;
+
+    if (!z)
+	return -1;
+
+    if (NULL == (c = make_chunk(z, t->dtype, n)))
+	goto err;
+
+    orig_len = c->dlength;
+    if (NULL == (orig = malloc(orig_len)))
+	goto err;
+    memcpy(orig, c->data, orig_len);
+
+    for (i = 0; i < t->nstages; i++) {
+	if (compress_chunk(z, c, t->stage[i].format,
+			   t->stage[i].option, t->stage[i].option2))
+	    goto err;
+    }
+
+    if (uncompress_chunk(z, c))
+	goto err;
+
+    if (c->dlength != orig_len || memcmp(c->data, orig, orig_len))
+	goto err;
+
+    ret = 0;
+
+ err:
+    if (ret)
+	fprintf(stderr, "FAIL: %s with %d elements\n", t->name, n);
+    free(orig);
+    delete_ztr(z);
+    return ret;
+}
+
+/*
+ * Returns 0 if compressing t->in gives exactly t->out and uncompressing
+ *           that restores t->in
+ *        -1 otherwise
+ */
+static int test_kat(kat_test *t) {
+    ztr_t *z = new_ztr();
+    ztr_chunk_t *c;
+    char *data;
+    int ret = -1;
+
+    if (!z)
+	return -1;
+
+    if (NULL == (data = malloc(t->in_len)))
+	goto err;
+    memcpy(data, t->in, t->in_len);
+    if (NULL == (c = ztr_new_chunk(z, ZTR_TYPE_SAMP, data, t->in_len,
+				   NULL, 0))) {
+	free(data);
+	goto err;
+    }
+
+    if (compress_chunk(z, c, t->format, t->option, 0))
+	goto err;
+
+    if (c->dlength != t->out_len || memcmp(c->data, t->out, t->out_len))
+	goto err;
+
+    if (uncompress_chunk(z, c))
+	goto err;
+
+    if (c->dlength != t->in_len || memcmp(c->data, t->in, t->in_len))
+	goto err;
+
+    ret = 0;
+
+ err:
+    if (ret)
+	fprintf(stderr, "FAIL: %s known answer\n", t->name);
+    delete_ztr(z);
+    return ret;
+}
+
+int main(int argc, char **argv) {
+    int lens[] = {1, 2, 3, 4, 7, 8, 9, 15, 16, 17, 31, 32, 33, 100, 1000, 5000};
+    int i, j, k, nfail = 0;
+
+    for (i = 0; i < sizeof(kats)/sizeof(*kats); i++)
+	nfail += test_kat(&kats[i]) != 0;
+
+    srand(argc > 1 ? atoi(argv[1]) : 1);
+
+    for (i = 0; i < sizeof(tests)/sizeof(*tests); i++) {
+	for (j = 0; j < sizeof(lens)/sizeof(*lens); j++) {
+	    /* A few different random inputs per length */
+	    for (k = 0; k < 4; k++)
+		nfail += test_one(&tests[i], lens[j]) != 0;
+	}
+    }
+
+    if (nfail)
+	fprintf(stderr, "%d failures\n", nfail);
+
+    return nfail ? 1 : 0;
+}